@@ -0,0 +1,489 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Load benchmark: runs calls between many local peers inside one process with
+ * test sources and fakesinks, and prints one line of JSON per call size with
+ * how much each peer costs. Run it with `make bench`. */
+
+#include "onevideo/lib.h"
+#include "onevideo/utils.h"
+
+#define STR_HELPER(x) #x
+#define STR(x) STR_HELPER(x)
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* TCP ports of the peers are this far apart, which leaves room for the UDP
+ * ports they receive on from each other */
+#define OV_BENCH_PORT_STRIDE 100
+
+static GMainLoop *loop = NULL;
+
+typedef struct {
+  /* Options */
+  guint16 base_port;
+  guint warmup;
+  guint duration;
+  gboolean shared_receive;
+  gboolean video_decode;
+  guint *sizes;
+  guint n_sizes;
+
+  /* The current call */
+  guint size_index;
+  guint n_peers;
+  OvLocalPeer **peers;
+  guint *stats_ids;
+  /* Negotiations finish in the threads of the peers; use g_atomic_int_* */
+  gint n_negotiated;
+  gint64 negotiate_start;
+  gdouble negotiate_ms;
+  gboolean measuring;
+  gboolean failed;
+  /* {audio, video} latency reports while measuring */
+  guint64 latency_sum[2];
+  guint latency_reports[2];
+
+  /* At the start of the measurement */
+  gint64 start_time;
+  gint64 start_cpu;
+  guint64 start_decoded;
+  guint64 start_dropped;
+} OvBench;
+
+static gboolean run_next_call (OvBench * bench);
+
+/* User and system CPU time used by the process in microseconds */
+static gint64
+get_cpu_time (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+    usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/* Resident memory of the process right now in KiB; the peak when we can't
+ * find that out */
+static guint64
+get_rss_kib (void)
+{
+  struct rusage usage;
+
+#ifdef __linux__
+  gchar *contents;
+  guint64 pages = 0;
+
+  if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL)) {
+    sscanf (contents, "%*u %" G_GUINT64_FORMAT, &pages);
+    g_free (contents);
+    if (pages > 0)
+      return pages * (sysconf (_SC_PAGESIZE) / 1024);
+  }
+#endif
+
+  getrusage (RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  /* Bytes on OS X, KiB everywhere else */
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+/* Video frames decoded and buffers dropped by playback over all peers */
+static void
+get_frame_counts (OvBench * bench, guint64 * decoded, guint64 * dropped)
+{
+  guint ii, jj;
+  gpointer key, value;
+  GHashTableIter iter;
+  GHashTable *stats;
+  const gchar *media_types[] = {"audio", "video"};
+
+  *decoded = *dropped = 0;
+
+  for (ii = 0; ii < bench->n_peers; ii++) {
+    for (jj = 0; jj < G_N_ELEMENTS (media_types); jj++) {
+      g_signal_emit_by_name (bench->peers[ii], "get-stats", media_types[jj],
+          &stats);
+      if (stats == NULL)
+        continue;
+
+      g_hash_table_iter_init (&iter, stats);
+      while (g_hash_table_iter_next (&iter, &key, &value)) {
+        guint64 frames = 0, drops = 0;
+
+        if (value == NULL || g_strcmp0 (key, "local") == 0)
+          continue;
+        gst_structure_get_uint64 (value, "video-decode-frames", &frames);
+        gst_structure_get_uint64 (value, "playback-dropped", &drops);
+        *decoded += frames;
+        *dropped += drops;
+      }
+      g_hash_table_unref (stats);
+    }
+  }
+}
+
+static void
+on_stats (OvLocalPeer * local, const OvStats * stats, OvBench * bench)
+{
+  guint ii, media;
+
+  if (!bench->measuring)
+    return;
+
+  media = g_strcmp0 (stats->media_type, "video") == 0 ? 1 : 0;
+  for (ii = 0; ii < stats->n_remotes; ii++) {
+    /* Nothing was played back from this remote in the interval */
+    if (stats->remotes[ii].latency == 0)
+      continue;
+    bench->latency_sum[media] += stats->remotes[ii].latency;
+    bench->latency_reports[media]++;
+  }
+}
+
+static gdouble
+get_average_latency (OvBench * bench, guint media)
+{
+  if (bench->latency_reports[media] == 0)
+    return 0;
+  return (gdouble) bench->latency_sum[media] / bench->latency_reports[media];
+}
+
+static void
+print_results (OvBench * bench)
+{
+  gdouble seconds, cpu;
+  guint64 decoded, dropped;
+  guint n_streams;
+
+  seconds = (g_get_monotonic_time () - bench->start_time) /
+    (gdouble) G_USEC_PER_SEC;
+  cpu = (get_cpu_time () - bench->start_cpu) / (gdouble) G_USEC_PER_SEC;
+  get_frame_counts (bench, &decoded, &dropped);
+  decoded -= MIN (decoded, bench->start_decoded);
+  dropped -= MIN (dropped, bench->start_dropped);
+  /* Every peer receives video from every other peer */
+  n_streams = bench->n_peers * (bench->n_peers - 1);
+
+  g_print ("{\"participants\": %u, \"shared_receive\": %s, "
+      "\"video_decode\": %s, \"seconds\": %.1f, \"negotiation_ms\": %.1f, "
+      "\"cpu_percent_per_peer\": %.1f, \"rss_kib\": %" G_GUINT64_FORMAT ", "
+      "\"video_frames_decoded\": %" G_GUINT64_FORMAT ", "
+      "\"decode_fps_per_stream\": %.1f, "
+      "\"playback_dropped\": %" G_GUINT64_FORMAT ", "
+      "\"audio_latency_ms\": %.1f, \"video_latency_ms\": %.1f}\n",
+      bench->n_peers, bench->shared_receive ? "true" : "false",
+      bench->video_decode ? "true" : "false", seconds, bench->negotiate_ms,
+      (cpu * 100) / seconds / bench->n_peers, get_rss_kib (), decoded,
+      decoded / seconds / n_streams, dropped,
+      get_average_latency (bench, 0), get_average_latency (bench, 1));
+}
+
+static void
+stop_call (OvBench * bench)
+{
+  guint ii;
+
+  bench->measuring = FALSE;
+  for (ii = 0; ii < bench->n_peers; ii++) {
+    ov_local_peer_unsubscribe_stats (bench->peers[ii],
+        bench->stats_ids[2 * ii]);
+    ov_local_peer_unsubscribe_stats (bench->peers[ii],
+        bench->stats_ids[2 * ii + 1]);
+    g_signal_handlers_disconnect_by_data (bench->peers[ii], bench);
+    ov_local_peer_call_hangup (bench->peers[ii]);
+  }
+  /* Only once everyone has hung up, so nobody is told about it by a peer
+   * that's already gone */
+  for (ii = 0; ii < bench->n_peers; ii++) {
+    ov_local_peer_stop (bench->peers[ii]);
+    g_object_unref (bench->peers[ii]);
+  }
+  g_clear_pointer (&bench->peers, g_free);
+  g_clear_pointer (&bench->stats_ids, g_free);
+}
+
+static gboolean
+on_measure_done (OvBench * bench)
+{
+  print_results (bench);
+  stop_call (bench);
+  /* Give the sockets of this call some time to go away */
+  g_timeout_add_seconds (1, (GSourceFunc) run_next_call, bench);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_warmup_done (OvBench * bench)
+{
+  bench->start_time = g_get_monotonic_time ();
+  bench->start_cpu = get_cpu_time ();
+  get_frame_counts (bench, &bench->start_decoded, &bench->start_dropped);
+  bench->measuring = TRUE;
+  g_timeout_add_seconds (bench->duration, (GSourceFunc) on_measure_done,
+      bench);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_negotiate_incoming (OvLocalPeer * local, OvPeer * peer, OvBench * bench)
+{
+  return TRUE;
+}
+
+static void
+on_negotiate_finished (OvLocalPeer * local, OvBench * bench)
+{
+  if (local == bench->peers[0])
+    bench->negotiate_ms = (g_get_monotonic_time () -
+        bench->negotiate_start) / 1000.0;
+
+  if (!bench->video_decode) {
+    guint ii;
+    GPtrArray *remotes = ov_local_peer_get_remotes (local);
+
+    for (ii = 0; ii < remotes->len; ii++)
+      ov_remote_peer_set_video_visible (g_ptr_array_index (remotes, ii),
+          FALSE);
+  }
+
+  ov_local_peer_call_start (local);
+
+  if ((guint) g_atomic_int_add (&bench->n_negotiated, 1) + 1 ==
+      bench->n_peers)
+    g_timeout_add_seconds (bench->warmup, (GSourceFunc) on_warmup_done,
+        bench);
+}
+
+static void
+on_negotiate_aborted (OvLocalPeer * local, GError * error, OvBench * bench)
+{
+  g_printerr ("Negotiation of a %u-peer call failed: %s\n", bench->n_peers,
+      error != NULL ? error->message : "unknown error");
+  bench->failed = TRUE;
+  g_main_loop_quit (loop);
+}
+
+static OvLocalPeer *
+create_peer (OvBench * bench, guint index)
+{
+  OvLocalPeer *local;
+
+  local = ov_local_peer_new (NULL,
+      bench->base_port + index * OV_BENCH_PORT_STRIDE);
+  if (local == NULL)
+    return NULL;
+
+  ov_local_peer_set_shared_receive (local, bench->shared_receive);
+  ov_local_peer_set_test_media (local, TRUE);
+  ov_local_peer_start (local);
+  /* No device means test video */
+  if (!ov_local_peer_set_video_device (local, NULL)) {
+    g_object_unref (local);
+    return NULL;
+  }
+
+  g_signal_connect (local, "negotiate-incoming",
+      G_CALLBACK (on_negotiate_incoming), bench);
+  g_signal_connect (local, "negotiate-finished",
+      G_CALLBACK (on_negotiate_finished), bench);
+  g_signal_connect (local, "negotiate-aborted",
+      G_CALLBACK (on_negotiate_aborted), bench);
+  bench->stats_ids[2 * index] = ov_local_peer_subscribe_stats (local, "audio",
+      1000, (OvStatsFunc) on_stats, bench, NULL);
+  bench->stats_ids[2 * index + 1] = ov_local_peer_subscribe_stats (local,
+      "video", 1000, (OvStatsFunc) on_stats, bench, NULL);
+
+  return local;
+}
+
+static gboolean
+run_next_call (OvBench * bench)
+{
+  guint ii;
+
+  if (bench->size_index == bench->n_sizes) {
+    g_main_loop_quit (loop);
+    return G_SOURCE_REMOVE;
+  }
+
+  bench->n_peers = bench->sizes[bench->size_index++];
+  bench->peers = g_new0 (OvLocalPeer *, bench->n_peers);
+  bench->stats_ids = g_new0 (guint, 2 * bench->n_peers);
+  g_atomic_int_set (&bench->n_negotiated, 0);
+  bench->negotiate_ms = 0;
+  memset (bench->latency_sum, 0, sizeof (bench->latency_sum));
+  memset (bench->latency_reports, 0, sizeof (bench->latency_reports));
+
+  g_printerr ("Starting a %u-peer call\n", bench->n_peers);
+  for (ii = 0; ii < bench->n_peers; ii++) {
+    bench->peers[ii] = create_peer (bench, ii);
+    if (bench->peers[ii] == NULL) {
+      g_printerr ("Unable to create local peer %u\n", ii);
+      bench->n_peers = ii;
+      bench->failed = TRUE;
+      g_main_loop_quit (loop);
+      return G_SOURCE_REMOVE;
+    }
+  }
+
+  /* Peer 0 calls everyone else */
+  for (ii = 1; ii < bench->n_peers; ii++) {
+    gchar *addr_s;
+    OvRemotePeer *remote;
+
+    addr_s = g_strdup_printf ("127.0.0.1:%u",
+        bench->base_port + ii * OV_BENCH_PORT_STRIDE);
+    remote = ov_remote_peer_new_from_string (bench->peers[0], addr_s);
+    ov_local_peer_add_remote (bench->peers[0], remote);
+    g_free (addr_s);
+  }
+  bench->negotiate_start = g_get_monotonic_time ();
+  ov_local_peer_negotiate_start (bench->peers[0]);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Parses a comma-separated list of call sizes like "2,4,8,16" */
+static gboolean
+parse_sizes (OvBench * bench, const gchar * sizes_s)
+{
+  guint ii;
+  gchar **sizes;
+
+  sizes = g_strsplit (sizes_s, ",", -1);
+  bench->n_sizes = g_strv_length (sizes);
+  bench->sizes = g_new0 (guint, bench->n_sizes);
+  for (ii = 0; ii < bench->n_sizes; ii++) {
+    bench->sizes[ii] = (guint) g_ascii_strtoull (sizes[ii], NULL, 10);
+    if (bench->sizes[ii] < 2 || bench->sizes[ii] > 16) {
+      g_strfreev (sizes);
+      return FALSE;
+    }
+  }
+  g_strfreev (sizes);
+
+  return bench->n_sizes > 0;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  OvBench *bench;
+  GOptionContext *optctx;
+  GHashTable *missing;
+  GError *error = NULL;
+  gint ret = 0;
+
+  guint base_port = 30000;
+  guint warmup = 3;
+  guint duration = 10;
+  gboolean shared_receive = FALSE;
+  gboolean no_video_decode = FALSE;
+  gchar *sizes_s = NULL;
+  GOptionEntry entries[] = {
+    {"participants", 'n', 0, G_OPTION_ARG_STRING, &sizes_s, "Comma-separated"
+          " list of call sizes to run, between 2 and 16 (default: 2,4,8,16)",
+          "N,N,..."},
+    {"port", 'p', 0, G_OPTION_ARG_INT, &base_port, "TCP port of the first"
+          " peer; the others use ports " STR (OV_BENCH_PORT_STRIDE) " apart"
+          " (default: 30000)", "PORT"},
+    {"warmup", 0, 0, G_OPTION_ARG_INT, &warmup, "Seconds to wait after"
+          " negotiation before measuring (default: 3)", "SECONDS"},
+    {"duration", 0, 0, G_OPTION_ARG_INT, &duration, "Seconds to measure each"
+          " call for (default: 10)", "SECONDS"},
+    {"shared-receive", 0, 0, G_OPTION_ARG_NONE, &shared_receive, "Receive"
+          " from all peers on the same ports (default: no)", NULL},
+    {"no-video-decode", 0, 0, G_OPTION_ARG_NONE, &no_video_decode, "Receive"
+          " video without decoding it (default: decode)", NULL},
+    {NULL}
+  };
+
+  gst_init (&argc, &argv);
+
+  optctx = g_option_context_new (" - Load benchmark for OneVideo calls");
+  g_option_context_add_main_entries (optctx, entries, NULL);
+  g_option_context_add_group (optctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+    g_printerr ("Error parsing options: %s\n", error->message);
+    return -1;
+  }
+  g_option_context_free (optctx);
+
+  missing = ov_get_missing_gstreamer_plugins (NULL);
+  if (missing != NULL) {
+    g_printerr ("Some GStreamer plugins could not be found; run"
+        " one-video-cli for details\n");
+    g_hash_table_unref (missing);
+    return -1;
+  }
+
+  bench = g_new0 (OvBench, 1);
+  bench->warmup = warmup;
+  bench->duration = MAX (duration, 1);
+  bench->shared_receive = shared_receive;
+  bench->video_decode = !no_video_decode;
+  if (!parse_sizes (bench, sizes_s != NULL ? sizes_s : "2,4,8,16")) {
+    g_printerr ("Invalid call sizes: %s\n", sizes_s);
+    ret = -1;
+    goto out;
+  }
+  if (base_port == 0 || base_port +
+      16 * OV_BENCH_PORT_STRIDE > G_MAXUINT16) {
+    g_printerr ("Invalid port: %u\n", base_port);
+    ret = -1;
+    goto out;
+  }
+  bench->base_port = base_port;
+
+  loop = g_main_loop_new (NULL, FALSE);
+  g_idle_add ((GSourceFunc) run_next_call, bench);
+  g_main_loop_run (loop);
+
+  if (bench->failed) {
+    if (bench->peers != NULL)
+      stop_call (bench);
+    ret = 1;
+  }
+
+out:
+  g_clear_pointer (&loop, g_main_loop_unref);
+  g_free (bench->sizes);
+  g_free (bench);
+  g_free (sizes_s);
+
+  return ret;
+}
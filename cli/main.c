@@ -27,6 +27,7 @@
 
 #include "onevideo/lib.h"
 #include "onevideo/utils.h"
+#include "metrics.h"
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
@@ -38,6 +39,7 @@ static GMainLoop *loop = NULL;
 typedef struct {
   gint low_res;
   gboolean net_stats;
+  guint max_latency;
 } OvCliUserOptions;
 
 typedef struct {
@@ -48,7 +50,8 @@ typedef struct {
 static void
 print_stats_dict (gchar * peer_id, GstStructure * stats, gpointer user_data)
 {
-  guint jitter, loss, ping;
+  guint jitter, loss, ping, latency;
+  guint64 dropped, level;
 
   if (stats == NULL || g_strcmp0 (peer_id, "local") == 0)
     return;
@@ -58,6 +61,47 @@ print_stats_dict (gchar * peer_id, GstStructure * stats, gpointer user_data)
   gst_structure_get_uint (stats, "round-trip", &ping);
   g_printerr ("  To %s, jitter: %u, packet loss: %.2f%%, round trip: %ums\n",
       peer_id, jitter, ((float) (loss * 100)) / 256, ping);
+
+  if (gst_structure_get_uint64 (stats, "playback-dropped", &dropped) &&
+      gst_structure_get_uint64 (stats, "playback-max-level", &level))
+    g_printerr ("  From %s, playback dropped: %" G_GUINT64_FORMAT ", max "
+        "queued: %" G_GUINT64_FORMAT "ms\n", peer_id, dropped,
+        level / GST_MSECOND);
+
+  if (gst_structure_get_uint (stats, "jitterbuffer-latency", &latency))
+    g_printerr ("  From %s, jitterbuffer latency: %ums\n", peer_id, latency);
+
+  if (gst_structure_has_field (stats, "video-decoder"))
+    g_printerr ("  From %s, video decoder: %s\n", peer_id,
+        gst_structure_get_string (stats, "video-decoder"));
+}
+
+static gboolean
+print_thread_time (GQuark field, const GValue * value, GString * line)
+{
+  g_string_append_printf (line, " %s %.2fs", g_quark_to_string (field),
+      (gdouble) g_value_get_uint64 (value) / GST_SECOND);
+  return TRUE;
+}
+
+static void
+print_thread_stats (gchar * peer_id, GstStructure * stats, gpointer user_data)
+{
+  GString *line;
+  const GValue *threads;
+
+  if (stats == NULL)
+    return;
+
+  threads = gst_structure_get_value (stats, "threads");
+  if (threads == NULL)
+    return;
+
+  line = g_string_new (NULL);
+  gst_structure_foreach (gst_value_get_structure (threads),
+      (GstStructureForeachFunc) print_thread_time, line);
+  g_printerr ("  CPU time of threads for %s:%s\n", peer_id, line->str);
+  g_string_free (line, TRUE);
 }
 
 static gboolean
@@ -87,6 +131,9 @@ print_net_stats_type (OvLocalPeer * local, const gchar * media_type)
 
 local_done:
   g_hash_table_foreach (stats_dict, (GHFunc) print_stats_dict, NULL);
+  /* The threads are the same for both media types */
+  if (g_strcmp0 (media_type, "video") == 0)
+    g_hash_table_foreach (stats_dict, (GHFunc) print_thread_stats, NULL);
   g_hash_table_unref (stats_dict);
 
   return G_SOURCE_CONTINUE;
@@ -205,6 +252,70 @@ set_low_res (OvLocalPeer * local)
   return G_SOURCE_REMOVE;
 }
 
+static void
+on_congestion_control (OvLocalPeer * local, GstStructure * decision,
+    gpointer user_data)
+{
+  gchar *quality;
+  guint bitrate, loss, quality_enum;
+
+  gst_structure_get_uint (decision, "bitrate", &bitrate);
+  gst_structure_get_uint (decision, "packets-fractionlost", &loss);
+  gst_structure_get_uint (decision, "quality", &quality_enum);
+  quality = ov_video_quality_to_string (quality_enum);
+  g_print ("Congestion control: %s (now %s at %ukbps, packet loss: %.2f%%)\n",
+      gst_structure_get_string (decision, "action"), quality, bitrate,
+      ((float) loss * 100) / 256);
+  g_free (quality);
+}
+
+static void
+on_active_speaker_changed (OvLocalPeer * local, OvPeer * remote,
+    gpointer user_data)
+{
+  gchar *addr_s;
+
+  if (remote == NULL) {
+    g_print ("Nobody is talking\n");
+    return;
+  }
+
+  g_object_get (remote, "address-string", &addr_s, NULL);
+  g_print ("%s is talking\n", addr_s);
+  g_free (addr_s);
+}
+
+static void
+on_call_setup_timing (OvLocalPeer * local, GstStructure * report,
+    gpointer user_data)
+{
+  guint ii;
+  guint64 total;
+  gboolean aborted;
+  const GValue *spans;
+
+  gst_structure_get_uint64 (report, "total", &total);
+  gst_structure_get_boolean (report, "aborted", &aborted);
+  g_print ("Call setup %s after %.1fms as %s:\n",
+      aborted ? "aborted" : "finished", total / 1000.0,
+      gst_structure_get_string (report, "role"));
+
+  spans = gst_structure_get_value (report, "spans");
+  for (ii = 0; ii < gst_value_array_get_size (spans); ii++) {
+    const GstStructure *span;
+    const gchar *peer;
+    guint64 start, duration;
+
+    span = gst_value_get_structure (gst_value_array_get_value (spans, ii));
+    gst_structure_get_uint64 (span, "start", &start);
+    gst_structure_get_uint64 (span, "duration", &duration);
+    peer = gst_structure_get_string (span, "peer");
+    g_print ("  %8.1fms %8.1fms  %s%s%s\n", start / 1000.0, duration / 1000.0,
+        gst_structure_get_string (span, "phase"), peer ? " " : "",
+        peer ? peer : "");
+  }
+}
+
 static void
 on_negotiate_finished (OvLocalPeer * local, gpointer user_data)
 {
@@ -213,6 +324,20 @@ on_negotiate_finished (OvLocalPeer * local, gpointer user_data)
   if (opts->low_res == 0)
     set_low_res (local);
 
+  if (opts->max_latency > 0) {
+    guint ii;
+    GPtrArray *remotes = ov_local_peer_get_remotes (local);
+
+    for (ii = 0; ii < remotes->len; ii++) {
+      OvRemotePeer *remote = g_ptr_array_index (remotes, ii);
+      /* Never go below the default latency */
+      if (!ov_remote_peer_set_latency_range (remote,
+            ov_remote_peer_get_latency (remote), opts->max_latency))
+        g_printerr ("Invalid maximum jitterbuffer latency: %ums\n",
+            opts->max_latency);
+    }
+  }
+
   g_print ("Negotiation finished successfully; starting call\n");
   ov_local_peer_call_start (local);
   if (opts->net_stats)
@@ -419,12 +544,32 @@ get_device (GList * devices, const gchar * device_path)
   return device;
 }
 
+static gboolean
+set_thread_cpus (OvLocalPeer * local, OvThreadRole role, const gchar * mask)
+{
+  gchar *end;
+  guint64 cpus;
+
+  if (mask == NULL)
+    return TRUE;
+
+  cpus = g_ascii_strtoull (mask, &end, 0);
+  if (*mask == '\0' || *end != '\0' || cpus == 0 ||
+      !ov_local_peer_set_thread_affinity (local, role, cpus, 0)) {
+    g_printerr ("Invalid CPU mask: %s\n", mask);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 int
 main (int   argc,
       char *argv[])
 {
   gboolean ret;
   OvLocalPeer *local;
+  OvCliMetrics *metrics = NULL;
   GOptionContext *optctx;
   GHashTable *missing;
   GList *devices;
@@ -433,12 +578,28 @@ main (int   argc,
 
   guint exit_after = 0;
   gint low_res = -1;
+  gint video_layers = 1;
+  gint keyframe_interval = OV_DEFAULT_KEYFRAME_INTERVAL;
+  gint remote_timeout = OV_DEFAULT_REMOTE_TIMEOUT_MS;
+  gint decode_threads = -1;
   gboolean auto_exit = FALSE;
   gboolean discover_peers = FALSE;
   gboolean net_stats = FALSE;
+  gboolean shared_receive = FALSE;
+  gboolean warm_transmit = FALSE;
+  gboolean multicast_media = FALSE;
+  gboolean relay = FALSE;
+  gboolean mute_audio = FALSE;
+  gboolean mute_video = FALSE;
+  gboolean announce = FALSE;
+  guint max_latency = 0;
+  guint metrics_port = 0;
   guint16 iface_port = 0;
   gchar *iface_name = NULL;
   gchar *device_path = NULL;
+  gchar *record_dir = NULL;
+  gchar *transmit_cpus = NULL;
+  gchar *receive_cpus = NULL;
   gchar **remotes = NULL;
   GOptionEntry entries[] = {
     {"exit-after", 0, 0, G_OPTION_ARG_INT, &exit_after, "Exit cleanly after N"
@@ -458,11 +619,51 @@ main (int   argc,
           " we wait for incoming connections.", "PEER:PORT"},
     {"discover", 0, 0, G_OPTION_ARG_NONE, &discover_peers, "Automatically"
           " discover and connect to peers (default: no)", NULL},
+    {"announce", 0, 0, G_OPTION_ARG_NONE, &announce, "Multicast our presence"
+          " instead of relying on peers probing for us (default: no)", NULL},
     {"low-res", 0, 0, G_OPTION_ARG_INT, &low_res, "Send low-resolution video"
           " for testing purposes. '-1' means no (default), '0' means at start,"
           " '1' or higher means after that many seconds.", "WHEN"},
     {"net-stats", 0, 0, G_OPTION_ARG_NONE, &net_stats, "Show network statistics"
-          " as calculated via RTCP (default: no)", NULL},
+          " as calculated via RTCP and call setup timing (default: no)", NULL},
+    {"simulcast", 0, 0, G_OPTION_ARG_INT, &video_layers, "Number of video"
+          " layers of decreasing quality to send (default: 1)", "LAYERS"},
+    {"keyframe-interval", 0, 0, G_OPTION_ARG_INT, &keyframe_interval, "Most"
+          " frames between keyframes in the H.264 video we encode (default: "
+          STR(OV_DEFAULT_KEYFRAME_INTERVAL) ")", "FRAMES"},
+    {"peer-timeout", 0, 0, G_OPTION_ARG_INT, &remote_timeout, "Drop peers"
+          " from the call after not hearing from them for this long (default: "
+          STR(OV_DEFAULT_REMOTE_TIMEOUT_MS) ")", "MILLISECONDS"},
+    {"decode-threads", 0, 0, G_OPTION_ARG_INT, &decode_threads, "Decode the"
+          " video of up to this many peers in threads of their own. '-1'"
+          " means none (default), '0' means all of them.", "N"},
+    {"transmit-cpus", 0, 0, G_OPTION_ARG_STRING, &transmit_cpus, "Bitmask of"
+          " the CPUs to capture and encode on; example: 0x3 (default: any)",
+          "MASK"},
+    {"receive-cpus", 0, 0, G_OPTION_ARG_STRING, &receive_cpus, "Bitmask of"
+          " the CPUs to receive and decode on (default: any)", "MASK"},
+    {"record", 0, 0, G_OPTION_ARG_STRING, &record_dir, "Record the call"
+          " into this directory without re-encoding it (default: no)", "DIR"},
+    {"shared-receive", 0, 0, G_OPTION_ARG_NONE, &shared_receive, "Receive"
+          " from all peers on the same ports (default: no)", NULL},
+    {"warm-transmit", 0, 0, G_OPTION_ARG_NONE, &warm_transmit, "Start"
+          " capturing while negotiating and keep capturing between calls"
+          " (default: no)", NULL},
+    {"multicast-media", 0, 0, G_OPTION_ARG_NONE, &multicast_media, "Send"
+          " media once to a multicast group for the call to peers on the LAN"
+          " that can receive it (default: no)", NULL},
+    {"relay", 0, 0, G_OPTION_ARG_NONE, &relay, "Forward media between the"
+          " peers we call instead of being in the call ourselves (default:"
+          " no)", NULL},
+    {"mute-audio", 0, 0, G_OPTION_ARG_NONE, &mute_audio, "Don't send our"
+          " audio (default: no)", NULL},
+    {"mute-video", 0, 0, G_OPTION_ARG_NONE, &mute_video, "Don't send our"
+          " video (default: no)", NULL},
+    {"max-jitterbuffer", 0, 0, G_OPTION_ARG_INT, &max_latency, "Let the"
+          " jitterbuffer latency of each peer grow up to this much with the"
+          " jitter (default: fixed latency)", "MILLISECONDS"},
+    {"metrics-port", 0, 0, G_OPTION_ARG_INT, &metrics_port, "Serve Prometheus"
+          " metrics over HTTP on this TCP port (default: off)", "PORT"},
     {NULL}
   };
 
@@ -494,6 +695,7 @@ main (int   argc,
   opts = g_new0 (OvCliUserOptions, 1);
   opts->low_res = low_res;
   opts->net_stats = net_stats;
+  opts->max_latency = max_latency;
 
   loop = g_main_loop_new (NULL, FALSE);
 
@@ -506,19 +708,92 @@ main (int   argc,
   if (local == NULL)
     goto out;
 
-  g_print ("Probing devices...\n");
-  ov_local_peer_start (local);
-  devices = ov_local_peer_get_video_devices (local);
-  g_print ("Probing finished\n");
-  ret = ov_local_peer_set_video_device (local, device_path ?
-        get_device (devices, device_path) : get_device_choice (devices));
-  g_list_free_full (devices, g_object_unref);
+  if (video_layers < 1 || video_layers > OV_MAX_VIDEO_LAYERS ||
+      !ov_local_peer_set_video_layers (local, video_layers)) {
+    g_printerr ("Invalid number of simulcast layers: %i\n", video_layers);
+    goto out;
+  }
+
+  if (keyframe_interval < 1 ||
+      !ov_local_peer_set_keyframe_interval (local, keyframe_interval)) {
+    g_printerr ("Invalid keyframe interval: %i\n", keyframe_interval);
+    goto out;
+  }
+
+  if (remote_timeout < 0 ||
+      !ov_local_peer_set_remote_timeout (local, remote_timeout)) {
+    g_printerr ("Invalid peer timeout: %i\n", remote_timeout);
+    goto out;
+  }
+
+  if (decode_threads >= 0)
+    ov_local_peer_set_thread_layout (local, OV_THREAD_LAYOUT_DECODE_THREADS,
+        decode_threads);
+
+  if (!set_thread_cpus (local, OV_THREAD_ROLE_TRANSMIT, transmit_cpus) ||
+      !set_thread_cpus (local, OV_THREAD_ROLE_RECEIVE, receive_cpus))
+    goto out;
+
+  if (record_dir != NULL && !ov_local_peer_set_recording (local, record_dir)) {
+    g_printerr ("Invalid recording directory: %s\n", record_dir);
+    goto out;
+  }
+
+  ov_local_peer_set_shared_receive (local, shared_receive);
+  ov_local_peer_set_warm_transmit (local, warm_transmit);
+  ov_local_peer_set_multicast_media (local, multicast_media);
+  if (relay && remotes == NULL && !discover_peers) {
+    g_printerr ("A relay needs peers to call\n");
+    goto out;
+  }
+  if (!ov_local_peer_set_relay (local, relay)) {
+    g_printerr ("Unable to relay with shared receive\n");
+    goto out;
+  }
+  ov_local_peer_set_audio_muted (local, mute_audio);
+  ov_local_peer_set_video_muted (local, mute_video);
+  ov_local_peer_set_announce_presence (local, announce);
+
+  if (metrics_port > G_MAXUINT16) {
+    g_printerr ("Invalid metrics port: %u\n", metrics_port);
+    goto out;
+  } else if (metrics_port > 0) {
+    metrics = ov_cli_metrics_new (local, metrics_port, &error);
+    if (metrics == NULL) {
+      g_printerr ("Unable to serve metrics: %s\n", error->message);
+      g_error_free (error);
+      goto out;
+    }
+    g_print ("Serving metrics on port %u\n", metrics_port);
+  }
+
+  if (relay) {
+    /* Nothing is captured, but there must be something to negotiate */
+    ov_local_peer_start (local);
+    ret = ov_local_peer_set_video_device (local, NULL);
+  } else {
+    g_print ("Probing devices...\n");
+    ov_local_peer_start (local);
+    devices = ov_local_peer_get_video_devices (local);
+    g_print ("Probing finished\n");
+    ret = ov_local_peer_set_video_device (local, device_path ?
+          get_device (devices, device_path) : get_device_choice (devices));
+    g_list_free_full (devices, g_object_unref);
+  }
   if (!ret)
     goto out;
 
   /* Common for incoming and outgoing calls */
   g_signal_connect (local, "negotiate-finished",
       G_CALLBACK (on_negotiate_finished), opts);
+  if (net_stats) {
+    g_signal_connect (local, "congestion-control",
+        G_CALLBACK (on_congestion_control), NULL);
+    g_signal_connect (local, "call-setup-timing",
+        G_CALLBACK (on_call_setup_timing), NULL);
+    g_signal_connect (local, "active-speaker-changed",
+        G_CALLBACK (on_active_speaker_changed), NULL);
+  }
 
   if (remotes == NULL && !discover_peers) {
       g_print ("No remotes specified; listening for incoming connections\n");
@@ -579,11 +854,15 @@ remotes_done:
   g_main_loop_run (loop);
 
 out:
+  g_clear_pointer (&metrics, ov_cli_metrics_free);
   g_clear_pointer (&loop, g_main_loop_unref);
   g_clear_object (&local);
   g_strfreev (remotes);
   g_free (device_path);
   g_free (iface_name);
+  g_free (record_dir);
+  g_free (transmit_cpus);
+  g_free (receive_cpus);
   g_free (opts);
 
   return 0;
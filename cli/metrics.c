@@ -0,0 +1,558 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "metrics.h"
+
+#include <string.h>
+
+/* A Prometheus (text exposition format) endpoint for monitoring many
+ * headless one-video-cli instances. RTP counters and RTCP gauges come from a
+ * stats subscription, playback and frame timing stats from get-stats when
+ * scraped, and negotiation metrics from the negotiation signals. */
+
+#define METRICS_STATS_INTERVAL_MS 1000
+#define METRICS_REQUEST_MAX 4096
+
+/* Upper bounds of the negotiation duration histogram buckets in seconds */
+static const gdouble negotiate_buckets[] =
+  {0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+typedef struct {
+  /* The streams of the latest OvStats; ids are owned by us */
+  OvStreamStats local;
+  GArray *remotes;
+} OvCliMetricsSnapshot;
+
+struct _OvCliMetrics {
+  OvLocalPeer *local;
+  GSocketService *service;
+
+  /* {audio, video} */
+  guint stats_ids[2];
+  OvCliMetricsSnapshot snapshots[2];
+
+  /* Negotiation */
+  gint64 negotiate_start;
+  guint64 negotiate_counts[G_N_ELEMENTS (negotiate_buckets)];
+  guint64 negotiate_count;
+  gdouble negotiate_sum;
+  guint64 negotiate_failures;
+  guint64 negotiate_skipped;
+};
+
+typedef struct {
+  OvCliMetrics *metrics;
+  GSocketConnection *connection;
+  gchar request[METRICS_REQUEST_MAX];
+  gsize len;
+  gchar *response;
+} OvCliMetricsRequest;
+
+static const gchar *media_types[] = {"audio", "video"};
+
+static void
+snapshot_clear_remotes (OvCliMetricsSnapshot * snapshot)
+{
+  guint ii;
+
+  for (ii = 0; ii < snapshot->remotes->len; ii++)
+    g_free ((gchar *) g_array_index (snapshot->remotes, OvStreamStats,
+          ii).id);
+  g_array_set_size (snapshot->remotes, 0);
+}
+
+static void
+on_stats (OvLocalPeer * local, const OvStats * stats,
+    OvCliMetricsSnapshot * snapshot)
+{
+  guint ii;
+
+  snapshot->local = stats->local;
+  snapshot_clear_remotes (snapshot);
+  g_array_append_vals (snapshot->remotes, stats->remotes, stats->n_remotes);
+  for (ii = 0; ii < snapshot->remotes->len; ii++) {
+    OvStreamStats *s = &g_array_index (snapshot->remotes, OvStreamStats, ii);
+    s->id = g_strdup (s->id);
+  }
+}
+
+static void
+on_negotiate_started (OvLocalPeer * local, OvCliMetrics * metrics)
+{
+  metrics->negotiate_start = g_get_monotonic_time ();
+}
+
+static void
+on_negotiate_finished (OvLocalPeer * local, OvCliMetrics * metrics)
+{
+  guint ii;
+  gdouble duration;
+
+  if (metrics->negotiate_start == 0)
+    return;
+
+  duration = (g_get_monotonic_time () - metrics->negotiate_start) /
+    (gdouble) G_USEC_PER_SEC;
+  metrics->negotiate_start = 0;
+
+  for (ii = 0; ii < G_N_ELEMENTS (negotiate_buckets); ii++)
+    if (duration <= negotiate_buckets[ii])
+      metrics->negotiate_counts[ii]++;
+  metrics->negotiate_count++;
+  metrics->negotiate_sum += duration;
+}
+
+static void
+on_negotiate_aborted (OvLocalPeer * local, GError * error,
+    OvCliMetrics * metrics)
+{
+  metrics->negotiate_start = 0;
+  metrics->negotiate_failures++;
+}
+
+static void
+on_negotiate_skipped (OvLocalPeer * local, OvPeer * skipped, GError * error,
+    OvCliMetrics * metrics)
+{
+  metrics->negotiate_skipped++;
+}
+
+/* Label values are quoted and have \, " and newlines escaped */
+static void
+append_label (GString * out, const gchar * name, const gchar * value)
+{
+  const gchar *p;
+
+  g_string_append_printf (out, "%s=\"", name);
+  for (p = value; *p != '\0'; p++) {
+    if (*p == '\\' || *p == '"')
+      g_string_append_c (out, '\\');
+    if (*p == '\n')
+      g_string_append (out, "\\n");
+    else
+      g_string_append_c (out, *p);
+  }
+  g_string_append_c (out, '"');
+}
+
+static void
+append_family (GString * out, const gchar * name, const gchar * type,
+    const gchar * help)
+{
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+      name, type);
+}
+
+static void
+append_sample (GString * out, const gchar * name, const gchar * media,
+    const gchar * peer, const gchar * direction, gdouble value)
+{
+  g_string_append_printf (out, "%s{", name);
+  append_label (out, "media", media);
+  if (peer != NULL) {
+    g_string_append_c (out, ',');
+    append_label (out, "peer", peer);
+  }
+  if (direction != NULL) {
+    g_string_append_c (out, ',');
+    append_label (out, "direction", direction);
+  }
+  g_string_append_printf (out, "} %.9g\n", value);
+}
+
+typedef enum {
+  RTP_BYTES,
+  RTP_PACKETS,
+  RTP_LOSS,
+  RTP_JITTER,
+  RTP_ROUND_TRIP,
+} RtpMetric;
+
+static gdouble
+rtp_metric_value (const OvStreamStats * s, RtpMetric metric)
+{
+  switch (metric) {
+    case RTP_BYTES:
+      return s->bytes;
+    case RTP_PACKETS:
+      return s->packets;
+    case RTP_LOSS:
+      return s->loss / 100;
+    case RTP_JITTER:
+      return s->jitter / 1000.0;
+    case RTP_ROUND_TRIP:
+      return s->round_trip / 1000.0;
+    default:
+      g_assert_not_reached ();
+  }
+}
+
+static void
+append_rtp_family (GString * out, OvCliMetrics * metrics, const gchar * name,
+    const gchar * type, const gchar * help, RtpMetric metric)
+{
+  guint ii, jj;
+  gboolean counter = metric == RTP_BYTES || metric == RTP_PACKETS;
+
+  append_family (out, name, type, help);
+  for (ii = 0; ii < G_N_ELEMENTS (metrics->snapshots); ii++) {
+    OvCliMetricsSnapshot *snapshot = &metrics->snapshots[ii];
+
+    /* The RTCP gauges of "local" are only the worst of the remotes */
+    if (counter)
+      append_sample (out, name, media_types[ii], "local", "send",
+          rtp_metric_value (&snapshot->local, metric));
+    for (jj = 0; jj < snapshot->remotes->len; jj++) {
+      OvStreamStats *s = &g_array_index (snapshot->remotes, OvStreamStats,
+          jj);
+      /* Counters are what we receive from the remote, gauges are what it
+       * reports about what we send it */
+      append_sample (out, name, media_types[ii], s->id,
+          counter ? "receive" : "send", rtp_metric_value (s, metric));
+    }
+  }
+}
+
+static void
+append_latency_family (GString * out, OvCliMetrics * metrics)
+{
+  guint ii, jj, kk;
+  const gchar *name = "onevideo_latency_seconds";
+  const gchar *stages[] = {"total", "capture", "network", "decode", "render"};
+
+  append_family (out, name, "gauge", "Glass-to-glass latency of what we "
+      "play back from the remote, by stage");
+  for (ii = 0; ii < G_N_ELEMENTS (metrics->snapshots); ii++) {
+    OvCliMetricsSnapshot *snapshot = &metrics->snapshots[ii];
+
+    for (jj = 0; jj < snapshot->remotes->len; jj++) {
+      OvStreamStats *s = &g_array_index (snapshot->remotes, OvStreamStats,
+          jj);
+      guint values[] = {s->latency, s->capture_latency, s->network_latency,
+        s->decode_latency, s->render_latency};
+
+      /* Nothing was played back, or the remote doesn't send capture times */
+      if (s->latency == 0)
+        continue;
+      for (kk = 0; kk < G_N_ELEMENTS (stages); kk++) {
+        g_string_append_printf (out, "%s{", name);
+        append_label (out, "media", media_types[ii]);
+        g_string_append_c (out, ',');
+        append_label (out, "peer", s->id);
+        g_string_append_c (out, ',');
+        append_label (out, "stage", stages[kk]);
+        g_string_append_printf (out, "} %.3f\n", values[kk] / 1000.0);
+      }
+    }
+  }
+}
+
+static void
+append_negotiate_histogram (GString * out, OvCliMetrics * metrics)
+{
+  guint ii;
+  const gchar *name = "onevideo_negotiation_duration_seconds";
+
+  append_family (out, name, "histogram", "Time from the start of "
+      "negotiation till it finished successfully");
+  for (ii = 0; ii < G_N_ELEMENTS (negotiate_buckets); ii++)
+    g_string_append_printf (out, "%s_bucket{le=\"%g\"} %" G_GUINT64_FORMAT
+        "\n", name, negotiate_buckets[ii], metrics->negotiate_counts[ii]);
+  g_string_append_printf (out, "%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT
+      "\n%s_sum %.9g\n%s_count %" G_GUINT64_FORMAT "\n", name,
+      metrics->negotiate_count, name, metrics->negotiate_sum, name,
+      metrics->negotiate_count);
+
+  append_family (out, "onevideo_negotiation_failures_total", "counter",
+      "Negotiations that were aborted");
+  g_string_append_printf (out, "onevideo_negotiation_failures_total %"
+      G_GUINT64_FORMAT "\n", metrics->negotiate_failures);
+  append_family (out, "onevideo_negotiation_skipped_remotes_total", "counter",
+      "Remotes skipped during negotiation because they didn't respond");
+  g_string_append_printf (out, "onevideo_negotiation_skipped_remotes_total %"
+      G_GUINT64_FORMAT "\n", metrics->negotiate_skipped);
+}
+
+typedef struct {
+  const gchar *name;
+  const gchar *type;
+  const gchar *help;
+  /* Field in the get-stats structures and how to scale it */
+  const gchar *field;
+  gdouble scale;
+  /* Only in the "local" structure */
+  gboolean local;
+} PlaybackMetric;
+
+static const PlaybackMetric playback_metrics[] = {
+  {"onevideo_jitterbuffer_latency_seconds", "gauge",
+    "How long we wait for late packets", "jitterbuffer-latency", 1e-3},
+  {"onevideo_playback_queue_seconds", "gauge",
+    "Data waiting to be played back", "playback-level", 1e-9},
+  {"onevideo_playback_queue_max_seconds", "gauge",
+    "Most data waiting to be played back during the call",
+    "playback-max-level", 1e-9},
+  {"onevideo_playback_dropped_total", "counter",
+    "Buffers dropped because playback couldn't keep up", "playback-dropped",
+    1},
+  {"onevideo_video_decode_seconds_count", "counter",
+    "Video frames decoded", "video-decode-frames", 1},
+  {"onevideo_video_decode_seconds_sum", "counter",
+    "Time taken to decode video frames", "video-decode-time", 1e-6},
+  {"onevideo_video_encode_seconds_count", "counter",
+    "Video frames encoded", "video-encode-frames", 1, TRUE},
+  {"onevideo_video_encode_seconds_sum", "counter",
+    "Time taken to encode video frames", "video-encode-time", 1e-6, TRUE},
+};
+
+static gboolean
+get_number (const GstStructure * s, const gchar * field, gdouble * value)
+{
+  guint uint_value;
+  guint64 uint64_value;
+
+  if (gst_structure_get_uint (s, field, &uint_value)) {
+    *value = uint_value;
+    return TRUE;
+  }
+  if (gst_structure_get_uint64 (s, field, &uint64_value)) {
+    *value = uint64_value;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static void
+append_playback_metrics (GString * out, OvCliMetrics * metrics)
+{
+  guint ii, jj;
+  gdouble value;
+  gpointer key, s;
+  GHashTableIter iter;
+  GHashTable *stats[G_N_ELEMENTS (media_types)];
+
+  for (ii = 0; ii < G_N_ELEMENTS (media_types); ii++)
+    g_signal_emit_by_name (metrics->local, "get-stats", media_types[ii],
+        &stats[ii]);
+
+  for (jj = 0; jj < G_N_ELEMENTS (playback_metrics); jj++) {
+    const PlaybackMetric *m = &playback_metrics[jj];
+
+    /* The count and sum of a summary share its HELP and TYPE */
+    if (g_str_has_suffix (m->name, "_count")) {
+      gchar *family = g_strndup (m->name, strlen (m->name) - 6);
+      append_family (out, family, "summary", m->help);
+      g_free (family);
+    } else if (!g_str_has_suffix (m->name, "_sum")) {
+      append_family (out, m->name, m->type, m->help);
+    }
+
+    for (ii = 0; ii < G_N_ELEMENTS (media_types); ii++) {
+      if (stats[ii] == NULL)
+        continue;
+      g_hash_table_iter_init (&iter, stats[ii]);
+      while (g_hash_table_iter_next (&iter, &key, &s)) {
+        if (s == NULL || m->local != (g_strcmp0 (key, "local") == 0) ||
+            !get_number (s, m->field, &value))
+          continue;
+        append_sample (out, m->name, media_types[ii], m->local ? NULL : key,
+            NULL, value * m->scale);
+      }
+    }
+  }
+
+  for (ii = 0; ii < G_N_ELEMENTS (media_types); ii++)
+    g_clear_pointer (&stats[ii], g_hash_table_unref);
+}
+
+static gchar *
+render_metrics (OvCliMetrics * metrics)
+{
+  GString *out = g_string_new (NULL);
+
+  append_rtp_family (out, metrics, "onevideo_rtp_bytes_total", "counter",
+      "RTP payload bytes sent or received", RTP_BYTES);
+  append_rtp_family (out, metrics, "onevideo_rtp_packets_total", "counter",
+      "RTP packets sent or received", RTP_PACKETS);
+  append_rtp_family (out, metrics, "onevideo_rtp_loss_ratio", "gauge",
+      "Fraction of our packets lost on the way to the remote", RTP_LOSS);
+  append_rtp_family (out, metrics, "onevideo_rtp_jitter_seconds", "gauge",
+      "Jitter of our packets as seen by the remote", RTP_JITTER);
+  append_rtp_family (out, metrics, "onevideo_rtp_round_trip_seconds", "gauge",
+      "Round-trip time to the remote", RTP_ROUND_TRIP);
+  append_latency_family (out, metrics);
+  append_negotiate_histogram (out, metrics);
+  append_playback_metrics (out, metrics);
+
+  return g_string_free (out, FALSE);
+}
+
+static void
+request_free (OvCliMetricsRequest * req)
+{
+  g_io_stream_close (G_IO_STREAM (req->connection), NULL, NULL);
+  g_object_unref (req->connection);
+  g_free (req->response);
+  g_free (req);
+}
+
+static void
+on_response_written (GOutputStream * stream, GAsyncResult * result,
+    OvCliMetricsRequest * req)
+{
+  g_output_stream_write_all_finish (stream, result, NULL, NULL);
+  request_free (req);
+}
+
+static void
+send_response (OvCliMetricsRequest * req)
+{
+  gchar *body;
+  GOutputStream *stream;
+
+  /* We only have the one page; anything else is a 404 */
+  if (g_str_has_prefix (req->request, "GET /metrics ") ||
+      g_str_has_prefix (req->request, "GET / ")) {
+    body = render_metrics (req->metrics);
+    req->response = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+        "Connection: close\r\n\r\n%s", strlen (body), body);
+    g_free (body);
+  } else {
+    req->response = g_strdup ("HTTP/1.0 404 Not Found\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+
+  stream = g_io_stream_get_output_stream (G_IO_STREAM (req->connection));
+  g_output_stream_write_all_async (stream, req->response,
+      strlen (req->response), G_PRIORITY_DEFAULT, NULL,
+      (GAsyncReadyCallback) on_response_written, req);
+}
+
+static void
+on_request_read (GInputStream * stream, GAsyncResult * result,
+    OvCliMetricsRequest * req)
+{
+  gssize len;
+
+  len = g_input_stream_read_finish (stream, result, NULL);
+  if (len <= 0) {
+    request_free (req);
+    return;
+  }
+  req->len += len;
+  req->request[req->len] = '\0';
+
+  /* Wait for the end of the headers, but don't let clients make us buffer
+   * forever */
+  if (strstr (req->request, "\r\n\r\n") == NULL &&
+      req->len < METRICS_REQUEST_MAX - 1) {
+    g_input_stream_read_async (stream, req->request + req->len,
+        METRICS_REQUEST_MAX - 1 - req->len, G_PRIORITY_DEFAULT, NULL,
+        (GAsyncReadyCallback) on_request_read, req);
+    return;
+  }
+
+  send_response (req);
+}
+
+static gboolean
+on_incoming (GSocketService * service, GSocketConnection * connection,
+    GObject * source, OvCliMetrics * metrics)
+{
+  GInputStream *stream;
+  OvCliMetricsRequest *req;
+
+  req = g_new0 (OvCliMetricsRequest, 1);
+  req->metrics = metrics;
+  req->connection = g_object_ref (connection);
+
+  stream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  g_input_stream_read_async (stream, req->request, METRICS_REQUEST_MAX - 1,
+      G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback) on_request_read, req);
+
+  return TRUE;
+}
+
+OvCliMetrics *
+ov_cli_metrics_new (OvLocalPeer * local, guint16 port, GError ** error)
+{
+  guint ii;
+  OvCliMetrics *metrics;
+
+  metrics = g_new0 (OvCliMetrics, 1);
+  metrics->local = g_object_ref (local);
+  for (ii = 0; ii < G_N_ELEMENTS (metrics->snapshots); ii++) {
+    metrics->snapshots[ii].remotes = g_array_new (FALSE, TRUE,
+        sizeof (OvStreamStats));
+    metrics->stats_ids[ii] = ov_local_peer_subscribe_stats (local,
+        media_types[ii], METRICS_STATS_INTERVAL_MS, (OvStatsFunc) on_stats,
+        &metrics->snapshots[ii], NULL);
+  }
+
+  g_signal_connect (local, "negotiate-started",
+      G_CALLBACK (on_negotiate_started), metrics);
+  g_signal_connect (local, "negotiate-finished",
+      G_CALLBACK (on_negotiate_finished), metrics);
+  g_signal_connect (local, "negotiate-aborted",
+      G_CALLBACK (on_negotiate_aborted), metrics);
+  g_signal_connect (local, "negotiate-skipped-remote",
+      G_CALLBACK (on_negotiate_skipped), metrics);
+
+  metrics->service = g_socket_service_new ();
+  if (!g_socket_listener_add_inet_port (G_SOCKET_LISTENER (metrics->service),
+        port, NULL, error)) {
+    ov_cli_metrics_free (metrics);
+    return NULL;
+  }
+  g_signal_connect (metrics->service, "incoming", G_CALLBACK (on_incoming),
+      metrics);
+  g_socket_service_start (metrics->service);
+
+  return metrics;
+}
+
+void
+ov_cli_metrics_free (OvCliMetrics * metrics)
+{
+  guint ii;
+
+  g_socket_service_stop (metrics->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (metrics->service));
+  g_object_unref (metrics->service);
+
+  g_signal_handlers_disconnect_by_data (metrics->local, metrics);
+  for (ii = 0; ii < G_N_ELEMENTS (metrics->snapshots); ii++) {
+    ov_local_peer_unsubscribe_stats (metrics->local, metrics->stats_ids[ii]);
+    snapshot_clear_remotes (&metrics->snapshots[ii]);
+    g_array_free (metrics->snapshots[ii].remotes, TRUE);
+  }
+  g_object_unref (metrics->local);
+  g_free (metrics);
+}
@@ -36,6 +36,13 @@
  * The element queues buffers from the matching proxysink to an internal queue,
  * so everything downstream is properly decoupled from the upstream pipeline.
  *
+ * By default the queue blocks upstream when it's full, like a normal queue.
+ * For live data, #GstProxySrc:max-latency makes it drop the oldest buffers
+ * instead once that much data is queued, and #GstProxySrc:latest-only keeps
+ * only the newest buffer. #GstProxySrc:dropped, #GstProxySrc:current-level-time
+ * and #GstProxySrc:max-level-time show how much data is building up between
+ * the two pipelines.
+ *
  */
 
 #ifdef HAVE_CONFIG_H
@@ -54,10 +61,23 @@ static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE ("src",
   GST_STATIC_CAPS_ANY
 );
 
+/* The defaults of the queue element, used when no latency policy is set */
+#define QUEUE_DEFAULT_MAX_SIZE_BUFFERS  200
+#define QUEUE_DEFAULT_MAX_SIZE_BYTES    (10 * 1024 * 1024)
+#define QUEUE_DEFAULT_MAX_SIZE_TIME     GST_SECOND
+
+#define DEFAULT_MAX_LATENCY             0
+#define DEFAULT_LATEST_ONLY             FALSE
+
 enum
 {
   PROP_0,
   PROP_PROXYSINK,
+  PROP_MAX_LATENCY,
+  PROP_LATEST_ONLY,
+  PROP_DROPPED,
+  PROP_CURRENT_LEVEL_TIME,
+  PROP_MAX_LEVEL_TIME,
 };
 
 struct _GstProxySrcPrivate
@@ -72,6 +92,17 @@ struct _GstProxySrcPrivate
   GstPad *dummy_sinkpad;
   /* The matching proxysink; queries and events are sent to its sinkpad */
   GWeakRef proxysink;
+
+  /* Queueing policy; see gst_proxy_src_configure_queue() */
+  GstClockTime max_latency;
+  gboolean latest_only;
+
+  /* Buffers that went into and out of the queue, and the most data that was
+   * in it; protected by the object lock. Whatever went in but neither came
+   * out nor is still queued has been dropped. */
+  guint64 in_buffers;
+  guint64 out_buffers;
+  GstClockTime max_level_time;
 };
 
 /* We're not subclassing from basesrc because we don't want any of the special
@@ -90,16 +121,116 @@ static gboolean gst_proxy_src_internal_src_event (GstPad *pad, GstObject *parent
 static GstStateChangeReturn gst_proxy_src_change_state (GstElement *element, GstStateChange transition);
 static void gst_proxy_src_dispose (GObject *object);
 
+/* Called with the object lock TAKEN */
+static void
+gst_proxy_src_configure_queue (GstProxySrc * self)
+{
+  GstElement *queue = self->priv->queue;
+
+  if (self->priv->latest_only) {
+    g_object_set (queue, "max-size-buffers", 1, "max-size-bytes", 0,
+        "max-size-time", (guint64) 0, NULL);
+    gst_util_set_object_arg (G_OBJECT (queue), "leaky", "downstream");
+  } else if (self->priv->max_latency > 0) {
+    g_object_set (queue, "max-size-buffers", 0, "max-size-bytes", 0,
+        "max-size-time", self->priv->max_latency, NULL);
+    gst_util_set_object_arg (G_OBJECT (queue), "leaky", "downstream");
+  } else {
+    g_object_set (queue, "max-size-buffers", QUEUE_DEFAULT_MAX_SIZE_BUFFERS,
+        "max-size-bytes", QUEUE_DEFAULT_MAX_SIZE_BYTES,
+        "max-size-time", QUEUE_DEFAULT_MAX_SIZE_TIME, NULL);
+    gst_util_set_object_arg (G_OBJECT (queue), "leaky", "no");
+  }
+}
+
+static guint
+gst_proxy_src_probe_info_n_buffers (GstPadProbeInfo * info)
+{
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    return gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+  return 1;
+}
+
+static GstPadProbeReturn
+gst_proxy_src_queue_sink_probe (GstPad * pad, GstPadProbeInfo * info,
+    GstProxySrc * self)
+{
+  guint64 level;
+
+  g_object_get (self->priv->queue, "current-level-time", &level, NULL);
+
+  GST_OBJECT_LOCK (self);
+  self->priv->in_buffers += gst_proxy_src_probe_info_n_buffers (info);
+  if (level > self->priv->max_level_time)
+    self->priv->max_level_time = level;
+  GST_OBJECT_UNLOCK (self);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+gst_proxy_src_queue_src_probe (GstPad * pad, GstPadProbeInfo * info,
+    GstProxySrc * self)
+{
+  GST_OBJECT_LOCK (self);
+  self->priv->out_buffers += gst_proxy_src_probe_info_n_buffers (info);
+  GST_OBJECT_UNLOCK (self);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static guint64
+gst_proxy_src_get_dropped (GstProxySrc * self)
+{
+  guint level;
+  guint64 in, out;
+
+  g_object_get (self->priv->queue, "current-level-buffers", &level, NULL);
+
+  GST_OBJECT_LOCK (self);
+  in = self->priv->in_buffers;
+  out = self->priv->out_buffers;
+  GST_OBJECT_UNLOCK (self);
+
+  /* The level and the counts aren't read atomically together */
+  if (in < out + level)
+    return 0;
+  return in - out - level;
+}
+
 static void
 gst_proxy_src_get_property (GObject * object,
     guint prop_id, GValue * value, GParamSpec * spec)
 {
   GstProxySrc *self = GST_PROXY_SRC (object);
+  guint64 level;
 
   switch (prop_id) {
     case PROP_PROXYSINK:
       g_value_take_object (value, g_weak_ref_get (&self->priv->proxysink));
       break;
+    case PROP_MAX_LATENCY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint64 (value, self->priv->max_latency);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_LATEST_ONLY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_boolean (value, self->priv->latest_only);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_DROPPED:
+      g_value_set_uint64 (value, gst_proxy_src_get_dropped (self));
+      break;
+    case PROP_CURRENT_LEVEL_TIME:
+      g_object_get (self->priv->queue, "current-level-time", &level, NULL);
+      g_value_set_uint64 (value, level);
+      break;
+    case PROP_MAX_LEVEL_TIME:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint64 (value, self->priv->max_level_time);
+      GST_OBJECT_UNLOCK (self);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, spec);
       break;
@@ -132,6 +263,18 @@ gst_proxy_src_set_property (GObject * object,
         g_object_unref (sink);
       }
       break;
+    case PROP_MAX_LATENCY:
+      GST_OBJECT_LOCK (self);
+      self->priv->max_latency = g_value_get_uint64 (value);
+      gst_proxy_src_configure_queue (self);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_LATEST_ONLY:
+      GST_OBJECT_LOCK (self);
+      self->priv->latest_only = g_value_get_boolean (value);
+      gst_proxy_src_configure_queue (self);
+      GST_OBJECT_UNLOCK (self);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, spec);
   }
@@ -156,6 +299,33 @@ gst_proxy_src_class_init (GstProxySrcClass * klass)
       g_param_spec_object ("proxysink", "Proxysink", "Matching proxysink",
         GST_TYPE_PROXY_SINK, G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class, PROP_MAX_LATENCY,
+      g_param_spec_uint64 ("max-latency", "Max latency",
+        "Drop the oldest buffers once this much data (in ns) is queued "
+        "instead of blocking upstream (0 = block)", 0, G_MAXUINT64,
+        DEFAULT_MAX_LATENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LATEST_ONLY,
+      g_param_spec_boolean ("latest-only", "Latest only",
+        "Only keep the newest buffer, dropping older ones (overrides "
+        "max-latency)", DEFAULT_LATEST_ONLY,
+        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_DROPPED,
+      g_param_spec_uint64 ("dropped", "Dropped",
+        "Number of buffers dropped since going to PAUSED", 0, G_MAXUINT64, 0,
+        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CURRENT_LEVEL_TIME,
+      g_param_spec_uint64 ("current-level-time", "Current level (ns)",
+        "Amount of data currently queued", 0, G_MAXUINT64, 0,
+        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_LEVEL_TIME,
+      g_param_spec_uint64 ("max-level-time", "Max level (ns)",
+        "Most data that was queued since going to PAUSED", 0, G_MAXUINT64, 0,
+        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
   gstelement_class->change_state = gst_proxy_src_change_state;
   gst_element_class_add_pad_template (gstelement_class,
     gst_static_pad_template_get (&src_template));
@@ -180,8 +350,21 @@ gst_proxy_src_init (GstProxySrc * self)
    * from the upstream pipeline */
   self->priv->queue = gst_element_factory_make ("queue", NULL);
   gst_bin_add (GST_BIN (self), self->priv->queue);
+  self->priv->max_latency = DEFAULT_MAX_LATENCY;
+  self->priv->latest_only = DEFAULT_LATEST_ONLY;
+  gst_proxy_src_configure_queue (self);
+
+  /* Count what goes in and out of the queue */
+  sinkpad = gst_element_get_static_pad (self->priv->queue, "sink");
+  gst_pad_add_probe (sinkpad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) gst_proxy_src_queue_sink_probe, self, NULL);
+  gst_object_unref (sinkpad);
 
   srcpad = gst_element_get_static_pad (self->priv->queue, "src");
+  gst_pad_add_probe (srcpad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) gst_proxy_src_queue_src_probe, self, NULL);
   templ = gst_static_pad_template_get (&src_template);
   self->priv->srcpad = gst_ghost_pad_new_from_template ("src", srcpad, templ);
   gst_object_unref (templ);
@@ -244,6 +427,11 @@ gst_proxy_src_change_state (GstElement * element, GstStateChange transition)
   switch (transition) {
   case GST_STATE_CHANGE_READY_TO_PAUSED:
     ret = GST_STATE_CHANGE_NO_PREROLL;
+    GST_OBJECT_LOCK (self);
+    self->priv->in_buffers = 0;
+    self->priv->out_buffers = 0;
+    self->priv->max_level_time = 0;
+    GST_OBJECT_UNLOCK (self);
     gst_pad_set_active (self->priv->internal_srcpad, TRUE);
     break;
   case GST_STATE_CHANGE_PAUSED_TO_READY:
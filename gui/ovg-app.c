@@ -60,6 +60,10 @@ static gchar *iface_name = NULL;
 static guint16 iface_port = 0;
 static gboolean low_res = FALSE;
 static gboolean net_stats = FALSE;
+static gint video_layers = 1;
+static gboolean shared_receive = FALSE;
+static gboolean composite_video = FALSE;
+static gboolean announce = FALSE;
 
 static GOptionEntry app_options[] =
 {
@@ -75,6 +79,14 @@ static GOptionEntry app_options[] =
         " for testing purposes (default: no)", NULL},
   {"net-stats", 0, 0, G_OPTION_ARG_NONE, &net_stats, "Show network statistics "
         " as calculated via RTCP (default: no)", NULL},
+  {"simulcast", 0, 0, G_OPTION_ARG_INT, &video_layers, "Number of video"
+        " layers of decreasing quality to send (default: 1)", "LAYERS"},
+  {"shared-receive", 0, 0, G_OPTION_ARG_NONE, &shared_receive, "Receive from"
+        " all peers on the same ports (default: no)", NULL},
+  {"composite-video", 0, 0, G_OPTION_ARG_NONE, &composite_video, "Render the"
+        " video of all peers in one OpenGL surface (default: no)", NULL},
+  {"announce", 0, 0, G_OPTION_ARG_NONE, &announce, "Multicast our presence"
+        " and only probe for peers at startup (default: no)", NULL},
   {NULL}
 };
 
@@ -185,6 +197,15 @@ ovg_app_startup (GApplication * app)
     goto out;
   }
 
+  if (video_layers < 1 || video_layers > OV_MAX_VIDEO_LAYERS ||
+      !ov_local_peer_set_video_layers (priv->ov_local, video_layers)) {
+    ovg_app_schedule_error (app, "Invalid number of simulcast layers!");
+    goto out;
+  }
+
+  ov_local_peer_set_shared_receive (priv->ov_local, shared_receive);
+  ov_local_peer_set_announce_presence (priv->ov_local, announce);
+
   if (!ov_local_peer_start (priv->ov_local)) {
     ovg_app_schedule_error (app, "Unable to start local peer!");
     goto out;
@@ -304,3 +325,9 @@ ovg_app_get_show_net_stats (OvgApp * app)
 {
   return net_stats;
 }
+
+gboolean
+ovg_app_get_composite_video (OvgApp * app)
+{
+  return composite_video;
+}
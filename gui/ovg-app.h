@@ -53,6 +53,7 @@ OvLocalPeer*        ovg_app_get_ov_local_peer   (OvgApp *app);
 gchar*              ovg_app_get_scheduled_error (OvgApp *app);
 gboolean            ovg_app_get_low_res         (OvgApp *app);
 gboolean            ovg_app_get_show_net_stats  (OvgApp *app);
+gboolean            ovg_app_get_composite_video (OvgApp *app);
 
 G_END_DECLS
 
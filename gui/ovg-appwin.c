@@ -65,8 +65,13 @@ struct _OvgAppWindowPrivate
   GtkWidget *start_call;
 
   GtkWidget *peers_video;
+  /* The overlay with the compositor widget if the video of all remotes is
+   * rendered in one widget */
+  GtkWidget *compositor;
 
   OvLocalPeer *ovg_local;
+  /* Subscription to the video stats of calls */
+  guint stats_id;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (OvgAppWindow, ovg_app_window,
@@ -84,102 +89,60 @@ static gboolean ovg_app_window_reset_state (OvgAppWindow *win);
 static gboolean ovg_send_lower_video_quality (OvLocalPeer *local);
 
 static void
-print_stats_dict (gchar * peer_id, GstStructure * stats, gpointer user_data)
+print_net_stats (const OvStats * stats)
 {
-  guint jitter, loss, ping;
+  guint ii;
 
-  if (stats == NULL || g_strcmp0 (peer_id, "local") == 0)
-    return;
+  g_printerr ("Outgoing video: %" G_GUINT64_FORMAT "kbps, %u packets/s, "
+      "packet loss: %.2f%%\n", stats->local.bitrate / 1000,
+      stats->local.packet_rate, stats->local.loss);
 
-  gst_structure_get_uint (stats, "jitter", &jitter);
-  gst_structure_get_uint (stats, "packets-fractionlost", &loss);
-  gst_structure_get_uint (stats, "round-trip", &ping);
-  g_printerr ("  To %s, jitter: %u, packet loss: %.2f%%, round trip: %ums\n",
-      peer_id, jitter, ((float) (loss * 100)) / 256, ping);
+  for (ii = 0; ii < stats->n_remotes; ii++) {
+    const OvStreamStats *s = &stats->remotes[ii];
+    g_printerr ("  To %s, jitter: %ums, packet loss: %.2f%%, round trip: "
+        "%ums\n", s->id, s->jitter, s->loss, s->round_trip);
+    g_printerr ("  From %s, %" G_GUINT64_FORMAT "kbps, %u packets/s\n", s->id,
+        s->bitrate / 1000, s->packet_rate);
+  }
 }
 
+/* With simulcast, only move the remotes that are losing packets down to
+ * a lower video layer instead of lowering the quality for everyone */
 static void
-print_net_stats_dict (GHashTable * stats_dict, GstStructure * local_stats)
+lower_video_layers (OvLocalPeer * local, const OvStats * stats)
 {
-  guint64 bitrate;
-  guint jitter, loss;
+  guint ii, layer;
+  OvRemotePeer *remote;
 
-  gst_structure_get_uint64 (local_stats, "bitrate", &bitrate);
-  gst_structure_get_uint (local_stats, "jitter", &jitter);
-  gst_structure_get_uint (local_stats, "packets-fractionlost", &loss);
-  g_printerr ("Outgoing video: %lukbps, jitter: %u, packet loss: %.2f%%\n",
-      bitrate / 1000, jitter, ((float) (loss * 100)) / 256);
-
-  g_hash_table_foreach (stats_dict, (GHFunc) print_stats_dict, NULL);
-}
-
-static guint
-get_highest_packet_loss (GHashTable * stats_dict, GstStructure * local_stats)
-{
-  gpointer value;
-  GHashTableIter iter;
-  guint loss, highest_loss = 0;
-
-  g_hash_table_iter_init (&iter, stats_dict);
-  /* Get the greatest packet loss */
-  while (g_hash_table_iter_next (&iter, NULL, &value)) {
-    if (value == NULL)
+  for (ii = 0; ii < stats->n_remotes; ii++) {
+    remote = ov_local_peer_get_remote_by_id (local, stats->remotes[ii].id);
+    if (remote == NULL)
       continue;
-    gst_structure_get_uint (GST_STRUCTURE (value), "packets-fractionlost", &loss);
-    if (loss > highest_loss)
-      highest_loss = loss;
-  }
 
-  return highest_loss;
+    layer = ov_remote_peer_get_video_layer (remote);
+    if (stats->remotes[ii].loss > 20 &&
+        layer + 1 < ov_local_peer_get_video_layers (local)) {
+      g_print ("Packet loss to %s is too high! %.2f%%\n", remote->id,
+          stats->remotes[ii].loss);
+      ov_remote_peer_set_video_layer (remote, layer + 1);
+    }
+  }
 }
 
-static gboolean
-check_net_stats (OvgAppWindow * win)
+static void
+on_net_stats (OvLocalPeer * local, const OvStats * stats, OvgAppWindow * win)
 {
-  guint loss;
-  OvLocalPeer *local;
   GtkApplication *app;
-  OvgAppWindowPrivate *priv;
-  GstStructure *local_stats;
-  GHashTable *stats_dict;
-  OvVideoQuality currentq, lowestq;
 
   app = gtk_window_get_application (GTK_WINDOW (win));
-  priv = ovg_app_window_get_instance_private (win);
-  local = priv->ovg_local;
 
-  g_signal_emit_by_name (local, "get-stats", "video", &stats_dict);
-  if (stats_dict == NULL)
-    /* No call, call ended, or no video */
-    return G_SOURCE_REMOVE;
-
-  local_stats = GST_STRUCTURE (g_hash_table_lookup (stats_dict, "local"));
-  if (local_stats == NULL)
-    return G_SOURCE_CONTINUE;
-
-  currentq = OV_VIDEO_QUALITY_RESO_RANGE &
-    ov_local_peer_get_video_quality (local);
-  lowestq = OV_VIDEO_QUALITY_RESO_RANGE &
-    ov_local_peer_get_lowest_video_quality (local);
-  loss = get_highest_packet_loss (stats_dict, local_stats);
-
-  /* Packet loss is >= 20% (~50/256), switch to lower quality
-   *
-   * Right now, we just switch to the lowest quality (or 360p, whichever is
-   * higher), but we should perhaps look at the packet loss %age and switch to
-   * an "appropriate" quality. Such as, if packet loss is 50% at 720p, perhaps
-   * switching to 480p will suffice. Realistically, packet loss statistics are
-   * probably too unreliable to do this. */
-  if (currentq > OV_VIDEO_QUALITY_360P && currentq > lowestq && loss > 50) {
-    g_print ("Packet loss is too high! %.2f%%\n", ((float) loss * 100) / 256);
-    ovg_send_lower_video_quality (local);
-  }
+  /* The library adapts the bitrate, framerate and resolution of what we send
+   * on its own; with simulcast we also move lossy remotes to lower layers */
+  if (ov_local_peer_get_video_layers (local) > 1)
+    lower_video_layers (local, stats);
 
   if (ovg_app_get_show_net_stats (OVG_APP (app)))
-    print_net_stats_dict (stats_dict, local_stats);
-
-  g_hash_table_unref (stats_dict);
-  return G_SOURCE_CONTINUE;
+    print_net_stats (stats);
 }
 
 static gboolean
@@ -544,11 +507,16 @@ ovg_app_window_peers_d_rows_clean_timed_out (OvLocalPeer * local,
     OvgAppWindow * win)
 {
   gchar *addr_s;
-  gint64 current_time;
+  gint64 current_time, timeout;
   GList *children, *l;
   OvgAppWindowPrivate *priv;
 
   current_time = g_get_monotonic_time ();
+  /* Peers that announce themselves are heard from less often */
+  if (ov_local_peer_get_announce_presence (local))
+    timeout = 2 * G_USEC_PER_SEC * OV_PRESENCE_ANNOUNCE_MAX_INTERVAL;
+  else
+    timeout = 2 * G_USEC_PER_SEC * PEER_DISCOVER_INTERVAL;
   priv = ovg_app_window_get_instance_private (win);
   children = gtk_container_get_children (GTK_CONTAINER (priv->peers_d));
 
@@ -561,8 +529,7 @@ ovg_app_window_peers_d_rows_clean_timed_out (OvLocalPeer * local,
         NULL);
     /* If this peer was discovered more than 2 discovery-intervals ago, it has
      * timed out */
-    if ((current_time - discover_time) >
-        2 * G_USEC_PER_SEC * PEER_DISCOVER_INTERVAL) {
+    if ((current_time - discover_time) > timeout) {
       g_print ("Removing row peer name: %s (timed out)\n", addr_s);
       gtk_container_remove (GTK_CONTAINER (priv->peers_d),
           GTK_WIDGET (l->data));
@@ -609,14 +576,187 @@ on_mute_button_left (GtkWidget * button, GdkEventCrossing * event,
   return FALSE;
 }
 
+static GtkWidget *
+ovg_mute_button_new (OvRemotePeer * remote)
+{
+  GtkWidget *mute;
+
+  mute = gtk_toggle_button_new ();
+  gtk_widget_set_opacity (mute, MUTE_BUTTON_DEFAULT_OPACITY);
+  gtk_widget_add_events (mute, GDK_ENTER_NOTIFY_MASK | GDK_LEAVE_NOTIFY_MASK);
+  gtk_button_set_image (GTK_BUTTON (mute),
+      gtk_image_new_from_icon_name ("audio-volume-high-symbolic",
+        GTK_ICON_SIZE_BUTTON));
+  g_object_set (G_OBJECT (mute), "halign", GTK_ALIGN_END, "valign",
+      GTK_ALIGN_END, "margin", 10, NULL);
+
+  g_signal_connect (mute, "clicked",
+      G_CALLBACK (on_mute_button_clicked), remote);
+  g_signal_connect (mute, "enter-notify-event",
+      G_CALLBACK (on_mute_button_entered), NULL);
+  g_signal_connect (mute, "leave-notify-event",
+      G_CALLBACK (on_mute_button_left), NULL);
+
+  return mute;
+}
+
+/* We try to fit the videos into a rectangular grid */
+static void
+get_grid_tile (guint index, guint n, gint width, gint height,
+    GdkRectangle * tile)
+{
+  guint n_cols, n_rows;
+
+  n_cols = (unsigned int) ceilf (sqrtf (n));
+  n_rows = (n + n_cols - 1) / n_cols;
+
+  tile->width = width / n_cols;
+  tile->height = height / n_rows;
+  tile->x = (index % n_cols) * tile->width;
+  tile->y = (index / n_cols) * tile->height;
+}
+
+static gint
+get_remote_index (GPtrArray * remotes, const gchar * addr_s)
+{
+  guint ii;
+
+  for (ii = 0; ii < remotes->len; ii++) {
+    OvRemotePeer *remote = g_ptr_array_index (remotes, ii);
+    if (g_strcmp0 (remote->addr_s, addr_s) == 0)
+      return ii;
+  }
+
+  return -1;
+}
+
+/* Lays out the video of the remotes that are still in the call whenever the
+ * compositor widget is resized or a remote leaves */
+static void
+on_compositor_size_allocate (GtkWidget * area, GdkRectangle * allocation,
+    OvgAppWindow * win)
+{
+  guint ii;
+  GdkRectangle tile;
+  GPtrArray *remotes;
+  OvgAppWindowPrivate *priv;
+
+  priv = ovg_app_window_get_instance_private (win);
+  remotes = ov_local_peer_get_remotes (priv->ovg_local);
+
+  for (ii = 0; ii < remotes->len; ii++) {
+    get_grid_tile (ii, remotes->len, allocation->width, allocation->height,
+        &tile);
+    ov_remote_peer_set_video_rect (g_ptr_array_index (remotes, ii), tile.x,
+        tile.y, tile.width, tile.height);
+  }
+}
+
+/* Puts each mute button in the corner of the video of its remote */
+static gboolean
+on_compositor_get_child_position (GtkOverlay * overlay, GtkWidget * widget,
+    GdkRectangle * allocation, OvgAppWindow * win)
+{
+  gint index;
+  GdkRectangle tile;
+  GtkRequisition size;
+  GPtrArray *remotes;
+  OvgAppWindowPrivate *priv;
+
+  priv = ovg_app_window_get_instance_private (win);
+  remotes = ov_local_peer_get_remotes (priv->ovg_local);
+
+  index = get_remote_index (remotes,
+      g_object_get_data (G_OBJECT (widget), "peer-name"));
+  if (index < 0)
+    return FALSE;
+
+  get_grid_tile (index, remotes->len,
+      gtk_widget_get_allocated_width (GTK_WIDGET (overlay)),
+      gtk_widget_get_allocated_height (GTK_WIDGET (overlay)), &tile);
+
+  /* The size includes the margin */
+  gtk_widget_get_preferred_size (widget, NULL, &size);
+  allocation->width = size.width;
+  allocation->height = size.height;
+  allocation->x = tile.x + tile.width - size.width;
+  allocation->y = tile.y + tile.height - size.height;
+
+  return TRUE;
+}
+
+/* Renders the video of all remotes in one widget; returns FALSE if that isn't
+ * possible */
+static gboolean
+ovg_app_window_populate_compositor (OvgAppWindow * win, OvLocalPeer * local,
+    GPtrArray * remotes)
+{
+  guint ii;
+  GtkWidget *child, *overlay, *area;
+  OvgAppWindowPrivate *priv;
+
+  priv = ovg_app_window_get_instance_private (win);
+
+  area = ov_local_peer_add_compositor_gtksink (local);
+  if (area == NULL)
+    return FALSE;
+
+  gtk_flow_box_set_min_children_per_line (GTK_FLOW_BOX (priv->peers_video),
+      1);
+
+  child = gtk_flow_box_child_new ();
+  gtk_container_add (GTK_CONTAINER (child), area);
+  g_signal_connect (area, "size-allocate",
+      G_CALLBACK (on_compositor_size_allocate), win);
+
+  overlay = gtk_overlay_new ();
+  gtk_container_add (GTK_CONTAINER (overlay), child);
+  g_signal_connect (overlay, "get-child-position",
+      G_CALLBACK (on_compositor_get_child_position), win);
+
+  for (ii = 0; ii < remotes->len; ii++) {
+    OvRemotePeer *remote;
+    GtkWidget *mute;
+
+    remote = g_ptr_array_index (remotes, ii);
+
+    mute = ovg_mute_button_new (remote);
+    g_object_set_data_full (G_OBJECT (mute), "peer-name",
+        g_strdup (remote->addr_s), g_free);
+    gtk_overlay_add_overlay (GTK_OVERLAY (overlay), mute);
+  }
+
+  gtk_container_add (GTK_CONTAINER (priv->peers_video), overlay);
+  priv->compositor = overlay;
+
+  return TRUE;
+}
+
+/* The remote sends us no more than what fits in its tile */
+static void
+on_peer_video_size_allocate (GtkWidget * area, GdkRectangle * allocation,
+    OvRemotePeer * remote)
+{
+  ov_remote_peer_set_video_view_size (remote, allocation->width,
+      allocation->height);
+}
+
 static void
 ovg_app_window_populate_peers_video (OvgAppWindow * win, OvLocalPeer * local,
     GPtrArray * remotes)
 {
   guint ii, n_cols;
+  GtkApplication *app;
   OvgAppWindowPrivate *priv;
 
   priv = ovg_app_window_get_instance_private (win);
+  app = gtk_window_get_application (GTK_WINDOW (win));
+
+  if (ovg_app_get_composite_video (OVG_APP (app))) {
+    if (ovg_app_window_populate_compositor (win, local, remotes))
+      return;
+    g_printerr ("Falling back to one video sink per remote\n");
+  }
 
   /* We try to fit the videos into a rectangular grid */
   n_cols = (unsigned int) ceilf (sqrtf (remotes->len));
@@ -625,35 +765,23 @@ ovg_app_window_populate_peers_video (OvgAppWindow * win, OvLocalPeer * local,
 
   for (ii = 0; ii < remotes->len; ii++) {
     OvRemotePeer *remote;
-    GtkWidget *child, *overlay, *mute, *area;
+    GtkWidget *child, *overlay, *area;
 
     remote = g_ptr_array_index (remotes, ii);
 
     child = gtk_flow_box_child_new ();
     area = ov_remote_peer_add_gtksink (remote);
     gtk_container_add (GTK_CONTAINER (child), area);
+    g_signal_connect (area, "size-allocate",
+        G_CALLBACK (on_peer_video_size_allocate), remote);
 
     overlay = gtk_overlay_new ();
     gtk_container_add (GTK_CONTAINER (overlay), child);
     g_object_set_data_full (G_OBJECT (overlay), "peer-name",
         g_strdup (remote->addr_s), g_free);
 
-    mute = gtk_toggle_button_new ();
-    gtk_widget_set_opacity (mute, MUTE_BUTTON_DEFAULT_OPACITY);
-    gtk_widget_add_events (mute, GDK_ENTER_NOTIFY_MASK | GDK_LEAVE_NOTIFY_MASK);
-    gtk_button_set_image (GTK_BUTTON (mute),
-        gtk_image_new_from_icon_name ("audio-volume-high-symbolic",
-          GTK_ICON_SIZE_BUTTON));
-    g_object_set (G_OBJECT (mute), "halign", GTK_ALIGN_END, "valign",
-        GTK_ALIGN_END, "margin", 10, NULL);
-    gtk_overlay_add_overlay (GTK_OVERLAY (overlay), mute);
-
-    g_signal_connect (mute, "clicked",
-        G_CALLBACK (on_mute_button_clicked), remote);
-    g_signal_connect (mute, "enter-notify-event",
-        G_CALLBACK (on_mute_button_entered), NULL);
-    g_signal_connect (mute, "leave-notify-event",
-        G_CALLBACK (on_mute_button_left), NULL);
+    gtk_overlay_add_overlay (GTK_OVERLAY (overlay),
+        ovg_mute_button_new (remote));
 
     gtk_container_add (GTK_CONTAINER (priv->peers_video), overlay);
   }
@@ -715,6 +843,23 @@ on_negotiate_started (OvLocalPeer * local, OvgAppWindow * win)
   g_print ("Remotes have replied; continuing negotiation...\n");
 }
 
+static void
+on_congestion_control (OvLocalPeer * local, GstStructure * decision,
+    OvgAppWindow * win)
+{
+  gchar *quality;
+  guint bitrate, loss, quality_enum;
+
+  gst_structure_get_uint (decision, "bitrate", &bitrate);
+  gst_structure_get_uint (decision, "packets-fractionlost", &loss);
+  gst_structure_get_uint (decision, "quality", &quality_enum);
+  quality = ov_video_quality_to_string (quality_enum);
+  g_print ("Congestion control: %s (now %s at %ukbps, packet loss: %.2f%%)\n",
+      gst_structure_get_string (decision, "action"), quality, bitrate,
+      ((float) loss * 100) / 256);
+  g_free (quality);
+}
+
 static void
 on_negotiate_finished (OvLocalPeer * local, OvgAppWindow * win)
 {
@@ -722,8 +867,6 @@ on_negotiate_finished (OvLocalPeer * local, OvgAppWindow * win)
 
   app = gtk_window_get_application (GTK_WINDOW (win));
 
-  g_timeout_add_seconds (2, (GSourceFunc) check_net_stats, win);
-
   if (ovg_app_get_low_res (OVG_APP (app)))
     ovg_send_lower_video_quality (local);
 
@@ -773,6 +916,25 @@ ovg_app_window_remove_peer (OvPeer * peer)
   priv = ovg_app_window_get_instance_private (win);
 
   g_object_get (peer, "address-string", &addr_s, NULL);
+
+  /* Only the mute button is specific to the remote; the video of the rest is
+   * laid out again once the compositor widget is resized */
+  if (priv->compositor != NULL) {
+    children = gtk_container_get_children (GTK_CONTAINER (priv->compositor));
+    for (l = children; l != NULL; l = l->next) {
+      gchar *peer_name = g_object_get_data (G_OBJECT (l->data), "peer-name");
+      if (g_strcmp0 (peer_name, addr_s) != 0)
+        continue;
+      g_print ("Removing remote peer %s\n", peer_name);
+      gtk_container_remove (GTK_CONTAINER (priv->compositor),
+          GTK_WIDGET (l->data));
+    }
+    g_list_free (children);
+    gtk_widget_queue_resize (priv->compositor);
+    g_free (addr_s);
+    return G_SOURCE_REMOVE;
+  }
+
   children = gtk_container_get_children (GTK_CONTAINER (priv->peers_video));
 
   for (l = children; l != NULL; l = l->next) {
@@ -829,6 +991,8 @@ setup_default_handlers (OvLocalPeer * local, OvgAppWindow * win)
       G_CALLBACK (on_call_remote_gone), win);
   g_signal_connect (local, "call-all-remotes-gone",
       G_CALLBACK (on_call_all_remotes_gone), win);
+  g_signal_connect (local, "congestion-control",
+      G_CALLBACK (on_congestion_control), win);
 }
 
 static gboolean
@@ -851,6 +1015,7 @@ ovg_app_window_reset_state (OvgAppWindow * win)
     gtk_container_remove (GTK_CONTAINER (priv->peers_video),
         GTK_WIDGET (l->data));
   g_list_free (children);
+  priv->compositor = NULL;
 
   /* Show */
   gtk_header_bar_set_title (GTK_HEADER_BAR (priv->header_bar),
@@ -865,6 +1030,9 @@ ovg_app_window_reset_state (OvgAppWindow * win)
   g_signal_handlers_disconnect_by_data (priv->ovg_local, win);
   /* Connect default handlers again */
   setup_default_handlers (priv->ovg_local, win);
+  /* Only called during calls */
+  priv->stats_id = ov_local_peer_subscribe_stats (priv->ovg_local, "video",
+      2000, (OvStatsFunc) on_net_stats, win, NULL);
 
   /* Only call once if dispatched from a main context */
   return G_SOURCE_REMOVE;
@@ -891,6 +1059,14 @@ ovg_app_window_show_scheduled_error (OvgAppWindow * win)
   return TRUE;
 }
 
+static gboolean
+peers_d_rows_clean_timeout (OvgAppWindow * win)
+{
+  OvgAppWindowPrivate *priv = ovg_app_window_get_instance_private (win);
+
+  return ovg_app_window_peers_d_rows_clean_timed_out (priv->ovg_local, win);
+}
+
 static gboolean
 setup_window (OvgAppWindow * win)
 {
@@ -910,6 +1086,11 @@ setup_window (OvgAppWindow * win)
         NULL))
     g_application_quit (G_APPLICATION (app));
 
+  /* We only probe at startup, so discovery-sent stops being emitted */
+  if (ov_local_peer_get_announce_presence (priv->ovg_local))
+    g_timeout_add_seconds (PEER_DISCOVER_INTERVAL,
+        (GSourceFunc) peers_d_rows_clean_timeout, win);
+
   return G_SOURCE_REMOVE;
 }
 
@@ -985,6 +1166,30 @@ on_end_call_button_clicked (OvgAppWindow * win, GtkButton * b)
   ovg_app_window_reset_state (win);
 }
 
+/* Nobody can see the video while we're minimised, so don't decode any */
+static gboolean
+on_window_state_event (OvgAppWindow * win, GdkEventWindowState * event)
+{
+  guint ii;
+  gboolean visible;
+  GPtrArray *remotes;
+  OvgAppWindowPrivate *priv;
+
+  priv = ovg_app_window_get_instance_private (win);
+
+  if (priv->ovg_local == NULL ||
+      !(event->changed_mask & GDK_WINDOW_STATE_ICONIFIED))
+    return FALSE;
+
+  visible = !(event->new_window_state & GDK_WINDOW_STATE_ICONIFIED);
+  remotes = ov_local_peer_get_remotes (priv->ovg_local);
+  for (ii = 0; ii < remotes->len; ii++)
+    ov_remote_peer_set_video_visible (g_ptr_array_index (remotes, ii),
+        visible);
+
+  return FALSE;
+}
+
 static void
 ovg_app_window_init (OvgAppWindow * win)
 {
@@ -1004,6 +1209,9 @@ ovg_app_window_init (OvgAppWindow * win)
   gtk_list_box_set_header_func (GTK_LIST_BOX (priv->peers_c),
       ovg_list_box_update_header_func, NULL, NULL);
 
+  g_signal_connect (win, "window-state-event",
+      G_CALLBACK (on_window_state_event), NULL);
+
   /* We can only initialize all this once the init is fully chained */
   g_idle_add ((GSourceFunc) setup_window, win);
 }
@@ -1022,6 +1230,7 @@ ovg_app_window_dispose (GObject * object)
   /* Disconnect handlers on dispose so they're not called during the dispose
    * chain up */
   g_signal_handlers_disconnect_by_data (priv->ovg_local, win);
+  ov_local_peer_unsubscribe_stats (priv->ovg_local, priv->stats_id);
   g_clear_object (&priv->ovg_local);
 
 chain:
@@ -31,6 +31,8 @@
 
 #include <string.h>
 
+G_LOCK_DEFINE_STATIC (msg_id);
+
 static const struct {
   OvTcpMsgType type;
   const char *type_string;
@@ -62,7 +64,10 @@ static const struct {
    *   (peer2_id, arecv_port2, arecv_rtcpsr_port2, vrecv_port2, vrecv_rtcpsr_port2),
    *   ...])
    *
-   *   Note that the rtcprr ports are shared between all peers */
+   *   Note that the rtcprr ports are shared between all peers
+   *
+   *   The video caps can have boolean "rtx" and "ulpfec" fields for the kinds
+   *   of packet loss repair the peer supports; see OvRtpRepair */
   {OV_TCP_MSG_TYPE_REPLY_CAPS,       "reply media caps",   "(xqqssssa(sqqqq))"},
 
   /* Format: (call_id, peer_id_str, peer_port)
@@ -114,6 +119,44 @@ static const struct {
   /* Format: call_id, peer_id_str */
   {OV_TCP_MSG_TYPE_END_CALL,         "end call",           "(xs)"},
 
+  /* Format: (call_id, peer_id_str, audio_muted, video_muted)
+   * Sent by a peer to all the others during a call when it stops or starts
+   * sending audio or video, and when the call starts if it isn't sending
+   * either. Nothing is renegotiated. */
+  {OV_TCP_MSG_TYPE_MUTE_MEDIA,       "mute media",         "(xsbb)"},
+
+  /* Sent by the negotiator during a call to each peer in it when a new peer
+   * joins. The peer starts sending to the new peer on the given ports and
+   * receiving the given caps from it, without touching its other streams.
+   *
+   * Format:
+   * (call_id, peer_id_str, peer_addr, send_acaps, send_vcaps,
+   *   # The new peer will recv from this peer on these ports
+   *  arecv_port, arecv_rtcpsr_port, arecv_rtcprr_port,
+   *  vrecv_port, vrecv_rtcpsr_port, vrecv_rtcprr_port)
+   *
+   * The peer_addr is as resolved by the negotiator, like in QUERY_CAPS */
+  {OV_TCP_MSG_TYPE_ADD_PEER,         "add peer to call",   "(xssssqqqqqq)"},
+
+  /* Format: (call_id, peer_id_str, max_quality)
+   * Sent by a peer during a call to each peer whose video it shows, with the
+   * highest OvVideoQuality that it shows it at; taken from the size of its
+   * tile and whether it's visible at all. The receiving peer sends it a
+   * simulcast layer or encodes no better than that. 0 means no limit. Nothing
+   * is renegotiated. */
+  {OV_TCP_MSG_TYPE_VIDEO_VIEW,       "video view",         "(xsu)"},
+
+  /* The reply to ADD_PEER: the caps that this peer is sending in the call,
+   * with the same flags as in CALL_DETAILS, and the ports it has allocated to
+   * receive from the new peer. The negotiator puts these in the CALL_DETAILS
+   * of the new peer.
+   *
+   * Format:
+   * (call_id, send_acaps, send_vcaps,
+   *  arecv_port, arecv_rtcpsr_port, arecv_rtcprr_port,
+   *  vrecv_port, vrecv_rtcpsr_port, vrecv_rtcprr_port) */
+  {OV_TCP_MSG_TYPE_REPLY_ADD_PEER,   "reply add peer",     "(xssqqqqqq)"},
+
   {0}
 };
 
@@ -162,6 +205,25 @@ supported:
   return NULL;
 }
 
+/* Requests sent on the same control connection are matched to their replies
+ * by id, so ids must never repeat even if two threads create a message in the
+ * same microsecond */
+guint64
+ov_tcp_msg_new_id (void)
+{
+  static guint64 last_id = 0;
+  guint64 id;
+
+  G_LOCK (msg_id);
+  id = g_get_monotonic_time ();
+  if (id <= last_id)
+    id = last_id + 1;
+  last_id = id;
+  G_UNLOCK (msg_id);
+
+  return id;
+}
+
 OvTcpMsg *
 ov_tcp_msg_new (OvTcpMsgType type, GVariant * data)
 {
@@ -169,8 +231,7 @@ ov_tcp_msg_new (OvTcpMsgType type, GVariant * data)
 
   msg = g_new0 (OvTcpMsg, 1);
   msg->version = OV_TCP_MAX_VERSION;
-  /* FIXME: Collisions? */
-  msg->id = g_get_monotonic_time ();
+  msg->id = ov_tcp_msg_new_id ();
   msg->type = type;
 
   if (data != NULL) {
@@ -287,70 +348,84 @@ ov_tcp_msg_print (OvTcpMsg * msg)
   return tmp;
 }
 
-gboolean
-ov_tcp_msg_write_to_stream (GOutputStream * output, OvTcpMsg * msg,
-    GCancellable * cancellable, GError ** error)
+/* Sets up @frame to write @msg to the network as a header followed by the
+ * big endian serialized variant, straight from the variant's own storage.
+ * The vectors are only valid till ov_tcp_msg_frame_clear() is called. */
+void
+ov_tcp_msg_frame_init (OvTcpMsgFrame * frame, OvTcpMsg * msg)
 {
-  gchar *tmp;
-  guint32 tmp1;
-  guint64 tmp2;
-  GVariant *variant;
-  gboolean ret = FALSE;
-
-  tmp = ov_tcp_msg_print (msg);
-  GST_DEBUG ("Writing msg type %s to the network; contents: %s",
-      ov_tcp_msg_type_to_string (msg->type, OV_TCP_MAX_VERSION),
-      tmp);
-  g_free (tmp);
-
-  /* TODO: Error checking */
-  /* Write header */
-  tmp1 = GUINT32_TO_BE (msg->version);
-  if (!g_output_stream_write_all (output, &tmp1, sizeof (tmp1), NULL,
-        cancellable, error))
-    goto err;
-  tmp2 = GUINT64_TO_BE (msg->id);
-  if (!g_output_stream_write_all (output, &tmp2, sizeof (tmp2), NULL,
-        cancellable, error))
-    goto err;
-  tmp1 = GUINT32_TO_BE (msg->type);
-  if (!g_output_stream_write_all (output, &tmp1, sizeof (tmp1), NULL,
-        cancellable, error))
-    goto err;
-  tmp1 = GUINT32_TO_BE (msg->size);
-  if (!g_output_stream_write_all (output, &tmp1, sizeof (tmp1), NULL,
-        cancellable, error))
-    goto err;
+  GST_WRITE_UINT32_BE (frame->header, msg->version);
+  GST_WRITE_UINT64_BE (frame->header + 4, msg->id);
+  GST_WRITE_UINT32_BE (frame->header + 12, msg->type);
+  GST_WRITE_UINT32_BE (frame->header + 16, msg->size);
 
-  if (msg->size > 0) {
-    guint32 size;
+  frame->vectors[0].buffer = frame->header;
+  frame->vectors[0].size = OV_TCP_MSG_HEADER_SIZE;
+  frame->n_vectors = 1;
+  frame->body = NULL;
 
-    /* Network data is always big endian */
+  if (msg->size == 0)
+    return;
+
+  /* Network data is always big endian */
 #if G_BYTE_ORDER == G_LITTLE_ENDIAN
-    variant = g_variant_byteswap (msg->variant);
+  frame->body = g_variant_byteswap (msg->variant);
 #elif G_BYTE_ORDER == G_BIG_ENDIAN
-    variant = g_variant_get_normal_form (msg->variant);
+  frame->body = g_variant_get_normal_form (msg->variant);
 #else
 #error "Unsupported byte order: " STR(G_BYTE_ORDER)
 #endif
-    size = g_variant_get_size (variant);
-    g_assert (msg->size == size);
-
-    /* Write data */
-    ret = g_output_stream_write_all (output, g_variant_get_data (variant),
-        size, NULL, cancellable, error);
-    g_variant_unref (variant);
-  } else {
-    ret = TRUE;
+  g_assert (msg->size == g_variant_get_size (frame->body));
+
+  frame->vectors[1].buffer = g_variant_get_data (frame->body);
+  frame->vectors[1].size = msg->size;
+  frame->n_vectors = 2;
+}
+
+void
+ov_tcp_msg_frame_clear (OvTcpMsgFrame * frame)
+{
+  g_clear_pointer (&frame->body, g_variant_unref);
+  frame->n_vectors = 0;
+}
+
+gboolean
+ov_tcp_msg_write_to_stream (GOutputStream * output, OvTcpMsg * msg,
+    GCancellable * cancellable, GError ** error)
+{
+  gchar *tmp;
+  gboolean ret;
+  OvTcpMsgFrame frame;
+#if !GLIB_CHECK_VERSION (2, 60, 0)
+  guint ii;
+#endif
+
+  if (OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = ov_tcp_msg_print (msg);
+    GST_LOG ("Writing msg type %s to the network; contents: %s",
+        ov_tcp_msg_type_to_string (msg->type, OV_TCP_MAX_VERSION),
+        tmp);
+    g_free (tmp);
   }
 
-out:
+  ov_tcp_msg_frame_init (&frame, msg);
+#if GLIB_CHECK_VERSION (2, 60, 0)
+  ret = g_output_stream_writev_all (output, frame.vectors, frame.n_vectors,
+      NULL, cancellable, error);
+#else
+  ret = TRUE;
+  for (ii = 0; ii < frame.n_vectors && ret; ii++)
+    ret = g_output_stream_write_all (output, frame.vectors[ii].buffer,
+        frame.vectors[ii].size, NULL, cancellable, error);
+#endif
+  ov_tcp_msg_frame_clear (&frame);
+
+  if (!ret)
+    GST_ERROR ("Unable to write msg type %s of size %u",
+        ov_tcp_msg_type_to_string (msg->type, OV_TCP_MAX_VERSION),
+        msg->size);
+
   return ret;
-err:
-  tmp = ov_tcp_msg_print (msg);
-  GST_ERROR ("Unable to write header for msg: %s", tmp);
-  g_free (tmp);
-  goto out;
 }
 
 gboolean
@@ -362,6 +437,8 @@ ov_tcp_msg_write_new_error_to_stream (GOutputStream * output,
   OvTcpMsg *msg;
 
   msg = ov_tcp_msg_new_error (id, error_msg);
+  /* Replies carry the id of the request they're for */
+  msg->id = id;
   ret = ov_tcp_msg_write_to_stream (output, msg, cancellable, error);
   ov_tcp_msg_free (msg);
 
@@ -376,12 +453,99 @@ ov_tcp_msg_write_new_ack_to_stream (GOutputStream * output, guint64 id,
   OvTcpMsg *msg;
 
   msg = ov_tcp_msg_new_ack (id);
+  msg->id = id;
   ret = ov_tcp_msg_write_to_stream (output, msg, cancellable, error);
   ov_tcp_msg_free (msg);
 
   return ret;
 }
 
+/* Fills the header fields of @msg from the OV_TCP_MSG_HEADER_SIZE bytes at
+ * @data */
+gboolean
+ov_tcp_msg_parse_header (OvTcpMsg * msg, const gchar * data)
+{
+  msg->version = GST_READ_UINT32_BE (data);
+
+  if (msg->version != 1) {
+    GST_ERROR ("Message version %u is not supported", msg->version);
+    return FALSE;
+  }
+
+  msg->id = GST_READ_UINT64_BE (data + 4);
+  msg->type = GST_READ_UINT32_BE (data + 12);
+  msg->size = GST_READ_UINT32_BE (data + 16);
+
+  return TRUE;
+}
+
+/* Sets the body of @msg from the msg->size bytes at @data that followed its
+ * header on the network. @data is not referenced afterwards, so callers can
+ * keep reusing the same buffer for every message. */
+gboolean
+ov_tcp_msg_set_body (OvTcpMsg * msg, const guint8 * data)
+{
+  GVariant *variant;
+  const gchar *variant_type;
+
+  variant_type = ov_tcp_msg_type_to_variant_type (msg->type,
+      msg->version);
+  if (variant_type == NULL)
+    return FALSE;
+
+  variant = g_variant_new_from_data (G_VARIANT_TYPE (variant_type), data,
+      msg->size, FALSE, NULL, NULL);
+  g_variant_ref_sink (variant);
+
+  /* Network data is always big endian. The data is untrusted, so both of
+   * these make their own normalised copy of it, which is the only copy. */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+  msg->variant = g_variant_byteswap (variant);
+#elif G_BYTE_ORDER == G_BIG_ENDIAN
+  msg->variant = g_variant_get_normal_form (variant);
+#else
+#error "Unsupported byte order: " STR(G_BYTE_ORDER)
+#endif
+  g_variant_unref (variant);
+
+  msg->data = g_variant_get_data (msg->variant);
+  msg->size = g_variant_get_size (msg->variant);
+
+  return TRUE;
+}
+
+/* Blocks till the next message starts arriving on @connection. Returns FALSE
+ * without setting @error if the other side closed the connection. Socket
+ * timeouts are ignored since control connections are idle most of the time */
+gboolean
+ov_tcp_msg_wait_on_connection (GSocketConnection * connection,
+    GCancellable * cancellable, GError ** error)
+{
+  gchar tmp;
+  gssize size;
+  GSocket *socket;
+  GInputVector vector = {&tmp, 1};
+  gint flags = G_SOCKET_MSG_PEEK;
+  GError *wait_error = NULL;
+
+  socket = g_socket_connection_get_socket (connection);
+
+  while (!g_socket_condition_wait (socket, G_IO_IN, cancellable,
+        &wait_error)) {
+    if (!g_error_matches (wait_error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+      g_propagate_error (error, wait_error);
+      return FALSE;
+    }
+    g_clear_error (&wait_error);
+  }
+
+  /* A zero-sized peek means EOF */
+  size = g_socket_receive_message (socket, NULL, &vector, 1, NULL, NULL,
+      &flags, cancellable, error);
+
+  return size > 0;
+}
+
 /* Does a blocking read for the header */
 gboolean
 ov_tcp_msg_read_header_from_stream (GInputStream * input, OvTcpMsg * msg,
@@ -399,92 +563,53 @@ ov_tcp_msg_read_header_from_stream (GInputStream * input, OvTcpMsg * msg,
   if (!ret)
     return FALSE;
 
-  if (bytes_read < sizeof (tmp)) {
-    GST_ERROR ("Unable to read message length prefix, got EOS");
+  if (bytes_read == 0) {
+    GST_DEBUG ("Unable to read message header, connection was closed");
     return FALSE;
   }
 
-  msg->version = GST_READ_UINT32_BE (tmp);
-
-  if (msg->version != 1) {
-    GST_ERROR ("Message version %u is not supported", msg->version);
+  if (bytes_read < sizeof (tmp)) {
+    GST_ERROR ("Unable to read message length prefix, got EOS");
     return FALSE;
   }
 
-  msg->id = GST_READ_UINT64_BE (tmp + 4);
-  msg->type = GST_READ_UINT32_BE (tmp + 12);
-  msg->size = GST_READ_UINT32_BE (tmp + 16);
-
-  return TRUE;
+  return ov_tcp_msg_parse_header (msg, tmp);
 }
 
-/* Does a blocking read and returns a (transfer-full) buffer with the contents
- * of the body */
+/* Does a blocking read of the body into @buffer, which is grown as needed and
+ * can be reused for the next message */
 gboolean
 ov_tcp_msg_read_body_from_stream (GInputStream * input, OvTcpMsg * msg,
-    GCancellable * cancellable, GError ** error)
+    GByteArray * buffer, GCancellable * cancellable, GError ** error)
 {
-  GBytes *read;
-  GByteArray *barray;
-  GVariant *variant;
-  const gchar *variant_type;
-  gsize size_left = msg->size;
+  gsize bytes_read;
 
   g_return_val_if_fail (msg != NULL, FALSE);
 
-  barray = g_byte_array_new ();
+  if (buffer->len < msg->size)
+    g_byte_array_set_size (buffer, msg->size);
 
   /* FIXME: Add a timeout that cancels if we don't get the data for a while */
-  do {
-    gsize size;
-    guint8 *data;
-
-    read = g_input_stream_read_bytes (input, size_left, cancellable, error);
-    if (g_bytes_get_size (read) == 0)
-      break;
-    data = g_bytes_unref_to_data (read, &size);
-    g_byte_array_append (barray, data, size);
-    g_free (data);
-    size_left -= size;
-  } while (size_left > 0);
-
-  if (size_left > 0) {
-    g_byte_array_free (barray, TRUE);
+  if (!g_input_stream_read_all (input, buffer->data, msg->size, &bytes_read,
+        cancellable, error))
+    return FALSE;
+
+  if (bytes_read < msg->size) {
     GST_ERROR ("Unable to finish reading incoming data due to EOS");
     return FALSE;
   }
 
-  read = g_byte_array_free_to_bytes (barray);
-
-  variant_type = ov_tcp_msg_type_to_variant_type (msg->type,
-      msg->version);
-  variant = g_variant_new_from_bytes (G_VARIANT_TYPE (variant_type), read,
-      FALSE);
-  g_variant_ref_sink (variant);
-  g_bytes_unref (read);
-
-  /* Network data is always big endian */
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-  msg->variant = g_variant_byteswap (variant);
-#elif G_BYTE_ORDER == G_BIG_ENDIAN
-  msg->variant = g_variant_get_normal_form (variant);
-#else
-#error "Unsupported byte order: " STR(G_BYTE_ORDER)
-#endif
-  g_variant_unref (variant);
-
-  msg->data = g_variant_get_data (msg->variant);
-  msg->size = g_variant_get_size (msg->variant);
-
-  return TRUE;
+  return ov_tcp_msg_set_body (msg, buffer->data);
 }
 
+/* @buffer is used for reading the body; pass NULL to use a temporary one */
 OvTcpMsg *
-ov_tcp_msg_read_from_stream (GInputStream * input, GCancellable * cancellable,
-    GError ** error)
+ov_tcp_msg_read_from_stream (GInputStream * input, GByteArray * buffer,
+    GCancellable * cancellable, GError ** error)
 {
   gboolean ret;
   OvTcpMsg *msg;
+  GByteArray *tmp_buffer = NULL;
 
   msg = g_new0 (OvTcpMsg, 1);
 
@@ -503,12 +628,17 @@ ov_tcp_msg_read_from_stream (GInputStream * input, GCancellable * cancellable,
   if (msg->size == 0)
     goto out;
 
+  if (buffer == NULL)
+    buffer = tmp_buffer = g_byte_array_new ();
+
   /* Read the rest of the message */
-  ret = ov_tcp_msg_read_body_from_stream (input, msg, cancellable,
+  ret = ov_tcp_msg_read_body_from_stream (input, msg, buffer, cancellable,
       error);
+  if (tmp_buffer)
+    g_byte_array_unref (tmp_buffer);
   if (ret != TRUE) {
     GST_ERROR ("Unable to read message body: %s",
-        *error ? (*error)->message : "Unknown error");
+        error && *error ? (*error)->message : "Unknown error");
     goto err_no_body;
   }
 
@@ -30,10 +30,14 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <gst/gst.h>
 
 G_BEGIN_DECLS
 
 #define OV_TCP_TIMEOUT 5
+/* How long we try to send a one-way message to all the remotes it's for, in
+ * seconds */
+#define OV_TCP_ONE_WAY_TIMEOUT 1
 
 /* Zeroconf is 224.0.0.251 on port 53. We use the same address but the port is
  * OV_DEFAULT_COMM_PORT.
@@ -52,6 +56,9 @@ enum _OvTcpMsgType {
   OV_TCP_MSG_TYPE_PAUSE_CALL,
   OV_TCP_MSG_TYPE_RESUME_CALL,
   OV_TCP_MSG_TYPE_END_CALL,
+  OV_TCP_MSG_TYPE_MUTE_MEDIA,
+  OV_TCP_MSG_TYPE_ADD_PEER,
+  OV_TCP_MSG_TYPE_VIDEO_VIEW,
 
   /* Replies */
   OV_TCP_MSG_TYPE_ACK = 200,
@@ -59,6 +66,7 @@ enum _OvTcpMsgType {
   OV_TCP_MSG_TYPE_ERROR_CALL,
   OV_TCP_MSG_TYPE_OK_NEGOTIATE,
   OV_TCP_MSG_TYPE_REPLY_CAPS,
+  OV_TCP_MSG_TYPE_REPLY_ADD_PEER,
 
   /* Both queries and replies */
 };
@@ -78,11 +86,28 @@ struct _OvTcpMsg {
 /* Size of the metadata sent with a OvTcpMsg */
 #define OV_TCP_MSG_HEADER_SIZE 20
 
+typedef struct _OvTcpMsgFrame OvTcpMsgFrame;
+
+/* An OvTcpMsg as it is written to the network; see ov_tcp_msg_frame_init() */
+struct _OvTcpMsgFrame {
+  guint8 header[OV_TCP_MSG_HEADER_SIZE];
+  /* Big endian form of the msg variant, owns the storage of vectors[1] */
+  GVariant *body;
+  GOutputVector vectors[2];
+  guint n_vectors;
+};
+
+/* ov_tcp_msg_print() formats the whole variant, so only call it when the
+ * result will actually be logged */
+#define OV_TCP_MSG_PRINT_ENABLED \
+  (gst_debug_category_get_threshold (onevideo_debug) >= GST_LEVEL_LOG)
+
 /* Ordered from oldest to newest */
 static const guint32 ov_versions[] = {1,};
 #define OV_TCP_MIN_VERSION ov_versions[0]
 #define OV_TCP_MAX_VERSION ov_versions[0]
 
+guint64       ov_tcp_msg_new_id                 (void);
 OvTcpMsg*     ov_tcp_msg_new                    (OvTcpMsgType type,
                                                  GVariant *data);
 void          ov_tcp_msg_free                   (OvTcpMsg *msg);
@@ -101,6 +126,14 @@ OvTcpMsg*     ov_tcp_msg_new_cancel_negotiate   (guint64 call_id,
 
 gchar*        ov_tcp_msg_print                  (OvTcpMsg *msg);
 
+void          ov_tcp_msg_frame_init                   (OvTcpMsgFrame *frame,
+                                                       OvTcpMsg *msg);
+void          ov_tcp_msg_frame_clear                  (OvTcpMsgFrame *frame);
+gboolean      ov_tcp_msg_parse_header                 (OvTcpMsg *msg,
+                                                       const gchar *data);
+gboolean      ov_tcp_msg_set_body                     (OvTcpMsg *msg,
+                                                       const guint8 *data);
+
 gboolean      ov_tcp_msg_write_to_stream              (GOutputStream *output,
                                                        OvTcpMsg *msg,
                                                        GCancellable *cancellable,
@@ -115,15 +148,20 @@ gboolean      ov_tcp_msg_write_new_ack_to_stream      (GOutputStream *output,
                                                        GCancellable *cancellable,
                                                        GError **error);
 
+gboolean      ov_tcp_msg_wait_on_connection           (GSocketConnection *connection,
+                                                       GCancellable *cancellable,
+                                                       GError **error);
 gboolean      ov_tcp_msg_read_header_from_stream      (GInputStream *input,
                                                        OvTcpMsg *msg,
                                                        GCancellable *cancellable,
                                                        GError **error);
 gboolean      ov_tcp_msg_read_body_from_stream        (GInputStream *input,
                                                        OvTcpMsg *msg,
+                                                       GByteArray *buffer,
                                                        GCancellable *cancellable,
                                                        GError **error);
 OvTcpMsg*     ov_tcp_msg_read_from_stream             (GInputStream *input,
+                                                       GByteArray *buffer,
                                                        GCancellable *cancellable,
                                                        GError **error);
 
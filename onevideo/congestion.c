@@ -0,0 +1,464 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "congestion.h"
+#include "ov-local-peer-priv.h"
+
+/* A loss- and delay-based controller along the lines of the loss-based half
+ * of Google Congestion Control. Every interval we look at the RTCP RRs sent by
+ * the remotes that receive our full-quality video:
+ *
+ * - Packet loss above ~10% or a round-trip time that has grown well above the
+ *   lowest one seen (queueing delay) means we are congested
+ * - Packet loss below ~2% with no queueing delay means we can send more
+ * - Anything in between means we stay where we are
+ *
+ * When congested, we first lower the encoder bitrate, then the framerate, and
+ * only then the resolution. We recover in the opposite order, and only go back
+ * up to the quality set by the application. */
+
+/* Packet loss is an 8-bit fraction, as in RTCP RRs */
+#define OV_CONGESTION_LOSS_HIGH         26      /* ~10% */
+#define OV_CONGESTION_LOSS_LOW          5       /* ~2% */
+/* Round-trip time above the lowest one seen that we treat as queueing delay */
+#define OV_CONGESTION_DELAY_MS          100
+/* Multiplicative decrease when we see queueing delay but no loss */
+#define OV_CONGESTION_DELAY_FACTOR      0.85
+/* Multiplicative increase per interval when the network is clear */
+#define OV_CONGESTION_INCREASE_FACTOR   1.08
+/* Intervals without congestion before we try a higher framerate/resolution */
+#define OV_CONGESTION_PROBE_INTERVALS   10
+/* Bits per pixel used to estimate the bitrate needed for a quality */
+#define OV_CONGESTION_BITS_PER_PIXEL    0.1
+#define OV_CONGESTION_MIN_BITRATE       100
+#define OV_CONGESTION_MAX_BITRATE       8000
+/* FEC overhead is this many times the loss percentage, up to the max. With
+ * no loss we only send FEC at the lowest percentage to cover bursts. */
+#define OV_CONGESTION_FEC_FACTOR        2
+#define OV_CONGESTION_FEC_MIN           2
+#define OV_CONGESTION_FEC_MAX           50
+
+/* Called with the lock TAKEN */
+static void
+ov_congestion_apply_fec (OvLocalPeerPrivate * priv, guint loss)
+{
+  guint percentage;
+
+  if (priv->fec_encoder == NULL)
+    return;
+
+  percentage = CLAMP (loss * 100 * OV_CONGESTION_FEC_FACTOR / 256,
+      OV_CONGESTION_FEC_MIN, OV_CONGESTION_FEC_MAX);
+  g_object_set (priv->fec_encoder, "percentage", percentage, NULL);
+  GST_TRACE ("Set FEC percentage to %u", percentage);
+}
+
+static gboolean
+ov_congestion_encoder_has_property (GstElement * encoder, const gchar * name)
+{
+  return g_object_class_find_property (G_OBJECT_GET_CLASS (encoder), name)
+    != NULL;
+}
+
+/* Called with the lock TAKEN */
+static GstElement *
+ov_congestion_get_encoder (OvLocalPeerPrivate * priv)
+{
+  GstElement *encoder;
+
+  encoder = priv->video_layers[0].encoder;
+  if (encoder == NULL)
+    return NULL;
+
+  /* Some encoders (f.ex., v4l2h264enc) have no rate control that we know of */
+  if (!ov_congestion_encoder_has_property (encoder, "bitrate") &&
+      !ov_congestion_encoder_has_property (encoder, "quality"))
+    return NULL;
+
+  return encoder;
+}
+
+/* Called with the lock TAKEN */
+static void
+ov_congestion_apply_bitrate (OvLocalPeerPrivate * priv)
+{
+  gint quality;
+  GstElement *encoder;
+
+  encoder = ov_congestion_get_encoder (priv);
+  if (encoder == NULL)
+    return;
+
+  if (ov_congestion_encoder_has_property (encoder, "bitrate")) {
+    /* All the H.264 encoders we use take the bitrate in kbit/s */
+    g_object_set (encoder, "bitrate", priv->cc.bitrate, NULL);
+    return;
+  }
+
+  /* jpegenc has no bitrate; scale the quality with the target bitrate */
+  quality = (OV_JPEG_ENCODE_QUALITY * priv->cc.bitrate) / priv->cc.max_bitrate;
+  g_object_set (encoder, "quality", CLAMP (quality, 5, OV_JPEG_ENCODE_QUALITY),
+      NULL);
+}
+
+/* Estimates the bitrate bounds for the current transmit caps and clamps the
+ * target bitrate to them.
+ *
+ * Called with the lock TAKEN */
+static void
+ov_congestion_update_bounds (OvLocalPeer * local)
+{
+  GstCaps *caps;
+  GstStructure *s;
+  gint width, height, fps_n, fps_d;
+  OvLocalPeerPrivate *priv;
+  gdouble kbps;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* Safe defaults in case the caps lack some fields */
+  width = 640;
+  height = 360;
+  fps_n = 15;
+  fps_d = 1;
+
+  caps = ov_local_peer_get_transmit_video_caps (local);
+  if (caps != NULL && !gst_caps_is_any (caps) && !gst_caps_is_empty (caps)) {
+    s = gst_caps_get_structure (caps, 0);
+    if (gst_structure_get_int (s, "height", &height) &&
+        !gst_structure_get_int (s, "width", &width))
+      /* Assume 16:9 */
+      width = (height * 16) / 9;
+    gst_structure_get_fraction (s, "framerate", &fps_n, &fps_d);
+    if (fps_d == 0)
+      fps_d = 1;
+  }
+  g_clear_pointer (&caps, gst_caps_unref);
+
+  kbps = (width * height * OV_CONGESTION_BITS_PER_PIXEL * fps_n) /
+    (fps_d * 1000);
+  priv->cc.max_bitrate = CLAMP ((guint) kbps, OV_CONGESTION_MIN_BITRATE,
+      OV_CONGESTION_MAX_BITRATE);
+  priv->cc.min_bitrate = MAX (priv->cc.max_bitrate / 5,
+      OV_CONGESTION_MIN_BITRATE);
+
+  if (priv->cc.bitrate == 0)
+    priv->cc.bitrate = priv->cc.max_bitrate;
+  else
+    priv->cc.bitrate = CLAMP (priv->cc.bitrate, priv->cc.min_bitrate,
+        priv->cc.max_bitrate);
+
+  GST_DEBUG ("Video bitrate bounds for %ix%i@%i/%i: %u-%u kbps", width, height,
+      fps_n, fps_d, priv->cc.min_bitrate, priv->cc.max_bitrate);
+}
+
+/* The lower of what the application wants and what the remotes show */
+static OvVideoQuality
+ov_congestion_get_ceiling (OvLocalPeerPrivate * priv)
+{
+  if (priv->cc.max_quality == OV_VIDEO_QUALITY_INVALID ||
+      ov_video_quality_above (priv->cc.max_quality, priv->view_quality))
+    return priv->view_quality;
+
+  return priv->cc.max_quality;
+}
+
+/* Finds the negotiated quality closest to @current in the requested direction.
+ * If @framerate is TRUE, only the framerate is changed. Otherwise the
+ * resolution is changed, keeping the framerate as close to the current one as
+ * possible. Never goes above @ceiling when going up.
+ *
+ * Returns OV_VIDEO_QUALITY_INVALID if there is nothing to switch to */
+static OvVideoQuality
+ov_congestion_find_quality (OvLocalPeer * local, OvVideoQuality current,
+    OvVideoQuality ceiling, gboolean lower, gboolean framerate)
+{
+  guint ii, cur_reso, cur_fps, reso, fps, target_reso, best_fps;
+  OvVideoQuality *qualities, found = OV_VIDEO_QUALITY_INVALID;
+
+  qualities = ov_local_peer_get_negotiated_video_qualities (local);
+  if (qualities == NULL)
+    return OV_VIDEO_QUALITY_INVALID;
+
+  cur_reso = current & OV_VIDEO_QUALITY_RESO_RANGE;
+  cur_fps = current & OV_VIDEO_QUALITY_FPS_RANGE;
+  target_reso = cur_reso;
+
+  if (!framerate) {
+    /* Find the closest resolution in the requested direction */
+    target_reso = 0;
+    for (ii = 0; qualities[ii] != 0; ii++) {
+      reso = qualities[ii] & OV_VIDEO_QUALITY_RESO_RANGE;
+      if (reso == cur_reso || (reso < cur_reso) != lower)
+        continue;
+      if (!lower && ov_video_quality_above (qualities[ii] &
+            OV_VIDEO_QUALITY_RESO_RANGE, ceiling))
+        continue;
+      if (target_reso == 0 ||
+          (lower ? reso > target_reso : reso < target_reso))
+        target_reso = reso;
+    }
+    if (target_reso == 0)
+      goto out;
+  }
+
+  best_fps = 0;
+  for (ii = 0; qualities[ii] != 0; ii++) {
+    reso = qualities[ii] & OV_VIDEO_QUALITY_RESO_RANGE;
+    fps = qualities[ii] & OV_VIDEO_QUALITY_FPS_RANGE;
+
+    if (reso != target_reso)
+      continue;
+    if (!lower && ov_video_quality_above (qualities[ii], ceiling))
+      continue;
+
+    if (framerate) {
+      /* Pick the framerate closest to the current one */
+      if (fps == cur_fps || (fps < cur_fps) != lower)
+        continue;
+      if (found == OV_VIDEO_QUALITY_INVALID ||
+          (lower ? fps > best_fps : fps < best_fps)) {
+        found = qualities[ii];
+        best_fps = fps;
+      }
+    } else {
+      /* Pick the highest framerate that isn't above the current one, or
+       * failing that, the lowest one */
+      if (found == OV_VIDEO_QUALITY_INVALID ||
+          (fps <= cur_fps && (fps > best_fps || best_fps > cur_fps)) ||
+          (fps > cur_fps && best_fps > cur_fps && fps < best_fps)) {
+        found = qualities[ii];
+        best_fps = fps;
+      }
+    }
+  }
+
+out:
+  g_free (qualities);
+  return found;
+}
+
+/* Called with the lock TAKEN */
+static gboolean
+ov_congestion_switch_quality (OvLocalPeer * local, gboolean lower,
+    gboolean framerate)
+{
+  OvLocalPeerPrivate *priv;
+  OvVideoQuality current, next;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* With simulcast, remotes that can't keep up with layer 0 are moved to
+   * a lower layer, so we only adapt the framerate of layer 0 */
+  if (!framerate && priv->n_active_video_layers > 1)
+    return FALSE;
+
+  current = ov_local_peer_get_video_quality (local);
+  if (current == OV_VIDEO_QUALITY_INVALID)
+    return FALSE;
+
+  next = ov_congestion_find_quality (local, current,
+      ov_congestion_get_ceiling (priv), lower, framerate);
+  if (next == OV_VIDEO_QUALITY_INVALID)
+    return FALSE;
+
+  if (!ov_local_peer_switch_video_quality (local, next))
+    return FALSE;
+
+  ov_congestion_update_bounds (local);
+  ov_congestion_apply_bitrate (priv);
+  return TRUE;
+}
+
+static void
+ov_congestion_emit (OvLocalPeer * local, const gchar * action, guint loss,
+    guint rtt)
+{
+  GstStructure *s;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  s = gst_structure_new ("application/x-ov-congestion-control",
+      "action", G_TYPE_STRING, action,
+      "bitrate", G_TYPE_UINT, priv->cc.bitrate,
+      "quality", G_TYPE_UINT, ov_local_peer_get_video_quality (local),
+      "packets-fractionlost", G_TYPE_UINT, loss,
+      "round-trip", G_TYPE_UINT, rtt, NULL);
+
+  GST_DEBUG ("Congestion control: %" GST_PTR_FORMAT, s);
+  g_signal_emit_by_name (local, "congestion-control", s);
+  gst_structure_free (s);
+}
+
+static gboolean
+ov_congestion_tick (OvLocalPeer * local)
+{
+  guint ii, loss, rtt, max_loss, max_rtt;
+  gboolean have_reports, delayed;
+  GHashTable *stats_dict;
+  GstStructure *stats;
+  OvRemotePeer *remote;
+  OvLocalPeerPrivate *priv;
+  const gchar *action = NULL;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_signal_emit_by_name (local, "get-stats", "video", &stats_dict);
+  if (stats_dict == NULL)
+    /* No call yet, or no video */
+    return G_SOURCE_CONTINUE;
+
+  ov_local_peer_lock (local);
+
+  max_loss = max_rtt = 0;
+  have_reports = FALSE;
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    remote = g_ptr_array_index (priv->remote_peers, ii);
+
+    /* Remotes on lower simulcast layers don't tell us about layer 0 */
+    if (remote->priv->video_layer != 0 ||
+        remote->state != OV_REMOTE_STATE_PLAYING)
+      continue;
+
+    stats = g_hash_table_lookup (stats_dict, remote->id);
+    if (stats == NULL ||
+        !gst_structure_get_uint (stats, "packets-fractionlost", &loss) ||
+        !gst_structure_get_uint (stats, "round-trip", &rtt))
+      continue;
+
+    have_reports = TRUE;
+    max_loss = MAX (max_loss, loss);
+    max_rtt = MAX (max_rtt, rtt);
+  }
+  g_hash_table_unref (stats_dict);
+
+  if (!have_reports)
+    goto out;
+
+  ov_congestion_apply_fec (priv, max_loss);
+
+  if (max_rtt > 0 && (priv->cc.min_rtt == 0 || max_rtt < priv->cc.min_rtt))
+    priv->cc.min_rtt = max_rtt;
+  delayed = max_rtt > priv->cc.min_rtt + OV_CONGESTION_DELAY_MS;
+
+  if (max_loss > OV_CONGESTION_LOSS_HIGH || delayed) {
+    gdouble factor;
+
+    priv->cc.clear_intervals = 0;
+
+    if (max_loss > OV_CONGESTION_LOSS_HIGH)
+      factor = 1.0 - (max_loss / 512.0);
+    else
+      factor = OV_CONGESTION_DELAY_FACTOR;
+
+    if (ov_congestion_get_encoder (priv) != NULL &&
+        priv->cc.bitrate > priv->cc.min_bitrate) {
+      priv->cc.bitrate = MAX ((guint) (priv->cc.bitrate * factor),
+          priv->cc.min_bitrate);
+      ov_congestion_apply_bitrate (priv);
+      action = "decrease-bitrate";
+    } else if (ov_congestion_switch_quality (local, TRUE, TRUE)) {
+      action = "decrease-framerate";
+    } else if (ov_congestion_switch_quality (local, TRUE, FALSE)) {
+      action = "decrease-resolution";
+    }
+  } else if (max_loss < OV_CONGESTION_LOSS_LOW) {
+    priv->cc.clear_intervals++;
+
+    if (ov_congestion_get_encoder (priv) != NULL &&
+        priv->cc.bitrate < priv->cc.max_bitrate) {
+      priv->cc.bitrate = MIN (
+          (guint) (priv->cc.bitrate * OV_CONGESTION_INCREASE_FACTOR) + 1,
+          priv->cc.max_bitrate);
+      ov_congestion_apply_bitrate (priv);
+      action = "increase-bitrate";
+    } else if (priv->cc.clear_intervals >= OV_CONGESTION_PROBE_INTERVALS) {
+      priv->cc.clear_intervals = 0;
+      /* Start the new quality from the bottom and ramp up from there */
+      priv->cc.bitrate = priv->cc.min_bitrate;
+      if (ov_congestion_switch_quality (local, FALSE, TRUE))
+        action = "increase-framerate";
+      else if (ov_congestion_switch_quality (local, FALSE, FALSE))
+        action = "increase-resolution";
+      else
+        priv->cc.bitrate = priv->cc.max_bitrate;
+    }
+  }
+
+out:
+  ov_local_peer_unlock (local);
+
+  if (action != NULL)
+    ov_congestion_emit (local, action, max_loss, max_rtt);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called with the lock TAKEN */
+void
+ov_congestion_start (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (!priv->cc.enabled || priv->cc.timeout_id > 0)
+    return;
+
+  priv->cc.bitrate = 0;
+  priv->cc.min_rtt = 0;
+  priv->cc.clear_intervals = 0;
+  if (priv->cc.max_quality == OV_VIDEO_QUALITY_INVALID)
+    priv->cc.max_quality = ov_local_peer_get_video_quality (local);
+
+  ov_congestion_update_bounds (local);
+  ov_congestion_apply_bitrate (priv);
+
+  priv->cc.timeout_id = g_timeout_add_seconds (OV_CONGESTION_INTERVAL_SECONDS,
+      (GSourceFunc) ov_congestion_tick, local);
+  GST_DEBUG ("Started congestion control at %u kbps", priv->cc.bitrate);
+}
+
+/* Called with the lock TAKEN */
+void
+ov_congestion_stop (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->cc.timeout_id == 0)
+    return;
+
+  g_source_remove (priv->cc.timeout_id);
+  priv->cc.timeout_id = 0;
+  GST_DEBUG ("Stopped congestion control");
+}
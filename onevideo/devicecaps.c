@@ -0,0 +1,472 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "devicecaps.h"
+
+/* Working out which caps of a video device we can use means intersecting and
+ * walking all of them, which adds up with several cameras. The result for each
+ * device is cached in memory and in a file in the user's cache directory, keyed
+ * by the sysfs path of the device, or its device path or name if the device
+ * provider doesn't tell us those. An entry is only used while the caps that
+ * the device reports are the same as when it was made.
+ *
+ * Devices are probed in the background as soon as the device monitor finds
+ * them, so ov_local_peer_set_video_device() usually finds them cached, and
+ * their entries are dropped when they are unplugged. */
+
+#define OV_DEVICE_CAPS_CACHE_FILE "video-device-caps.ini"
+
+typedef struct _OvDeviceCapsEntry OvDeviceCapsEntry;
+
+struct _OvDeviceCapsEntry {
+  /* Checksum of the caps reported by the device */
+  gchar *checksum;
+  /* NULL if the device has no caps that we can use */
+  GstCaps *caps;
+  /* OV_VIDEO_FORMAT_YUY2 if we must encode its video, else UNKNOWN */
+  OvVideoFormat format;
+};
+
+struct _OvDeviceCapsCache {
+  /* Protects entries and keyfile, which are used from the probing thread, the
+   * main context, and the application's threads */
+  GMutex lock;
+  /* Device key -> OvDeviceCapsEntry */
+  GHashTable *entries;
+  /* What's saved to filename; kept in sync with entries */
+  GKeyFile *keyfile;
+  gchar *filename;
+  /* Probes devices in the background, one at a time */
+  GThreadPool *pool;
+  GstBus *bus;
+  guint bus_watch_id;
+};
+
+static void
+ov_device_caps_entry_free (OvDeviceCapsEntry * entry)
+{
+  g_free (entry->checksum);
+  g_clear_pointer (&entry->caps, gst_caps_unref);
+  g_free (entry);
+}
+
+/* Extract the useful caps from the caps of a device
+ * Useful caps are those that are high-def and high framerate, or if none such
+ * are found, high-def and low-framerate, then low-def and high-framerate, then
+ * low-def and low-framerate */
+static GstCaps *
+ov_device_get_usable_caps (GstCaps * devcaps, OvVideoFormat *device_format)
+{
+  gint ii, len;
+  OvVideoFormat next_format, formats = 0;
+  GstCaps *tmpcaps, *retcaps, *mediacaps = NULL;
+
+  retcaps = gst_caps_new_empty ();
+
+  /* Check for the best quality (H264) first, then JPEG, then YUY2, then fail */
+  next_format = OV_VIDEO_FORMAT_H264;
+
+retry:
+  g_clear_pointer (&mediacaps, gst_caps_unref);
+
+  switch (next_format) {
+    case OV_VIDEO_FORMAT_H264:
+    case OV_VIDEO_FORMAT_JPEG:
+    case OV_VIDEO_FORMAT_YUY2:
+      /* Check if the device supports this format. If so, add it to the list of
+       * supported media types and merge the caps in our list of caps. Else, try
+       * the next-best video format. */
+      mediacaps = ov_video_format_to_caps (next_format);
+      tmpcaps = gst_caps_intersect (devcaps, mediacaps);
+      if (!gst_caps_is_empty (tmpcaps)) {
+        gst_caps_append (retcaps, tmpcaps);
+        formats |= next_format;
+      } else {
+        gst_caps_unref (tmpcaps);
+      }
+      next_format >>= 1;
+      /* If the device does not support JPEG/H264; try YUY2. We ignore other RAW
+       * formats because those are all faked by libv4l2 by converting/decoding
+       * one of these. We will encode YUY2 to JPEG before transmitting. */
+      if (next_format == OV_VIDEO_FORMAT_YUY2 &&
+          formats != OV_VIDEO_FORMAT_UNKNOWN) {
+        /* Ignore YUY2 formats if we got JPEG and/or H264 */
+        gst_caps_unref (mediacaps);
+        break; /* done */
+      }
+      goto retry;
+
+    case OV_VIDEO_FORMAT_SENTINEL:
+      if (formats >= OV_VIDEO_FORMAT_YUY2)
+        break; /* done */
+
+      GST_ERROR ("Unsupported video output formats! %" GST_PTR_FORMAT, devcaps);
+      gst_caps_unref (retcaps);
+      return NULL; /* fail */
+    default:
+      g_assert_not_reached ();
+  }
+
+  if (formats == OV_VIDEO_FORMAT_YUY2) {
+    *device_format = OV_VIDEO_FORMAT_YUY2;
+    GST_WARNING ("Device does not provide compressed output! Trying YUY2 "
+        "(lower quality, higher CPU usage)");
+  }
+  /* We now have a useful subset of the original device caps */
+
+  /* Transform device caps to rtp caps */
+  len = gst_caps_get_size (retcaps);
+  for (ii = 0; ii < len; ii++) {
+    GstStructure *s, *tmp;
+    gint n1, n2;
+    gdouble dest;
+
+    s = gst_caps_get_structure (retcaps, ii);
+
+    /* Fixate device caps and remove extraneous fields */
+    gst_structure_remove_fields (s, "pixel-aspect-ratio", "colorimetry",
+        "interlace-mode", "format", NULL);
+
+    /* Remove formats smaller than 240p */
+    gst_structure_get_int (s, "height", &n1);
+    if (n1 < 240)
+      goto remove;
+
+    /* Remove caps that *only* have framerates less than 15 */
+    tmp = gst_structure_copy (s);
+    /* We will probably not get valid framerates higher than this */
+    gst_structure_fixate_field_nearest_fraction (tmp, "framerate",
+        30, 1);
+    gst_structure_get_fraction (tmp, "framerate", &n1, &n2);
+    gst_structure_free (tmp);
+    gst_util_fraction_to_double (n1, n2, &dest);
+    if ((formats >= OV_VIDEO_FORMAT_JPEG && dest < 15) ||
+        (formats == OV_VIDEO_FORMAT_YUY2 && dest < 15))
+      goto remove;
+
+    /* The raw video will be encoded to JPEG, so in reality our supported video
+     * caps are JPEG, not raw */
+    if (g_strcmp0 (gst_structure_get_name (s), "video/x-raw") == 0)
+      gst_structure_set_name (s, "image/jpeg");
+
+    continue;
+remove:
+    gst_caps_remove_structure (retcaps, ii);
+    ii--; len--;
+  }
+
+  /* If we can encode raw video to H.264, offer that too. It is listed first so
+   * that it's preferred over JPEG for peers that can decode it. */
+  if (formats == OV_VIDEO_FORMAT_YUY2 && _ov_gst_get_h264_encoder_name ()) {
+    tmpcaps = ov_caps_rename_structures (retcaps, VIDEO_FORMAT_H264);
+    gst_caps_append (tmpcaps, retcaps);
+    retcaps = tmpcaps;
+  }
+
+  GST_DEBUG ("Supported video output formats %" GST_PTR_FORMAT, retcaps);
+  return retcaps;
+}
+
+static gchar *
+ov_device_get_cache_key (GstDevice * device)
+{
+  gchar *key = NULL;
+  GstStructure *props;
+
+  /* Set by our patch to the v4l2 device provider */
+  g_object_get (device, "properties", &props, NULL);
+  if (props != NULL) {
+    key = g_strdup (gst_structure_get_string (props, "sysfs.path"));
+    if (key == NULL)
+      key = g_strdup (gst_structure_get_string (props, "device.path"));
+    gst_structure_free (props);
+  }
+
+  if (key == NULL)
+    key = gst_device_get_display_name (device);
+
+  return key;
+}
+
+/* Called with the cache lock TAKEN */
+static void
+ov_device_caps_cache_save (OvDeviceCapsCache * cache)
+{
+  gsize length;
+  gchar *data, *dirname;
+  GError *error = NULL;
+
+  dirname = g_path_get_dirname (cache->filename);
+  g_mkdir_with_parents (dirname, 0700);
+  g_free (dirname);
+
+  data = g_key_file_to_data (cache->keyfile, &length, NULL);
+  if (!g_file_set_contents (cache->filename, data, length, &error)) {
+    GST_WARNING ("Unable to save the video device caps cache: %s",
+        error->message);
+    g_error_free (error);
+  }
+  g_free (data);
+}
+
+static void
+ov_device_caps_cache_load (OvDeviceCapsCache * cache)
+{
+  guint ii;
+  gchar **groups;
+  GError *error = NULL;
+
+  if (!g_key_file_load_from_file (cache->keyfile, cache->filename,
+        G_KEY_FILE_NONE, &error)) {
+    if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      GST_WARNING ("Unable to load the video device caps cache: %s",
+          error->message);
+    g_error_free (error);
+    return;
+  }
+
+  groups = g_key_file_get_groups (cache->keyfile, NULL);
+  for (ii = 0; groups[ii] != NULL; ii++) {
+    OvDeviceCapsEntry *entry;
+    gchar *caps;
+
+    entry = g_new0 (OvDeviceCapsEntry, 1);
+    entry->checksum = g_key_file_get_string (cache->keyfile, groups[ii],
+        "checksum", NULL);
+    entry->format = g_key_file_get_integer (cache->keyfile, groups[ii],
+        "format", NULL);
+    caps = g_key_file_get_string (cache->keyfile, groups[ii], "caps", NULL);
+    if (caps != NULL)
+      entry->caps = gst_caps_from_string (caps);
+
+    if (entry->checksum == NULL || (caps != NULL && entry->caps == NULL)) {
+      GST_WARNING ("Ignoring invalid cached caps of video device %s",
+          groups[ii]);
+      g_key_file_remove_group (cache->keyfile, groups[ii], NULL);
+      ov_device_caps_entry_free (entry);
+    } else {
+      g_hash_table_insert (cache->entries, g_strdup (groups[ii]), entry);
+    }
+    g_free (caps);
+  }
+  g_strfreev (groups);
+
+  GST_DEBUG ("Loaded the caps of %u video devices from %s",
+      g_hash_table_size (cache->entries), cache->filename);
+}
+
+/* Returns a ref to the usable caps of @device, or NULL if it has none, and
+ * sets @format. Probes the device if it isn't cached. */
+static GstCaps *
+ov_device_caps_cache_probe (OvDeviceCapsCache * cache, GstDevice * device,
+    OvVideoFormat * format)
+{
+  gchar *key, *checksum, *tmp;
+  GstCaps *devcaps, *caps = NULL;
+  OvDeviceCapsEntry *entry;
+
+  key = ov_device_get_cache_key (device);
+  devcaps = gst_device_get_caps (device);
+  tmp = devcaps ? gst_caps_to_string (devcaps) : g_strdup ("");
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, tmp, -1);
+  g_free (tmp);
+
+  g_mutex_lock (&cache->lock);
+  entry = g_hash_table_lookup (cache->entries, key);
+  if (entry != NULL && g_strcmp0 (entry->checksum, checksum) == 0) {
+    if (entry->caps != NULL)
+      caps = gst_caps_ref (entry->caps);
+    *format = entry->format;
+    g_mutex_unlock (&cache->lock);
+    GST_DEBUG ("Using the cached caps of video device %s", key);
+    goto out;
+  }
+  g_mutex_unlock (&cache->lock);
+
+  /* Don't hold the lock while probing */
+  *format = OV_VIDEO_FORMAT_UNKNOWN;
+  if (devcaps != NULL)
+    caps = ov_device_get_usable_caps (devcaps, format);
+
+  entry = g_new0 (OvDeviceCapsEntry, 1);
+  entry->checksum = g_strdup (checksum);
+  entry->caps = caps ? gst_caps_ref (caps) : NULL;
+  entry->format = *format;
+
+  g_mutex_lock (&cache->lock);
+  g_hash_table_replace (cache->entries, g_strdup (key), entry);
+  g_key_file_remove_group (cache->keyfile, key, NULL);
+  g_key_file_set_string (cache->keyfile, key, "checksum", checksum);
+  g_key_file_set_integer (cache->keyfile, key, "format", *format);
+  if (caps != NULL) {
+    tmp = gst_caps_to_string (caps);
+    g_key_file_set_string (cache->keyfile, key, "caps", tmp);
+    g_free (tmp);
+  }
+  ov_device_caps_cache_save (cache);
+  g_mutex_unlock (&cache->lock);
+  GST_DEBUG ("Probed and cached the caps of video device %s", key);
+
+out:
+  g_clear_pointer (&devcaps, gst_caps_unref);
+  g_free (checksum);
+  g_free (key);
+  return caps;
+}
+
+static void
+ov_device_caps_cache_probe_func (GstDevice * device, OvDeviceCapsCache * cache)
+{
+  GstCaps *caps;
+  OvVideoFormat format;
+
+  caps = ov_device_caps_cache_probe (cache, device, &format);
+  g_clear_pointer (&caps, gst_caps_unref);
+  gst_object_unref (device);
+}
+
+static gboolean
+on_device_monitor_message (GstBus * bus G_GNUC_UNUSED, GstMessage * msg,
+    OvDeviceCapsCache * cache)
+{
+  gchar *key;
+  GstDevice *device;
+
+  switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_DEVICE_ADDED:
+      gst_message_parse_device_added (msg, &device);
+      /* Takes the ref */
+      g_thread_pool_push (cache->pool, device, NULL);
+      break;
+    case GST_MESSAGE_DEVICE_REMOVED:
+      gst_message_parse_device_removed (msg, &device);
+      key = ov_device_get_cache_key (device);
+      g_mutex_lock (&cache->lock);
+      g_hash_table_remove (cache->entries, key);
+      if (g_key_file_remove_group (cache->keyfile, key, NULL))
+        ov_device_caps_cache_save (cache);
+      g_mutex_unlock (&cache->lock);
+      GST_DEBUG ("Video device %s was unplugged; dropped its cached caps",
+          key);
+      g_free (key);
+      gst_object_unref (device);
+      break;
+    default:
+      break;
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+OvDeviceCapsCache *
+ov_device_caps_cache_new (void)
+{
+  OvDeviceCapsCache *cache;
+
+  cache = g_new0 (OvDeviceCapsCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) ov_device_caps_entry_free);
+  cache->keyfile = g_key_file_new ();
+  cache->filename = g_build_filename (g_get_user_cache_dir (), "onevideo",
+      OV_DEVICE_CAPS_CACHE_FILE, NULL);
+  ov_device_caps_cache_load (cache);
+
+  return cache;
+}
+
+void
+ov_device_caps_cache_free (OvDeviceCapsCache * cache)
+{
+  ov_device_caps_cache_stop (cache);
+  g_hash_table_unref (cache->entries);
+  g_key_file_free (cache->keyfile);
+  g_free (cache->filename);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/* Probe the devices found by @dm in the background, and keep the cache up to
+ * date as devices are plugged in and out. @dm must have been started. */
+void
+ov_device_caps_cache_start (OvDeviceCapsCache * cache, GstDeviceMonitor * dm)
+{
+  GList *devices, *l;
+
+  g_return_if_fail (cache->pool == NULL);
+
+  cache->pool = g_thread_pool_new ((GFunc) ov_device_caps_cache_probe_func,
+      cache, 1, FALSE, NULL);
+  cache->bus = gst_device_monitor_get_bus (dm);
+  cache->bus_watch_id = gst_bus_add_watch (cache->bus,
+      (GstBusFunc) on_device_monitor_message, cache);
+
+  /* The pool takes the refs */
+  devices = gst_device_monitor_get_devices (dm);
+  for (l = devices; l != NULL; l = l->next)
+    g_thread_pool_push (cache->pool, l->data, NULL);
+  g_list_free (devices);
+}
+
+void
+ov_device_caps_cache_stop (OvDeviceCapsCache * cache)
+{
+  if (cache->bus_watch_id > 0) {
+    g_source_remove (cache->bus_watch_id);
+    cache->bus_watch_id = 0;
+  }
+  g_clear_object (&cache->bus);
+  /* Probing is quick, so let it finish what's queued */
+  if (cache->pool != NULL) {
+    g_thread_pool_free (cache->pool, FALSE, TRUE);
+    cache->pool = NULL;
+  }
+}
+
+/* Returns the caps of @device that we can send, and sets @device_format if
+ * we will have to encode its video */
+GstCaps *
+ov_device_caps_cache_get (OvDeviceCapsCache * cache, GstDevice * device,
+    OvVideoFormat * device_format)
+{
+  GstCaps *caps, *ret;
+  OvVideoFormat format;
+
+  caps = ov_device_caps_cache_probe (cache, device, &format);
+  if (caps == NULL)
+    return NULL;
+
+  /* Otherwise the format is decided by negotiation */
+  if (format != OV_VIDEO_FORMAT_UNKNOWN)
+    *device_format = format;
+
+  /* The caller owns what we return */
+  ret = gst_caps_copy (caps);
+  gst_caps_unref (caps);
+
+  return ret;
+}
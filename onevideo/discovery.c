@@ -34,6 +34,12 @@
 
 #include <string.h>
 
+/* A multicast DISCOVER reaches us once for each interface that it was sent on
+ * and that we've joined the multicast group on. Only the first one is replied
+ * to, and the probes that we replied to are forgotten after this. Ids are
+ * picked by the senders, so a probe is the id together with who sent it. */
+#define OV_DISCOVERY_REPLIED_USEC (2 * G_USEC_PER_SEC)
+
 /* Takes ownership of @data */
 OvUdpMsg *
 ov_udp_msg_new (OvUdpMsgType type, gchar * data, gsize size)
@@ -176,6 +182,39 @@ out:
   return ret;
 }
 
+/* Only called from the main context, like on_incoming_udp_message() */
+static gboolean
+ov_local_peer_probe_is_repeat (OvLocalPeer * local, OvUdpMsg * msg,
+    GInetSocketAddress * from)
+{
+  gchar *addr_s, *key;
+  gint64 now, *replied;
+  GHashTableIter iter;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+  now = g_get_monotonic_time ();
+
+  g_hash_table_iter_init (&iter, priv->replied_probes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &replied))
+    if (now - *replied > OV_DISCOVERY_REPLIED_USEC)
+      g_hash_table_iter_remove (&iter);
+
+  addr_s = ov_inet_socket_address_to_string (from);
+  key = g_strdup_printf ("%" G_GUINT64_FORMAT "@%s", msg->id, addr_s);
+  g_free (addr_s);
+
+  if (g_hash_table_contains (priv->replied_probes, key)) {
+    g_free (key);
+    return TRUE;
+  }
+
+  replied = g_new (gint64, 1);
+  *replied = now;
+  g_hash_table_insert (priv->replied_probes, key, replied);
+  return FALSE;
+}
+
 static void
 ov_local_peer_send_info (OvLocalPeer * local, GSocketAddress * addr,
     OvUdpMsg * msg)
@@ -238,8 +277,23 @@ on_incoming_udp_message (GSocket * socket, GIOCondition condition G_GNUC_UNUSED,
 
   switch (msg->type) {
     case OV_UDP_MSG_TYPE_MULTICAST_DISCOVER:
+      if (ov_local_peer_probe_is_repeat (local, msg, sfrom)) {
+        GST_TRACE ("Already replied to discover id %lu", msg->id);
+        break;
+      }
       ov_local_peer_send_info (local, from, msg);
       break;
+    case OV_UDP_MSG_TYPE_MULTICAST_HELLO:
+      /* Announcements are only interesting if we're looking for peers */
+      if (priv->discover_socket_source != NULL &&
+          !g_source_is_destroyed (priv->discover_socket_source)) {
+        OvDiscoveredPeer *d;
+
+        d = ov_discovered_peer_new (G_INET_SOCKET_ADDRESS (from));
+        g_signal_emit_by_name (local, "peer-discovered", d);
+        g_object_unref (d);
+      }
+      break;
     default:
       GST_ERROR ("Received unknown udp msg type: %u", msg->type);
   }
@@ -251,8 +305,10 @@ out:
   return G_SOURCE_CONTINUE;
 }
 
+/* Send a message of @type with no payload to all the peers that listen for
+ * multicast messages */
 gboolean
-ov_discovery_send_multicast_discover (OvLocalPeer * local,
+ov_discovery_send_multicast (OvLocalPeer * local, OvUdpMsgType type,
     GCancellable * cancellable, GError ** error)
 {
   OvUdpMsg *msg;
@@ -270,11 +326,10 @@ ov_discovery_send_multicast_discover (OvLocalPeer * local,
   mc_addr = g_inet_socket_address_new (group, OV_DEFAULT_COMM_PORT);
   g_object_unref (group);
 
-  msg = ov_udp_msg_new (OV_UDP_MSG_TYPE_MULTICAST_DISCOVER,
-      NULL, 0);
+  msg = ov_udp_msg_new (type, NULL, 0);
 
-  GST_TRACE ("Sending multicast discover (id %lu) to %s:%u",
-      msg->id, OV_MULTICAST_GROUP, OV_DEFAULT_COMM_PORT);
+  GST_TRACE ("Sending multicast msg of type %u (id %lu) to %s:%u",
+      msg->type, msg->id, OV_MULTICAST_GROUP, OV_DEFAULT_COMM_PORT);
 
   g_object_get (OV_PEER (local), "address", &local_addr, NULL);
   addr = g_inet_socket_address_get_address (local_addr);
@@ -305,3 +360,74 @@ ov_discovery_send_multicast_discover (OvLocalPeer * local,
 
   return ret;
 }
+
+/* Returns @interval seconds in milliseconds, give or take a quarter, so that
+ * peers that were started together don't keep announcing together */
+static guint
+ov_discovery_jittered_ms (guint interval)
+{
+  guint ms = interval * 1000;
+
+  return g_random_int_range (ms - ms / 4, ms + ms / 4 + 1);
+}
+
+static gboolean
+on_announce_presence_timeout (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  /* Announcing was stopped or restarted while we waited for the lock */
+  if (priv->announce_source_id !=
+      g_source_get_id (g_main_current_source ())) {
+    ov_local_peer_unlock (local);
+    return G_SOURCE_REMOVE;
+  }
+
+  GST_TRACE ("Announcing presence; next in ~%us", priv->announce_interval);
+  ov_discovery_send_multicast (local, OV_UDP_MSG_TYPE_MULTICAST_HELLO, NULL,
+      NULL);
+
+  priv->announce_source_id = g_timeout_add (
+      ov_discovery_jittered_ms (priv->announce_interval),
+      (GSourceFunc) on_announce_presence_timeout, local);
+  /* Back off, but keep announcing so that those looking for peers can tell
+   * that we're still here */
+  priv->announce_interval = MIN (priv->announce_interval * 2,
+      OV_PRESENCE_ANNOUNCE_MAX_INTERVAL);
+  ov_local_peer_unlock (local);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called with the lock TAKEN. Announce our presence now if we're announcing,
+ * because something about us has changed, and then back off again. */
+void
+ov_local_peer_announce_presence (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+  if (!priv->announce_presence)
+    return;
+
+  ov_local_peer_stop_announcing (local);
+  priv->announce_interval = 1;
+  priv->announce_source_id =
+    g_idle_add ((GSourceFunc) on_announce_presence_timeout, local);
+}
+
+/* Called with the lock TAKEN */
+void
+ov_local_peer_stop_announcing (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+  if (priv->announce_source_id > 0) {
+    g_source_remove (priv->announce_source_id);
+    priv->announce_source_id = 0;
+  }
+}
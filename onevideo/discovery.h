@@ -46,6 +46,9 @@ enum _OvUdpMsgType {
 
   /* Replies */
   OV_UDP_MSG_TYPE_UNICAST_HI_THERE     = 200,
+
+  /* Announcements; see ov_local_peer_set_announce_presence() */
+  OV_UDP_MSG_TYPE_MULTICAST_HELLO      = 300,
 };
 
 typedef struct _OvUdpMsg OvUdpMsg;
@@ -88,9 +91,13 @@ gboolean        ov_udp_msg_send_to_from        (OvUdpMsg *msg,
                                                 GCancellable *cancellable,
                                                 GError **error);
 
-gboolean        ov_discovery_send_multicast_discover  (OvLocalPeer *local,
-                                                       GCancellable *cancellable,
-                                                       GError **error);
+gboolean        ov_discovery_send_multicast     (OvLocalPeer *local,
+                                                 OvUdpMsgType type,
+                                                 GCancellable *cancellable,
+                                                 GError **error);
+
+void            ov_local_peer_announce_presence (OvLocalPeer *local);
+void            ov_local_peer_stop_announcing   (OvLocalPeer *local);
 
 G_END_DECLS
 
@@ -31,9 +31,43 @@
 #include "utils.h"
 #include "incoming.h"
 #include "ov-local-peer-priv.h"
+#include "ov-local-peer-setup.h"
+
+#include <string.h>
 
 static guint timeout_value = 0;
 
+typedef struct _OvIncomingConn OvIncomingConn;
+
+/* Run by the connection once the reply to a request has been written */
+typedef void (*OvAfterReplyFunc) (OvLocalPeer * local, gpointer data);
+
+/* State for one incoming control connection. Everything here is only touched
+ * from the TCP server's main context, except while a request is being handled
+ * in a thread of its own; see ov_incoming_conn_handle_msg(). A connection
+ * loops through: read header -> read body -> handle request -> write reply ->
+ * read header ... */
+struct _OvIncomingConn {
+  OvLocalPeer *local;
+  GSocketConnection *connection;
+  GCancellable *cancel;
+
+  gchar header[OV_TCP_MSG_HEADER_SIZE];
+  /* Reused for reading the body of every request */
+  GByteArray *buffer;
+  /* The request being handled */
+  OvTcpMsg *msg;
+  /* The reply being written */
+  OvTcpMsgFrame reply;
+#if !GLIB_CHECK_VERSION (2, 60, 0)
+  guint reply_vector;
+#endif
+
+  OvAfterReplyFunc after_reply;
+  gpointer after_reply_data;
+  GDestroyNotify after_reply_destroy;
+};
+
 #define OV_NEGOTIATE_TIMEOUT_SECONDS 5
 
 static gboolean
@@ -55,18 +89,18 @@ check_negotiate_timeout (OvLocalPeer * local)
     ov_local_peer_negotiate_abort (local);
     timeout_value = 0;
     g_signal_emit_by_name (local, "negotiate-aborted", NULL);
+    ov_local_peer_trace_finish (local, TRUE);
     return G_SOURCE_REMOVE;
   }
 
   return G_SOURCE_CONTINUE;
 }
 
-static gboolean
+static OvTcpMsg *
 ov_local_peer_handle_start_negotiate (OvLocalPeer * local,
     GSocketConnection * connection, OvTcpMsg * msg)
 {
   guint64 call_id;
-  GOutputStream *output;
   OvTcpMsg *reply;
   const gchar *variant_type;
   GSocketAddress *remote_addr, *negotiator_addr;
@@ -76,8 +110,10 @@ ov_local_peer_handle_start_negotiate (OvLocalPeer * local,
   OvLocalPeerState state;
   OvPeer *incoming;
   gboolean ret = FALSE;
+  gint64 start, incoming_start, incoming_end;
 
   priv = ov_local_peer_get_private (local);
+  start = g_get_monotonic_time ();
 
   variant_type = ov_tcp_msg_type_to_variant_type (
       OV_TCP_MSG_TYPE_START_NEGOTIATE, OV_TCP_MAX_VERSION);
@@ -95,6 +131,13 @@ ov_local_peer_handle_start_negotiate (OvLocalPeer * local,
     goto send_reply;
   }
 
+  /* Relays only forward the calls that they negotiate */
+  if (priv->relay) {
+    reply = ov_tcp_msg_new_error (msg->id, "Refused");
+    g_free (negotiator_id);
+    goto send_reply;
+  }
+
   /* We receive the port to use while talking to the negotiator, but we must
    * derive the host to use from the connection itself because the negotiator
    * does not always know what address we're resolving it as */
@@ -105,7 +148,9 @@ ov_local_peer_handle_start_negotiate (OvLocalPeer * local,
   g_object_unref (remote_addr);
 
   incoming = ov_peer_new (G_INET_SOCKET_ADDRESS (negotiator_addr));
+  incoming_start = g_get_monotonic_time ();
   g_signal_emit_by_name (local, "negotiate-incoming", incoming, &ret);
+  incoming_end = g_get_monotonic_time ();
   g_object_unref (incoming);
   if (!ret) {
     reply = ov_tcp_msg_new_error (msg->id, "Refused");
@@ -122,6 +167,15 @@ ov_local_peer_handle_start_negotiate (OvLocalPeer * local,
   g_object_unref (negotiator_addr);
   priv->negotiate->negotiator->id = negotiator_id;
 
+  /* A trace left over from an earlier aborted call setup is not reported */
+  g_clear_pointer (&priv->call_trace, ov_call_trace_free);
+  priv->call_trace = ov_call_trace_new (call_id, FALSE);
+  priv->negotiate->trace_span = ov_call_trace_begin (priv->call_trace,
+      "negotiate", NULL);
+  /* How long the application took to accept the call */
+  ov_call_trace_add (priv->call_trace, "negotiate-incoming", negotiator_id,
+      incoming_start, incoming_end);
+
   /* Set a rough timer for timing out the negotiation */
   timeout_value = 0;
   priv->negotiate->check_timeout_id =
@@ -134,27 +188,29 @@ ov_local_peer_handle_start_negotiate (OvLocalPeer * local,
   g_object_get (OV_PEER (local), "id", &local_id, NULL);
   reply = ov_tcp_msg_new_ok_negotiate (msg->id, local_id);
   g_free (local_id);
-
-  ret = TRUE;
+  ov_call_trace_add (priv->call_trace, "start-negotiate", negotiator_id,
+      start, g_get_monotonic_time ());
 
   ov_local_peer_unlock (local);
 send_reply:
-  output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
-  ov_tcp_msg_write_to_stream (output, reply, NULL, NULL);
+  return reply;
+}
 
-  ov_tcp_msg_free (reply);
-  return ret;
+static void
+emit_negotiate_aborted (OvLocalPeer * local, gpointer data G_GNUC_UNUSED)
+{
+  g_signal_emit_by_name (local, "negotiate-aborted", NULL);
+  ov_local_peer_trace_finish (local, TRUE);
 }
 
-static gboolean
+static OvTcpMsg *
 ov_local_peer_handle_cancel_negotiate (OvLocalPeer * local,
-    GOutputStream * output, OvTcpMsg * msg)
+    OvIncomingConn * conn, OvTcpMsg * msg)
 {
   guint64 call_id;
   OvTcpMsg *reply;
   const gchar *variant_type;
   OvLocalPeerPrivate *priv;
-  gboolean ret = FALSE;
 
   priv = ov_local_peer_get_private (local);
 
@@ -180,21 +236,16 @@ ov_local_peer_handle_cancel_negotiate (OvLocalPeer * local,
 
   reply = ov_tcp_msg_new_ack (msg->id);
 
-  ret = TRUE;
+  conn->after_reply = emit_negotiate_aborted;
 
 send_reply:
-  ov_tcp_msg_write_to_stream (output, reply, NULL, NULL);
-
-  if (ret)
-    g_signal_emit_by_name (local, "negotiate-aborted", NULL);
-
-  ov_tcp_msg_free (reply);
-  return ret;
+  return reply;
 }
 
 /* Called with the lock TAKEN */
 static gboolean
-setup_negotiate_remote_peers (OvLocalPeer * local, OvTcpMsg * msg)
+setup_negotiate_remote_peers (OvLocalPeer * local, OvTcpMsg * msg,
+    GError ** error)
 {
   GVariantIter *iter;
   GHashTable *remotes;
@@ -211,6 +262,8 @@ setup_negotiate_remote_peers (OvLocalPeer * local, OvTcpMsg * msg)
    * those are all new remotes */
   g_hash_table_insert (remotes, priv->negotiate->negotiator->id,
       priv->negotiate->negotiator);
+  if (!ov_remote_peer_reserve_recv_ports (priv->negotiate->negotiator, error))
+    goto err;
 
   variant_type = ov_tcp_msg_type_to_variant_type (
       OV_TCP_MSG_TYPE_QUERY_CAPS, OV_TCP_MAX_VERSION);
@@ -220,7 +273,11 @@ setup_negotiate_remote_peers (OvLocalPeer * local, OvTcpMsg * msg)
 
     if (g_hash_table_contains (remotes, peer_id)) {
       GST_ERROR ("Query caps contains duplicate remote: %s", peer_id);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+          "Duplicate remote %s", peer_id);
       g_free (peer_id);
+      g_free (peer_addr_s);
+      g_variant_iter_free (iter);
       goto err;
     }
 
@@ -231,6 +288,12 @@ setup_negotiate_remote_peers (OvLocalPeer * local, OvTcpMsg * msg)
     remote->id = g_strdup (peer_id);
 
     g_hash_table_insert (remotes, remote->id, remote);
+    if (!ov_remote_peer_reserve_recv_ports (remote, error)) {
+      g_free (peer_id);
+      g_free (peer_addr_s);
+      g_variant_iter_free (iter);
+      goto err;
+    }
   }
   g_variant_iter_free (iter);
 
@@ -238,18 +301,17 @@ setup_negotiate_remote_peers (OvLocalPeer * local, OvTcpMsg * msg)
   priv->negotiate->remotes = remotes;
   return TRUE;
 err:
+  /* The negotiator isn't ours to free */
+  g_hash_table_steal (remotes, priv->negotiate->negotiator->id);
   g_hash_table_unref (remotes);
   return FALSE;
 }
 
-static gboolean
-ov_local_peer_handle_query_reply_caps (OvLocalPeer * local,
-    GSocketConnection * connection, OvTcpMsg * msg)
+static OvTcpMsg *
+ov_local_peer_handle_query_reply_caps (OvLocalPeer * local, OvTcpMsg * msg)
 {
   gchar *tmp;
-  gboolean ret;
   guint64 call_id;
-  GOutputStream *output;
   GHashTableIter iter;
   GVariantBuilder *peers;
   const gchar *variant_type;
@@ -257,10 +319,13 @@ ov_local_peer_handle_query_reply_caps (OvLocalPeer * local,
   gchar *recv_acaps, *recv_vcaps;
   /* The caps that we can send */
   gchar *send_acaps, *send_vcaps;
+  GstCaps *vcaps;
   OvRemotePeer *remote;
   OvTcpMsg *reply;
   OvLocalPeerState state;
   OvLocalPeerPrivate *priv;
+  guint span, ports_span;
+  GError *error = NULL;
 
   priv = ov_local_peer_get_private (local);
 
@@ -289,9 +354,23 @@ ov_local_peer_handle_query_reply_caps (OvLocalPeer * local,
   }
 
   timeout_value = 0;
+  span = ov_local_peer_trace_begin (local, "query-caps",
+      priv->negotiate->negotiator->id);
 
   /* Allocate ports for all peers listed (pre-setup) */
-  setup_negotiate_remote_peers (local, msg);
+  ports_span = ov_local_peer_trace_begin (local, "allocate-ports", NULL);
+  if (!setup_negotiate_remote_peers (local, msg, &error)) {
+    /* The negotiator skips us and cancels the negotiation */
+    GST_ERROR ("Unable to set up the remotes to negotiate with: %s",
+        error->message);
+    ov_local_peer_trace_end (local, ports_span);
+    ov_local_peer_trace_end (local, span);
+    reply = ov_tcp_msg_new_error (msg->id, error->message);
+    g_error_free (error);
+    ov_local_peer_unlock (local);
+    goto send_reply;
+  }
+  ov_local_peer_trace_end (local, ports_span);
 
   /* Build the 'reply-caps' msg */
   peers = g_variant_builder_new (G_VARIANT_TYPE ("a(sqqqq)"));
@@ -305,11 +384,15 @@ ov_local_peer_handle_query_reply_caps (OvLocalPeer * local,
 
   send_acaps = gst_caps_to_string (priv->supported_send_acaps);
   /* TODO: Decide send_vcaps based on our upload bandwidth limit */
-  send_vcaps = gst_caps_to_string (priv->supported_send_vcaps);
+  vcaps = ov_local_peer_get_offered_vcaps (local, TRUE);
+  send_vcaps = gst_caps_to_string (vcaps);
+  gst_caps_unref (vcaps);
   /* TODO: Fixate and restrict recv_?caps as per CPU and download
    * bandwidth limits based on the number of peers */
   recv_acaps = gst_caps_to_string (priv->supported_recv_acaps);
-  recv_vcaps = gst_caps_to_string (priv->supported_recv_vcaps);
+  vcaps = ov_local_peer_get_offered_vcaps (local, FALSE);
+  recv_vcaps = gst_caps_to_string (vcaps);
+  gst_caps_unref (vcaps);
 
   variant_type = ov_tcp_msg_type_to_variant_type (
       OV_TCP_MSG_TYPE_REPLY_CAPS, OV_TCP_MAX_VERSION);
@@ -321,21 +404,20 @@ ov_local_peer_handle_query_reply_caps (OvLocalPeer * local,
 
   g_free (send_acaps); g_free (send_vcaps);
   g_free (recv_acaps); g_free (recv_vcaps);
+  ov_local_peer_trace_end (local, span);
 
   g_signal_emit_by_name (local, "negotiate-started");
 
-  tmp = g_variant_print (reply->variant, FALSE);
-  GST_DEBUG ("Replying to 'query caps' with %s", tmp);
-  g_free (tmp);
+  if (OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = g_variant_print (reply->variant, FALSE);
+    GST_LOG ("Replying to 'query caps' with %s", tmp);
+    g_free (tmp);
+  }
 
 send_reply:
-  output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
-  ret = ov_tcp_msg_write_to_stream (output, reply, NULL, NULL);
-  /* XXX: Failure return here is not a fatal error. If our message did not get
-   * through, the negotiation will just timeout instead. */
-  ov_tcp_msg_free (reply);
-
-  return ret;
+  /* XXX: Failure to send the reply is not a fatal error. If our message did
+   * not get through, the negotiation will just timeout instead. */
+  return reply;
 }
 
 /* Called with the lock TAKEN */
@@ -344,7 +426,7 @@ set_call_details (OvLocalPeer * local, OvTcpMsg * msg)
 {
   GVariantIter *iter;
   const gchar *vtype;
-  gchar *peer_id, *acaps, *vcaps;
+  gchar *peer_id, *acaps, *vcaps, *group = NULL;
   OvLocalPeerPrivate *priv;
   GHashTable *remotes;
   guint32 ports[6] = {};
@@ -361,9 +443,16 @@ set_call_details (OvLocalPeer * local, OvTcpMsg * msg)
   if (priv->send_acaps != NULL)
     gst_caps_unref (priv->send_acaps);
   priv->send_acaps = gst_caps_from_string (acaps);
+  priv->send_dtx = ov_caps_take_flag (&priv->send_acaps, "dtx");
   if (priv->send_vcaps != NULL)
     gst_caps_unref (priv->send_vcaps);
   priv->send_vcaps = gst_caps_from_string (vcaps);
+  priv->send_repair = ov_caps_take_rtp_repair (&priv->send_vcaps);
+  /* Set if we send our RTP to the multicast group */
+  g_clear_pointer (&priv->multicast_group, g_free);
+  priv->send_multicast_port = 0;
+  ov_caps_take_multicast (&priv->send_vcaps, &priv->multicast_group,
+      &priv->send_multicast_port);
   g_free (acaps); g_free (vcaps);
 
   /* Set the video format we're sending */
@@ -395,10 +484,24 @@ set_call_details (OvLocalPeer * local, OvTcpMsg * msg)
     if (remote->priv->recv_acaps != NULL)
       gst_caps_unref (remote->priv->recv_acaps);
     remote->priv->recv_acaps = gst_caps_from_string (acaps);
+    remote->priv->recv_dtx =
+      ov_caps_take_flag (&remote->priv->recv_acaps, "dtx");
     if (remote->priv->recv_vcaps != NULL)
       gst_caps_unref (remote->priv->recv_vcaps);
     remote->priv->recv_vcaps = gst_caps_from_string (vcaps);
+    remote->priv->recv_repair =
+      ov_caps_take_rtp_repair (&remote->priv->recv_vcaps);
+    /* Set if we receive its RTP from the multicast group; there's only one
+     * group per call */
+    g_clear_pointer (&group, g_free);
+    ov_caps_take_multicast (&remote->priv->recv_vcaps, &group,
+        &remote->priv->recv_multicast_port);
+    remote->priv->is_relay =
+      ov_caps_take_flag (&remote->priv->recv_vcaps, "relay");
+    if (group != NULL && priv->multicast_group == NULL)
+      priv->multicast_group = g_steal_pointer (&group);
   }
+  g_free (group);
 
   ov_local_peer_set_state (local, OV_LOCAL_STATE_NEGOTIATED);
   ov_local_peer_set_state_negotiatee (local);
@@ -406,21 +509,21 @@ set_call_details (OvLocalPeer * local, OvTcpMsg * msg)
   g_variant_iter_free (iter);
   return TRUE;
 err:
-  g_free (peer_id); g_free (acaps); g_free (vcaps);
+  g_free (peer_id); g_free (acaps); g_free (vcaps); g_free (group);
   g_variant_iter_free (iter);
   return FALSE;
 }
 
-static gboolean
-ov_local_peer_handle_call_details (OvLocalPeer * local, GOutputStream * output,
-    OvTcpMsg * msg)
+static OvTcpMsg *
+ov_local_peer_handle_call_details (OvLocalPeer * local, OvTcpMsg * msg)
 {
   guint64 call_id;
   OvTcpMsg *reply;
   const gchar *variant_type;
   OvLocalPeerPrivate *priv;
   OvLocalPeerState state;
-  gboolean ret = FALSE;
+  gboolean ok;
+  guint span;
 
   priv = ov_local_peer_get_private (local);
 
@@ -446,9 +549,13 @@ ov_local_peer_handle_call_details (OvLocalPeer * local, GOutputStream * output,
   }
 
   timeout_value = 0;
+  span = ov_local_peer_trace_begin (local, "call-details",
+      priv->negotiate->negotiator->id);
 
   /* Set call details */
-  if (!set_call_details (local, msg)) {
+  ok = set_call_details (local, msg);
+  ov_local_peer_trace_end (local, span);
+  if (!ok) {
     reply = ov_tcp_msg_new_error_call (call_id, "Invalid call details");
     /* XXX: We don't abort the negotiation because of invalid call details.
      * We give the negotiator another chance to send us the call details or to
@@ -456,16 +563,15 @@ ov_local_peer_handle_call_details (OvLocalPeer * local, GOutputStream * output,
     goto send_reply_unlock;
   }
 
+  /* We know what we'll send now */
+  ov_local_peer_warm_transmit (local);
+
   reply = ov_tcp_msg_new_ack (msg->id);
-  ret = TRUE;
 
 send_reply_unlock:
   ov_local_peer_unlock (local);
 send_reply:
-  ov_tcp_msg_write_to_stream (output, reply, NULL, NULL);
-
-  ov_tcp_msg_free (reply);
-  return ret;
+  return reply;
 }
 
 /* Called with the lock TAKEN */
@@ -524,8 +630,14 @@ err:
   return FALSE;
 }
 
-static gboolean
-ov_local_peer_handle_start_call (OvLocalPeer * local, GOutputStream * output,
+static void
+emit_negotiate_finished (OvLocalPeer * local, gpointer data G_GNUC_UNUSED)
+{
+  g_signal_emit_by_name (local, "negotiate-finished");
+}
+
+static OvTcpMsg *
+ov_local_peer_handle_start_call (OvLocalPeer * local, OvIncomingConn * conn,
     OvTcpMsg * msg)
 {
   guint64 call_id;
@@ -533,7 +645,7 @@ ov_local_peer_handle_start_call (OvLocalPeer * local, GOutputStream * output,
   const gchar *variant_type;
   OvLocalPeerPrivate *priv;
   OvLocalPeerState state;
-  gboolean ret = FALSE;
+  guint span, negotiate_span;
 
   priv = ov_local_peer_get_private (local);
 
@@ -560,9 +672,14 @@ ov_local_peer_handle_start_call (OvLocalPeer * local, GOutputStream * output,
   }
 
   timeout_value = 0;
+  span = ov_local_peer_trace_begin (local, "start-call",
+      priv->negotiate->negotiator->id);
+  /* start_call() frees priv->negotiate */
+  negotiate_span = priv->negotiate->trace_span;
 
   /* Start calling the specified list of peers */
   if (!start_call (local, msg)) {
+    ov_local_peer_trace_end (local, span);
     reply = ov_tcp_msg_new_error_call (call_id, "Invalid list of peers");
     /* XXX: We don't abort the negotiation because of this error here.
      * We give the negotiator another chance to start the call, or to
@@ -570,35 +687,43 @@ ov_local_peer_handle_start_call (OvLocalPeer * local, GOutputStream * output,
     goto send_reply_unlock;
   }
 
+  ov_local_peer_trace_end (local, span);
+  ov_local_peer_trace_end (local, negotiate_span);
+
   reply = ov_tcp_msg_new_ack (msg->id);
-  ret = TRUE;
+  /* Emit signal after unlocking and after writing the reply */
+  conn->after_reply = emit_negotiate_finished;
 
 send_reply_unlock:
   ov_local_peer_unlock (local);
 send_reply:
-  ov_tcp_msg_write_to_stream (output, reply, NULL, NULL);
-  /* Emit signal after unlocking and after writing the reply */
-  if (ret)
-    g_signal_emit_by_name (local, "negotiate-finished");
+  return reply;
+}
 
-  ov_tcp_msg_free (reply);
-  return ret;
+static void
+emit_call_remote_gone (OvLocalPeer * local, OvPeer * removed)
+{
+  g_signal_emit_by_name (local, "call-remote-gone", removed, FALSE);
 }
 
-static gboolean
-ov_local_peer_remove_peer_from_call (OvLocalPeer * local, GOutputStream * output,
-    OvTcpMsg * msg)
+static void
+emit_call_all_remotes_gone (OvLocalPeer * local, OvPeer * removed)
+{
+  emit_call_remote_gone (local, removed);
+  g_signal_emit_by_name (local, "call-all-remotes-gone");
+}
+
+static OvTcpMsg *
+ov_local_peer_remove_peer_from_call (OvLocalPeer * local,
+    OvIncomingConn * conn, OvTcpMsg * msg)
 {
   guint64 call_id;
   OvTcpMsg *reply;
-  OvPeer *removed;
   OvRemotePeer *remote;
   const gchar *variant_type;
   GPtrArray *remote_peers;
   OvLocalPeerState state;
   gchar *peer_id = NULL;
-  gboolean all_remotes_gone = FALSE;
-  gboolean ret = FALSE;
 
   variant_type = ov_tcp_msg_type_to_variant_type (
       OV_TCP_MSG_TYPE_END_CALL, OV_TCP_MAX_VERSION);
@@ -625,126 +750,643 @@ ov_local_peer_remove_peer_from_call (OvLocalPeer * local, GOutputStream * output
 
   GST_DEBUG ("Removing remote peer %s from the call", remote->id);
 
-  removed = ov_peer_new (remote->addr);
+  /* Emit signals after unlocking and after writing the reply */
+  conn->after_reply = (OvAfterReplyFunc) emit_call_remote_gone;
+  conn->after_reply_data = ov_peer_new (remote->addr);
+  conn->after_reply_destroy = g_object_unref;
+
   /* Remove the specified peer from the call */
   ov_local_peer_remove_remote (local, remote);
 
   remote_peers = ov_local_peer_get_remotes (local);
   if (remote_peers->len == 0) {
     GST_DEBUG ("No peers left in call");
-    all_remotes_gone = TRUE;
+    conn->after_reply = (OvAfterReplyFunc) emit_call_all_remotes_gone;
   }
 
   reply = ov_tcp_msg_new_ack (msg->id);
 
-  ret = TRUE;
+send_reply_unlock:
+  ov_local_peer_unlock (local);
+send_reply:
+  g_free (peer_id);
+  return reply;
+}
+
+typedef struct {
+  OvPeer *peer;
+  gboolean muted[2];
+} OvRemoteMuted;
+
+static void
+ov_remote_muted_free (OvRemoteMuted * muted)
+{
+  g_object_unref (muted->peer);
+  g_free (muted);
+}
+
+static void
+emit_call_remote_muted (OvLocalPeer * local, OvRemoteMuted * muted)
+{
+  g_signal_emit_by_name (local, "call-remote-muted", muted->peer,
+      muted->muted[OV_AUDIO_RTP_SESSION], muted->muted[OV_VIDEO_RTP_SESSION]);
+}
+
+static OvTcpMsg *
+ov_local_peer_handle_mute_media (OvLocalPeer * local, OvIncomingConn * conn,
+    OvTcpMsg * msg)
+{
+  guint64 call_id;
+  OvTcpMsg *reply;
+  OvRemotePeer *remote;
+  OvRemoteMuted *muted;
+  const gchar *variant_type;
+  OvLocalPeerState state;
+  gboolean audio_muted, video_muted;
+  gchar *peer_id = NULL;
+  OvLocalPeerPrivate *priv;
+
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_MUTE_MEDIA, OV_TCP_MAX_VERSION);
+  if (!g_variant_is_of_type (msg->variant, G_VARIANT_TYPE (variant_type))) {
+    reply = ov_tcp_msg_new_error (msg->id, "Invalid message data");
+    goto send_reply;
+  }
+  g_variant_get (msg->variant, variant_type, &call_id, &peer_id, &audio_muted,
+      &video_muted);
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+
+  state = ov_local_peer_get_state (local);
+  if (!(state & OV_LOCAL_STATE_PAUSED ||
+        state & OV_LOCAL_STATE_PLAYING)) {
+    reply = ov_tcp_msg_new_error (msg->id, "Busy");
+    goto send_reply_unlock;
+  }
+
+  if (call_id != priv->active_call_id) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Invalid call id");
+    goto send_reply_unlock;
+  }
+
+  remote = ov_local_peer_get_remote_by_id (local, peer_id);
+  if (!remote) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Invalid peer id");
+    goto send_reply_unlock;
+  }
+
+  GST_DEBUG ("Remote %s is %ssending audio and %ssending video", remote->id,
+      audio_muted ? "not " : "", video_muted ? "not " : "");
+  remote->priv->recv_muted[OV_AUDIO_RTP_SESSION] = audio_muted;
+  if (remote->priv->recv_muted[OV_VIDEO_RTP_SESSION] != video_muted) {
+    remote->priv->recv_muted[OV_VIDEO_RTP_SESSION] = video_muted;
+    /* Nothing of what's still in flight needs decoding; it sends a keyframe
+     * when it unmutes, but we ask anyway in case that one was lost */
+    if (remote->priv->vdepay != NULL && !remote->priv->video_hidden) {
+      ov_remote_peer_drop_video (remote, video_muted);
+      if (!video_muted && remote->state == OV_REMOTE_STATE_PLAYING)
+        ov_remote_peer_request_video_keyframe (remote);
+    }
+  }
+
+  /* Emit signal after unlocking and after writing the reply */
+  muted = g_new0 (OvRemoteMuted, 1);
+  muted->peer = ov_peer_new (remote->addr);
+  muted->muted[OV_AUDIO_RTP_SESSION] = audio_muted;
+  muted->muted[OV_VIDEO_RTP_SESSION] = video_muted;
+  conn->after_reply = (OvAfterReplyFunc) emit_call_remote_muted;
+  conn->after_reply_data = muted;
+  conn->after_reply_destroy = (GDestroyNotify) ov_remote_muted_free;
+
+  reply = ov_tcp_msg_new_ack (msg->id);
 
 send_reply_unlock:
   ov_local_peer_unlock (local);
 send_reply:
-  ov_tcp_msg_write_to_stream (output, reply, NULL, NULL);
+  g_free (peer_id);
+  return reply;
+}
 
-  /* Emit signals after unlocking and after writing the reply */
-  if (ret) {
-    g_signal_emit_by_name (local, "call-remote-gone", removed, FALSE);
-    g_object_unref (removed);
+/* Sent by a remote when it changes how big it shows our video */
+static OvTcpMsg *
+ov_local_peer_handle_video_view (OvLocalPeer * local, OvTcpMsg * msg)
+{
+  guint64 call_id;
+  guint32 quality;
+  OvTcpMsg *reply;
+  OvRemotePeer *remote;
+  const gchar *variant_type;
+  OvLocalPeerState state;
+  OvLocalPeerPrivate *priv;
+  gchar *peer_id = NULL;
+
+  priv = ov_local_peer_get_private (local);
+
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_VIDEO_VIEW, OV_TCP_MAX_VERSION);
+  if (!g_variant_is_of_type (msg->variant, G_VARIANT_TYPE (variant_type))) {
+    reply = ov_tcp_msg_new_error (msg->id, "Invalid message data");
+    goto send_reply;
   }
-  if (all_remotes_gone)
-    g_signal_emit_by_name (local, "call-all-remotes-gone");
+  g_variant_get (msg->variant, variant_type, &call_id, &peer_id, &quality);
 
-  ov_tcp_msg_free (reply);
+  ov_local_peer_lock (local);
+
+  state = ov_local_peer_get_state (local);
+  if (!(state & OV_LOCAL_STATE_PAUSED ||
+        state & OV_LOCAL_STATE_PLAYING)) {
+    reply = ov_tcp_msg_new_error (msg->id, "Busy");
+    goto send_reply_unlock;
+  }
+
+  if (call_id != priv->active_call_id) {
+    reply = ov_tcp_msg_new_error (msg->id, "Invalid call id");
+    goto send_reply_unlock;
+  }
+
+  remote = ov_local_peer_get_remote_by_id (local, peer_id);
+  if (!remote) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Invalid peer id");
+    goto send_reply_unlock;
+  }
+
+  GST_DEBUG ("Remote %s shows our video at up to %#x", remote->id, quality);
+  remote->priv->send_view_quality = quality;
+  ov_remote_peer_apply_video_view (remote);
+
+  reply = ov_tcp_msg_new_ack (msg->id);
+
+send_reply_unlock:
+  ov_local_peer_unlock (local);
+send_reply:
   g_free (peer_id);
-  return ret;
+  return reply;
 }
 
-/* TODO: This does blocking reads over the network, which is ok for now because
- * we're using a threaded listener with 10 threads. However, this makes us
- * susceptible to DoS attacks. Needs fixing. */
-gboolean
-on_incoming_peer_tcp_connection (GSocketService * service,
-    GSocketConnection * connection, GObject * source_object G_GNUC_UNUSED,
-    OvLocalPeer * local)
+static void
+emit_call_remote_added (OvLocalPeer * local, OvPeer * added)
 {
-  gchar *tmp;
-  gboolean ret;
-  GInputStream *input;
-  GOutputStream *output;
-  OvTcpMsg *msg;
+  g_signal_emit_by_name (local, "call-remote-added", added);
+}
+
+/* Sent by the negotiator when a peer joins the call that we're in. We start
+ * receiving from it and sending to it right away, without touching anything
+ * else, and tell the negotiator what we send and where the new peer should
+ * send to us for its CALL_DETAILS */
+static OvTcpMsg *
+ov_local_peer_handle_add_peer (OvLocalPeer * local, OvIncomingConn * conn,
+    OvTcpMsg * msg)
+{
+  guint64 call_id;
+  guint16 ports[6];
+  OvTcpMsg *reply;
+  OvRemotePeer *remote;
+  GstCaps *acaps, *vcaps, *offered;
+  const gchar *variant_type;
+  OvLocalPeerState state;
+  OvLocalPeerPrivate *priv;
+  gchar *peer_id, *peer_addr_s, *acaps_s, *vcaps_s, *send_s[2];
+  gboolean supported;
   GError *error = NULL;
 
-  input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
-  output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  priv = ov_local_peer_get_private (local);
 
-  msg = g_new0 (OvTcpMsg, 1);
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_ADD_PEER, OV_TCP_MAX_VERSION);
+  if (!g_variant_is_of_type (msg->variant, G_VARIANT_TYPE (variant_type))) {
+    reply = ov_tcp_msg_new_error (msg->id, "Invalid message data");
+    return reply;
+  }
+  g_variant_get (msg->variant, variant_type, &call_id, &peer_id, &peer_addr_s,
+      &acaps_s, &vcaps_s, &ports[0], &ports[1], &ports[2], &ports[3],
+      &ports[4], &ports[5]);
+  acaps = gst_caps_from_string (acaps_s);
+  vcaps = gst_caps_from_string (vcaps_s);
+  g_free (acaps_s); g_free (vcaps_s);
+
+  ov_local_peer_lock (local);
 
-  ret = ov_tcp_msg_read_header_from_stream (input, msg, NULL,
-      &error);
-  if (ret != TRUE) {
-    GST_ERROR ("Unable to read message length prefix: %s",
-        error ? error->message : "Unknown error");
-    if (msg->id)
-      /* TODO: Make this more specific; add GError types and send back and
-       * forth. In general, error handling is quite crap everywhere right
-       * now. */
-      ov_tcp_msg_write_new_error_to_stream (output, msg->id,
-          "Couldn't finish reading header", NULL, NULL);
-    goto out;
+  state = ov_local_peer_get_state (local);
+  if (!(state & OV_LOCAL_STATE_PAUSED ||
+        state & OV_LOCAL_STATE_PLAYING)) {
+    reply = ov_tcp_msg_new_error (msg->id, "Busy");
+    goto send_reply_unlock;
   }
 
-  GST_DEBUG ("Incoming message type '%s' and version %u of length %u bytes",
-      ov_tcp_msg_type_to_string (msg->type, msg->version),
-      msg->version, msg->size);
+  if (call_id != priv->active_call_id) {
+    reply = ov_tcp_msg_new_error (msg->id, "Invalid call id");
+    goto send_reply_unlock;
+  }
 
-  /* TODO: Handle incoming messages when we're busy negotiating a call, or
-   * are in a call, etc. */
+  if (ov_local_peer_get_remote_by_id (local, peer_id) != NULL) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Peer is already in the call");
+    goto send_reply_unlock;
+  }
 
-  if (msg->size == 0)
-    goto body_done;
+  if (acaps == NULL || vcaps == NULL) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Invalid caps");
+    goto send_reply_unlock;
+  }
 
-  /* Read the rest of the message */
-  ret = ov_tcp_msg_read_body_from_stream (input, msg, NULL, &error);
-  if (ret != TRUE) {
-    GST_ERROR ("Unable to read message body: %s",
-        error ? error->message : "Unknown error");
-    ov_tcp_msg_write_new_error_to_stream (output, msg->id,
-        "Couldn't read body", NULL, NULL);
-    goto out;
+  /* The negotiator only knows what we offered when the call was negotiated */
+  offered = ov_local_peer_get_offered_vcaps (local, FALSE);
+  supported = gst_caps_can_intersect (acaps, priv->supported_recv_acaps) &&
+    gst_caps_can_intersect (vcaps, offered);
+  gst_caps_unref (offered);
+  if (!supported) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Unsupported caps");
+    goto send_reply_unlock;
   }
 
-  tmp = g_variant_print (msg->variant, FALSE);
-  GST_DEBUG ("Received message body: %s", tmp);
-  g_free (tmp);
+  remote = ov_remote_peer_new_from_string (local, peer_addr_s);
+  if (remote == NULL) {
+    reply = ov_tcp_msg_new_error_call (call_id, "Invalid peer address");
+    goto send_reply_unlock;
+  }
+  if (!ov_remote_peer_reserve_recv_ports (remote, &error)) {
+    GST_ERROR ("Unable to add %s to the call: %s", peer_id, error->message);
+    reply = ov_tcp_msg_new_error_call (call_id, error->message);
+    g_error_free (error);
+    ov_remote_peer_free (remote);
+    goto send_reply_unlock;
+  }
+  remote->id = g_strdup (peer_id);
+  memcpy (remote->priv->send_ports, ports, sizeof (ports));
+  remote->priv->recv_acaps = g_steal_pointer (&acaps);
+  remote->priv->recv_dtx = ov_caps_take_flag (&remote->priv->recv_acaps, "dtx");
+  remote->priv->recv_vcaps = g_steal_pointer (&vcaps);
+  remote->priv->recv_repair =
+    ov_caps_take_rtp_repair (&remote->priv->recv_vcaps);
+
+  GST_DEBUG ("Adding remote peer %s to the call", remote->id);
+
+  if (!ov_local_peer_start_joined_remote (local, remote)) {
+    ov_local_peer_remove_remote (local, remote);
+    reply = ov_tcp_msg_new_error_call (call_id, "Unable to add peer");
+    goto send_reply_unlock;
+  }
+
+  send_s[0] = ov_local_peer_get_send_caps_string (local, OV_AUDIO_RTP_SESSION);
+  send_s[1] = ov_local_peer_get_send_caps_string (local, OV_VIDEO_RTP_SESSION);
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_REPLY_ADD_PEER, OV_TCP_MAX_VERSION);
+  reply = ov_tcp_msg_new (OV_TCP_MSG_TYPE_REPLY_ADD_PEER,
+      g_variant_new (variant_type, call_id, send_s[0], send_s[1],
+        remote->priv->recv_ports[0], remote->priv->recv_ports[1],
+        priv->recv_rtcp_ports[0], remote->priv->recv_ports[2],
+        remote->priv->recv_ports[3], priv->recv_rtcp_ports[1]));
+  g_free (send_s[0]); g_free (send_s[1]);
+
+  /* Emit signal after unlocking and after writing the reply */
+  conn->after_reply = (OvAfterReplyFunc) emit_call_remote_added;
+  conn->after_reply_data = ov_peer_new (remote->addr);
+  conn->after_reply_destroy = g_object_unref;
+
+send_reply_unlock:
+  ov_local_peer_unlock (local);
+  g_clear_pointer (&acaps, gst_caps_unref);
+  g_clear_pointer (&vcaps, gst_caps_unref);
+  g_free (peer_id);
+  g_free (peer_addr_s);
+  return reply;
+}
+
+static void ov_incoming_conn_read_header (OvIncomingConn * conn);
+
+static void
+ov_incoming_conn_free (OvIncomingConn * conn)
+{
+  OvLocalPeer *local = conn->local;
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (local);
+
+  priv->tcp_connections = g_list_remove (priv->tcp_connections, conn);
+
+  g_io_stream_close (G_IO_STREAM (conn->connection), NULL, NULL);
+  g_object_unref (conn->connection);
+  g_object_unref (conn->cancel);
+  g_byte_array_unref (conn->buffer);
+  ov_tcp_msg_free (conn->msg);
+  ov_tcp_msg_frame_clear (&conn->reply);
+  if (conn->after_reply_destroy)
+    conn->after_reply_destroy (conn->after_reply_data);
+  g_free (conn);
+
+  /* The last connection is gone after ov_local_peer_stop_tcp_server() */
+  ov_local_peer_tcp_server_quit_if_idle (local);
+}
+
+static void
+on_incoming_reply_written (GOutputStream * output, GAsyncResult * result,
+    OvIncomingConn * conn)
+{
+  gboolean ret;
+  GError *error = NULL;
+
+#if GLIB_CHECK_VERSION (2, 60, 0)
+  ret = g_output_stream_writev_all_finish (output, result, NULL, &error);
+#else
+  ret = g_output_stream_write_all_finish (output, result, NULL, &error);
+#endif
+  if (!ret) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      GST_ERROR ("Unable to write reply: %s", error->message);
+    g_error_free (error);
+    ov_incoming_conn_free (conn);
+    return;
+  }
+
+#if !GLIB_CHECK_VERSION (2, 60, 0)
+  /* Without writev, the header and the body are written one after another */
+  if (++conn->reply_vector < conn->reply.n_vectors) {
+    GOutputVector *vector = &conn->reply.vectors[conn->reply_vector];
+    g_output_stream_write_all_async (output, vector->buffer, vector->size,
+        G_PRIORITY_DEFAULT, conn->cancel,
+        (GAsyncReadyCallback) on_incoming_reply_written, conn);
+    return;
+  }
+#endif
+
+  if (conn->after_reply)
+    conn->after_reply (conn->local, conn->after_reply_data);
+  if (conn->after_reply_destroy)
+    conn->after_reply_destroy (conn->after_reply_data);
+  conn->after_reply = NULL;
+  conn->after_reply_data = NULL;
+  conn->after_reply_destroy = NULL;
+
+  ov_tcp_msg_frame_clear (&conn->reply);
+  g_clear_pointer (&conn->msg, ov_tcp_msg_free);
+
+  /* Wait for the next request on this connection */
+  ov_incoming_conn_read_header (conn);
+}
+
+/* Writes @reply (transfer full) to the remote asynchronously and then goes
+ * back to reading the next request */
+static void
+ov_incoming_conn_send_reply (OvIncomingConn * conn, OvTcpMsg * reply)
+{
+  gchar *tmp;
+  GOutputStream *output;
+
+  /* The reply carries the id of the request so that the other side can
+   * match it when several requests are in flight on the same connection */
+  reply->id = conn->msg->id;
+
+  if (OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = ov_tcp_msg_print (reply);
+    GST_LOG ("Replying with msg type %s; contents: %s",
+        ov_tcp_msg_type_to_string (reply->type, reply->version), tmp);
+    g_free (tmp);
+  }
+
+  /* The frame keeps the serialized variant alive, so the msg can go */
+  ov_tcp_msg_frame_init (&conn->reply, reply);
+  ov_tcp_msg_free (reply);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (conn->connection));
+#if GLIB_CHECK_VERSION (2, 60, 0)
+  g_output_stream_writev_all_async (output, conn->reply.vectors,
+      conn->reply.n_vectors, G_PRIORITY_DEFAULT, conn->cancel,
+      (GAsyncReadyCallback) on_incoming_reply_written, conn);
+#else
+  conn->reply_vector = 0;
+  g_output_stream_write_all_async (output, conn->reply.vectors[0].buffer,
+      conn->reply.vectors[0].size, G_PRIORITY_DEFAULT, conn->cancel,
+      (GAsyncReadyCallback) on_incoming_reply_written, conn);
+#endif
+}
+
+/* Runs in a GTask thread. Nothing else touches @conn till the reply is sent
+ * from on_incoming_msg_handled(), since nothing is read from it meanwhile. */
+static void
+ov_incoming_conn_handle_msg_thread (GTask * task,
+    gpointer source_object G_GNUC_UNUSED, OvIncomingConn * conn,
+    GCancellable * cancellable G_GNUC_UNUSED)
+{
+  OvTcpMsg *msg = conn->msg;
+  OvTcpMsg *reply;
+
+  /* TODO: Handle incoming messages when we're busy negotiating a call, or
+   * are in a call, etc. */
 
-body_done:
   switch (msg->type) {
     case OV_TCP_MSG_TYPE_START_NEGOTIATE:
-      ov_local_peer_handle_start_negotiate (local, connection, msg);
+      reply = ov_local_peer_handle_start_negotiate (conn->local,
+          conn->connection, msg);
       break;
     case OV_TCP_MSG_TYPE_CANCEL_NEGOTIATE:
-      ov_local_peer_handle_cancel_negotiate (local, output, msg);
+      reply = ov_local_peer_handle_cancel_negotiate (conn->local, conn, msg);
       break;
     case OV_TCP_MSG_TYPE_QUERY_CAPS:
-      ov_local_peer_handle_query_reply_caps (local, connection, msg);
+      reply = ov_local_peer_handle_query_reply_caps (conn->local, msg);
       break;
     case OV_TCP_MSG_TYPE_CALL_DETAILS:
-      ov_local_peer_handle_call_details (local, output, msg);
+      reply = ov_local_peer_handle_call_details (conn->local, msg);
       break;
     case OV_TCP_MSG_TYPE_START_CALL:
-      ov_local_peer_handle_start_call (local, output, msg);
+      reply = ov_local_peer_handle_start_call (conn->local, conn, msg);
       break;
     case OV_TCP_MSG_TYPE_END_CALL:
-      ov_local_peer_remove_peer_from_call (local, output, msg);
+      reply = ov_local_peer_remove_peer_from_call (conn->local, conn, msg);
+      break;
+    case OV_TCP_MSG_TYPE_MUTE_MEDIA:
+      reply = ov_local_peer_handle_mute_media (conn->local, conn, msg);
+      break;
+    case OV_TCP_MSG_TYPE_ADD_PEER:
+      reply = ov_local_peer_handle_add_peer (conn->local, conn, msg);
+      break;
+    case OV_TCP_MSG_TYPE_VIDEO_VIEW:
+      reply = ov_local_peer_handle_video_view (conn->local, msg);
       break;
     default:
-      ov_tcp_msg_write_new_error_to_stream (output, msg->id,
-          "Unknown message type", NULL, NULL);
+      reply = ov_tcp_msg_new_error (msg->id, "Unknown message type");
   }
 
-out:
-  /* FIXME: Check error */
-  g_io_stream_close (G_IO_STREAM (connection), NULL, &error);
-  g_clear_error (&error);
-  ov_tcp_msg_free (msg);
-  /* Call again for new connections */
-  return FALSE;
+  g_task_return_pointer (task, reply, (GDestroyNotify) ov_tcp_msg_free);
+}
+
+/* Called from the TCP server's main context */
+static void
+on_incoming_msg_handled (GObject * source_object G_GNUC_UNUSED,
+    GAsyncResult * result, OvIncomingConn * conn)
+{
+  ov_incoming_conn_send_reply (conn,
+      g_task_propagate_pointer (G_TASK (result), NULL));
+}
+
+/* The handlers take the lock, which the negotiation threads hold while waiting
+ * for remotes to reply. If they ran in the TCP server's main context, that
+ * would hold up every other connection, one-way sends, and replies to the
+ * requests that the lock holder is waiting for, so they're run in a thread
+ * and the reply is sent once they're done. */
+static void
+ov_incoming_conn_handle_msg (OvIncomingConn * conn)
+{
+  gchar *tmp;
+  GTask *task;
+
+  if (conn->msg->variant && OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = ov_tcp_msg_print (conn->msg);
+    GST_LOG ("Received message body: %s", tmp);
+    g_free (tmp);
+  }
+
+  /* The callback is run in the thread-default main context, which is the TCP
+   * server's */
+  task = g_task_new (NULL, NULL,
+      (GAsyncReadyCallback) on_incoming_msg_handled, conn);
+  g_task_set_task_data (task, conn, NULL);
+  g_task_run_in_thread (task,
+      (GTaskThreadFunc) ov_incoming_conn_handle_msg_thread);
+  g_object_unref (task);
+}
+
+static void
+on_incoming_body_read (GInputStream * input, GAsyncResult * result,
+    OvIncomingConn * conn)
+{
+  gsize bytes_read;
+  GError *error = NULL;
+
+  if (!g_input_stream_read_all_finish (input, result, &bytes_read, &error)) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      GST_ERROR ("Unable to read message body: %s", error->message);
+    g_error_free (error);
+    ov_incoming_conn_free (conn);
+    return;
+  }
+
+  if (bytes_read < conn->msg->size) {
+    GST_ERROR ("Unable to finish reading incoming data due to EOS");
+    ov_incoming_conn_free (conn);
+    return;
+  }
+
+  if (!ov_tcp_msg_set_body (conn->msg, conn->buffer->data)) {
+    ov_incoming_conn_send_reply (conn,
+        ov_tcp_msg_new_error (conn->msg->id, "Couldn't read body"));
+    return;
+  }
+
+  ov_incoming_conn_handle_msg (conn);
+}
+
+static void
+on_incoming_header_read (GInputStream * input, GAsyncResult * result,
+    OvIncomingConn * conn)
+{
+  gsize bytes_read;
+  GError *error = NULL;
+
+  if (!g_input_stream_read_all_finish (input, result, &bytes_read, &error)) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      GST_ERROR ("Unable to read message length prefix: %s", error->message);
+    g_error_free (error);
+    ov_incoming_conn_free (conn);
+    return;
+  }
+
+  if (bytes_read == 0) {
+    /* Remotes keep their control connection open for the whole call, so this
+     * is how it normally ends */
+    GST_DEBUG ("Control connection closed by the remote");
+    ov_incoming_conn_free (conn);
+    return;
+  }
+
+  conn->msg = g_new0 (OvTcpMsg, 1);
+
+  if (bytes_read < OV_TCP_MSG_HEADER_SIZE ||
+      !ov_tcp_msg_parse_header (conn->msg, conn->header)) {
+    GST_ERROR ("Unable to read message length prefix, got EOS");
+    /* The stream can't be resynchronized, so just drop the connection */
+    ov_incoming_conn_free (conn);
+    return;
+  }
+
+  GST_DEBUG ("Incoming message type '%s' and version %u of length %u bytes",
+      ov_tcp_msg_type_to_string (conn->msg->type, conn->msg->version),
+      conn->msg->version, conn->msg->size);
+
+  if (conn->msg->size == 0) {
+    ov_incoming_conn_handle_msg (conn);
+    return;
+  }
+
+  /* Read the rest of the message */
+  if (conn->buffer->len < conn->msg->size)
+    g_byte_array_set_size (conn->buffer, conn->msg->size);
+  g_input_stream_read_all_async (input, conn->buffer->data, conn->msg->size,
+      G_PRIORITY_DEFAULT, conn->cancel,
+      (GAsyncReadyCallback) on_incoming_body_read, conn);
+}
+
+static void
+ov_incoming_conn_read_header (OvIncomingConn * conn)
+{
+  GInputStream *input;
+
+  input = g_io_stream_get_input_stream (G_IO_STREAM (conn->connection));
+  g_input_stream_read_all_async (input, conn->header, OV_TCP_MSG_HEADER_SIZE,
+      G_PRIORITY_DEFAULT, conn->cancel,
+      (GAsyncReadyCallback) on_incoming_header_read, conn);
+}
+
+/* Called from the TCP server's main context for each new connection. All
+ * reads and writes on it are asynchronous, so a slow or idle remote never
+ * holds up the others. */
+gboolean
+on_incoming_peer_tcp_connection (GSocketService * service,
+    GSocketConnection * connection, GObject * source_object G_GNUC_UNUSED,
+    OvLocalPeer * local)
+{
+  OvIncomingConn *conn;
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (local);
+
+  conn = g_new0 (OvIncomingConn, 1);
+  conn->local = local;
+  conn->connection = g_object_ref (connection);
+  conn->cancel = g_cancellable_new ();
+  conn->buffer = g_byte_array_new ();
+  priv->tcp_connections = g_list_prepend (priv->tcp_connections, conn);
+
+  ov_incoming_conn_read_header (conn);
+
+  return TRUE;
+}
+
+/* Called from the TCP server's main context. Stops accepting connections and
+ * cancels the ones that are open; the main loop is quit once they're all
+ * gone. */
+gboolean
+ov_local_peer_stop_tcp_server (OvLocalPeer * local)
+{
+  GList *l;
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (local);
+
+  g_signal_handlers_disconnect_by_data (priv->tcp_server, local);
+  g_socket_service_stop (priv->tcp_server);
+
+  for (l = priv->tcp_connections; l != NULL; l = l->next)
+    g_cancellable_cancel (((OvIncomingConn *) l->data)->cancel);
+
+  ov_local_peer_tcp_server_quit_if_idle (local);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called from the TCP server's main context. Quits its main loop once
+ * ov_local_peer_stop_tcp_server() has been called, the last connection is
+ * gone and the last one-way message has been sent (or given up on). */
+void
+ov_local_peer_tcp_server_quit_if_idle (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (local);
+
+  if (priv->tcp_connections == NULL && priv->tcp_one_way_sends == NULL &&
+      !g_socket_service_is_active (priv->tcp_server))
+    g_main_loop_quit (priv->tcp_loop);
 }
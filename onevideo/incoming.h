@@ -39,6 +39,9 @@ gboolean on_incoming_peer_tcp_connection (GSocketService *service,
                                           GObject *source_object,
                                           OvLocalPeer *local);
 
+gboolean ov_local_peer_stop_tcp_server   (OvLocalPeer *local);
+void     ov_local_peer_tcp_server_quit_if_idle (OvLocalPeer *local);
+
 G_END_DECLS
 
 #endif /* __OV_INCOMING_H__ */
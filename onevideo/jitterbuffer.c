@@ -0,0 +1,316 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "jitterbuffer.h"
+#include "ov-local-peer-priv.h"
+
+/* Adapts the jitterbuffer latency of each remote that has a latency range set
+ * with ov_remote_peer_set_latency_range(). Every interval we look at the
+ * interarrival jitter of its audio and video as estimated by the RTPSource of
+ * each stream, and at packets that arrived too late to be played:
+ *
+ * - A target of a few times the jitter is enough to absorb most of it
+ * - Late packets mean the jitter is burstier than that, so we grow right away
+ * - We grow to the target right away but shrink towards it slowly, since
+ *   shrinking too early makes us drop packets again
+ *
+ * The audio and video of a remote always use the same latency. rtpbin
+ * synchronises them with the RTCP SR timestamps, which only keeps them in
+ * lip-sync if both are delayed by the same amount. */
+
+/* Multiple of the jitter that we aim for */
+#define OV_JITTERBUFFER_JITTER_FACTOR   4
+/* Growth per interval in which packets arrived too late to be played */
+#define OV_JITTERBUFFER_LATE_FACTOR     1.5
+/* Fraction of the distance to the target that we shrink per interval */
+#define OV_JITTERBUFFER_SHRINK_DIVISOR  4
+
+typedef struct _OvJitterbuffer OvJitterbuffer;
+
+struct _OvJitterbuffer {
+  GstElement *element;
+  guint session;
+  guint ssrc;
+  /* num-late from the jitterbuffer stats at the last interval */
+  guint64 late;
+};
+
+static void
+ov_jitterbuffer_free (OvJitterbuffer * jb)
+{
+  gst_object_unref (jb->element);
+  g_free (jb);
+}
+
+/* Called from the streaming thread when rtpbin creates a jitterbuffer for a
+ * stream from this remote. Called with the local recv_lock TAKEN. */
+void
+ov_remote_peer_add_jitterbuffer (OvRemotePeer * remote, GstElement * element,
+    guint session, guint ssrc)
+{
+  OvJitterbuffer *jb;
+
+  jb = g_new0 (OvJitterbuffer, 1);
+  jb->element = gst_object_ref (element);
+  jb->session = session;
+  jb->ssrc = ssrc;
+  remote->priv->jitterbuffers = g_list_prepend (remote->priv->jitterbuffers,
+      jb);
+
+  g_object_set (element, "latency", remote->priv->latency, NULL);
+  GST_DEBUG ("New %s jitterbuffer for %s with SSRC %u and latency %ums",
+      OV_RTP_SESSION_TO_NAME (session), remote->addr_s, ssrc,
+      remote->priv->latency);
+}
+
+void
+ov_remote_peer_free_jitterbuffers (OvRemotePeer * remote)
+{
+  g_list_free_full (remote->priv->jitterbuffers,
+      (GDestroyNotify) ov_jitterbuffer_free);
+  remote->priv->jitterbuffers = NULL;
+}
+
+/* Returns the stats of the RTPSource of the stream in the rtpbin that the
+ * jitterbuffer is in, or NULL */
+static GstStructure *
+ov_jitterbuffer_get_source_stats (OvJitterbuffer * jb)
+{
+  GstObject *rtpbin;
+  GObject *rtpsession, *rtpsource;
+  GstStructure *stats;
+
+  rtpbin = gst_object_get_parent (GST_OBJECT (jb->element));
+  if (rtpbin == NULL)
+    return NULL;
+
+  g_signal_emit_by_name (rtpbin, "get-internal-session", jb->session,
+      &rtpsession);
+  gst_object_unref (rtpbin);
+  if (rtpsession == NULL)
+    return NULL;
+
+  g_signal_emit_by_name (rtpsession, "get-source-by-ssrc", jb->ssrc,
+      &rtpsource);
+  g_object_unref (rtpsession);
+  if (rtpsource == NULL)
+    return NULL;
+
+  g_object_get (rtpsource, "stats", &stats, NULL);
+  g_object_unref (rtpsource);
+  return stats;
+}
+
+/* Returns the jitter of the stream in milliseconds as estimated by its
+ * RTPSource */
+static guint
+ov_jitterbuffer_get_jitter (OvJitterbuffer * jb)
+{
+  guint jitter = 0;
+  gint clock_rate = 0;
+  GstStructure *stats;
+
+  stats = ov_jitterbuffer_get_source_stats (jb);
+  if (stats == NULL)
+    return 0;
+
+  gst_structure_get_uint (stats, "jitter", &jitter);
+  gst_structure_get_int (stats, "clock-rate", &clock_rate);
+  gst_structure_free (stats);
+
+  if (clock_rate <= 0)
+    return 0;
+  /* The jitter is in clock-rate units */
+  return (guint) (((guint64) jitter * 1000) / clock_rate);
+}
+
+/* Returns the RTPSource stats of the newest stream of @session that we're
+ * receiving from @remote, or NULL. @ssrc is set to its SSRC. Called with the
+ * lock TAKEN, but not the recv_lock. */
+GstStructure *
+ov_remote_peer_get_receive_stats (OvRemotePeer * remote, guint session,
+    guint * ssrc)
+{
+  GList *l;
+  OvJitterbuffer jb = {0};
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  /* See ov_jitterbuffer_adapt_remote() */
+  g_mutex_lock (&local_priv->recv_lock);
+  for (l = remote->priv->jitterbuffers; l != NULL; l = l->next) {
+    OvJitterbuffer *tmp = l->data;
+    if (tmp->session == session) {
+      jb = *tmp;
+      break;
+    }
+  }
+  g_mutex_unlock (&local_priv->recv_lock);
+
+  if (jb.element == NULL)
+    return NULL;
+
+  *ssrc = jb.ssrc;
+  return ov_jitterbuffer_get_source_stats (&jb);
+}
+
+/* Returns the number of packets that arrived too late to be played since the
+ * last interval */
+static guint64
+ov_jitterbuffer_get_new_late (OvJitterbuffer * jb)
+{
+  guint64 late = 0, new_late;
+  GstStructure *stats;
+
+  g_object_get (jb->element, "stats", &stats, NULL);
+  gst_structure_get_uint64 (stats, "num-late", &late);
+  gst_structure_free (stats);
+
+  new_late = late > jb->late ? late - jb->late : 0;
+  jb->late = late;
+  return new_late;
+}
+
+/* Called with the lock TAKEN */
+static void
+ov_jitterbuffer_adapt_remote (OvRemotePeer * remote)
+{
+  GList *l, *jbs;
+  guint jitter, target, latency;
+  guint64 late = 0;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  /* Getting the RTPSource takes the rtpbin lock, which is held while the
+   * jitterbuffers are added, so we can't hold the recv_lock for that. The
+   * jitterbuffers are only freed with the remote, which needs the local lock,
+   * so it's fine to use them after. */
+  g_mutex_lock (&local_priv->recv_lock);
+  jbs = g_list_copy (remote->priv->jitterbuffers);
+  g_mutex_unlock (&local_priv->recv_lock);
+
+  jitter = 0;
+  for (l = jbs; l != NULL; l = l->next) {
+    jitter = MAX (jitter, ov_jitterbuffer_get_jitter (l->data));
+    late += ov_jitterbuffer_get_new_late (l->data);
+  }
+  g_list_free (jbs);
+
+  latency = remote->priv->latency;
+  target = jitter * OV_JITTERBUFFER_JITTER_FACTOR;
+  if (late > 0)
+    target = MAX (target, (guint) (latency * OV_JITTERBUFFER_LATE_FACTOR) + 1);
+  target = CLAMP (target, remote->priv->min_latency, remote->priv->max_latency);
+
+  if (target > latency)
+    latency = target;
+  else if (target < latency)
+    latency -= MAX ((latency - target) / OV_JITTERBUFFER_SHRINK_DIVISOR, 1);
+
+  if (latency == remote->priv->latency)
+    return;
+
+  GST_DEBUG ("Jitterbuffer latency of %s: %ums -> %ums (jitter %ums, %"
+      G_GUINT64_FORMAT " late)", remote->addr_s, remote->priv->latency,
+      latency, jitter, late);
+  ov_remote_peer_apply_latency (remote, latency);
+}
+
+/* Called with the lock TAKEN */
+void
+ov_remote_peer_apply_latency (OvRemotePeer * remote, guint latency)
+{
+  GList *l;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+  remote->priv->latency = latency;
+
+  g_mutex_lock (&local_priv->recv_lock);
+  for (l = remote->priv->jitterbuffers; l != NULL; l = l->next)
+    g_object_set (((OvJitterbuffer *) l->data)->element, "latency", latency,
+        NULL);
+  g_mutex_unlock (&local_priv->recv_lock);
+}
+
+static gboolean
+ov_jitterbuffer_tick (OvLocalPeer * local)
+{
+  guint ii;
+  OvRemotePeer *remote;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    remote = g_ptr_array_index (priv->remote_peers, ii);
+    if (remote->state != OV_REMOTE_STATE_PLAYING ||
+        remote->priv->min_latency == remote->priv->max_latency)
+      continue;
+    ov_jitterbuffer_adapt_remote (remote);
+  }
+  ov_local_peer_unlock (local);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called with the lock TAKEN */
+void
+ov_jitterbuffer_start (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->jitterbuffer_timeout_id > 0)
+    return;
+
+  priv->jitterbuffer_timeout_id =
+    g_timeout_add_seconds (OV_JITTERBUFFER_INTERVAL_SECONDS,
+        (GSourceFunc) ov_jitterbuffer_tick, local);
+}
+
+/* Called with the lock TAKEN */
+void
+ov_jitterbuffer_stop (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->jitterbuffer_timeout_id == 0)
+    return;
+
+  g_source_remove (priv->jitterbuffer_timeout_id);
+  priv->jitterbuffer_timeout_id = 0;
+}
@@ -0,0 +1,58 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __OV_JITTERBUFFER_H__
+#define __OV_JITTERBUFFER_H__
+
+#include <gst/gst.h>
+
+#include "ov-local-peer.h"
+#include "ov-remote-peer.h"
+
+G_BEGIN_DECLS
+
+/* How often we adapt the jitterbuffer latency of the remotes */
+#define OV_JITTERBUFFER_INTERVAL_SECONDS 1
+
+void          ov_jitterbuffer_start               (OvLocalPeer *local);
+void          ov_jitterbuffer_stop                (OvLocalPeer *local);
+
+void          ov_remote_peer_add_jitterbuffer     (OvRemotePeer *remote,
+                                                   GstElement *element,
+                                                   guint session,
+                                                   guint ssrc);
+void          ov_remote_peer_free_jitterbuffers   (OvRemotePeer *remote);
+void          ov_remote_peer_apply_latency        (OvRemotePeer *remote,
+                                                   guint latency);
+GstStructure* ov_remote_peer_get_receive_stats    (OvRemotePeer *remote,
+                                                   guint session,
+                                                   guint *ssrc);
+
+G_END_DECLS
+
+#endif /* __OV_JITTERBUFFER_H__ */
@@ -0,0 +1,362 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "latency.h"
+
+#include <gst/rtp/gstrtpbuffer.h>
+
+/* Glass-to-glass latency: the time from a frame being captured by a remote
+ * till we hand it to playback, split into the stages that users can actually
+ * do something about.
+ *
+ * Every RTP packet we send carries its capture time as wall clock time in the
+ * OV_RTP_HDREXT_CAPTURE_TIME_ID header extension, along with how long it took
+ * to get from capture to the network. When receiving, we note when each frame
+ * arrives at the depayloader, leaves the decoder, and reaches the playback
+ * pipeline. Comparing the wall clocks of two machines only makes sense if
+ * both are synced with NTP, which is what we assume. */
+
+/* How far the PTS of a frame may drift while going through the decoder and
+ * still be matched with what went in. Audio decoders work out the timestamps
+ * of what they output themselves. */
+#define OV_LATENCY_PTS_TOLERANCE (5 * GST_MSECOND)
+
+/* Seconds between the NTP epoch (1900) and the UNIX epoch (1970) */
+#define OV_NTP_UNIX_OFFSET G_GUINT64_CONSTANT (2208988800)
+
+static guint64
+ov_real_time_to_ntp (gint64 real_time)
+{
+  return gst_util_uint64_scale (real_time + OV_NTP_UNIX_OFFSET *
+      G_USEC_PER_SEC, G_GUINT64_CONSTANT (1) << 32, G_USEC_PER_SEC);
+}
+
+static gint64
+ov_ntp_to_real_time (guint64 ntp)
+{
+  return gst_util_uint64_scale (ntp, G_USEC_PER_SEC,
+      G_GUINT64_CONSTANT (1) << 32) - OV_NTP_UNIX_OFFSET * G_USEC_PER_SEC;
+}
+
+/*-- SENDING --*/
+typedef struct {
+  gint64 now;
+  GstClockTime running_time;
+} OvCaptureTimeStamp;
+
+static gboolean
+ov_rtp_buffer_add_capture_time (GstBuffer ** buffer, guint idx,
+    OvCaptureTimeStamp * stamp)
+{
+  guint8 data[OV_RTP_HDREXT_CAPTURE_TIME_SIZE];
+  guint64 sent_us = 0;
+  GstClockTime pts;
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+  /* Our sources are live, so buffer timestamps are running times */
+  pts = GST_BUFFER_PTS (*buffer);
+  if (GST_CLOCK_TIME_IS_VALID (pts) && stamp->running_time > pts)
+    sent_us = (stamp->running_time - pts) / GST_USECOND;
+
+  GST_WRITE_UINT64_BE (data, ov_real_time_to_ntp (stamp->now - sent_us));
+  GST_WRITE_UINT32_BE (data + 8, MIN (sent_us, G_MAXUINT32));
+
+  *buffer = gst_buffer_make_writable (*buffer);
+  if (!gst_rtp_buffer_map (*buffer, GST_MAP_READWRITE, &rtp))
+    return TRUE;
+  if (!gst_rtp_buffer_add_extension_onebyte_header (&rtp,
+        OV_RTP_HDREXT_CAPTURE_TIME_ID, data, sizeof (data)))
+    GST_WARNING ("Unable to add capture time to RTP buffer");
+  gst_rtp_buffer_unmap (&rtp);
+
+  return TRUE;
+}
+
+static GstPadProbeReturn
+on_payloader_output (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GstClock *clock;
+  GstElement *payloader;
+  OvCaptureTimeStamp stamp;
+
+  payloader = GST_ELEMENT (GST_PAD_PARENT (pad));
+  clock = gst_element_get_clock (payloader);
+  if (clock == NULL)
+    return GST_PAD_PROBE_OK;
+  stamp.now = g_get_real_time ();
+  stamp.running_time = gst_clock_get_time (clock) -
+    gst_element_get_base_time (payloader);
+  gst_object_unref (clock);
+
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+
+    list = gst_buffer_list_make_writable (list);
+    gst_buffer_list_foreach (list,
+        (GstBufferListFunc) ov_rtp_buffer_add_capture_time, &stamp);
+    GST_PAD_PROBE_INFO_DATA (info) = list;
+  } else {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    ov_rtp_buffer_add_capture_time (&buffer, 0, &stamp);
+    GST_PAD_PROBE_INFO_DATA (info) = buffer;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Stamps the capture time into every RTP packet that @payloader outputs */
+void
+ov_element_add_capture_time (GstElement * payloader)
+{
+  GstPad *pad;
+
+  pad = gst_element_get_static_pad (payloader, "src");
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      on_payloader_output, NULL, NULL);
+  gst_object_unref (pad);
+}
+
+/*-- RECEIVING --*/
+static OvLatencyTracker *
+ov_latency_tracker_ref (OvLatencyTracker * tracker)
+{
+  g_atomic_int_inc (&tracker->ref_count);
+  return tracker;
+}
+
+void
+ov_latency_tracker_unref (OvLatencyTracker * tracker)
+{
+  if (!g_atomic_int_dec_and_test (&tracker->ref_count))
+    return;
+  g_mutex_clear (&tracker->lock);
+  g_free (tracker);
+}
+
+/* Called with the tracker lock TAKEN. The slot of the frame being tracked
+ * with the PTS closest to @pts, or -1 if there's none. */
+static gint
+ov_latency_tracker_find (OvLatencyTracker * tracker, GstClockTime pts)
+{
+  guint ii;
+  gint slot = -1;
+  GstClockTimeDiff diff, best = OV_LATENCY_PTS_TOLERANCE + 1;
+
+  for (ii = 0; ii < OV_LATENCY_TRACKER_SLOTS; ii++) {
+    if (!GST_CLOCK_TIME_IS_VALID (tracker->pts[ii]))
+      continue;
+    diff = ABS (GST_CLOCK_DIFF (tracker->pts[ii], pts));
+    if (diff < best) {
+      best = diff;
+      slot = ii;
+    }
+  }
+
+  return slot;
+}
+
+/* Packets of a frame can come as a list, and they all share its PTS. Returns
+ * the first or the @last one, or NULL if the list is empty. */
+static GstBuffer *
+ov_probe_info_get_buffer (GstPadProbeInfo * info, gboolean last)
+{
+  guint len;
+  GstBufferList *list;
+
+  if (!(GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST))
+    return GST_PAD_PROBE_INFO_BUFFER (info);
+
+  list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+  len = gst_buffer_list_length (list);
+  if (len == 0)
+    return NULL;
+  return gst_buffer_list_get (list, last ? len - 1 : 0);
+}
+
+static GstPadProbeReturn
+on_latency_received (GstPad * pad, GstPadProbeInfo * info,
+    OvLatencyTracker * tracker)
+{
+  gint slot;
+  guint size;
+  gpointer data;
+  gint64 now, captured, sent;
+  GstClockTime pts;
+  GstBuffer *buffer = ov_probe_info_get_buffer (info, TRUE);
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+  if (buffer == NULL)
+    return GST_PAD_PROBE_OK;
+
+  pts = GST_BUFFER_PTS (buffer);
+  if (!GST_CLOCK_TIME_IS_VALID (pts) ||
+      !gst_rtp_buffer_map (buffer, GST_MAP_READ, &rtp))
+    return GST_PAD_PROBE_OK;
+
+  if (!gst_rtp_buffer_get_extension_onebyte_header (&rtp,
+        OV_RTP_HDREXT_CAPTURE_TIME_ID, 0, &data, &size) ||
+      size < OV_RTP_HDREXT_CAPTURE_TIME_SIZE) {
+    gst_rtp_buffer_unmap (&rtp);
+    return GST_PAD_PROBE_OK;
+  }
+  captured = ov_ntp_to_real_time (GST_READ_UINT64_BE (data));
+  sent = captured + GST_READ_UINT32_BE ((guint8 *) data + 8);
+  gst_rtp_buffer_unmap (&rtp);
+
+  now = g_get_real_time ();
+
+  g_mutex_lock (&tracker->lock);
+  /* A frame has arrived when its last packet has; they all share the PTS */
+  slot = (tracker->next + OV_LATENCY_TRACKER_SLOTS - 1) %
+    OV_LATENCY_TRACKER_SLOTS;
+  if (tracker->pts[slot] != pts) {
+    /* Frames that never make it to playback get overwritten */
+    slot = tracker->next;
+    tracker->next = (tracker->next + 1) % OV_LATENCY_TRACKER_SLOTS;
+    tracker->pts[slot] = pts;
+    tracker->captured[slot] = captured;
+    tracker->sent[slot] = sent;
+    tracker->decoded[slot] = 0;
+  }
+  tracker->received[slot] = now;
+  g_mutex_unlock (&tracker->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_latency_decoded (GstPad * pad, GstPadProbeInfo * info,
+    OvLatencyTracker * tracker)
+{
+  gint slot;
+  GstClockTime pts;
+  GstBuffer *buffer = ov_probe_info_get_buffer (info, FALSE);
+
+  pts = buffer != NULL ? GST_BUFFER_PTS (buffer) : GST_CLOCK_TIME_NONE;
+  if (!GST_CLOCK_TIME_IS_VALID (pts))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&tracker->lock);
+  slot = ov_latency_tracker_find (tracker, pts);
+  if (slot >= 0 && tracker->decoded[slot] == 0)
+    tracker->decoded[slot] = g_get_real_time ();
+  g_mutex_unlock (&tracker->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_latency_playback (GstPad * pad, GstPadProbeInfo * info,
+    OvLatencyTracker * tracker)
+{
+  gint slot;
+  gint64 now;
+  OvLatencyTotals *t = &tracker->totals;
+  GstClockTime pts;
+  GstBuffer *buffer = ov_probe_info_get_buffer (info, FALSE);
+
+  pts = buffer != NULL ? GST_BUFFER_PTS (buffer) : GST_CLOCK_TIME_NONE;
+
+  if (!GST_CLOCK_TIME_IS_VALID (pts))
+    return GST_PAD_PROBE_OK;
+
+  now = g_get_real_time ();
+
+  g_mutex_lock (&tracker->lock);
+  slot = ov_latency_tracker_find (tracker, pts);
+  if (slot >= 0 && tracker->decoded[slot] > 0) {
+    t->frames++;
+    t->capture_us += tracker->sent[slot] - tracker->captured[slot];
+    /* Clocks that are out of sync can make this negative */
+    t->network_us += MAX (tracker->received[slot] - tracker->sent[slot], 0);
+    t->decode_us += MAX (tracker->decoded[slot] - tracker->received[slot], 0);
+    t->render_us += MAX (now - tracker->decoded[slot], 0);
+    tracker->pts[slot] = GST_CLOCK_TIME_NONE;
+  }
+  g_mutex_unlock (&tracker->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+ov_element_add_latency_probe (GstElement * element, const gchar * pad_name,
+    GstPadProbeCallback callback, OvLatencyTracker * tracker)
+{
+  GstPad *pad;
+
+  pad = gst_element_get_static_pad (element, pad_name);
+  /* Lists go through pads untouched by probes that only want buffers */
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, callback,
+      ov_latency_tracker_ref (tracker),
+      (GDestroyNotify) ov_latency_tracker_unref);
+  gst_object_unref (pad);
+}
+
+/* Tracks the frames going into @depayloader and coming out of @decoder. The
+ * pad probes keep the returned ref alive for as long as those are around. */
+OvLatencyTracker *
+ov_latency_tracker_new (GstElement * depayloader, GstElement * decoder)
+{
+  guint ii;
+  OvLatencyTracker *tracker;
+
+  tracker = g_new0 (OvLatencyTracker, 1);
+  tracker->ref_count = 1;
+  g_mutex_init (&tracker->lock);
+  for (ii = 0; ii < OV_LATENCY_TRACKER_SLOTS; ii++)
+    tracker->pts[ii] = GST_CLOCK_TIME_NONE;
+
+  ov_element_add_latency_probe (depayloader, "sink",
+      (GstPadProbeCallback) on_latency_received, tracker);
+  ov_element_add_latency_probe (decoder, "src",
+      (GstPadProbeCallback) on_latency_decoded, tracker);
+
+  return tracker;
+}
+
+/* Frames are done when they come out of @proxysrc in the playback pipeline */
+void
+ov_latency_tracker_add_playback (OvLatencyTracker * tracker,
+    GstElement * proxysrc)
+{
+  ov_element_add_latency_probe (proxysrc, "src",
+      (GstPadProbeCallback) on_latency_playback, tracker);
+}
+
+void
+ov_latency_tracker_get (OvLatencyTracker * tracker, OvLatencyTotals * totals)
+{
+  g_mutex_lock (&tracker->lock);
+  *totals = tracker->totals;
+  g_mutex_unlock (&tracker->lock);
+}
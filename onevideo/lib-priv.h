@@ -29,6 +29,7 @@
 #define __OV_LIB_PRIV_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <gst/gst.h>
 
 #ifdef __APPLE__
@@ -49,6 +50,34 @@ GST_DEBUG_CATEGORY_EXTERN (onevideo_debug);
 
 #define RTP_DEFAULT_LATENCY_MS 10
 
+/* Quality used by jpegenc when encoding raw video; congestion control scales
+ * it down from here when the network can't keep up */
+#define OV_JPEG_ENCODE_QUALITY 30
+
+/* Keyframe requests from remotes that arrive sooner than this after the last
+ * one are dropped, in microseconds */
+#define OV_KEYFRAME_REQUEST_MIN_INTERVAL (500 * G_TIME_SPAN_MILLISECOND)
+
+/* How often the rtpbins send RTCP at least, in nanoseconds. The remotes
+ * notice that we're gone when they don't get any for a while, so this is a lot
+ * shorter than the default of 5 seconds; see
+ * ov_local_peer_set_remote_timeout() */
+#define OV_RTCP_MIN_INTERVAL (500 * GST_MSECOND)
+
+/* The default buffer size for kernel-side UDP send/recv buffers varies
+ * between operating systems and installations. It's not unusual that
+ * these are smaller than the size of a single jpeg from a HD webcam,
+ * which is a problem, so try to make them larger if possible at all. */
+#define OV_VIDEO_SEND_BUFSIZE (2 * 1024 * 1024)
+#define OV_VIDEO_RECV_BUFSIZE (2 * 1024 * 1024)
+
+/* The ports on the multicast group of a call that senders are given, 4 apart
+ * with audio RTP on the port and video RTP 2 above it; see
+ * ov_local_peer_set_multicast_media(). Each call starts at one of the 64-port
+ * blocks above OV_MULTICAST_MEDIA_PORT, picked from its call id. */
+#define OV_MULTICAST_MEDIA_PORT 5400
+#define OV_MULTICAST_MEDIA_PORT_BLOCKS 256
+
 /* We force the same raw audio format everywhere */
 #define AUDIO_CAPS_STR "format=S16LE, channels=2, rate=48000, layout=interleaved"
 /* This is only used for the test video source since we need both width and
@@ -65,6 +94,16 @@ GST_DEBUG_CATEGORY_EXTERN (onevideo_debug);
 #define RTP_JPEG_VIDEO_CAPS_STR "application/x-rtp, payload=26, media=video, clock-rate=90000, encoding-name=JPEG"
 #define RTP_H264_VIDEO_CAPS_STR "application/x-rtp, payload=96, media=video, clock-rate=90000, encoding-name=H264"
 
+/* Payload types used for repairing lost video packets; see OvRtpRepair. RTX
+ * needs one for each video format so the receiver can map them back. */
+#define RTP_H264_RTX_PT                 97
+#define RTP_JPEG_RTX_PT                 98
+#define RTP_RED_RTX_PT                  99
+#define RTP_RED_PT                      100
+#define RTP_ULPFEC_PT                   101
+/* Percentage of FEC overhead when congestion control isn't adapting it */
+#define OV_FEC_DEFAULT_PERCENTAGE       10
+
 /* For simplicity, we always use 0 for audio RTP sessions and 1 for video
  * XXX: These are also used as indices for the ssrc[] arrays on OvLocalPeerPriv
  * and OvRemotePeerPriv, so keep them within the range */
@@ -101,7 +140,124 @@ enum _OvVideoFormat {
    * Video sources will usually support combinations of these */
   OV_VIDEO_FORMAT_YUY2        = 1 << 2, /* Fallback if JPEG/H264 are not supported */
   OV_VIDEO_FORMAT_JPEG        = 1 << 3, /* Almost every webcam should support this */
-  OV_VIDEO_FORMAT_H264        = 1 << 4, /* Not supported yet */
+  OV_VIDEO_FORMAT_H264        = 1 << 4, /* Passthrough, or encoded from YUY2/TEST */
+};
+
+typedef struct _OvFrameTimer OvFrameTimer;
+
+/* Frames in flight inside an element that we can time at once */
+#define OV_FRAME_TIMER_SLOTS 8
+
+/* Times how long an element takes for each frame by matching the PTS of the
+ * buffers that come out of it with the ones that went in. Refcounted since
+ * the pad probes of the element hold a ref too; see
+ * ov_element_add_frame_timer() */
+struct _OvFrameTimer {
+  gint ref_count;
+  GMutex lock;
+  GstClockTime pts[OV_FRAME_TIMER_SLOTS];
+  gint64 start[OV_FRAME_TIMER_SLOTS];
+  guint next;
+  /* Frames timed and their total time in microseconds */
+  guint64 frames;
+  guint64 total_us;
+};
+
+/* One-byte RTP header extension (RFC 5285) that we put the capture time of
+ * every packet we send in: the 64-bit NTP wall clock time at which it was
+ * captured, followed by the 32-bit number of microseconds it spent in our
+ * transmit pipeline before being sent. Receivers that don't know about it
+ * ignore it, so it's not negotiated. See latency.c */
+#define OV_RTP_HDREXT_CAPTURE_TIME_ID 1
+#define OV_RTP_HDREXT_CAPTURE_TIME_SIZE 12
+
+typedef struct _OvLatencyTotals OvLatencyTotals;
+
+/* Frames that made it to playback and how long they spent in each stage in
+ * total, in microseconds */
+struct _OvLatencyTotals {
+  guint64 frames;
+  /* From capture till it was sent by the remote */
+  guint64 capture_us;
+  /* Over the network and through our jitterbuffer */
+  guint64 network_us;
+  /* Depayloading and decoding */
+  guint64 decode_us;
+  /* Till it was handed to the playback pipeline */
+  guint64 render_us;
+};
+
+typedef struct _OvLatencyTracker OvLatencyTracker;
+
+/* Frames between the depayloader and playback that we can track at once */
+#define OV_LATENCY_TRACKER_SLOTS 16
+
+/* Follows the frames received from a remote from the depayloader through the
+ * decoder till they're handed to playback, by PTS, and adds up how long each
+ * stage took in microseconds. Refcounted like OvFrameTimer. */
+struct _OvLatencyTracker {
+  gint ref_count;
+  GMutex lock;
+  GstClockTime pts[OV_LATENCY_TRACKER_SLOTS];
+  /* Wall clock times of each stage; see OV_RTP_HDREXT_CAPTURE_TIME_ID */
+  gint64 captured[OV_LATENCY_TRACKER_SLOTS];
+  gint64 sent[OV_LATENCY_TRACKER_SLOTS];
+  gint64 received[OV_LATENCY_TRACKER_SLOTS];
+  gint64 decoded[OV_LATENCY_TRACKER_SLOTS];
+  guint next;
+  OvLatencyTotals totals;
+};
+
+typedef struct _OvRecording OvRecording;
+
+/* Muxes the compressed audio and video that a pipeline sends or receives into
+ * files in the recording directory, from tees in front of the payloaders or
+ * behind the depayloaders. See recording.c */
+struct _OvRecording {
+  /* The pipeline or bin that the recording is in */
+  GstElement *bin;
+  GstElement *splitmux;
+  /* Sink pads of the queues of the {audio, video} branches, which get EOS
+   * when the recording stops */
+  GstPad *sinkpads[2];
+  /* The muxer and the elements of the branches to it, which keep running
+   * after the pipeline stops till the file has been finished */
+  GPtrArray *elements;
+  /* Set once the file being written has been finished after stopping */
+  GMutex lock;
+  GCond cond;
+  gboolean stopping;
+  gboolean finished;
+};
+
+typedef enum _OvRtpRepair OvRtpRepair;
+
+/* Ways in which lost video RTP packets can be repaired. Whether the receivers
+ * support them is negotiated as boolean fields on the video caps exchanged in
+ * REPLY_CAPS and CALL_DETAILS; see ov_caps_take_rtp_repair() */
+enum _OvRtpRepair {
+  OV_RTP_REPAIR_NONE          = 0,
+  /* Retransmission of the packets NACKed by receivers (RFC 4588); the
+   * "rtx" caps field */
+  OV_RTP_REPAIR_RTX           = 1 << 0,
+  /* ULPFEC forward error correction (RFC 5109) inside RED (RFC 2198); the
+   * "ulpfec" caps field */
+  OV_RTP_REPAIR_ULPFEC        = 1 << 1,
+};
+
+typedef enum _OvLivenessEvent OvLivenessEvent;
+
+/* What the rtpbins that receive from a remote tell us about it from their
+ * streaming threads; see ov_remote_peer_liveness_event() */
+enum _OvLivenessEvent {
+  /* Just look at how long ago we last heard from it */
+  OV_LIVENESS_CHECK           = 0,
+  /* It sent an RTCP BYE, so it has left the call */
+  OV_LIVENESS_BYE             = 1 << 0,
+  /* It stopped sending video RTP, but still sends RTCP */
+  OV_LIVENESS_STALLED         = 1 << 1,
+  /* Its video RTP is arriving again after having stalled */
+  OV_LIVENESS_RESUMED         = 1 << 2,
 };
 
 struct _OvRemotePeerPrivate {
@@ -125,16 +281,124 @@ struct _OvRemotePeerPrivate {
    * {audio_ssrc, video_ssrc} */
   guint ssrcs[2];
 
+  /* The simulcast video layer that we send to this remote */
+  guint video_layer;
+  /* The highest quality that this remote told us it shows our video at with
+   * VIDEO_VIEW; OV_VIDEO_QUALITY_INVALID if it has no limit */
+  OvVideoQuality send_view_quality;
+
+  /* The port on the multicast group of the call that this remote sends its
+   * audio RTP to, with video RTP 2 above it; 0 if it sends to recv_ports */
+  guint16 recv_multicast_port;
+
+  /* Whether this remote forwards our RTP to the others instead of us sending
+   * it to them, and doesn't send any media of its own; see relay.c */
+  gboolean is_relay;
+  /* When we're the relay: the multiudpsinks that forward the {audio, video}
+   * RTP of this remote, and the ports that each of the other remotes receives
+   * it on. Format: {OvRemotePeer *to: guint16 ports[2]} */
+  GstElement *relay_sinks[2];
+  GHashTable *relay_dests;
+
+  /*-- Control connection --*/
+  /* TCP connection that we send all our OvTcpMsgs to this remote on. It's
+   * opened with the first request (usually START_NEGOTIATE) and kept till the
+   * remote is freed. control_thread reads the replies and hands them to the
+   * waiting requests via control_pending, matching them by id.
+   * control_lock protects all of these. */
+  GMutex control_lock;
+  GCond control_cond;
+  GSocketConnection *control;
+  GCancellable *control_cancel;
+  GThread *control_thread;
+  /* Set by control_thread when the remote closes the connection */
+  gboolean control_closed;
+  /* Incremented every time a connection is torn down, so requests can tell
+   * that the connection they were sent on is gone */
+  guint control_generation;
+  /* guint64 request id -> OvTcpMsg reply (NULL till it arrives) */
+  GHashTable *control_pending;
+  /* Monotonic times at which the control connection was last opened; for
+   * tracing negotiation */
+  gint64 control_connect_start;
+  gint64 control_connect_end;
+
   /*-- Receive pipeline --*/
   /* The format that we will receive data in from this peer */
   GstCaps *recv_acaps;
   GstCaps *recv_vcaps;
+  /* How the video from this peer can be repaired when packets are lost */
+  OvRtpRepair recv_repair;
+  /* Whether it sends Opus DTX, i.e. tiny frames now and then while silent */
+  gboolean recv_dtx;
+  /* What it offered to receive in its REPLY_CAPS {acaps, vcaps}, without the
+   * multicast and DTX flags, and whether it can receive DTX. Only kept by the
+   * negotiator of the call to decide what a peer that joins it later can
+   * send; see ov_local_peer_call_add_remote() */
+  GstCaps *offered_recv_caps[2];
+  gboolean offered_recv_dtx;
+  /* Set when it joins a call that we're already sending in, and cleared once
+   * we hear from it and send it a keyframe so it can start decoding. Atomic,
+   * since it's cleared from a streaming thread */
+  gint needs_keyframe;
+  /* Loudest audio decoded since the last active speaker check, in dBov; set
+   * from the decoder's streaming thread with atomics. audio_level is the
+   * level seen by the check, which decays slowly. See speaker.c */
+  gint audio_peak;
+  gint audio_level;
+  /* We stop mixing this remote once its audio has been silent up to here;
+   * only touched from the decoder's streaming thread */
+  GstClockTime audio_hangover_end;
   /* Pre-depayloader queues */
   GstElement *aqueue;
   GstElement *vqueue;
+  /* Merges the streams of all the simulcast layers this remote can switch
+   * between (each has its own SSRC) in front of vqueue */
+  GstElement *vfunnel;
   /* Depayloaders */
   GstElement *adepay;
   GstElement *vdepay;
+  /* Video decoder; see _ov_gst_get_video_decoder_name() */
+  GstElement *vdecode;
+  /* Queue in front of vdecode that gives it a thread of its own, or NULL;
+   * see ov_local_peer_set_thread_layout() */
+  GstElement *vdecqueue;
+  /* Parser (or identity) between vdepay and vdecode */
+  GstElement *vparse;
+  /* What we record of what this remote sends us, if anything. The RTP of
+   * hidden video can't be dropped before vdepay then, so it's dropped in
+   * front of vparse. See recording.c */
+  OvRecording *recording;
+  /* How long vdecode takes per frame */
+  OvFrameTimer *decode_timer;
+  /* Glass-to-glass latency of what we play back; {audio, video} */
+  OvLatencyTracker *latency_trackers[2];
+  /* Jitterbuffer latency bounds in ms; it's adapted between them if they
+   * differ. See ov_remote_peer_set_latency_range() and jitterbuffer.c */
+  guint min_latency;
+  guint max_latency;
+  /* Latency currently set on all our jitterbuffers, in ms */
+  guint latency;
+  /* The jitterbuffers of all our streams, protected by the local recv_lock
+   * since they're added from streaming threads */
+  GList *jitterbuffers;
+  /* Set when the application isn't showing this remote's video; we drop its
+   * RTP in front of vdepay with vdrop_probe so nothing gets decoded. See
+   * ov_remote_peer_set_video_visible() */
+  gboolean video_hidden;
+  gulong vdrop_probe;
+  /* Wakes up on the default main context when we haven't heard from this
+   * remote for the local remote_timeout, or when liveness_events (atomic
+   * OvLivenessEvent flags) are set. While its video is stalled, its RTP is
+   * dropped in front of vdepay with vstall_probe, which asks for the stall to
+   * be lifted once it sees RTP again. See ov_remote_peer_watch_liveness() */
+  GSource *liveness_source;
+  guint liveness_events;
+  gboolean video_stalled;
+  gulong vstall_probe;
+  /* What the remote told us it has stopped sending with MUTE_MEDIA, indexed
+   * by RTP session. Its video is dropped in the same way while it's muted. */
+  gboolean recv_muted[2];
   /* Audio/Video proxysinks */
   GstElement *audio_proxysink;
   GstElement *video_proxysink;
@@ -148,12 +412,46 @@ struct _OvRemotePeerPrivate {
   GstElement *video_proxysrc;
   /* Video sink */
   GstElement *video_sink;
+  /* Where our video is in the compositor's output: {x, y, width, height}
+   * Unset (0 width) means the compositor's default of (0, 0) at full size */
+  gint video_rect[4];
+  /* How big the application shows this remote's video: {width, height}, 0 if
+   * it hasn't told us. What that asks of the remote was last sent to it as
+   * recv_view_quality; see ov_remote_peer_update_video_view() */
+  guint view_size[2];
+  OvVideoQuality recv_view_quality;
+
+  /* While a thread uses this remote with the local lock released, for
+   * instance in a fanout, it holds it with ov_remote_peer_hold(), and
+   * ov_remote_peer_free() only sets free_pending; the last
+   * ov_remote_peer_release() frees it then. Protected by the local lock */
+  guint holds;
+  gboolean free_pending;
 };
 
 /* OvVideoFormat is not a public symbol */
 GstCaps*        ov_video_format_to_caps (OvVideoFormat format);
 OvVideoFormat   ov_caps_to_video_format (const GstCaps *caps);
 gboolean        _ov_opengl_is_mesa      (void);
+const gchar*    _ov_gst_get_h264_encoder_name (void);
+const gchar*    _ov_gst_get_video_decoder_name (OvVideoFormat format);
+
+OvRtpRepair     _ov_gst_get_rtp_repair  (gboolean send);
+GstCaps*        ov_caps_with_rtp_repair (const GstCaps *caps,
+                                         OvRtpRepair repair);
+OvRtpRepair     ov_caps_take_rtp_repair (GstCaps **caps);
+GstCaps*        ov_caps_with_flag       (const GstCaps *caps,
+                                         const gchar *field);
+gboolean        ov_caps_take_flag       (GstCaps **caps,
+                                         const gchar *field);
+GstCaps*        ov_caps_with_multicast  (const GstCaps *caps,
+                                         const gchar *group,
+                                         guint16 port);
+gboolean        ov_caps_take_multicast  (GstCaps **caps,
+                                         gchar **group,
+                                         guint16 *port);
+GstCaps*        ov_caps_rename_structures (const GstCaps *caps,
+                                           const gchar *name);
 
 G_END_DECLS
 
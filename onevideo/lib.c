@@ -29,7 +29,18 @@
 #include "comms.h"
 #include "utils.h"
 #include "outgoing.h"
+#include "incoming.h"
 #include "discovery.h"
+#include "congestion.h"
+#include "jitterbuffer.h"
+#include "stats.h"
+#include "latency.h"
+#include "trace.h"
+#include "devicecaps.h"
+#include "relay.h"
+#include "speaker.h"
+#include "threads.h"
+#include "recording.h"
 
 #include "ov-local-peer.h"
 #include "ov-local-peer-priv.h"
@@ -44,9 +55,6 @@ static gboolean ov_local_peer_begin_transmit (OvLocalPeer *local);
 
 #define on_remote_receive_error ov_on_gst_bus_error
 
-/* Default timeout for remote peers */
-#define OV_REMOTE_PEER_TIMEOUT_SECONDS 10
-
 static void
 ov_local_peer_clear_transmit (OvLocalPeerPrivate * priv)
 {
@@ -57,11 +65,35 @@ ov_local_peer_clear_transmit (OvLocalPeerPrivate * priv)
   priv->vsend_rtp_sink = NULL;
   priv->vsend_rtcp_sink = NULL;
   priv->vrecv_rtcp_src = NULL;
+  memset (priv->capture_srcs, 0, sizeof (priv->capture_srcs));
+  memset (priv->capture_mute_probes, 0, sizeof (priv->capture_mute_probes));
+  priv->fec_encoder = NULL;
+  g_clear_pointer (&priv->encode_timer, ov_frame_timer_unref);
+  memset (priv->video_layers, 0, sizeof (priv->video_layers));
+  priv->n_active_video_layers = 0;
   priv->ssrcs[OV_VIDEO_RTP_SESSION] = 0;
   priv->ssrcs[OV_AUDIO_RTP_SESSION] = 0;
+  priv->transmit_warm = FALSE;
+  g_clear_pointer (&priv->warm_acaps, gst_caps_unref);
+  g_clear_pointer (&priv->warm_vcaps, gst_caps_unref);
+  priv->warm_repair = OV_RTP_REPAIR_NONE;
+  g_clear_pointer (&priv->recording, ov_recording_free);
   g_clear_object (&priv->transmit);
 }
 
+/* Waits till the transmit pipeline has been set to PLAYING if that's being
+ * done ahead of the call. The thread doesn't take the lock, so this may be
+ * called with the lock TAKEN */
+static void
+ov_local_peer_join_warm_transmit (OvLocalPeerPrivate * priv)
+{
+  if (priv->warm_thread == NULL)
+    return;
+
+  g_thread_join (priv->warm_thread);
+  priv->warm_thread = NULL;
+}
+
 static void
 ov_local_peer_stop_transmit (OvLocalPeer * local)
 {
@@ -70,22 +102,58 @@ ov_local_peer_stop_transmit (OvLocalPeer * local)
 
   priv = ov_local_peer_get_private (local);
 
+  ov_congestion_stop (local);
+  /* The next call starts from whatever quality it negotiates */
+  priv->cc.max_quality = OV_VIDEO_QUALITY_INVALID;
+  priv->view_quality = OV_VIDEO_QUALITY_INVALID;
+
+  ov_local_peer_join_warm_transmit (priv);
+  if (priv->recording != NULL)
+    ov_recording_stop (g_steal_pointer (&priv->recording));
   if (priv->transmit != NULL) {
     ret = gst_element_set_state (priv->transmit, GST_STATE_NULL);
     g_assert (ret == GST_STATE_CHANGE_SUCCESS);
   }
-  /* Each call has a new transmit pipeline */
+  /* Each call has a new transmit pipeline unless it's kept warm */
   ov_local_peer_clear_transmit (priv);
   /* Clear capsfilter for new pipeline */
   g_object_set (priv->transmit_vcapsfilter, "caps", NULL, NULL);
   GST_DEBUG ("Stopped transmitting");
 }
 
+/* Keeps the transmit pipeline running after a call for the next one, sending
+ * nowhere. Called with the lock TAKEN */
+static void
+ov_local_peer_idle_transmit (OvLocalPeer * local)
+{
+  guint ii;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_congestion_stop (local);
+  priv->cc.max_quality = OV_VIDEO_QUALITY_INVALID;
+  priv->view_quality = OV_VIDEO_QUALITY_INVALID;
+
+  g_object_set (priv->asend_rtp_sink, "clients", "", NULL);
+  g_object_set (priv->asend_rtcp_sink, "clients", "", NULL);
+  /* Layer 0 is vsend_rtp_sink */
+  for (ii = 0; ii < priv->n_active_video_layers; ii++)
+    g_object_set (priv->video_layers[ii].sink, "clients", "", NULL);
+  g_object_set (priv->vsend_rtcp_sink, "clients", "", NULL);
+
+  priv->transmit_warm = TRUE;
+  GST_DEBUG ("Kept transmit pipeline running for the next call");
+}
+
 static void
 ov_local_peer_clear_playback (OvLocalPeerPrivate * priv)
 {
   priv->audiosink = NULL;
   priv->audiomixer = NULL;
+  priv->video_compositor = NULL;
+  /* A new sink is needed for every call, like with ov_remote_peer_add_gtksink */
+  g_clear_object (&priv->video_compositor_sink);
   g_clear_object (&priv->playback);
 }
 
@@ -102,40 +170,55 @@ ov_local_peer_stop_playback (OvLocalPeer * local)
   GST_DEBUG ("Stopped playback");
 }
 
-static gint
-compare_uint16s (const void * a, const void * b)
-{
-  return (*(const guint16*)a - *(const guint16*)b);
-}
-
-/* Called with the lock TAKEN */
-static gboolean
-set_free_recv_ports (OvLocalPeer * local, guint16 (*recv_ports)[4])
+/* Called after all the remotes have been removed from priv->receive */
+static void
+ov_local_peer_stop_receive (OvLocalPeer * local)
 {
-  guint ii, start;
+  GstStateChangeReturn ret;
   OvLocalPeerPrivate *priv;
 
   priv = ov_local_peer_get_private (local);
+  if (priv->receive == NULL)
+    return;
+
+  ret = gst_element_set_state (priv->receive, GST_STATE_NULL);
+  g_assert (ret == GST_STATE_CHANGE_SUCCESS);
+  priv->recv_rtpbin = NULL;
+  priv->recv_rtcp_sinks[OV_AUDIO_RTP_SESSION] = NULL;
+  priv->recv_rtcp_sinks[OV_VIDEO_RTP_SESSION] = NULL;
+  g_clear_object (&priv->receive);
+
+  g_mutex_lock (&priv->recv_lock);
+  g_hash_table_remove_all (priv->recv_ssrcs);
+  g_hash_table_remove_all (priv->recv_remotes);
+  g_mutex_unlock (&priv->recv_lock);
+  GST_DEBUG ("Stopped shared receive");
+}
 
-  /* Start from the port right after the video RTCP recv port */
-  start = 1 + priv->recv_rtcp_ports[1];
+/* Reserves the ports that we receive from @remote on, unless that has already
+ * been done. With a shared receive pipeline, everyone sends to the same ports,
+ * so there's nothing to reserve. Returns FALSE and sets @error if there are no
+ * free ports, in which case @remote can't be in a call.
+ *
+ * Called with the lock TAKEN */
+gboolean
+ov_remote_peer_reserve_recv_ports (OvRemotePeer * remote, GError ** error)
+{
+  OvLocalPeerPrivate *local_priv;
 
-  g_array_sort (priv->used_ports, compare_uint16s);
+  local_priv = ov_local_peer_get_private (remote->local);
 
-  /* Recv ports are always in contiguous sets of 4, so if we
-   * find a hole in the sorted list of used ports, it has 4 unused ports */
-  for (ii = 0; ii < priv->used_ports->len; ii++)
-    if (g_array_index (priv->used_ports, guint16, ii) == start)
-      start++;
-    else
-      break;
+  if (local_priv->shared_receive) {
+    memcpy (remote->priv->recv_ports, local_priv->shared_recv_ports,
+        sizeof (remote->priv->recv_ports));
+    return TRUE;
+  }
 
-  /* TODO: Check whether these ports are actually available on the system */
+  if (remote->priv->recv_ports[0] > 0)
+    return TRUE;
 
-  for (ii = 0; ii < 4; ii++)
-    (*recv_ports)[ii] = start + ii;
-  g_array_append_vals (priv->used_ports, recv_ports, 4);
-  return TRUE;
+  return ov_socket_pool_reserve (local_priv->socket_pool,
+      &remote->priv->recv_ports, error);
 }
 
 OvRemotePeer *
@@ -143,8 +226,10 @@ ov_remote_peer_new (OvLocalPeer * local, GInetSocketAddress * addr)
 {
   gchar *name;
   GstBus *bus;
-  gboolean ret;
+  gboolean shared;
   OvRemotePeer *remote;
+  OvLocalPeerPrivate *local_priv;
+  GError *error = NULL;
 
   remote = g_new0 (OvRemotePeer, 1);
   remote->state = OV_REMOTE_STATE_NULL;
@@ -152,11 +237,14 @@ ov_remote_peer_new (OvLocalPeer * local, GInetSocketAddress * addr)
   remote->addr = g_object_ref (addr);
   remote->addr_s = ov_inet_socket_address_to_string (remote->addr);
 
-  name = g_strdup_printf ("receive-%s", remote->addr_s);
-  remote->receive = gst_object_ref_sink (gst_pipeline_new (name));
-  g_free (name);
-
   remote->priv = g_new0 (OvRemotePeerPrivate, 1);
+  g_mutex_init (&remote->priv->control_lock);
+  g_cond_init (&remote->priv->control_cond);
+  remote->priv->control_pending = g_hash_table_new_full (g_int64_hash,
+      g_int64_equal, g_free, NULL);
+  remote->priv->min_latency = RTP_DEFAULT_LATENCY_MS;
+  remote->priv->max_latency = RTP_DEFAULT_LATENCY_MS;
+  remote->priv->latency = RTP_DEFAULT_LATENCY_MS;
   name = g_strdup_printf ("audio-playback-bin-%s", remote->addr_s);
   remote->priv->aplayback = gst_bin_new (name);
   g_free (name);
@@ -164,24 +252,41 @@ ov_remote_peer_new (OvLocalPeer * local, GInetSocketAddress * addr)
   remote->priv->vplayback = gst_bin_new (name);
   g_free (name);
 
-  /* We need a lock for set_free_recv_ports() which manipulates
-   * local->priv->used_ports */
   ov_local_peer_lock (local);
-  ret = set_free_recv_ports (local, &remote->priv->recv_ports);
-  g_assert (ret);
+  local_priv = ov_local_peer_get_private (local);
+  shared = local_priv->shared_receive;
+  if (!ov_remote_peer_reserve_recv_ports (remote, &error)) {
+    /* The ports stay 0; this is tried again when negotiating, which fails if
+     * they still can't be reserved */
+    GST_WARNING ("Unable to reserve ports to receive from %s: %s",
+        remote->addr_s, error->message);
+    g_clear_error (&error);
+  }
   ov_local_peer_unlock (local);
 
-  /* Use the system clock and explicitly reset the base/start times to ensure
-   * that all the pipelines started by us have the same base/start times */
-  gst_pipeline_use_clock (GST_PIPELINE (remote->receive),
-      gst_system_clock_obtain());
-  gst_element_set_base_time (remote->receive, 0);
-
-  bus = gst_pipeline_get_bus (GST_PIPELINE (remote->receive));
-  gst_bus_add_signal_watch (bus);
-  g_signal_connect (bus, "message::error",
-      G_CALLBACK (on_remote_receive_error), remote);
-  g_object_unref (bus);
+  name = g_strdup_printf ("receive-%s", remote->addr_s);
+  if (shared) {
+    /* Only holds the decoders; it's added to the shared receive pipeline */
+    remote->receive = gst_object_ref_sink (gst_bin_new (name));
+  } else {
+    remote->receive = gst_object_ref_sink (gst_pipeline_new (name));
+
+    /* Use the system clock and explicitly reset the base/start times to
+     * ensure that all the pipelines started by us have the same base/start
+     * times */
+    gst_pipeline_use_clock (GST_PIPELINE (remote->receive),
+        gst_system_clock_obtain());
+    gst_element_set_base_time (remote->receive, 0);
+
+    bus = gst_pipeline_get_bus (GST_PIPELINE (remote->receive));
+    gst_bus_add_signal_watch (bus);
+    g_signal_connect (bus, "message::error",
+        G_CALLBACK (on_remote_receive_error), remote);
+    g_object_unref (bus);
+    ov_local_peer_watch_threads (local, remote->receive,
+        OV_THREAD_ROLE_RECEIVE);
+  }
+  g_free (name);
 
   remote->state = OV_REMOTE_STATE_ALLOCATED;
 
@@ -282,6 +387,127 @@ _ov_opengl_is_mesa (void)
 #endif
 }
 
+/* H.264 encoders that we know how to configure for low-latency, in order of
+ * preference. Hardware encoders come first; x264enc is the fallback. */
+static const gchar *h264_encoders[] = {
+  "vaapih264enc",
+  "v4l2h264enc",
+  "vtenc_h264",
+  "nvh264enc",
+  "x264enc",
+  NULL
+};
+
+/* Decoders for each video format that we receive, in order of preference.
+ * Hardware decoders come first; the software decoder is the last resort. All
+ * of these can output to GL or DMABuf memory when the sink supports it, so
+ * with gtkglsink/glimagesink the frames never go through system memory. */
+static const gchar *h264_decoders[] = {
+  "vah264dec",
+  "vaapih264dec",
+  "nvh264dec",
+  "v4l2slh264dec",
+  "v4l2h264dec",
+  "vtdec_hw",
+  "d3d11h264dec",
+  "avdec_h264",
+  "openh264dec",
+  NULL
+};
+
+static const gchar *jpeg_decoders[] = {
+  "vajpegdec",
+  "vaapijpegdec",
+  "nvjpegdec",
+  "v4l2jpegdec",
+  "jpegdec",
+  NULL
+};
+
+/* Returns the first element in @names that can be created and can go to
+ * READY, or NULL if none of them can */
+static const gchar *
+ov_gst_probe_element_names (const gchar ** names)
+{
+  guint ii;
+
+  for (ii = 0; names[ii] != NULL; ii++) {
+    GstElement *element;
+    GstStateChangeReturn ret;
+
+    element = gst_element_factory_make (names[ii], NULL);
+    if (element == NULL)
+      continue;
+
+    /* Hardware codecs can be installed without the hardware being present or
+     * usable; they will fail to open the device when going to READY */
+    ret = gst_element_set_state (element, GST_STATE_READY);
+    gst_element_set_state (element, GST_STATE_NULL);
+    gst_object_unref (element);
+
+    if (ret == GST_STATE_CHANGE_FAILURE) {
+      GST_DEBUG ("%s is not usable", names[ii]);
+      continue;
+    }
+
+    return names[ii];
+  }
+
+  return NULL;
+}
+
+/* Returns the name of the best usable H.264 encoder, or NULL if none were
+ * found. The result is probed once and cached. */
+const gchar *
+_ov_gst_get_h264_encoder_name (void)
+{
+  static gsize probed = 0;
+  static const gchar *name = NULL;
+
+  if (g_once_init_enter (&probed)) {
+    name = ov_gst_probe_element_names (h264_encoders);
+
+    if (name != NULL)
+      GST_DEBUG ("Using %s for encoding raw video to H.264", name);
+    else
+      GST_DEBUG ("No usable H.264 encoder found; raw video will be sent as "
+          "JPEG");
+    g_once_init_leave (&probed, 1);
+  }
+
+  return name;
+}
+
+/* Returns the name of the best usable decoder for the given video format
+ * (JPEG or H264), or NULL if none were found. Probed once per format. */
+const gchar *
+_ov_gst_get_video_decoder_name (OvVideoFormat format)
+{
+  static gsize h264_probed = 0, jpeg_probed = 0;
+  static const gchar *h264_name = NULL, *jpeg_name = NULL;
+
+  switch (format) {
+    case OV_VIDEO_FORMAT_H264:
+      if (g_once_init_enter (&h264_probed)) {
+        h264_name = ov_gst_probe_element_names (h264_decoders);
+        GST_DEBUG ("Using %s for decoding H.264", h264_name);
+        g_once_init_leave (&h264_probed, 1);
+      }
+      return h264_name;
+    case OV_VIDEO_FORMAT_JPEG:
+      if (g_once_init_enter (&jpeg_probed)) {
+        jpeg_name = ov_gst_probe_element_names (jpeg_decoders);
+        GST_DEBUG ("Using %s for decoding JPEG", jpeg_name);
+        g_once_init_leave (&jpeg_probed, 1);
+      }
+      return jpeg_name;
+    default:
+      g_assert_not_reached ();
+  }
+
+  return NULL;
+}
+
 gpointer
 ov_remote_peer_add_gtksink (OvRemotePeer * remote)
 {
@@ -308,29 +534,154 @@ software_only:
   return NULL;
 }
 
+/* Renders the video of all remotes into one widget with a single GL context
+ * instead of one sink per remote, which also keeps the decoded frames in GL
+ * memory for colour conversion and scaling. Must be called before every call
+ * is started; use ov_remote_peer_set_video_rect() to lay out the remotes.
+ * Returns NULL if GL compositing isn't available, in which case the
+ * per-remote sinks should be used. */
+gpointer
+ov_local_peer_add_compositor_gtksink (OvLocalPeer * local)
+{
+  gpointer widget;
+  GstElement *sink;
+  GstElementFactory *factory;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  factory = gst_element_factory_find ("glvideomixer");
+  if (factory == NULL) {
+    g_printerr ("glvideomixer not found; can't composite remote video\n");
+    return NULL;
+  }
+  gst_object_unref (factory);
+
+  if (!ov_get_gtkglsink (&sink, &widget)) {
+    g_printerr ("Unable to create gtkglsink bin; can't composite remote "
+        "video\n");
+    return NULL;
+  }
+
+  ov_local_peer_lock (local);
+  g_clear_object (&priv->video_compositor_sink);
+  priv->video_compositor_sink = gst_object_ref_sink (sink);
+  ov_local_peer_unlock (local);
+
+  return widget;
+}
+
+/* Positions the video of this remote in the output of the compositor, in
+ * pixels. Can be called at any time; does nothing if the video of remotes
+ * isn't being composited. */
 void
-ov_remote_peer_pause (OvRemotePeer * remote)
+ov_remote_peer_set_video_rect (OvRemotePeer * remote, gint x, gint y,
+    gint width, gint height)
+{
+  GstPad *srcpad, *sinkpad;
+
+  g_return_if_fail (remote != NULL);
+  g_return_if_fail (width >= 0 && height >= 0);
+
+  remote->priv->video_rect[0] = x;
+  remote->priv->video_rect[1] = y;
+  remote->priv->video_rect[2] = width;
+  remote->priv->video_rect[3] = height;
+  ov_remote_peer_set_video_view_size (remote, width, height);
+
+  if (remote->priv->vplayback == NULL)
+    return;
+
+  srcpad = gst_element_get_static_pad (remote->priv->vplayback, "videopad");
+  if (srcpad == NULL)
+    /* Not compositing, or the call hasn't started yet */
+    return;
+
+  sinkpad = gst_pad_get_peer (srcpad);
+  if (sinkpad != NULL) {
+    g_object_set (sinkpad, "xpos", x, "ypos", y, "width", width, "height",
+        height, NULL);
+    gst_object_unref (sinkpad);
+  }
+  gst_object_unref (srcpad);
+}
+
+/* Returns the sink for the simulcast video layer this remote is sent */
+static GstElement *
+ov_remote_peer_get_video_layer_sink (OvRemotePeer * remote)
+{
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  if (remote->priv->video_layer < local_priv->n_active_video_layers)
+    return local_priv->video_layers[remote->priv->video_layer].sink;
+
+  return local_priv->vsend_rtp_sink;
+}
+
+static void
+ov_remote_peer_unlink_video_compositor (OvRemotePeer * remote)
+{
+  GstPad *srcpad, *sinkpad;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  srcpad = gst_element_get_static_pad (remote->priv->vplayback, "videopad");
+  sinkpad = gst_pad_get_peer (srcpad);
+
+  if (sinkpad) {
+    gst_pad_unlink (srcpad, sinkpad);
+    gst_element_release_request_pad (local_priv->video_compositor, sinkpad);
+    gst_object_unref (sinkpad);
+    GST_DEBUG ("Released compositor sinkpad of %s", remote->addr_s);
+  }
+  gst_object_unref (srcpad);
+}
+
+/* Emits @action ("add" or "remove") on the sinks that we transmit to @remote
+ * with. Its RTP ports are 0 if it gets our RTP from the multicast group. */
+static void
+ov_remote_peer_emit_transmit_clients (OvRemotePeer * remote,
+    const gchar * action)
 {
-  GstStateChangeReturn ret;
   gchar *addr_only;
   OvLocalPeerPrivate *local_priv;
 
   local_priv = ov_local_peer_get_private (remote->local);
 
-  g_assert (remote->state == OV_REMOTE_STATE_PLAYING);
+  /* Relays don't transmit */
+  if (local_priv->transmit == NULL)
+    return;
 
-  /* Stop transmitting */
   addr_only = g_inet_address_to_string (
       g_inet_socket_address_get_address (remote->addr));
-  g_signal_emit_by_name (local_priv->asend_rtp_sink, "remove", addr_only,
-      remote->priv->send_ports[0]);
-  g_signal_emit_by_name (local_priv->asend_rtcp_sink, "remove", addr_only,
+  if (remote->priv->send_ports[0] != 0)
+    g_signal_emit_by_name (local_priv->asend_rtp_sink, action, addr_only,
+        remote->priv->send_ports[0]);
+  g_signal_emit_by_name (local_priv->asend_rtcp_sink, action, addr_only,
       remote->priv->send_ports[1]);
-  g_signal_emit_by_name (local_priv->vsend_rtp_sink, "remove", addr_only,
-      remote->priv->send_ports[3]);
-  g_signal_emit_by_name (local_priv->vsend_rtcp_sink, "remove", addr_only,
+  if (remote->priv->send_ports[3] != 0)
+    g_signal_emit_by_name (ov_remote_peer_get_video_layer_sink (remote),
+        action, addr_only, remote->priv->send_ports[3]);
+  g_signal_emit_by_name (local_priv->vsend_rtcp_sink, action, addr_only,
       remote->priv->send_ports[4]);
   g_free (addr_only);
+}
+
+void
+ov_remote_peer_pause (OvRemotePeer * remote)
+{
+  GstStateChangeReturn ret;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  g_assert (remote->state == OV_REMOTE_STATE_PLAYING);
+
+  /* Stop transmitting */
+  ov_remote_peer_emit_transmit_clients (remote, "remove");
 
   /* Pause receiving */
   ret = gst_element_set_state (remote->receive, GST_STATE_PAUSED);
@@ -356,6 +707,9 @@ ov_remote_peer_pause (OvRemotePeer * remote)
   }
 
   if (remote->priv->video_proxysrc != NULL) {
+    /* The compositor would wait for data from us otherwise */
+    if (local_priv->video_compositor != NULL)
+      ov_remote_peer_unlink_video_compositor (remote);
     ret = gst_element_set_state (remote->priv->vplayback, GST_STATE_PAUSED);
     g_assert (ret == GST_STATE_CHANGE_SUCCESS);
     GST_DEBUG ("Paused video of %s", remote->addr_s);
@@ -370,7 +724,6 @@ ov_remote_peer_resume (OvRemotePeer * remote)
 {
   gboolean res;
   GstStateChangeReturn ret;
-  gchar *addr_only;
   OvLocalPeerPrivate *local_priv;
 
   local_priv = ov_local_peer_get_private (remote->local);
@@ -378,17 +731,7 @@ ov_remote_peer_resume (OvRemotePeer * remote)
   g_assert (remote->state == OV_REMOTE_STATE_PAUSED);
 
   /* Start transmitting */
-  addr_only = g_inet_address_to_string (
-      g_inet_socket_address_get_address (remote->addr));
-  g_signal_emit_by_name (local_priv->asend_rtp_sink, "add", addr_only,
-      remote->priv->send_ports[0]);
-  g_signal_emit_by_name (local_priv->asend_rtcp_sink, "add", addr_only,
-      remote->priv->send_ports[1]);
-  g_signal_emit_by_name (local_priv->vsend_rtp_sink, "add", addr_only,
-      remote->priv->send_ports[3]);
-  g_signal_emit_by_name (local_priv->vsend_rtcp_sink, "add", addr_only,
-      remote->priv->send_ports[4]);
-  g_free (addr_only);
+  ov_remote_peer_emit_transmit_clients (remote, "add");
 
   if (remote->priv->audio_proxysrc != NULL) {
     res = gst_element_link_pads (remote->priv->aplayback, "audiopad",
@@ -400,6 +743,8 @@ ov_remote_peer_resume (OvRemotePeer * remote)
   }
 
   if (remote->priv->video_proxysrc != NULL) {
+    if (local_priv->video_compositor != NULL)
+      ov_remote_peer_link_video_compositor (remote);
     ret = gst_element_set_state (remote->priv->vplayback, GST_STATE_PLAYING);
     g_assert (ret == GST_STATE_CHANGE_SUCCESS);
     GST_DEBUG ("Resumed video of %s", remote->addr_s);
@@ -408,6 +753,12 @@ ov_remote_peer_resume (OvRemotePeer * remote)
   /* Resume receiving */
   ret = gst_element_set_state (remote->receive, GST_STATE_PLAYING);
   g_assert (ret == GST_STATE_CHANGE_SUCCESS);
+  /* We weren't listening, so don't time it out before it can be heard */
+  remote->last_seen = g_get_monotonic_time ();
+  /* We dropped packets while paused, so the decoder needs a keyframe */
+  if (!remote->priv->video_hidden &&
+      !remote->priv->recv_muted[OV_VIDEO_RTP_SESSION])
+    ov_remote_peer_request_video_keyframe (remote);
   remote->state = OV_REMOTE_STATE_PLAYING;
   GST_DEBUG ("Fully resumed remote peer %s", remote->addr_s);
 }
@@ -448,6 +799,163 @@ ov_remote_peer_get_muted (OvRemotePeer * remote)
   return muted;
 }
 
+gboolean
+ov_remote_peer_get_audio_sending (OvRemotePeer * remote)
+{
+  g_return_val_if_fail (remote != NULL, FALSE);
+
+  return !remote->priv->recv_muted[OV_AUDIO_RTP_SESSION];
+}
+
+gboolean
+ov_remote_peer_get_video_sending (OvRemotePeer * remote)
+{
+  g_return_val_if_fail (remote != NULL, FALSE);
+
+  return !remote->priv->recv_muted[OV_VIDEO_RTP_SESSION];
+}
+
+/* Let the jitterbuffer latency of this remote grow and shrink between
+ * @min_ms and @max_ms depending on the jitter of what it sends us. If they're
+ * the same, the latency is fixed at that. Defaults to a fixed latency of
+ * RTP_DEFAULT_LATENCY_MS, which is only enough on a LAN. Can be set at any
+ * time; during a call we start from @min_ms. */
+gboolean
+ov_remote_peer_set_latency_range (OvRemotePeer * remote, guint min_ms,
+    guint max_ms)
+{
+  g_return_val_if_fail (remote != NULL, FALSE);
+
+  if (min_ms > max_ms) {
+    GST_WARNING ("Invalid latency range %u-%ums", min_ms, max_ms);
+    return FALSE;
+  }
+
+  ov_local_peer_lock (remote->local);
+  remote->priv->min_latency = min_ms;
+  remote->priv->max_latency = max_ms;
+  ov_remote_peer_apply_latency (remote, min_ms);
+  ov_local_peer_unlock (remote->local);
+
+  GST_DEBUG ("Jitterbuffer latency range of %s is now %u-%ums", remote->addr_s,
+      min_ms, max_ms);
+  return TRUE;
+}
+
+/* The jitterbuffer latency currently used for this remote in ms */
+guint
+ov_remote_peer_get_latency (OvRemotePeer * remote)
+{
+  g_return_val_if_fail (remote != NULL, 0);
+
+  return remote->priv->latency;
+}
+
+/* The best quality worth asking of @remote, from the size that we show its
+ * video at. OV_VIDEO_QUALITY_INVALID if that's as big as it gets. */
+static OvVideoQuality
+ov_remote_peer_get_view_quality (OvRemotePeer * remote)
+{
+  guint height;
+
+  /* Still received while hidden so that it can be shown again right away,
+   * but nobody is looking at it */
+  if (remote->priv->video_hidden)
+    return OV_VIDEO_QUALITY_240P | OV_VIDEO_QUALITY_5FPS;
+
+  height = remote->priv->view_size[1];
+  /* Letterboxed if the view is wider than 16:9 */
+  if (remote->priv->view_size[0] > 0)
+    height = MIN (height, remote->priv->view_size[0] * 9 / 16);
+
+  /* Every framerate gets rendered */
+  if (height == 0 || height > 720)
+    return OV_VIDEO_QUALITY_INVALID;
+  else if (height > 480)
+    return OV_VIDEO_QUALITY_720P | OV_VIDEO_QUALITY_FPS_RANGE;
+  else if (height > 360)
+    return OV_VIDEO_QUALITY_480P | OV_VIDEO_QUALITY_FPS_RANGE;
+  else if (height > 240)
+    return OV_VIDEO_QUALITY_360P | OV_VIDEO_QUALITY_FPS_RANGE;
+  return OV_VIDEO_QUALITY_240P | OV_VIDEO_QUALITY_FPS_RANGE;
+}
+
+/* Tells @remote how much of its video we now show, if that changed. Before the
+ * call starts, it's sent once it does. Called with the lock TAKEN */
+void
+ov_remote_peer_update_video_view (OvRemotePeer * remote)
+{
+  OvVideoQuality quality;
+
+  quality = ov_remote_peer_get_view_quality (remote);
+  if (quality == remote->priv->recv_view_quality)
+    return;
+  remote->priv->recv_view_quality = quality;
+
+  if (ov_local_peer_get_state (remote->local) &
+      (OV_LOCAL_STATE_PLAYING | OV_LOCAL_STATE_PAUSED))
+    ov_remote_peer_send_video_view (remote);
+}
+
+/* Tell us how big the application shows the video of this remote, in pixels,
+ * so that it doesn't send us more than that. Done for you by
+ * ov_remote_peer_set_video_rect() when compositing. 0 means full size. */
+void
+ov_remote_peer_set_video_view_size (OvRemotePeer * remote, guint width,
+    guint height)
+{
+  g_return_if_fail (remote != NULL);
+
+  ov_local_peer_lock (remote->local);
+  remote->priv->view_size[0] = width;
+  remote->priv->view_size[1] = height;
+  ov_remote_peer_update_video_view (remote);
+  ov_local_peer_unlock (remote->local);
+}
+
+/* Tell us whether the application is showing the video of this remote. While
+ * it isn't, the video is received but not depayloaded (unless it's being
+ * recorded) or decoded. When it's
+ * visible again, we ask the remote for a keyframe and decode from there on.
+ * Nothing is renegotiated. Visible by default. */
+void
+ov_remote_peer_set_video_visible (OvRemotePeer * remote, gboolean visible)
+{
+  g_return_if_fail (remote != NULL);
+
+  ov_local_peer_lock (remote->local);
+
+  if (remote->priv->video_hidden == !visible)
+    goto out;
+  remote->priv->video_hidden = !visible;
+  /* It can send us less meanwhile */
+  ov_remote_peer_update_video_view (remote);
+
+  /* Applied when the receive pipeline is setup otherwise */
+  if (remote->priv->vdepay == NULL)
+    goto out;
+
+  /* It sends a keyframe itself when it stops muting its video */
+  if (remote->priv->recv_muted[OV_VIDEO_RTP_SESSION])
+    goto out;
+
+  ov_remote_peer_drop_video (remote, !visible);
+  /* Paused remotes get a keyframe request on resume */
+  if (visible && remote->state == OV_REMOTE_STATE_PLAYING)
+    ov_remote_peer_request_video_keyframe (remote);
+
+out:
+  ov_local_peer_unlock (remote->local);
+}
+
+gboolean
+ov_remote_peer_get_video_visible (OvRemotePeer * remote)
+{
+  g_return_val_if_fail (remote != NULL, FALSE);
+
+  return !remote->priv->video_hidden;
+}
+
 /* Does not do any operations that involve taking the OvLocalPeer lock.
  * See: ov_local_peer_remove_remote()
  *
@@ -457,23 +965,13 @@ ov_remote_peer_remove_not_array (OvRemotePeer * remote)
 {
   gboolean res;
   GstStateChangeReturn ret;
-  gchar *tmp, *addr_only;
+  gchar *tmp;
   OvLocalPeerPrivate *local_priv;
 
   local_priv = ov_local_peer_get_private (remote->local);
 
   /* Stop transmitting */
-  addr_only = g_inet_address_to_string (
-      g_inet_socket_address_get_address (remote->addr));
-  g_signal_emit_by_name (local_priv->asend_rtp_sink, "remove", addr_only,
-      remote->priv->send_ports[0]);
-  g_signal_emit_by_name (local_priv->asend_rtcp_sink, "remove", addr_only,
-      remote->priv->send_ports[1]);
-  g_signal_emit_by_name (local_priv->vsend_rtp_sink, "remove", addr_only,
-      remote->priv->send_ports[3]);
-  g_signal_emit_by_name (local_priv->vsend_rtcp_sink, "remove", addr_only,
-      remote->priv->send_ports[4]);
-  g_free (addr_only);
+  ov_remote_peer_emit_transmit_clients (remote, "remove");
 
   /* Release all requested pads and relevant playback bins */
   if (remote->priv->audio_proxysrc != NULL) {
@@ -504,6 +1002,8 @@ ov_remote_peer_remove_not_array (OvRemotePeer * remote)
   }
 
   if (remote->priv->video_proxysrc != NULL) {
+    if (local_priv->video_compositor != NULL)
+      ov_remote_peer_unlink_video_compositor (remote);
     ret = gst_element_set_state (remote->priv->vplayback, GST_STATE_NULL);
     g_assert (ret == GST_STATE_CHANGE_SUCCESS);
     res =
@@ -514,8 +1014,14 @@ ov_remote_peer_remove_not_array (OvRemotePeer * remote)
   }
 
   /* Stop receiving */
-  ret = gst_element_set_state (remote->receive, GST_STATE_NULL);
-  g_assert (ret == GST_STATE_CHANGE_SUCCESS);
+  if (remote->priv->recording != NULL)
+    ov_recording_stop (g_steal_pointer (&remote->priv->recording));
+  if (GST_IS_PIPELINE (remote->receive)) {
+    ret = gst_element_set_state (remote->receive, GST_STATE_NULL);
+    g_assert (ret == GST_STATE_CHANGE_SUCCESS);
+  } else {
+    ov_local_peer_remove_remote_shared (remote->local, remote);
+  }
   remote->state = OV_REMOTE_STATE_NULL;
 
   tmp = g_strdup (remote->addr_s);
@@ -524,8 +1030,28 @@ ov_remote_peer_remove_not_array (OvRemotePeer * remote)
   g_free (tmp);
 }
 
+/* Keeps @remote from being freed while it's used with the lock released. If
+ * it's removed from the call meanwhile, it's only freed once it's released.
+ * Called with the lock TAKEN */
 void
-ov_remote_peer_free (OvRemotePeer * remote)
+ov_remote_peer_hold (OvRemotePeer * remote)
+{
+  remote->priv->holds++;
+}
+
+/* Frees @remote if it was freed while it was held. Called with the lock
+ * TAKEN */
+void
+ov_remote_peer_release (OvRemotePeer * remote)
+{
+  g_assert (remote->priv->holds > 0);
+
+  if (--remote->priv->holds == 0 && remote->priv->free_pending)
+    ov_remote_peer_free (remote);
+}
+
+void
+ov_remote_peer_free (OvRemotePeer * remote)
 {
   guint ii;
   OvLocalPeerPrivate *local_priv;
@@ -533,15 +1059,32 @@ ov_remote_peer_free (OvRemotePeer * remote)
   ov_local_peer_lock (remote->local);
   local_priv = ov_local_peer_get_private (remote->local);
 
+  if (remote->priv->holds > 0) {
+    GST_DEBUG ("Remote %s is still in use, freeing it later", remote->addr_s);
+    remote->priv->free_pending = TRUE;
+    ov_local_peer_unlock (remote->local);
+    return;
+  }
+
   GST_DEBUG ("Freeing remote %s", remote->addr_s);
-  for (ii = 0; ii < local_priv->used_ports->len; ii++)
-    /* Port numbers are unique, sorted, and contiguous. So if we find the first
-     * port, we've found all of them. */
-    if (g_array_index (local_priv->used_ports, guint, ii) ==
-        remote->priv->recv_ports[0])
-      g_array_remove_range (local_priv->used_ports, ii, 4);
+  if (!local_priv->shared_receive)
+    ov_socket_pool_release (local_priv->socket_pool,
+        remote->priv->recv_ports[0]);
   ov_local_peer_unlock (remote->local);
 
+  g_mutex_lock (&local_priv->recv_lock);
+  ov_remote_peer_free_jitterbuffers (remote);
+  g_mutex_unlock (&local_priv->recv_lock);
+  g_clear_pointer (&remote->priv->decode_timer, ov_frame_timer_unref);
+  for (ii = 0; ii < G_N_ELEMENTS (remote->priv->latency_trackers); ii++)
+    g_clear_pointer (&remote->priv->latency_trackers[ii],
+        ov_latency_tracker_unref);
+
+  ov_remote_peer_close_control_connection (remote);
+  g_hash_table_unref (remote->priv->control_pending);
+  g_mutex_clear (&remote->priv->control_lock);
+  g_cond_clear (&remote->priv->control_cond);
+
   /* Free relevant bins and pipelines */
   g_clear_object (&remote->priv->aplayback);
   g_clear_object (&remote->priv->vplayback);
@@ -549,10 +1092,20 @@ ov_remote_peer_free (OvRemotePeer * remote)
    * but I'm not sure how that works. Just commenting it out for now. */
   //g_clear_object (&remote->receive);
 
+  g_clear_pointer (&remote->priv->relay_dests, g_hash_table_unref);
+  g_clear_pointer (&remote->priv->recording, ov_recording_free);
+
+  if (remote->priv->liveness_source != NULL) {
+    g_source_destroy (remote->priv->liveness_source);
+    g_source_unref (remote->priv->liveness_source);
+  }
+
   if (remote->priv->recv_acaps)
     gst_caps_unref (remote->priv->recv_acaps);
   if (remote->priv->recv_vcaps)
     gst_caps_unref (remote->priv->recv_vcaps);
+  for (ii = 0; ii < G_N_ELEMENTS (remote->priv->offered_recv_caps); ii++)
+    g_clear_pointer (&remote->priv->offered_recv_caps[ii], gst_caps_unref);
   g_object_unref (remote->addr);
   g_free (remote->addr_s);
   g_free (remote->id);
@@ -604,117 +1157,197 @@ ov_caps_to_video_format (const GstCaps * caps)
   return OV_VIDEO_FORMAT_UNKNOWN;
 }
 
-/* Get the caps from the device and extract the useful caps from it
- * Useful caps are those that are high-def and high framerate, or if none such
- * are found, high-def and low-framerate, then low-def and high-framerate, then
- * low-def and low-framerate */
-static GstCaps *
-ov_device_get_usable_caps (GstDevice * device, OvVideoFormat *device_format)
+static const struct {
+  OvRtpRepair repair;
+  const gchar *field;
+  /* Elements needed for sending and for receiving */
+  const gchar *send[3];
+  const gchar *recv[3];
+} rtp_repairs[] = {
+  {OV_RTP_REPAIR_RTX, "rtx", {"rtprtxsend", NULL}, {"rtprtxreceive", NULL}},
+  {OV_RTP_REPAIR_ULPFEC, "ulpfec", {"rtpulpfecenc", "rtpredenc", NULL},
+    {"rtpulpfecdec", "rtpreddec", NULL}},
+};
+
+/* Returns the kinds of RTP repair that we have the elements for */
+OvRtpRepair
+_ov_gst_get_rtp_repair (gboolean send)
 {
-  gint ii, len;
-  OvVideoFormat next_format, formats = 0;
-  GstCaps *tmpcaps, *devcaps, *retcaps, *mediacaps = NULL;
+  guint ii, jj;
+  const gchar * const *names;
+  OvRtpRepair repair = OV_RTP_REPAIR_NONE;
+
+  for (ii = 0; ii < G_N_ELEMENTS (rtp_repairs); ii++) {
+    names = send ? rtp_repairs[ii].send : rtp_repairs[ii].recv;
+    for (jj = 0; names[jj] != NULL; jj++)
+      if (!gst_registry_check_feature_version (gst_registry_get (), names[jj],
+            1, 14, 0))
+        break;
+    if (names[jj] == NULL)
+      repair |= rtp_repairs[ii].repair;
+  }
 
-  devcaps = gst_device_get_caps (device);
-  retcaps = gst_caps_new_empty ();
+  return repair;
+}
 
-  /* Check for the best quality (H264) first, then JPEG, then YUY2, then fail */
-  next_format = OV_VIDEO_FORMAT_H264;
+/* Returns a copy of @caps with the fields for @repair set on every structure
+ * so that it can be negotiated along with the video format */
+GstCaps *
+ov_caps_with_rtp_repair (const GstCaps * caps, OvRtpRepair repair)
+{
+  guint ii, jj, len;
+  GstCaps *ret;
 
-retry:
-  g_clear_pointer (&mediacaps, gst_caps_unref);
+  ret = gst_caps_copy (caps);
+  len = gst_caps_get_size (ret);
+  for (ii = 0; ii < len; ii++)
+    for (jj = 0; jj < G_N_ELEMENTS (rtp_repairs); jj++)
+      if (repair & rtp_repairs[jj].repair)
+        gst_structure_set (gst_caps_get_structure (ret, ii),
+            rtp_repairs[jj].field, G_TYPE_BOOLEAN, TRUE, NULL);
 
-  switch (next_format) {
-    case OV_VIDEO_FORMAT_H264:
-    case OV_VIDEO_FORMAT_JPEG:
-    case OV_VIDEO_FORMAT_YUY2:
-      /* Check if the device supports this format. If so, add it to the list of
-       * supported media types and merge the caps in our list of caps. Else, try
-       * the next-best video format. */
-      mediacaps = ov_video_format_to_caps (next_format);
-      tmpcaps = gst_caps_intersect (devcaps, mediacaps);
-      if (!gst_caps_is_empty (tmpcaps)) {
-        gst_caps_append (retcaps, tmpcaps);
-        formats |= next_format;
-      } else {
-        gst_caps_unref (tmpcaps);
-      }
-      next_format >>= 1;
-      /* If the device does not support JPEG/H264; try YUY2. We ignore other RAW
-       * formats because those are all faked by libv4l2 by converting/decoding
-       * one of these. We will encode YUY2 to JPEG before transmitting. */
-      if (next_format == OV_VIDEO_FORMAT_YUY2 &&
-          formats != OV_VIDEO_FORMAT_UNKNOWN) {
-        /* Ignore YUY2 formats if we got JPEG and/or H264 */
-        gst_caps_unref (mediacaps);
-        break; /* done */
-      }
-      goto retry;
+  return ret;
+}
+
+/* Removes the RTP repair fields from negotiated caps in-place and returns the
+ * kinds of repair they had. The fields must not end up in a capsfilter. */
+OvRtpRepair
+ov_caps_take_rtp_repair (GstCaps ** caps)
+{
+  guint ii, jj, len;
+  gboolean value;
+  GstStructure *s;
+  OvRtpRepair repair = OV_RTP_REPAIR_NONE;
+
+  if (gst_caps_is_empty (*caps) || gst_caps_is_any (*caps))
+    return repair;
+
+  s = gst_caps_get_structure (*caps, 0);
+  for (ii = 0; ii < G_N_ELEMENTS (rtp_repairs); ii++)
+    if (gst_structure_get_boolean (s, rtp_repairs[ii].field, &value) && value)
+      repair |= rtp_repairs[ii].repair;
+
+  *caps = gst_caps_make_writable (*caps);
+  len = gst_caps_get_size (*caps);
+  for (ii = 0; ii < len; ii++)
+    for (jj = 0; jj < G_N_ELEMENTS (rtp_repairs); jj++)
+      gst_structure_remove_field (gst_caps_get_structure (*caps, ii),
+          rtp_repairs[jj].field);
+
+  return repair;
+}
 
-    case OV_VIDEO_FORMAT_SENTINEL:
-      if (formats >= OV_VIDEO_FORMAT_YUY2)
-        break; /* done */
+/* Returns a copy of @caps with the "multicast" field set on every structure,
+ * which offers to send or receive RTP on the multicast group of the call. The
+ * negotiator then puts @group and the @port that the sender was given on the
+ * negotiated caps too if @group isn't NULL. */
+GstCaps *
+ov_caps_with_multicast (const GstCaps * caps, const gchar * group,
+    guint16 port)
+{
+  guint ii, len;
+  GstCaps *ret;
+  GstStructure *s;
 
-      GST_ERROR ("Unsupported video output formats! %" GST_PTR_FORMAT, devcaps);
-      gst_caps_unref (devcaps);
-      gst_caps_unref (retcaps);
-      return NULL; /* fail */
-    default:
-      g_assert_not_reached ();
+  ret = gst_caps_copy (caps);
+  len = gst_caps_get_size (ret);
+  for (ii = 0; ii < len; ii++) {
+    s = gst_caps_get_structure (ret, ii);
+    gst_structure_set (s, "multicast", G_TYPE_BOOLEAN, TRUE, NULL);
+    if (group != NULL)
+      gst_structure_set (s, "multicast-group", G_TYPE_STRING, group,
+          "multicast-port", G_TYPE_INT, port, NULL);
   }
 
-  gst_caps_unref (devcaps);
+  return ret;
+}
+
+/* Removes the multicast fields from caps in-place and returns whether the
+ * multicast one was set. @group and @port are only set if they aren't NULL and
+ * the negotiated ones were there too. Like with the RTP repair fields, they
+ * must not end up in a capsfilter. */
+gboolean
+ov_caps_take_multicast (GstCaps ** caps, gchar ** group, guint16 * port)
+{
+  guint ii, len;
+  gint value;
+  const gchar *group_s;
+  GstStructure *s;
+  gboolean multicast = FALSE;
+
+  if (gst_caps_is_empty (*caps) || gst_caps_is_any (*caps))
+    return FALSE;
 
-  if (formats == OV_VIDEO_FORMAT_YUY2) {
-    *device_format = OV_VIDEO_FORMAT_YUY2;
-    GST_WARNING ("Device does not provide compressed output! Trying YUY2 "
-        "(lower quality, higher CPU usage)");
+  s = gst_caps_get_structure (*caps, 0);
+  gst_structure_get_boolean (s, "multicast", &multicast);
+  group_s = gst_structure_get_string (s, "multicast-group");
+  if (multicast && group != NULL && group_s != NULL &&
+      gst_structure_get_int (s, "multicast-port", &value) &&
+      value > 0 && value <= G_MAXUINT16 - 2) {
+    *group = g_strdup (group_s);
+    *port = value;
   }
-  /* We now have a useful subset of the original device caps */
 
-  /* Transform device caps to rtp caps */
-  len = gst_caps_get_size (retcaps);
-  for (ii = 0; ii < len; ii++) {
-    GstStructure *s, *tmp;
-    gint n1, n2;
-    gdouble dest;
+  *caps = gst_caps_make_writable (*caps);
+  len = gst_caps_get_size (*caps);
+  for (ii = 0; ii < len; ii++)
+    gst_structure_remove_fields (gst_caps_get_structure (*caps, ii),
+        "multicast", "multicast-group", "multicast-port", NULL);
 
-    s = gst_caps_get_structure (retcaps, ii);
+  return multicast;
+}
+
+/* Returns a copy of @caps with the boolean @field set on every structure, for
+ * telling peers about something that isn't negotiated as a media format */
+GstCaps *
+ov_caps_with_flag (const GstCaps * caps, const gchar * field)
+{
+  guint ii, len;
+  GstCaps *ret;
+
+  ret = gst_caps_copy (caps);
+  len = gst_caps_get_size (ret);
+  for (ii = 0; ii < len; ii++)
+    gst_structure_set (gst_caps_get_structure (ret, ii), field,
+        G_TYPE_BOOLEAN, TRUE, NULL);
+
+  return ret;
+}
+
+/* Removes the boolean @field from caps in-place and returns whether it was
+ * set */
+gboolean
+ov_caps_take_flag (GstCaps ** caps, const gchar * field)
+{
+  guint ii, len;
+  gboolean value = FALSE;
 
-    /* Fixate device caps and remove extraneous fields */
-    gst_structure_remove_fields (s, "pixel-aspect-ratio", "colorimetry",
-        "interlace-mode", "format", NULL);
+  if (gst_caps_is_empty (*caps) || gst_caps_is_any (*caps))
+    return FALSE;
 
-    /* Remove formats smaller than 240p */
-    gst_structure_get_int (s, "height", &n1);
-    if (n1 < 240)
-      goto remove;
+  gst_structure_get_boolean (gst_caps_get_structure (*caps, 0), field, &value);
 
-    /* Remove caps that *only* have framerates less than 15 */
-    tmp = gst_structure_copy (s);
-    /* We will probably not get valid framerates higher than this */
-    gst_structure_fixate_field_nearest_fraction (tmp, "framerate",
-        30, 1);
-    gst_structure_get_fraction (tmp, "framerate", &n1, &n2);
-    gst_structure_free (tmp);
-    gst_util_fraction_to_double (n1, n2, &dest);
-    if ((formats >= OV_VIDEO_FORMAT_JPEG && dest < 15) ||
-        (formats == OV_VIDEO_FORMAT_YUY2 && dest < 15))
-      goto remove;
+  *caps = gst_caps_make_writable (*caps);
+  len = gst_caps_get_size (*caps);
+  for (ii = 0; ii < len; ii++)
+    gst_structure_remove_field (gst_caps_get_structure (*caps, ii), field);
 
-    /* The raw video will be encoded to JPEG, so in reality our supported video
-     * caps are JPEG, not raw */
-    if (g_strcmp0 (gst_structure_get_name (s), "video/x-raw") == 0)
-      gst_structure_set_name (s, "image/jpeg");
+  return value;
+}
 
-    continue;
-remove:
-    gst_caps_remove_structure (retcaps, ii);
-    ii--; len--;
-  }
+/* Returns a copy of @caps with every structure renamed to @name */
+GstCaps *
+ov_caps_rename_structures (const GstCaps * caps, const gchar * name)
+{
+  guint ii, len;
+  GstCaps *renamed;
+
+  renamed = gst_caps_copy (caps);
+  len = gst_caps_get_size (renamed);
+  for (ii = 0; ii < len; ii++)
+    gst_structure_set_name (gst_caps_get_structure (renamed, ii), name);
 
-  GST_DEBUG ("Supported video output formats %" GST_PTR_FORMAT, retcaps);
-  return retcaps;
+  return renamed;
 }
 
 GList *
@@ -749,15 +1382,28 @@ ov_local_peer_set_video_device (OvLocalPeer * local,
     return FALSE;
   }
 
+  /* A warm transmit pipeline captures from the old device */
+  ov_local_peer_lock (local);
+  if (priv->transmit_warm)
+    ov_local_peer_stop_transmit (local);
+  ov_local_peer_unlock (local);
+
   if (device) {
-    priv->supported_send_vcaps = ov_device_get_usable_caps (device,
-        &priv->device_video_format);
+    priv->supported_send_vcaps = ov_device_caps_cache_get (priv->device_caps,
+        device, &priv->device_video_format);
   } else {
     priv->supported_send_vcaps = gst_caps_from_string (
         VIDEO_FORMAT_JPEG CAPS_FIELD_SEP TEST_VIDEO_CAPS_720P_STR CAPS_STRUC_SEP
         VIDEO_FORMAT_JPEG CAPS_FIELD_SEP TEST_VIDEO_CAPS_360P_STR CAPS_STRUC_SEP
         VIDEO_FORMAT_JPEG CAPS_FIELD_SEP TEST_VIDEO_CAPS_240P_STR);
     priv->device_video_format = OV_VIDEO_FORMAT_TEST;
+    /* Prefer H.264 if we can encode to it */
+    if (_ov_gst_get_h264_encoder_name ()) {
+      GstCaps *h264caps = ov_caps_rename_structures (priv->supported_send_vcaps,
+          VIDEO_FORMAT_H264);
+      gst_caps_append (h264caps, priv->supported_send_vcaps);
+      priv->supported_send_vcaps = h264caps;
+    }
   }
 
   GST_DEBUG ("Supported send vcaps: %" GST_PTR_FORMAT,
@@ -778,7 +1424,7 @@ ov_local_peer_set_video_device (OvLocalPeer * local,
 }
 
 /* Expects a normalized/fixated structure with no lists of values */
-static OvVideoQuality
+OvVideoQuality
 ov_structure_to_video_quality (const GstStructure * s)
 {
   gint height, fps_n, fps_d;
@@ -824,6 +1470,33 @@ ov_structure_to_video_quality (const GstStructure * s)
   return quality;
 }
 
+/* Whether @quality has a higher resolution than @ceiling, or the same one at
+ * a higher framerate. Nothing is above OV_VIDEO_QUALITY_INVALID. */
+gboolean
+ov_video_quality_above (OvVideoQuality quality, OvVideoQuality ceiling)
+{
+  guint reso, fps;
+
+  if (ceiling == OV_VIDEO_QUALITY_INVALID)
+    return FALSE;
+
+  reso = quality & OV_VIDEO_QUALITY_RESO_RANGE;
+  fps = quality & OV_VIDEO_QUALITY_FPS_RANGE;
+
+  return reso > (ceiling & OV_VIDEO_QUALITY_RESO_RANGE) ||
+    (reso == (ceiling & OV_VIDEO_QUALITY_RESO_RANGE) &&
+     fps > (ceiling & OV_VIDEO_QUALITY_FPS_RANGE));
+}
+
+OvVideoQuality
+ov_video_caps_to_video_quality (const GstCaps * caps)
+{
+  if (caps == NULL || gst_caps_is_any (caps) || gst_caps_is_empty (caps))
+    return OV_VIDEO_QUALITY_INVALID;
+
+  return ov_structure_to_video_quality (gst_caps_get_structure (caps, 0));
+}
+
 gchar *
 ov_video_quality_to_string (OvVideoQuality quality)
 {
@@ -953,9 +1626,11 @@ ov_local_peer_get_lowest_video_quality (OvLocalPeer * local)
   return lowestq;
 }
 
-/* Returns FALSE if video caps haven't been negotiated yet */
+/* Like ov_local_peer_set_video_quality(), but doesn't change the highest
+ * quality that congestion control is allowed to use */
 gboolean
-ov_local_peer_set_video_quality (OvLocalPeer * local, OvVideoQuality quality)
+ov_local_peer_switch_video_quality (OvLocalPeer * local,
+    OvVideoQuality quality)
 {
   gint ii, len;
   GstCaps *matching, *normalized;
@@ -996,27 +1671,785 @@ ov_local_peer_set_video_quality (OvLocalPeer * local, OvVideoQuality quality)
   return FALSE;
 }
 
-static gboolean
-ov_local_peer_discovery_send (OvLocalPeer * local, GError ** error)
+/* The best negotiated quality that isn't above @ceiling, or the lowest one if
+ * they all are. OV_VIDEO_QUALITY_INVALID if nothing has been negotiated. */
+static OvVideoQuality
+ov_local_peer_find_video_quality (OvLocalPeer * local, OvVideoQuality ceiling)
+{
+  guint ii;
+  OvVideoQuality *qualities, best, lowest;
+
+  qualities = ov_local_peer_get_negotiated_video_qualities (local);
+  if (qualities == NULL)
+    return OV_VIDEO_QUALITY_INVALID;
+
+  best = lowest = OV_VIDEO_QUALITY_INVALID;
+  for (ii = 0; qualities[ii] != 0; ii++) {
+    if (lowest == OV_VIDEO_QUALITY_INVALID ||
+        ov_video_quality_above (lowest, qualities[ii]))
+      lowest = qualities[ii];
+    if (!ov_video_quality_above (qualities[ii], ceiling) &&
+        (best == OV_VIDEO_QUALITY_INVALID ||
+         ov_video_quality_above (qualities[ii], best)))
+      best = qualities[ii];
+  }
+  g_free (qualities);
+
+  return best != OV_VIDEO_QUALITY_INVALID ? best : lowest;
+}
+
+/* Returns FALSE if video caps haven't been negotiated yet */
+gboolean
+ov_local_peer_set_video_quality (OvLocalPeer * local, OvVideoQuality quality)
 {
   gboolean ret;
+  OvVideoQuality target;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* No more than what the remotes show, though */
+  target = quality;
+  if (ov_video_quality_above (quality, priv->view_quality))
+    target = ov_local_peer_find_video_quality (local, priv->view_quality);
+
+  ret = ov_local_peer_switch_video_quality (local, target);
+  if (ret)
+    /* Congestion control must not go back above what the application wants */
+    priv->cc.max_quality = quality;
+
+  return ret;
+}
+
+void
+ov_local_peer_set_congestion_control (OvLocalPeer * local, gboolean enabled)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+  priv->cc.enabled = enabled;
+  if (enabled && priv->transmit != NULL && !priv->transmit_warm)
+    ov_congestion_start (local);
+  else if (!enabled)
+    ov_congestion_stop (local);
+  ov_local_peer_unlock (local);
+}
+
+gboolean
+ov_local_peer_get_congestion_control (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->cc.enabled;
+}
+
+/* Subscribers get the stats of each interval in a struct that is reused, so
+ * they don't have to poll OvLocalPeer::get-stats and compute the rates
+ * themselves. @func is called from the default main context, and only
+ * when there's a call. @notify is called with @user_data on unsubscribing. */
+guint
+ov_local_peer_subscribe_stats (OvLocalPeer * local, const gchar * media_type,
+    guint interval_ms, OvStatsFunc func, gpointer user_data,
+    GDestroyNotify notify)
+{
+  guint id, session;
+
+  g_return_val_if_fail (interval_ms > 0 && func != NULL, 0);
+
+  session = OV_RTP_SESSION_FROM_NAME (media_type);
+  if (!OV_RTP_SESSION_IS_VALID (session)) {
+    GST_ERROR ("Invalid media type: %s", media_type);
+    return 0;
+  }
+
+  ov_local_peer_lock (local);
+  id = ov_stats_subscribe (local, session, interval_ms, func, user_data,
+      notify);
+  ov_local_peer_unlock (local);
+
+  return id;
+}
+
+void
+ov_local_peer_unsubscribe_stats (OvLocalPeer * local, guint id)
+{
+  gboolean ret;
+
+  ov_local_peer_lock (local);
+  ret = ov_stats_unsubscribe (local, id);
+  ov_local_peer_unlock (local);
 
-  /* Broadcast to the entire subnet to find listening peers */
-  ret = ov_discovery_send_multicast_discover (local, NULL, error);
   if (!ret)
-    return ret;
+    GST_WARNING ("No stats subscription with id %u", id);
+}
 
-  g_signal_emit_by_name (local, "discovery-sent");
+/* Must be called before the call starts. Layers after the first are sent at
+ * successively lower resolutions picked from the negotiated caps, so fewer
+ * layers than requested might actually be sent. */
+gboolean
+ov_local_peer_set_video_layers (OvLocalPeer * local, guint n_layers)
+{
+  OvLocalPeerPrivate *priv;
+
+  g_return_val_if_fail (n_layers > 0 && n_layers <= OV_MAX_VIDEO_LAYERS,
+      FALSE);
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->transmit != NULL && !priv->transmit_warm) {
+    GST_ERROR ("Can't change the number of video layers during a call");
+    ov_local_peer_unlock (local);
+    return FALSE;
+  }
+
+  /* A warm pipeline only has the old layers */
+  if (priv->transmit_warm && n_layers != priv->n_video_layers)
+    ov_local_peer_stop_transmit (local);
+
+  priv->n_video_layers = n_layers;
+  ov_local_peer_unlock (local);
+  return TRUE;
+}
+
+/* Takes effect from the next call. Only applies to H.264 that we encode
+ * ourselves; device video that is passed through keeps the device's GOP. */
+gboolean
+ov_local_peer_set_keyframe_interval (OvLocalPeer * local, guint frames)
+{
+  gboolean rewarm;
+  OvLocalPeerPrivate *priv;
+
+  g_return_val_if_fail (frames > 0, FALSE);
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  /* A warm pipeline has encoders set up with the old interval */
+  rewarm = priv->transmit_warm && frames != priv->keyframe_interval;
+  priv->keyframe_interval = frames;
+  if (rewarm) {
+    /* Set up a new one for the same media, so the next call still starts
+     * without waiting for the devices */
+    ov_local_peer_stop_transmit (local);
+    ov_local_peer_warm_transmit (local);
+  }
+
+  ov_local_peer_unlock (local);
+  return TRUE;
+}
+
+guint
+ov_local_peer_get_keyframe_interval (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->keyframe_interval;
+}
+
+/* Can be changed at any time, and applies to the remotes already in a call
+ * the next time their deadline is checked */
+gboolean
+ov_local_peer_set_remote_timeout (OvLocalPeer * local, guint timeout_ms)
+{
+  OvLocalPeerPrivate *priv;
+
+  /* We only hear from each remote every OV_RTCP_MIN_INTERVAL or so */
+  if (timeout_ms * GST_MSECOND < 4 * OV_RTCP_MIN_INTERVAL) {
+    GST_WARNING ("Remote timeout of %ums is too short", timeout_ms);
+    return FALSE;
+  }
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+  priv->remote_timeout = timeout_ms;
+  ov_local_peer_unlock (local);
+  return TRUE;
+}
+
+guint
+ov_local_peer_get_remote_timeout (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->remote_timeout;
+}
+
+gboolean
+ov_local_peer_set_recording (OvLocalPeer * local, const gchar * directory)
+{
+  OvLocalPeerPrivate *priv;
+
+  if (directory != NULL &&
+      !g_file_test (directory, G_FILE_TEST_IS_DIR)) {
+    GST_WARNING ("Can't record into %s: not a directory", directory);
+    return FALSE;
+  }
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  /* A warm pipeline isn't recording, and would record between calls */
+  if (directory != NULL && priv->transmit_warm)
+    ov_local_peer_stop_transmit (local);
+
+  g_free (priv->record_dir);
+  priv->record_dir = g_strdup (directory);
+  ov_local_peer_unlock (local);
+  return TRUE;
+}
+
+gchar *
+ov_local_peer_get_recording (OvLocalPeer * local)
+{
+  gchar *directory;
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+  directory = g_strdup (priv->record_dir);
+  ov_local_peer_unlock (local);
+
+  return directory;
+}
+
+/* Remotes that are already being received from keep the layout they were set
+ * up with */
+gboolean
+ov_local_peer_set_thread_layout (OvLocalPeer * local, OvThreadLayout layout,
+    guint max_decode_threads)
+{
+  OvLocalPeerPrivate *priv;
+
+  if (layout != OV_THREAD_LAYOUT_DEFAULT &&
+      layout != OV_THREAD_LAYOUT_DECODE_THREADS) {
+    GST_WARNING ("Invalid thread layout %i", layout);
+    return FALSE;
+  }
 
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+  priv->thread_layout = layout;
+  priv->max_decode_threads = max_decode_threads;
+  ov_local_peer_unlock (local);
+  return TRUE;
+}
+
+OvThreadLayout
+ov_local_peer_get_thread_layout (OvLocalPeer * local,
+    guint * max_decode_threads)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (max_decode_threads != NULL)
+    *max_decode_threads = priv->max_decode_threads;
+  return priv->thread_layout;
+}
+
+/* Threads that are already running keep their CPUs and niceness */
+gboolean
+ov_local_peer_set_thread_affinity (OvLocalPeer * local, OvThreadRole role,
+    guint64 cpus, gint nice)
+{
+#ifndef __linux__
+  GST_WARNING ("Thread affinity is only supported on Linux");
+  return FALSE;
+#else
+  OvLocalPeerPrivate *priv;
+
+  if (role >= OV_THREAD_ROLE_LAST) {
+    GST_WARNING ("Invalid thread role %i", role);
+    return FALSE;
+  }
+
+  if (nice < -20 || nice > 19) {
+    GST_WARNING ("Invalid niceness %i", nice);
+    return FALSE;
+  }
+
+  priv = ov_local_peer_get_private (local);
+
+  /* Read by streaming threads when they start; see threads.c */
+  g_mutex_lock (&priv->threads_lock);
+  priv->thread_cpus[role] = cpus;
+  priv->thread_nice[role] = nice;
+  g_mutex_unlock (&priv->threads_lock);
+  return TRUE;
+#endif
+}
+
+/* Must be called before any remotes are created, since it decides whether
+ * each remote gets its own receive pipeline and ports */
+gboolean
+ov_local_peer_set_shared_receive (OvLocalPeer * local, gboolean shared)
+{
+  gboolean ret = FALSE;
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->remote_peers->len > 0 || priv->negotiate != NULL) {
+    GST_ERROR ("Can't change how we receive once remotes have been added");
+    goto out;
+  }
+
+  if (shared && priv->relay) {
+    GST_ERROR ("Relays need separate ports for each remote");
+    goto out;
+  }
+
+  priv->shared_receive = shared;
+  /* Spare ports are only needed if remotes get their own */
+  if (shared)
+    ov_socket_pool_stop (priv->socket_pool);
+  else if (ov_local_peer_get_state (local) >= OV_LOCAL_STATE_STARTED)
+    ov_socket_pool_start (priv->socket_pool);
+  ret = TRUE;
+out:
+  ov_local_peer_unlock (local);
+  return ret;
+}
+
+gboolean
+ov_local_peer_get_shared_receive (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->shared_receive;
+}
+
+/* Takes effect from the next call. Pass a NULL device to
+ * ov_local_peer_set_video_device() for test video too. */
+gboolean
+ov_local_peer_set_test_media (OvLocalPeer * local, gboolean test_media)
+{
+  gboolean ret = FALSE;
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->transmit != NULL && !priv->transmit_warm) {
+    GST_ERROR ("Can't switch to or from test media during a call");
+    goto out;
+  }
+
+  if (priv->transmit_warm && test_media != priv->test_media)
+    ov_local_peer_stop_transmit (local);
+
+  priv->test_media = test_media;
+  ret = TRUE;
+out:
+  ov_local_peer_unlock (local);
+  return ret;
+}
+
+gboolean
+ov_local_peer_get_test_media (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->test_media;
+}
+
+void
+ov_local_peer_set_warm_transmit (OvLocalPeer * local, gboolean warm)
+{
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  priv->warm_transmit = warm;
+  /* Not needed anymore if it's not in use by a call */
+  if (!warm && priv->transmit_warm)
+    ov_local_peer_stop_transmit (local);
+
+  ov_local_peer_unlock (local);
+}
+
+gboolean
+ov_local_peer_get_warm_transmit (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->warm_transmit;
+}
+
+/* Must be set before negotiating a call */
+gboolean
+ov_local_peer_set_relay (OvLocalPeer * local, gboolean relay)
+{
+  gboolean ret = FALSE;
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->remote_peers->len > 0 || priv->negotiate != NULL) {
+    GST_ERROR ("Can't become or stop being a relay during a call");
+    goto out;
+  }
+
+  if (relay && priv->shared_receive) {
+    GST_ERROR ("Relays need separate ports for each remote");
+    goto out;
+  }
+
+  priv->relay = relay;
+  /* Not needed anymore */
+  if (relay && priv->transmit_warm)
+    ov_local_peer_stop_transmit (local);
+  ret = TRUE;
+out:
+  ov_local_peer_unlock (local);
+  return ret;
+}
+
+gboolean
+ov_local_peer_get_relay (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->relay;
+}
+
+static void
+ov_local_peer_set_send_muted (OvLocalPeer * local, guint session,
+    gboolean muted)
+{
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->send_muted[session] == muted)
+    goto out;
+  priv->send_muted[session] = muted;
+
+  /* Applied when the transmit pipeline is setup otherwise */
+  ov_local_peer_mute_capture (local, session);
+  /* Sent when the call starts otherwise */
+  if (ov_local_peer_get_state (local) &
+      (OV_LOCAL_STATE_PLAYING | OV_LOCAL_STATE_PAUSED))
+    ov_local_peer_send_mute_media (local);
+out:
+  ov_local_peer_unlock (local);
+}
+
+void
+ov_local_peer_set_audio_muted (OvLocalPeer * local, gboolean muted)
+{
+  ov_local_peer_set_send_muted (local, OV_AUDIO_RTP_SESSION, muted);
+}
+
+gboolean
+ov_local_peer_get_audio_muted (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->send_muted[OV_AUDIO_RTP_SESSION];
+}
+
+void
+ov_local_peer_set_video_muted (OvLocalPeer * local, gboolean muted)
+{
+  ov_local_peer_set_send_muted (local, OV_VIDEO_RTP_SESSION, muted);
+}
+
+gboolean
+ov_local_peer_get_video_muted (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->send_muted[OV_VIDEO_RTP_SESSION];
+}
+
+/* Takes effect from the next call */
+void
+ov_local_peer_set_multicast_media (OvLocalPeer * local, gboolean multicast)
+{
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+  priv->multicast_media = multicast;
+  ov_local_peer_unlock (local);
+}
+
+gboolean
+ov_local_peer_get_multicast_media (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->multicast_media;
+}
+
+/* Returns the number of video layers being sent during a call, and the number
+ * requested otherwise */
+guint
+ov_local_peer_get_video_layers (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->n_active_video_layers > 0)
+    return priv->n_active_video_layers;
+
+  return priv->n_video_layers;
+}
+
+/* Returns OV_VIDEO_QUALITY_INVALID if the layer is not being sent */
+OvVideoQuality
+ov_local_peer_get_video_layer_quality (OvLocalPeer * local, guint layer)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (layer >= priv->n_active_video_layers)
+    return OV_VIDEO_QUALITY_INVALID;
+
+  /* The quality of layer 0 can be changed at any time */
+  if (layer == 0)
+    return ov_local_peer_get_video_quality (local);
+
+  return priv->video_layers[layer].quality;
+}
+
+/* Moves @remote to a simulcast video layer that is being sent. Called with the
+ * lock TAKEN */
+static void
+ov_remote_peer_switch_video_layer (OvRemotePeer * remote, guint layer)
+{
+  gchar *addr_only;
+  GstPad *srcpad;
+  GstStructure *s;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  if (layer == remote->priv->video_layer)
+    return;
+
+  if (remote->state == OV_REMOTE_STATE_PLAYING) {
+    addr_only = g_inet_address_to_string (
+        g_inet_socket_address_get_address (remote->addr));
+    g_signal_emit_by_name (ov_remote_peer_get_video_layer_sink (remote),
+        "remove", addr_only, remote->priv->send_ports[3]);
+    remote->priv->video_layer = layer;
+    g_signal_emit_by_name (ov_remote_peer_get_video_layer_sink (remote),
+        "add", addr_only, remote->priv->send_ports[3]);
+    g_free (addr_only);
+  } else {
+    /* Takes effect on resume */
+    remote->priv->video_layer = layer;
+  }
+
+  /* The remote can't decode the new layer till it gets a keyframe */
+  s = gst_structure_new ("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN,
+      TRUE, NULL);
+  srcpad = gst_element_get_static_pad (local_priv->video_layers[layer].pay,
+      "src");
+  gst_pad_send_event (srcpad,
+      gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM, s));
+  gst_object_unref (srcpad);
+
+  GST_DEBUG ("Sending video layer %u to %s", layer, remote->addr_s);
+}
+
+/* Start sending the specified simulcast video layer to this remote instead of
+ * the current one. Returns FALSE if that layer is not being sent. Lasts till
+ * the remote asks for a different quality with VIDEO_VIEW. */
+gboolean
+ov_remote_peer_set_video_layer (OvRemotePeer * remote, guint layer)
+{
+  OvLocalPeerPrivate *local_priv;
+
+  g_return_val_if_fail (remote != NULL, FALSE);
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  ov_local_peer_lock (remote->local);
+
+  if (local_priv->transmit == NULL) {
+    /* Not in a call yet; takes effect when we begin transmitting */
+    remote->priv->video_layer = layer;
+    goto out;
+  }
+
+  if (layer >= local_priv->n_active_video_layers) {
+    ov_local_peer_unlock (remote->local);
+    GST_WARNING ("Video layer %u is not being sent", layer);
+    return FALSE;
+  }
+
+  ov_remote_peer_switch_video_layer (remote, layer);
+
+out:
+  ov_local_peer_unlock (remote->local);
+  return TRUE;
+}
+
+guint
+ov_remote_peer_get_video_layer (OvRemotePeer * remote)
+{
+  g_return_val_if_fail (remote != NULL, 0);
+
+  return remote->priv->video_layer;
+}
+
+/* Without simulcast, all the remotes get the same video, so it must be good
+ * enough for the one that shows it the biggest. Called with the lock TAKEN */
+static void
+ov_local_peer_update_view_quality (OvLocalPeer * local)
+{
+  guint ii, reso, fps;
+  OvRemotePeer *remote;
+  OvVideoQuality ceiling, current, target;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->transmit == NULL || priv->n_active_video_layers > 1)
+    return;
+
+  reso = fps = 0;
+  ceiling = OV_VIDEO_QUALITY_INVALID;
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    remote = g_ptr_array_index (priv->remote_peers, ii);
+    if (remote->priv->send_view_quality == OV_VIDEO_QUALITY_INVALID)
+      goto apply;
+    reso = MAX (reso,
+        remote->priv->send_view_quality & OV_VIDEO_QUALITY_RESO_RANGE);
+    fps = MAX (fps,
+        remote->priv->send_view_quality & OV_VIDEO_QUALITY_FPS_RANGE);
+  }
+  if (ii > 0)
+    ceiling = reso | fps;
+
+apply:
+  if (ceiling == priv->view_quality)
+    return;
+  priv->view_quality = ceiling;
+
+  /* Never above what the application wants either */
+  if (priv->cc.max_quality != OV_VIDEO_QUALITY_INVALID &&
+      (ceiling == OV_VIDEO_QUALITY_INVALID ||
+       ov_video_quality_above (ceiling, priv->cc.max_quality)))
+    ceiling = priv->cc.max_quality;
+
+  current = ov_local_peer_get_video_quality (local);
+  target = ov_local_peer_find_video_quality (local, ceiling);
+  if (target == OV_VIDEO_QUALITY_INVALID || target == current)
+    return;
+  /* Congestion control goes back up by itself when the network allows */
+  if (priv->cc.timeout_id > 0 && ov_video_quality_above (target, current))
+    return;
+
+  GST_DEBUG ("Remotes show our video at up to %#x, sending %#x",
+      priv->view_quality, target);
+  ov_local_peer_switch_video_quality (local, target);
+}
+
+/* Serves what @remote told us that it shows of our video with VIDEO_VIEW.
+ * With simulcast, it gets the best layer that isn't above that. Otherwise we
+ * encode at no more than the remotes want between them. Called with the lock
+ * TAKEN */
+void
+ov_remote_peer_apply_video_view (OvRemotePeer * remote)
+{
+  guint layer;
+  OvVideoQuality quality;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  if (local_priv->transmit == NULL)
+    return;
+
+  if (local_priv->n_active_video_layers <= 1) {
+    ov_local_peer_update_view_quality (remote->local);
+    return;
+  }
+
+  /* Layers are in decreasing quality; the last one is the best we can do */
+  for (layer = 0; layer < local_priv->n_active_video_layers - 1; layer++) {
+    quality = ov_local_peer_get_video_layer_quality (remote->local, layer);
+    if (!ov_video_quality_above (quality, remote->priv->send_view_quality))
+      break;
+  }
+  ov_remote_peer_switch_video_layer (remote, layer);
+}
+
+static gboolean
+ov_local_peer_discovery_send (OvLocalPeer * local, GError ** error)
+{
+  gboolean ret;
+
+  /* Broadcast to the entire subnet to find listening peers */
+  ret = ov_discovery_send_multicast (local, OV_UDP_MSG_TYPE_MULTICAST_DISCOVER,
+      NULL, error);
+  if (!ret)
+    return ret;
+
+  g_signal_emit_by_name (local, "discovery-sent");
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+discovery_send_cb (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->discover_socket_source == NULL ||
+      g_source_is_destroyed (priv->discover_socket_source))
+    return G_SOURCE_REMOVE;
+
+  ov_local_peer_discovery_send (local, NULL);
+
+  /* We must always return CONTINUE here unless the source has been destroyed */
   return G_SOURCE_CONTINUE;
 }
 
+/* When peers announce themselves, we only probe a few times at startup to find
+ * the ones that are already there, backing off in between */
 static gboolean
-discovery_send_cb (OvLocalPeer * local)
+discovery_startup_probe_cb (OvLocalPeer * local)
 {
   OvLocalPeerPrivate *priv;
 
   priv = ov_local_peer_get_private (local);
+  priv->discover_probe_source_id = 0;
 
   if (priv->discover_socket_source == NULL ||
       g_source_is_destroyed (priv->discover_socket_source))
@@ -1024,8 +2457,15 @@ discovery_send_cb (OvLocalPeer * local)
 
   ov_local_peer_discovery_send (local, NULL);
 
-  /* We must always return CONTINUE here unless the source has been destroyed */
-  return G_SOURCE_CONTINUE;
+  if (--priv->discover_probes_left > 0) {
+    priv->discover_interval *= 2;
+    priv->discover_probe_source_id = g_timeout_add (
+        g_random_int_range (priv->discover_interval * 750,
+          priv->discover_interval * 1250 + 1),
+        (GSourceFunc) discovery_startup_probe_cb, local);
+  }
+
+  return G_SOURCE_REMOVE;
 }
 
 static gboolean
@@ -1086,6 +2526,10 @@ out:
  * seconds between multicast UDP probes for peers. Setting @interval to 0 uses
  * the default duration (5 seconds).
  *
+ * If ov_local_peer_set_announce_presence() is on, @interval is ignored. Peers
+ * are only probed a few times at startup, and are then discovered by their
+ * presence announcements.
+ *
  * Returns: %TRUE if discovery was started successfully, %FALSE otherwise
  */
 gboolean
@@ -1127,8 +2571,17 @@ ov_local_peer_discovery_start (OvLocalPeer * local, guint interval,
     return FALSE;
   }
 
-  g_timeout_add_seconds (interval ? interval : 5,
-      (GSourceFunc) discovery_send_cb, local);
+  if (priv->announce_presence) {
+    /* Including the one we just sent */
+    priv->discover_probes_left = 2;
+    priv->discover_interval = 1;
+    priv->discover_probe_source_id = g_timeout_add (
+        g_random_int_range (750, 1251),
+        (GSourceFunc) discovery_startup_probe_cb, local);
+  } else {
+    g_timeout_add_seconds (interval ? interval : 5,
+        (GSourceFunc) discovery_send_cb, local);
+  }
 
   return ret;
 }
@@ -1140,6 +2593,11 @@ ov_local_peer_discovery_stop (OvLocalPeer * local)
 
   priv = ov_local_peer_get_private (local);
 
+  if (priv->discover_probe_source_id > 0) {
+    g_source_remove (priv->discover_probe_source_id);
+    priv->discover_probe_source_id = 0;
+  }
+
   if (priv->discover_socket_source == NULL ||
       g_source_is_destroyed (priv->discover_socket_source))
     return;
@@ -1153,6 +2611,46 @@ ov_local_peer_discovery_stop (OvLocalPeer * local)
   g_clear_pointer (&priv->discover_socket_source, g_source_unref);
 }
 
+/**
+ * ov_local_peer_set_announce_presence:
+ * @local: the local peer
+ * @announce: whether to announce our presence
+ *
+ * Instead of answering the discovery probes that every peer looking for others
+ * keeps sending, peers can multicast their presence when they start and when
+ * they become available again after a call. Announcements back off
+ * exponentially with some jitter, up to one every
+ * %OV_PRESENCE_ANNOUNCE_MAX_INTERVAL seconds. Peers looking for others then
+ * only probe at startup. Probes are still answered for peers that don't do
+ * this.
+ */
+void
+ov_local_peer_set_announce_presence (OvLocalPeer * local, gboolean announce)
+{
+  OvLocalPeerPrivate *priv;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  priv->announce_presence = announce;
+  if (!announce)
+    ov_local_peer_stop_announcing (local);
+  else if (ov_local_peer_get_state (local) >= OV_LOCAL_STATE_STARTED)
+    ov_local_peer_announce_presence (local);
+
+  ov_local_peer_unlock (local);
+}
+
+gboolean
+ov_local_peer_get_announce_presence (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  return priv->announce_presence;
+}
+
 GPtrArray *
 ov_local_peer_get_remotes (OvLocalPeer * local)
 {
@@ -1167,7 +2665,7 @@ ov_local_peer_get_remote_by_id (OvLocalPeer * local,
     const gchar * id)
 {
   guint ii;
-  OvRemotePeer *remote;
+  OvRemotePeer *remote = NULL;
   OvLocalPeerPrivate *priv;
 
   ov_local_peer_lock (local);
@@ -1175,8 +2673,9 @@ ov_local_peer_get_remote_by_id (OvLocalPeer * local,
 
   for (ii = 0; ii < priv->remote_peers->len; ii++) {
     remote = g_ptr_array_index (priv->remote_peers, ii);
-    if (g_strcmp0 (id, remote->id))
+    if (g_strcmp0 (id, remote->id) == 0)
       break;
+    remote = NULL;
   }
   ov_local_peer_unlock (local);
 
@@ -1188,69 +2687,252 @@ append_clients (gpointer data, gpointer user_data)
 {
   OvRemotePeer *remote = data;
   GString **clients = user_data;
+  OvLocalPeerPrivate *local_priv;
+  guint layer;
   gchar *addr_s;
 
+  local_priv = ov_local_peer_get_private (remote->local);
+  layer = remote->priv->video_layer;
+  if (layer >= local_priv->n_active_video_layers)
+    layer = 0;
+
   addr_s = g_inet_address_to_string (
       g_inet_socket_address_get_address (remote->addr));
 
-  g_string_append_printf (clients[0], "%s:%u,", addr_s,
-      remote->priv->send_ports[0]);
+  /* The RTP ports are 0 if the remote gets our RTP from the multicast group */
+  if (remote->priv->send_ports[0] != 0)
+    g_string_append_printf (clients[0], "%s:%u,", addr_s,
+        remote->priv->send_ports[0]);
   g_string_append_printf (clients[1], "%s:%u,", addr_s,
       remote->priv->send_ports[1]);
-  g_string_append_printf (clients[2], "%s:%u,", addr_s,
-      remote->priv->send_ports[3]);
+  /* Video RTP for simulcast layers other than 0 goes after the rest */
+  if (remote->priv->send_ports[3] != 0)
+    g_string_append_printf (clients[layer == 0 ? 2 : 3 + layer], "%s:%u,",
+        addr_s, remote->priv->send_ports[3]);
   g_string_append_printf (clients[3], "%s:%u,", addr_s,
       remote->priv->send_ports[4]);
 
   g_free (addr_s);
 }
 
-/* Called with the lock TAKEN */
+/* Set up the transmit pipeline and the sockets that its RTCP udpsrcs need
+ * before going to READY, and save the media it's for. Called with the lock
+ * TAKEN */
 static gboolean
-ov_local_peer_begin_transmit (OvLocalPeer * local)
+ov_local_peer_setup_transmit (OvLocalPeer * local)
 {
   GSocket *socket;
-  GString **clients;
   gchar *local_addr_s;
   GInetSocketAddress *addr;
-  GstStateChangeReturn ret;
   OvLocalPeerPrivate *priv;
 
   priv = ov_local_peer_get_private (local);
 
-  /* {audio RTP, audio RTCP SR, video RTP, video RTCP SR} */
-  clients = g_malloc0_n (sizeof (GString*), 4);
-  clients[0] = g_string_new ("");
-  clients[1] = g_string_new ("");
-  clients[2] = g_string_new ("");
-  clients[3] = g_string_new ("");
-  g_ptr_array_foreach (priv->remote_peers, append_clients, clients);
+  if (!ov_local_peer_setup_transmit_pipeline (local))
+    return FALSE;
 
   g_object_get (OV_PEER (local), "address", &addr, NULL);
   local_addr_s =
     g_inet_address_to_string (g_inet_socket_address_get_address (addr));
   g_object_unref (addr);
 
-  /* Send audio RTP to all remote peers */
-  g_object_set (priv->asend_rtp_sink, "clients", clients[0]->str, NULL);
-  /* Send audio RTCP SRs to all remote peers */
+  /* Send audio RTCP SRs and recv audio RTCP RRs from all remote peers on the
+   * same socket */
   socket = ov_get_socket_for_addr (local_addr_s, priv->recv_rtcp_ports[0]);
-  g_object_set (priv->asend_rtcp_sink, "clients", clients[1]->str,
-      "socket", socket, NULL);
-  /* Recv audio RTCP RRs from all remote peers (same socket as above) */
+  g_object_set (priv->asend_rtcp_sink, "socket", socket, NULL);
   g_object_set (priv->arecv_rtcp_src, "socket", socket, NULL);
   g_object_unref (socket);
 
-  /* Send video RTP to all remote peers */
-  g_object_set (priv->vsend_rtp_sink, "clients", clients[2]->str, NULL);
-  /* Send video RTCP SRs to all remote peers */
+  /* Same for video */
   socket = ov_get_socket_for_addr (local_addr_s, priv->recv_rtcp_ports[1]);
-  g_object_set (priv->vsend_rtcp_sink, "clients", clients[3]->str,
-      "socket", socket, NULL);
-  /* Recv video RTCP RRs from all remote peers (same socket as above) */
+  g_object_set (priv->vsend_rtcp_sink, "socket", socket, NULL);
   g_object_set (priv->vrecv_rtcp_src, "socket", socket, NULL);
   g_object_unref (socket);
 
+  g_free (local_addr_s);
+
+  gst_caps_replace (&priv->warm_acaps, priv->send_acaps);
+  gst_caps_replace (&priv->warm_vcaps, priv->send_vcaps);
+  priv->warm_repair = priv->send_repair;
+  priv->warm_dtx = priv->send_dtx;
+
+  return TRUE;
+}
+
+/* Whether the transmit pipeline running outside of a call is for the media
+ * that were negotiated for the current call. Called with the lock TAKEN */
+static gboolean
+ov_local_peer_can_reuse_transmit (OvLocalPeerPrivate * priv)
+{
+  return priv->transmit_warm && priv->warm_repair == priv->send_repair &&
+    priv->warm_dtx == priv->send_dtx &&
+    gst_caps_is_equal (priv->warm_acaps, priv->send_acaps) &&
+    gst_caps_is_equal (priv->warm_vcaps, priv->send_vcaps);
+}
+
+static gpointer
+ov_local_peer_warm_transmit_thread (GstElement * transmit)
+{
+  GstStateChangeReturn ret;
+
+  /* Opening the devices is what takes most of the time */
+  ret = gst_element_set_state (transmit, GST_STATE_PLAYING);
+  if (ret == GST_STATE_CHANGE_FAILURE)
+    GST_WARNING ("Unable to warm up the transmit pipeline; state change "
+        "failed");
+  else
+    GST_DEBUG ("Transmit pipeline is warm");
+  gst_object_unref (transmit);
+
+  return NULL;
+}
+
+/* Start capturing and encoding ahead of the call, once the media that we send
+ * have been negotiated. Does nothing unless warm standby is enabled.
+ * Called with the lock TAKEN */
+void
+ov_local_peer_warm_transmit (OvLocalPeer * local)
+{
+  GstCaps *vcaps;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* Relays don't transmit, and a recording starts with its call */
+  if (!priv->warm_transmit || priv->relay || priv->record_dir != NULL)
+    return;
+
+  if (ov_local_peer_can_reuse_transmit (priv)) {
+    /* Kept running since the previous call; start from the best quality like
+     * a new pipeline would */
+    vcaps = gst_caps_fixate (gst_caps_copy (priv->send_vcaps));
+    ov_local_peer_set_transmit_video_caps (local, vcaps);
+    gst_caps_unref (vcaps);
+    GST_DEBUG ("Reusing the warm transmit pipeline");
+    return;
+  }
+
+  if (priv->transmit != NULL)
+    /* Running for other media */
+    ov_local_peer_stop_transmit (local);
+
+  if (!ov_local_peer_setup_transmit (local)) {
+    GST_WARNING ("Unable to setup the transmit pipeline ahead of the call");
+    return;
+  }
+
+  priv->transmit_warm = TRUE;
+  priv->warm_thread = g_thread_new ("ov-warm-transmit",
+      (GThreadFunc) ov_local_peer_warm_transmit_thread,
+      gst_object_ref (priv->transmit));
+}
+
+/* The video caps that we offer to send or receive in REPLY_CAPS, with the
+ * fields for the ways of repairing lost packets and for multicast that we can
+ * do. Called with the lock TAKEN */
+GstCaps *
+ov_local_peer_get_offered_vcaps (OvLocalPeer * local, gboolean send)
+{
+  GstCaps *caps, *ret;
+  gboolean multicast;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (!send && priv->relay) {
+    /* We forward whatever the others can decode */
+    caps = gst_caps_from_string (VIDEO_FORMAT_JPEG CAPS_STRUC_SEP
+        VIDEO_FORMAT_H264);
+    ret = ov_caps_with_rtp_repair (caps,
+        OV_RTP_REPAIR_RTX | OV_RTP_REPAIR_ULPFEC);
+    gst_caps_unref (caps);
+    return ret;
+  }
+
+  if (send) {
+    caps = ov_caps_with_rtp_repair (priv->supported_send_vcaps,
+        _ov_gst_get_rtp_repair (TRUE));
+    /* Everyone on the group gets the same video, so there are no layers to
+     * pick from */
+    multicast = priv->multicast_media && priv->n_video_layers == 1;
+  } else {
+    caps = gst_caps_ref (priv->supported_recv_vcaps);
+    /* The shared udpsrcs are bound to our own address */
+    multicast = priv->multicast_media && !priv->shared_receive;
+  }
+
+  if (!multicast)
+    return caps;
+
+  ret = ov_caps_with_multicast (caps, NULL, 0);
+  gst_caps_unref (caps);
+  return ret;
+}
+
+/* The caps that we send in the call {audio, video} as they were in our
+ * CALL_DETAILS, with the DTX and RTP repair flags; for telling a peer that
+ * joins the call later. Called with the lock TAKEN */
+gchar *
+ov_local_peer_get_send_caps_string (OvLocalPeer * local, guint session)
+{
+  gchar *ret;
+  GstCaps *caps;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (session == OV_VIDEO_RTP_SESSION)
+    caps = ov_caps_with_rtp_repair (priv->send_vcaps, priv->send_repair);
+  else if (priv->send_dtx)
+    caps = ov_caps_with_flag (priv->send_acaps, "dtx");
+  else
+    caps = gst_caps_ref (priv->send_acaps);
+
+  ret = gst_caps_to_string (caps);
+  gst_caps_unref (caps);
+  return ret;
+}
+
+/* Called with the lock TAKEN */
+static gboolean
+ov_local_peer_begin_transmit (OvLocalPeer * local)
+{
+  guint ii;
+  GString **clients;
+  GstStateChangeReturn ret;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* {audio RTP, audio RTCP SR, video RTP, video RTCP SR,
+   *  video RTP for simulcast layers 1..n} */
+  clients = g_malloc0_n (sizeof (GString*), 3 + OV_MAX_VIDEO_LAYERS);
+  for (ii = 0; ii < 3 + OV_MAX_VIDEO_LAYERS; ii++)
+    clients[ii] = g_string_new ("");
+  g_ptr_array_foreach (priv->remote_peers, append_clients, clients);
+  /* Each RTP packet is sent once to the multicast group for all the remotes
+   * that receive from it */
+  if (priv->send_multicast_port != 0) {
+    g_string_append_printf (clients[0], "%s:%u,", priv->multicast_group,
+        priv->send_multicast_port);
+    g_string_append_printf (clients[2], "%s:%u,", priv->multicast_group,
+        priv->send_multicast_port + 2);
+  }
+
+  /* Send audio RTP to all remote peers */
+  g_object_set (priv->asend_rtp_sink, "clients", clients[0]->str, NULL);
+  /* Send audio RTCP SRs to all remote peers */
+  g_object_set (priv->asend_rtcp_sink, "clients", clients[1]->str, NULL);
+
+  /* Send video RTP to all remote peers */
+  g_object_set (priv->vsend_rtp_sink, "clients", clients[2]->str, NULL);
+  for (ii = 1; ii < priv->n_active_video_layers; ii++)
+    g_object_set (priv->video_layers[ii].sink, "clients",
+        clients[3 + ii]->str, NULL);
+  /* Send video RTCP SRs to all remote peers */
+  g_object_set (priv->vsend_rtcp_sink, "clients", clients[3]->str, NULL);
+
+  /* Does nothing if the pipeline was warm */
   ret = gst_element_set_state (priv->transmit, GST_STATE_PLAYING);
   if (ret == GST_STATE_CHANGE_FAILURE)
     GST_ERROR ("Unable to begin transmitting; state change failed");
@@ -1258,12 +2940,16 @@ ov_local_peer_begin_transmit (OvLocalPeer * local)
     GST_DEBUG ("Transmitting to remote peers. Audio: %s Video: %s",
         clients[0]->str, clients[2]->str);
 
-  g_string_free (clients[0], TRUE);
-  g_string_free (clients[1], TRUE);
-  g_string_free (clients[2], TRUE);
-  g_string_free (clients[3], TRUE);
+  if (priv->transmit_warm) {
+    /* The encoders have been running, so the remotes can't decode anything
+     * till the next keyframe */
+    ov_local_peer_send_video_keyframe (local);
+    priv->transmit_warm = FALSE;
+  }
+
+  for (ii = 0; ii < 3 + OV_MAX_VIDEO_LAYERS; ii++)
+    g_string_free (clients[ii], TRUE);
   g_free (clients);
-  g_free (local_addr_s);
 
   return ret != GST_STATE_CHANGE_FAILURE;
 }
@@ -1300,11 +2986,77 @@ ov_local_peer_remove_remote (OvLocalPeer * local, OvRemotePeer * remote)
   local_priv = ov_local_peer_get_private (local);
   /* Remove from the peers list first so nothing else tries to use it */
   g_ptr_array_remove (local_priv->remote_peers, remote);
+  if (local_priv->relay)
+    ov_local_peer_relay_remove_remote (local, remote);
+  /* It may have been the one showing our video the biggest */
+  ov_local_peer_update_view_quality (local);
   ov_local_peer_unlock (local);
 
   ov_remote_peer_remove_not_array (remote);
 }
 
+/* Sets up @remote, which is joining the call that we're in, and starts
+ * receiving from it and transmitting to it. Nothing is rebuilt and the streams
+ * of the other remotes aren't touched: its branches are added to the receive
+ * and playback pipelines that are already PLAYING, and it's added to the
+ * clients of our sinks. It's sent a keyframe once we hear from it, since our
+ * encoders are in the middle of a GOP. If this fails, @remote must be removed
+ * with ov_local_peer_remove_remote(). Called with the lock TAKEN */
+gboolean
+ov_local_peer_start_joined_remote (OvLocalPeer * local, OvRemotePeer * remote)
+{
+  gboolean res;
+  GstStateChangeReturn ret;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_assert (!priv->relay);
+
+  g_ptr_array_add (priv->remote_peers, remote);
+  ov_remote_peer_watch_liveness (remote);
+
+  res = ov_local_peer_setup_remote (local, remote);
+  g_assert (res);
+
+  if (priv->shared_receive) {
+    if (!gst_element_sync_state_with_parent (remote->receive))
+      goto recv_fail;
+  } else {
+    ret = gst_element_set_state (remote->receive, GST_STATE_PLAYING);
+    if (ret == GST_STATE_CHANGE_FAILURE)
+      goto recv_fail;
+  }
+
+  if (remote->priv->audio_proxysrc != NULL &&
+      !gst_element_sync_state_with_parent (remote->priv->aplayback))
+    goto play_fail;
+  if (remote->priv->video_proxysrc != NULL &&
+      !gst_element_sync_state_with_parent (remote->priv->vplayback))
+    goto play_fail;
+  remote->state = OV_REMOTE_STATE_PLAYING;
+
+  /* Start transmitting; it shows our video at full size till it tells us */
+  g_atomic_int_set (&remote->priv->needs_keyframe, TRUE);
+  ov_remote_peer_emit_transmit_clients (remote, "add");
+  ov_local_peer_update_view_quality (local);
+  /* We've been showing the others for a while already */
+  if (remote->priv->recv_view_quality != OV_VIDEO_QUALITY_INVALID)
+    ov_remote_peer_send_video_view (remote);
+
+  GST_DEBUG ("Remote %s joined the call, receiving on ports %u, %u, %u, %u",
+      remote->addr_s, remote->priv->recv_ports[0], remote->priv->recv_ports[1],
+      remote->priv->recv_ports[2], remote->priv->recv_ports[3]);
+  return TRUE;
+
+recv_fail:
+  GST_ERROR ("Unable to start receiving from %s", remote->addr_s);
+  return FALSE;
+play_fail:
+  GST_ERROR ("Unable to start playing back %s", remote->addr_s);
+  return FALSE;
+}
+
 gboolean
 ov_local_peer_start (OvLocalPeer * local)
 {
@@ -1329,9 +3081,14 @@ ov_local_peer_start (OvLocalPeer * local)
     priv->mc_ifaces = ov_get_network_interfaces ();
 
   GST_DEBUG ("Starting device monitor");
-  /* Start probing devices asynchronously. We don't listen to the bus messages
-   * for this right now, and just get the list of all devices later. */
+  /* Start probing devices asynchronously. The caps cache listens to the bus
+   * messages to probe the usable caps of each device as it is found. */
   gst_device_monitor_start (priv->dm);
+  ov_device_caps_cache_start (priv->device_caps, priv->dm);
+
+  /* Bind the receive ports of the first remotes ahead of time */
+  if (!priv->shared_receive)
+    ov_socket_pool_start (priv->socket_pool);
 
   /*-- Setup various pipelines and resources --*/
 
@@ -1355,74 +3112,189 @@ out:
   return ret;
 err:
   ret = FALSE;
+  ov_device_caps_cache_stop (priv->device_caps);
   gst_device_monitor_stop (priv->dm);
+  ov_socket_pool_stop (priv->socket_pool);
   g_list_free_full (priv->mc_ifaces, g_free);
   priv->mc_ifaces = NULL;
   goto out;
 }
 
+typedef struct _OvLivenessSource OvLivenessSource;
+
+/* Dispatched on the default main context when the liveness deadline of a
+ * remote is up, or when one of its rtpbins tells us something about it */
+struct _OvLivenessSource {
+  GSource source;
+  OvLocalPeer *local;
+};
+
+static gboolean ov_remote_peer_check_liveness (OvLivenessSource * source);
+
 static gboolean
-ov_local_peer_check_timeouts (OvLocalPeer * local)
+ov_liveness_source_dispatch (GSource * source, GSourceFunc callback,
+    gpointer user_data)
+{
+  return ov_remote_peer_check_liveness ((OvLivenessSource *) source);
+}
+
+static GSourceFuncs ov_liveness_source_funcs = {
+  NULL, NULL, ov_liveness_source_dispatch, NULL
+};
+
+/* Called with the lock TAKEN */
+static OvRemotePeer *
+ov_local_peer_get_remote_by_liveness_source (OvLocalPeer * local,
+    GSource * source)
 {
   guint ii;
-  gint64 current_time;
-  GPtrArray *remotes;
-  GPtrArray *timedout = g_ptr_array_new ();
-  GPtrArray *removed = g_ptr_array_new ();
-  gboolean all_remotes_gone = FALSE;
+  OvRemotePeer *remote;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    remote = g_ptr_array_index (priv->remote_peers, ii);
+    if (remote->priv->liveness_source == source)
+      return remote;
+  }
+
+  return NULL;
+}
 
-  GST_DEBUG ("Checking for remote timeouts...");
+/* A remote is gone when it says BYE, or when we haven't had any RTCP from it
+ * for remote_timeout ms. Its video is stalled when it stops sending RTP for it
+ * but keeps sending RTCP; see ov_remote_peer_stall_video().
+ *
+ * The remote might have been removed by another thread since this source was
+ * woken up, so it's looked up again instead of being passed to us. */
+static gboolean
+ov_remote_peer_check_liveness (OvLivenessSource * source)
+{
+  guint events;
+  gint64 now, timeout;
+  gboolean timedout, all_remotes_gone, stalled = FALSE;
+  OvPeer *peer = NULL;
+  OvRemotePeer *remote;
+  OvLocalPeer *local = source->local;
+  OvLocalPeerPrivate *priv;
 
   ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
 
-  if (ov_local_peer_get_state (local) == OV_LOCAL_STATE_STOPPED) {
-    GST_DEBUG ("Already stopped; skipping timeout check");
+  remote = ov_local_peer_get_remote_by_liveness_source (local,
+      (GSource *) source);
+  if (remote == NULL) {
+    ov_local_peer_unlock (local);
     return G_SOURCE_REMOVE;
   }
 
-  current_time = g_get_monotonic_time ();
-  remotes = ov_local_peer_get_remotes (local);
-  for (ii = 0; ii < remotes->len; ii++) {
-    OvRemotePeer *remote = g_ptr_array_index (remotes, ii);
-    if ((current_time - remote->last_seen) >
-        OV_REMOTE_PEER_TIMEOUT_SECONDS * G_USEC_PER_SEC)
-      g_ptr_array_add (timedout, remote);
+  events = g_atomic_int_and (&remote->priv->liveness_events, 0);
+  now = g_get_monotonic_time ();
+  timeout = priv->remote_timeout * G_TIME_SPAN_MILLISECOND;
+
+  if (remote->state == OV_REMOTE_STATE_PAUSED) {
+    /* We aren't listening, so there's nothing to hear */
+    remote->last_seen = now;
+    goto rearm;
   }
 
-  if (timedout->len == remotes->len)
-    all_remotes_gone = TRUE;
+  if (events & OV_LIVENESS_BYE) {
+    GST_DEBUG ("Remote peer %s said BYE, removing...", remote->addr_s);
+    timedout = FALSE;
+    goto gone;
+  }
 
-  for (ii = 0; ii < timedout->len; ii++) {
-    OvRemotePeer *remote = g_ptr_array_index (timedout, ii);
-    OvPeer *peer = ov_peer_new (remote->addr);
+  if (now - remote->last_seen >= timeout) {
     GST_DEBUG ("Remote peer %s timed out, removing...", remote->addr_s);
-    ov_local_peer_remove_remote (local, remote);
-    g_ptr_array_add (removed, peer);
+    timedout = TRUE;
+    goto gone;
+  }
+
+  /* It can only resume after it has stalled and then stall again after
+   * resuming, so the order in which they happened is always this one */
+  stalled = remote->priv->video_stalled;
+  if (events & OV_LIVENESS_RESUMED)
+    stalled = FALSE;
+  /* Nothing to wait for if it told us it stopped sending video */
+  if (events & OV_LIVENESS_STALLED &&
+      !remote->priv->recv_muted[OV_VIDEO_RTP_SESSION])
+    stalled = TRUE;
+  if (stalled != remote->priv->video_stalled) {
+    ov_remote_peer_stall_video (remote, stalled);
+    peer = ov_peer_new (remote->addr);
   }
 
+rearm:
+  g_source_set_ready_time ((GSource *) source, remote->last_seen + timeout);
+  /* Don't sleep through whatever happened while we were checking */
+  if (g_atomic_int_get (&remote->priv->liveness_events) != 0)
+    g_source_set_ready_time ((GSource *) source, 0);
   ov_local_peer_unlock (local);
-  g_ptr_array_free (timedout, TRUE);
 
-  for (ii = 0; ii < removed->len; ii++) {
-    OvPeer *peer = g_ptr_array_index (removed, ii);
-    g_signal_emit_by_name (local, "call-remote-gone", peer, TRUE);
+  /* Emit signal after unlocking */
+  if (peer != NULL) {
+    g_signal_emit_by_name (local, "call-remote-stalled", peer, stalled);
     g_object_unref (peer);
   }
-  g_ptr_array_free (removed, TRUE);
+  return G_SOURCE_CONTINUE;
 
-  if (!all_remotes_gone)
-    return G_SOURCE_CONTINUE;
+gone:
+  peer = ov_peer_new (remote->addr);
+  /* Frees the remote, which destroys this source */
+  ov_local_peer_remove_remote (local, remote);
+  all_remotes_gone = priv->remote_peers->len == 0;
+  ov_local_peer_unlock (local);
 
-  g_signal_emit_by_name (local, "call-all-remotes-gone");
+  g_signal_emit_by_name (local, "call-remote-gone", peer, timedout);
+  g_object_unref (peer);
+  if (all_remotes_gone)
+    g_signal_emit_by_name (local, "call-all-remotes-gone");
   return G_SOURCE_REMOVE;
 }
 
+/* Starts watching whether @remote is still in the call, from the RTCP that
+ * it sends us. Relays don't send anything that would tell us they're there,
+ * so they aren't watched. Called with the lock TAKEN when @remote starts
+ * PLAYING */
+void
+ov_remote_peer_watch_liveness (OvRemotePeer * remote)
+{
+  GSource *source;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (remote->local);
+
+  remote->last_seen = g_get_monotonic_time ();
+  if (remote->priv->is_relay || remote->priv->liveness_source != NULL)
+    return;
+
+  source = g_source_new (&ov_liveness_source_funcs, sizeof (OvLivenessSource));
+  ((OvLivenessSource *) source)->local = remote->local;
+  g_source_set_ready_time (source,
+      remote->last_seen + priv->remote_timeout * G_TIME_SPAN_MILLISECOND);
+  g_source_attach (source, NULL);
+  remote->priv->liveness_source = source;
+}
+
+/* Called from a streaming thread when one of the rtpbins that @remote is in
+ * tells us something about its sources. The liveness source is woken up right
+ * away to handle it; OV_LIVENESS_CHECK only makes it look at last_seen. */
+void
+ov_remote_peer_liveness_event (OvRemotePeer * remote, OvLivenessEvent event)
+{
+  if (remote->priv->liveness_source == NULL)
+    return;
+
+  g_atomic_int_or (&remote->priv->liveness_events, event);
+  g_source_set_ready_time (remote->priv->liveness_source, 0);
+}
+
 gboolean
 ov_local_peer_call_start (OvLocalPeer * local)
 {
-  guint index;
+  guint index, span;
   gboolean res;
-  gint current_time;
   GstStateChangeReturn ret;
   OvRemotePeer *remote;
   OvLocalPeerPrivate *priv;
@@ -1438,32 +3310,73 @@ ov_local_peer_call_start (OvLocalPeer * local)
     return FALSE;
   }
 
-  /* We can only setup the transmit pipeline once we know whether we will be
-   * transmitting H264 or JPEG */
-  res = ov_local_peer_setup_transmit_pipeline (local);
-  g_assert (res);
+  if (priv->relay) {
+    /* Nothing to transmit or play back */
+    span = ov_local_peer_trace_begin (local, "relay-playing", NULL);
+    if (!ov_local_peer_relay_start (local))
+      goto relay_fail;
+    ov_local_peer_trace_end (local, span);
+    goto playing;
+  }
+
+  if (ov_local_peer_can_reuse_transmit (priv)) {
+    /* Capture and encoding were started ahead of the call */
+    span = ov_local_peer_trace_begin (local, "transmit-warm-wait", NULL);
+    ov_local_peer_join_warm_transmit (priv);
+    ov_local_peer_trace_end (local, span);
+  } else {
+    if (priv->transmit != NULL)
+      /* Warm, but for other media */
+      ov_local_peer_stop_transmit (local);
+    /* We can only setup the transmit pipeline once we know whether we will
+     * be transmitting H264 or JPEG */
+    span = ov_local_peer_trace_begin (local, "transmit-setup", NULL);
+    res = ov_local_peer_setup_transmit (local);
+    g_assert (res);
+    ov_local_peer_trace_end (local, span);
+  }
 
   /* Setup the playback pipeline anew to avoid bugs with reuse of elements */
+  span = ov_local_peer_trace_begin (local, "playback-setup", NULL);
   res = ov_local_peer_setup_playback_pipeline (local);
   g_assert (res);
+  ov_local_peer_trace_end (local, span);
 
   /* Begin transmission */
+  span = ov_local_peer_trace_begin (local, "transmit-playing", NULL);
   res = ov_local_peer_begin_transmit (local);
   g_assert (res);
+  ov_local_peer_trace_end (local, span);
+
+  /* Adapt what we send to the network conditions */
+  ov_congestion_start (local);
+
+  /* The remotes are added to this as they're setup below */
+  if (priv->shared_receive) {
+    span = ov_local_peer_trace_begin (local, "receive-setup", NULL);
+    res = ov_local_peer_setup_receive_pipeline (local);
+    g_assert (res);
+    ov_local_peer_trace_end (local, span);
+  }
 
-  current_time = g_get_monotonic_time ();
   for (index = 0; index < priv->remote_peers->len; index++) {
     remote = g_ptr_array_index (priv->remote_peers, index);
-    remote->last_seen = current_time;
+    ov_remote_peer_watch_liveness (remote);
 
     /* Call details have all been set, so we can do the setup */
+    span = ov_local_peer_trace_begin (local, "receive-setup", remote->id);
     res = ov_local_peer_setup_remote (local, remote);
     g_assert (res);
+    ov_local_peer_trace_end (local, span);
 
     /* Start PLAYING the pipelines */
-    ret = gst_element_set_state (remote->receive, GST_STATE_PLAYING);
-    if (ret == GST_STATE_CHANGE_FAILURE) {
-      goto recv_fail;
+    if (!priv->shared_receive) {
+      span = ov_local_peer_trace_begin (local, "receive-playing", remote->id);
+      ret = gst_element_set_state (remote->receive, GST_STATE_PLAYING);
+      if (ret == GST_STATE_CHANGE_FAILURE) {
+        goto recv_fail;
+      }
+      ov_local_peer_trace_end (local, span);
     }
     GST_DEBUG ("Ready to receive data from %s on ports %u, %u, %u, %u",
         remote->addr_s, remote->priv->recv_ports[0],
@@ -1472,20 +3385,42 @@ ov_local_peer_call_start (OvLocalPeer * local)
     remote->state = OV_REMOTE_STATE_PLAYING;
   }
 
+  if (priv->shared_receive) {
+    span = ov_local_peer_trace_begin (local, "receive-playing", NULL);
+    ret = gst_element_set_state (priv->receive, GST_STATE_PLAYING);
+    if (ret == GST_STATE_CHANGE_FAILURE)
+      goto shared_recv_fail;
+    ov_local_peer_trace_end (local, span);
+  }
+
+  span = ov_local_peer_trace_begin (local, "playback-playing", NULL);
   ret = gst_element_set_state (priv->playback, GST_STATE_PLAYING);
   if (ret == GST_STATE_CHANGE_FAILURE)
     goto play_fail;
+  ov_local_peer_trace_end (local, span);
 
   GST_DEBUG ("Ready to playback data from all remotes");
+  /* Adapt how long we wait for late packets to the network conditions */
+  ov_jitterbuffer_start (local);
+  /* Tell the application who is talking */
+  ov_speaker_start (local);
+playing:
   /* The difference between negotiator and negotiatee ends with playback */
   ov_local_peer_set_state (local, OV_LOCAL_STATE_PLAYING);
+  /* The remotes assume that we send everything till we tell them otherwise */
+  if (priv->send_muted[OV_AUDIO_RTP_SESSION] ||
+      priv->send_muted[OV_VIDEO_RTP_SESSION])
+    ov_local_peer_send_mute_media (local);
+  /* ...and that we show all of their video */
+  for (index = 0; index < priv->remote_peers->len; index++) {
+    remote = g_ptr_array_index (priv->remote_peers, index);
+    if (remote->priv->recv_view_quality != OV_VIDEO_QUALITY_INVALID)
+      ov_remote_peer_send_video_view (remote);
+  }
   ov_local_peer_unlock (local);
 
-  priv->remotes_timeout_source =
-    g_timeout_source_new_seconds (OV_REMOTE_PEER_TIMEOUT_SECONDS/2);
-  g_source_set_callback (priv->remotes_timeout_source,
-      (GSourceFunc) ov_local_peer_check_timeouts, local, NULL);
-  g_source_attach (priv->remotes_timeout_source, NULL);
+  /* Emit signal after unlocking */
+  ov_local_peer_trace_finish (local, FALSE);
 
   return TRUE;
 
@@ -1500,6 +3435,18 @@ ov_local_peer_call_start (OvLocalPeer * local)
     ov_local_peer_unlock (local);
     return FALSE;
   }
+
+  shared_recv_fail: {
+    GST_ERROR ("Unable to set shared receive pipeline to PLAYING!");
+    ov_local_peer_unlock (local);
+    return FALSE;
+  }
+
+  relay_fail: {
+    GST_ERROR ("Unable to start relaying!");
+    ov_local_peer_unlock (local);
+    return FALSE;
+  }
 }
 
 /* Resets the local peer to a state equivalent to after callign
@@ -1519,6 +3466,8 @@ ov_local_peer_call_hangup (OvLocalPeer * local)
     ov_local_peer_send_end_call (local);
 
   GST_DEBUG ("Ending call on local peer");
+  ov_jitterbuffer_stop (local);
+  ov_speaker_stop (local);
   /* Remove all the remote peers added to the local peer */
   if (priv->remote_peers->len > 0) {
     g_ptr_array_foreach (priv->remote_peers,
@@ -1527,14 +3476,23 @@ ov_local_peer_call_hangup (OvLocalPeer * local)
     priv->remote_peers = g_ptr_array_new ();
   }
 
-  if (state >= OV_LOCAL_STATE_PLAYING) {
+  if (state >= OV_LOCAL_STATE_PLAYING && !priv->relay) {
     GST_DEBUG ("Stopping transmit and playback");
-    ov_local_peer_stop_transmit (local);
+    /* Each recording is of one call */
+    if (priv->warm_transmit && priv->recording == NULL)
+      ov_local_peer_idle_transmit (local);
+    else
+      ov_local_peer_stop_transmit (local);
+    ov_local_peer_stop_receive (local);
     ov_local_peer_stop_playback (local);
   }
 
   g_clear_pointer (&priv->send_acaps, gst_caps_unref);
   g_clear_pointer (&priv->send_vcaps, gst_caps_unref);
+  g_clear_pointer (&priv->multicast_group, g_free);
+  priv->send_multicast_port = 0;
+  /* Calls hung up before they started playing are not reported */
+  g_clear_pointer (&priv->call_trace, ov_call_trace_free);
   /* Revert state to STARTED */
   ov_local_peer_set_state (local, OV_LOCAL_STATE_STARTED);
   ov_local_peer_unlock (local);
@@ -1545,6 +3503,7 @@ ov_local_peer_stop (OvLocalPeer * local)
 {
   OvLocalPeerState state;
   OvLocalPeerPrivate *priv;
+  gboolean stop_tcp_server = FALSE;
 
   ov_local_peer_lock (local);
   priv = ov_local_peer_get_private (local);
@@ -1557,15 +3516,22 @@ ov_local_peer_stop (OvLocalPeer * local)
 
   if (state >= OV_LOCAL_STATE_READY)
     ov_local_peer_call_hangup (local);
+  /* Kept warm after the call, or warmed up for a call that didn't start */
+  if (priv->transmit != NULL)
+    ov_local_peer_stop_transmit (local);
 
   if (state >= OV_LOCAL_STATE_STARTED) {
     /* Stop video device monitor */
+    ov_device_caps_cache_stop (priv->device_caps);
     gst_device_monitor_stop (priv->dm);
+    /* Reserved ports are released as the remotes are freed */
+    ov_socket_pool_stop (priv->socket_pool);
 
-    /* Stop and free TCP server */
-    g_signal_handlers_disconnect_by_data (priv->tcp_server, local);
-    g_socket_service_stop (priv->tcp_server);
-    g_clear_object (&priv->tcp_server);
+    ov_local_peer_stop_announcing (local);
+
+    /* The TCP server is stopped below, after unlocking, since its handlers
+     * take the lock */
+    stop_tcp_server = TRUE;
 
     /* Stop and destroy multicast socket sources */
     g_clear_pointer (&priv->mc_socket_source, g_source_destroy);
@@ -1577,4 +3543,15 @@ ov_local_peer_stop (OvLocalPeer * local)
 
   ov_local_peer_set_state (local, OV_LOCAL_STATE_STOPPED);
   ov_local_peer_unlock (local);
+
+  if (stop_tcp_server && priv->tcp_thread != NULL) {
+    /* Stop and free TCP server once all its connections have been closed */
+    g_main_context_invoke (priv->tcp_context,
+        (GSourceFunc) ov_local_peer_stop_tcp_server, local);
+    g_thread_join (priv->tcp_thread);
+    priv->tcp_thread = NULL;
+    g_clear_pointer (&priv->tcp_loop, g_main_loop_unref);
+    g_clear_pointer (&priv->tcp_context, g_main_context_unref);
+    g_clear_object (&priv->tcp_server);
+  }
 }
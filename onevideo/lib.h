@@ -75,11 +75,21 @@ enum _OvVideoQuality {
   OV_VIDEO_QUALITY_1080P30      = OV_VIDEO_QUALITY_1080P | OV_VIDEO_QUALITY_30FPS,
 };
 
+/* Maximum number of simulcast video layers that can be sent */
+#define OV_MAX_VIDEO_LAYERS 3
+
+/* Longest time in seconds between two presence announcements by a peer;
+ * a peer that hasn't been heard from for twice this long has gone away */
+#define OV_PRESENCE_ANNOUNCE_MAX_INTERVAL 60
+
 /* Peer discovery */
 gboolean            ov_local_peer_discovery_start   (OvLocalPeer *local,
                                                      guint interval,
                                                      GError **error);
 void                ov_local_peer_discovery_stop    (OvLocalPeer *local);
+void                ov_local_peer_set_announce_presence (OvLocalPeer *local,
+                                                         gboolean announce);
+gboolean            ov_local_peer_get_announce_presence (OvLocalPeer *local);
 
 /* Setup, negotiation, and calling */
 void                ov_local_peer_add_remote        (OvLocalPeer *local,
@@ -91,6 +101,9 @@ gboolean            ov_local_peer_start             (OvLocalPeer *local);
 gboolean            ov_local_peer_negotiate_start   (OvLocalPeer *local);
 gboolean            ov_local_peer_negotiate_abort   (OvLocalPeer *local);
 gboolean            ov_local_peer_call_start        (OvLocalPeer *local);
+/* Asynchronously add a remote peer to the call that we negotiated */
+gboolean            ov_local_peer_call_add_remote   (OvLocalPeer *local,
+                                                     OvRemotePeer *remote);
 void                ov_local_peer_call_hangup       (OvLocalPeer *local);
 void                ov_local_peer_stop              (OvLocalPeer *local);
 
@@ -106,14 +119,247 @@ OvVideoQuality      ov_local_peer_get_lowest_video_quality        (OvLocalPeer *
 gboolean            ov_local_peer_set_video_quality               (OvLocalPeer *local,
                                                                    OvVideoQuality quality);
 gchar*              ov_video_quality_to_string                    (OvVideoQuality quality);
+OvVideoQuality      ov_video_caps_to_video_quality                (const GstCaps *caps);
+
+/* Congestion control adapts the bitrate, framerate, and as a last resort, the
+ * resolution of the video we send to the network conditions reported via
+ * RTCP. It also adapts the FEC overhead, which stays fixed when disabled.
+ * Enabled by default. See OvLocalPeer::congestion-control */
+void                ov_local_peer_set_congestion_control          (OvLocalPeer *local,
+                                                                   gboolean enabled);
+gboolean            ov_local_peer_get_congestion_control          (OvLocalPeer *local);
+
+/* Statistics delivered to subscribers; see ov_local_peer_subscribe_stats().
+ * Rates are over the time since the previous report. */
+typedef struct _OvStreamStats OvStreamStats;
+typedef struct _OvStats OvStats;
+
+struct _OvStreamStats {
+  /* The id of the remote, or "local" for what we send */
+  const gchar *id;
+  /* What we receive from the remote, or what we send for "local" */
+  guint64 bitrate;        /* bits per second */
+  guint packet_rate;      /* packets per second */
+  /* Totals for the current stream */
+  guint64 bytes;
+  guint64 packets;
+  /* How the remote receives what we send as told by its RTCP RRs; the worst
+   * of all the remotes for "local" */
+  gdouble loss;           /* percentage of packets lost */
+  guint jitter;           /* milliseconds */
+  guint round_trip;       /* milliseconds */
+  /* Glass-to-glass latency of what we receive from the remote, averaged over
+   * the frames played back since the previous report, in milliseconds. This
+   * is the sum of the time from capture till the remote sent it, over the
+   * network and through the jitterbuffer, in the decoder, and till playback.
+   * Relies on the clocks of both ends being synced with NTP. 0 for "local"
+   * and if nothing was played back. */
+  guint latency;
+  guint capture_latency;
+  guint network_latency;
+  guint decode_latency;
+  guint render_latency;
+};
+
+struct _OvStats {
+  /* "audio" or "video" */
+  const gchar *media_type;
+  /* Milliseconds since the previous report */
+  guint interval;
+  OvStreamStats local;
+  guint n_remotes;
+  OvStreamStats *remotes;
+};
+
+/* @stats is only valid till the function returns */
+typedef void      (*OvStatsFunc)                                  (OvLocalPeer *local,
+                                                                   const OvStats *stats,
+                                                                   gpointer user_data);
+
+/* Call @func every @interval_ms during calls with the stats of @media_type.
+ * Returns an id for ov_local_peer_unsubscribe_stats(), or 0 on error. */
+guint               ov_local_peer_subscribe_stats                 (OvLocalPeer *local,
+                                                                   const gchar *media_type,
+                                                                   guint interval_ms,
+                                                                   OvStatsFunc func,
+                                                                   gpointer user_data,
+                                                                   GDestroyNotify notify);
+void                ov_local_peer_unsubscribe_stats               (OvLocalPeer *local,
+                                                                   guint id);
+
+/* Simulcast: send several video layers of decreasing quality and pick the one
+ * sent to each remote. Must be set before the call is started. */
+gboolean            ov_local_peer_set_video_layers                (OvLocalPeer *local,
+                                                                   guint n_layers);
+guint               ov_local_peer_get_video_layers                (OvLocalPeer *local);
+OvVideoQuality      ov_local_peer_get_video_layer_quality         (OvLocalPeer *local,
+                                                                   guint layer);
+
+/* Longest run of frames without a keyframe in the H.264 that we encode.
+ * Remotes ask for a keyframe with RTCP when they join or lose packets, so this
+ * can be long to save bitrate. Defaults to OV_DEFAULT_KEYFRAME_INTERVAL. */
+gboolean            ov_local_peer_set_keyframe_interval           (OvLocalPeer *local,
+                                                                   guint frames);
+guint               ov_local_peer_get_keyframe_interval           (OvLocalPeer *local);
+
+/* How long we wait for RTCP from a remote before removing it from the call
+ * with OvLocalPeer::call-remote-gone. A remote that says BYE is removed right
+ * away, and one that keeps sending RTCP but stops sending video has its video
+ * decoding suspended till the video comes back; see
+ * OvLocalPeer::call-remote-stalled. At least 2 seconds; defaults to
+ * OV_DEFAULT_REMOTE_TIMEOUT_MS. */
+gboolean            ov_local_peer_set_remote_timeout              (OvLocalPeer *local,
+                                                                   guint timeout_ms);
+guint               ov_local_peer_get_remote_timeout              (OvLocalPeer *local);
+
+/* Streaming threads. Each pipeline already has threads wherever it has a
+ * queue: one captures and one encodes each media type that we send, one per
+ * media type depayloads and decodes what each remote sends, and one per media
+ * type plays it back. The CPU time used by each thread is in the "threads"
+ * field of OvLocalPeer::get-stats. */
+typedef enum {
+  /* Decode the video of a remote in the thread that depayloads it */
+  OV_THREAD_LAYOUT_DEFAULT,
+  /* Decode the video of each remote in a thread of its own */
+  OV_THREAD_LAYOUT_DECODE_THREADS,
+} OvThreadLayout;
+
+typedef enum {
+  OV_THREAD_ROLE_TRANSMIT,        /* capturing, encoding and sending */
+  OV_THREAD_ROLE_RECEIVE,         /* receiving, depayloading and decoding */
+  OV_THREAD_ROLE_PLAYBACK,        /* mixing and rendering */
+  OV_THREAD_ROLE_RECORDING,       /* see ov_local_peer_set_recording() */
+  OV_THREAD_ROLE_LAST
+} OvThreadRole;
+
+/* With OV_THREAD_LAYOUT_DECODE_THREADS, at most @max_decode_threads remotes
+ * get a decode thread, in the order in which we start receiving from them;
+ * the rest decode in the thread that depayloads. 0 means one for every
+ * remote. Applies to remotes that we start receiving from after this is
+ * called; OV_THREAD_LAYOUT_DEFAULT by default. */
+gboolean            ov_local_peer_set_thread_layout               (OvLocalPeer *local,
+                                                                   OvThreadLayout layout,
+                                                                   guint max_decode_threads);
+OvThreadLayout      ov_local_peer_get_thread_layout               (OvLocalPeer *local,
+                                                                   guint *max_decode_threads);
+
+/* Run the streaming threads of @role only on the CPUs set in the @cpus
+ * bitmask (bit 0 is CPU 0; 0 means any CPU), with the niceness @nice (-20 to
+ * 19; 0 leaves it alone). Negative values need CAP_SYS_NICE. Applies to
+ * threads that start after this is called. Only supported on Linux. */
+gboolean            ov_local_peer_set_thread_affinity             (OvLocalPeer *local,
+                                                                   OvThreadRole role,
+                                                                   guint64 cpus,
+                                                                   gint nice);
+
+/* Record calls into @directory without transcoding anything: the audio and
+ * video that we send and that each remote sends us are muxed as they are into
+ * Matroska files of about a minute each, named
+ * <date>-<time>-<peer id>-<n>.mkv. The timestamps in all of the files of a
+ * call are on the same timeline, so they can be lined up. Recording runs in
+ * threads with OV_THREAD_ROLE_RECORDING, which are niced by default, and
+ * drops data instead of holding up the call if it can't keep up. Video that
+ * the application hides is still recorded. Warm standby is off while
+ * recording. Applies to what we start sending and receiving after this is
+ * called; NULL turns it off, which is the default. */
+gboolean            ov_local_peer_set_recording                   (OvLocalPeer *local,
+                                                                   const gchar *directory);
+gchar*              ov_local_peer_get_recording                   (OvLocalPeer *local);
+
+/* Receive from all remotes on one set of ports with one RTP session per media
+ * type instead of a pipeline per remote. Must be set before any remotes are
+ * created. Off by default. */
+gboolean            ov_local_peer_set_shared_receive              (OvLocalPeer *local,
+                                                                   gboolean shared);
+gboolean            ov_local_peer_get_shared_receive              (OvLocalPeer *local);
+
+/* Warm standby: start capturing and encoding what we send as soon as the call
+ * details have been negotiated instead of when the call starts, and keep doing
+ * so between calls while sending nowhere. A call that negotiates the same
+ * media as the previous one reuses the running pipeline, so its first frames
+ * don't wait for the capture devices to open and settle. Keeps the capture
+ * devices open; off by default. */
+void                ov_local_peer_set_warm_transmit               (OvLocalPeer *local,
+                                                                   gboolean warm);
+gboolean            ov_local_peer_get_warm_transmit               (OvLocalPeer *local);
+
+/* Offer to send our RTP once to a multicast group for the whole call instead
+ * of to each remote, and to receive the RTP of remotes from it. The call uses
+ * the group if its negotiator turned this on too, and only between peers that
+ * both offer it; the rest of the RTP and all of the RTCP is unicast as usual.
+ * Not offered for sending with simulcast, or for receiving with shared
+ * receive. The LAN must route multicast. Takes effect from the next call; off
+ * by default. */
+void                ov_local_peer_set_multicast_media             (OvLocalPeer *local,
+                                                                   gboolean multicast);
+gboolean            ov_local_peer_get_multicast_media             (OvLocalPeer *local);
+
+/* Act as a forwarding relay for the calls that we negotiate, instead of being
+ * in them: each remote sends its RTP only to us, and we forward every packet
+ * as-is to the other remotes. Nothing is captured, decoded or played back
+ * here, so each remote only uploads one stream however big the call is.
+ * Incoming calls are refused. Can't be used with shared receive, and must be
+ * set before negotiating a call. Off by default. */
+gboolean            ov_local_peer_set_relay                       (OvLocalPeer *local,
+                                                                   gboolean relay);
+gboolean            ov_local_peer_get_relay                       (OvLocalPeer *local);
+
+/* Stop sending our audio or video, and tell the remotes so they can stop
+ * expecting it. What we capture is dropped right after the source, so nothing
+ * is encoded or sent, but RTCP keeps the call alive. Can be set at any time,
+ * and nothing is renegotiated; when video is sent again it starts with a
+ * keyframe. Not muted by default. */
+void                ov_local_peer_set_audio_muted                 (OvLocalPeer *local,
+                                                                   gboolean muted);
+gboolean            ov_local_peer_get_audio_muted                 (OvLocalPeer *local);
+void                ov_local_peer_set_video_muted                 (OvLocalPeer *local,
+                                                                   gboolean muted);
+gboolean            ov_local_peer_get_video_muted                 (OvLocalPeer *local);
+
+/* Use an audio test source and fakesinks instead of the audio devices and
+ * video windows, for running headless (benchmarks, for instance). Off by
+ * default. */
+gboolean            ov_local_peer_set_test_media                  (OvLocalPeer *local,
+                                                                   gboolean test_media);
+gboolean            ov_local_peer_get_test_media                  (OvLocalPeer *local);
+
+/* Composite the video of all remotes into one gtk widget instead of using
+ * ov_remote_peer_add_gtksink() for each remote */
+gpointer            ov_local_peer_add_compositor_gtksink          (OvLocalPeer *local);
 
 /* Remote peers */
 gpointer            ov_remote_peer_add_gtksink        (OvRemotePeer *remote);
+void                ov_remote_peer_set_video_rect     (OvRemotePeer *remote,
+                                                       gint x, gint y,
+                                                       gint width, gint height);
+/* Receiver-driven quality: remotes send us no more than the size we show their
+ * video at, from a lower simulcast layer or a smaller encoding, and next to
+ * nothing while it's hidden. Set by ov_remote_peer_set_video_rect(). */
+void                ov_remote_peer_set_video_view_size (OvRemotePeer *remote,
+                                                        guint width,
+                                                        guint height);
 void                ov_remote_peer_set_muted          (OvRemotePeer *remote,
                                                        gboolean muted);
 gboolean            ov_remote_peer_get_muted          (OvRemotePeer *remote);
+/* Whether the remote has told us that it stopped sending its audio or video
+ * with ov_local_peer_set_audio_muted() or ov_local_peer_set_video_muted() */
+gboolean            ov_remote_peer_get_audio_sending  (OvRemotePeer *remote);
+gboolean            ov_remote_peer_get_video_sending  (OvRemotePeer *remote);
+/* Adaptive jitterbuffer: the latency is adapted between min and max to the
+ * jitter of the remote. Fixed at a LAN-friendly value by default. */
+gboolean            ov_remote_peer_set_latency_range  (OvRemotePeer *remote,
+                                                       guint min_ms,
+                                                       guint max_ms);
+guint               ov_remote_peer_get_latency        (OvRemotePeer *remote);
+/* Decode on demand: hidden remotes' video is received but not decoded */
+void                ov_remote_peer_set_video_visible  (OvRemotePeer *remote,
+                                                       gboolean visible);
+gboolean            ov_remote_peer_get_video_visible  (OvRemotePeer *remote);
 void                ov_remote_peer_pause              (OvRemotePeer *remote);
 void                ov_remote_peer_resume             (OvRemotePeer *remote);
+gboolean            ov_remote_peer_set_video_layer    (OvRemotePeer *remote,
+                                                       guint layer);
+guint               ov_remote_peer_get_video_layer    (OvRemotePeer *remote);
 
 GPtrArray*          ov_local_peer_get_remotes         (OvLocalPeer *local);
 OvRemotePeer*       ov_local_peer_get_remote_by_id    (OvLocalPeer *local,
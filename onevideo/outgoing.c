@@ -27,7 +27,9 @@
 
 #include "comms.h"
 #include "lib-priv.h"
+#include "incoming.h"
 #include "outgoing.h"
+#include "relay.h"
 #include "ov-local-peer-priv.h"
 
 #include <string.h>
@@ -75,19 +77,14 @@ handle_tcp_msg_ok_negotiate (OvTcpMsg * msg)
   return peer_id;
 }
 
-OvTcpMsg *
-ov_remote_peer_send_tcp_msg (OvRemotePeer * remote, OvTcpMsg * msg,
+static GSocketConnection *
+ov_remote_peer_tcp_connect (OvRemotePeer * remote, guint timeout,
     GCancellable * cancellable, GError ** error)
 {
-  gchar *tmp;
-  gboolean ret;
   GSocketClient *client;
   GSocketConnection *conn;
-  GInputStream *input;
-  GOutputStream *output;
   GSocketAddress *addr;
   GInetSocketAddress *local_addr;
-  OvTcpMsg *reply = NULL;
 
   client = g_socket_client_new ();
 
@@ -101,86 +98,502 @@ ov_remote_peer_send_tcp_msg (OvRemotePeer * remote, OvTcpMsg * msg,
   g_object_unref (addr);
 
   /* Set timeout */
-  g_socket_client_set_timeout (client, OV_TCP_TIMEOUT);
+  g_socket_client_set_timeout (client, timeout);
 
   conn = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (remote->addr),
       cancellable, error);
+
+  g_object_unref (client);
+  return conn;
+}
+
+/* Reads replies from the control connection and hands them over to the
+ * requests waiting for them till the connection is closed */
+static gpointer
+ov_remote_peer_control_thread (OvRemotePeer * remote)
+{
+  guint64 *key;
+  GByteArray *buffer;
+  GInputStream *input;
+  GSocketConnection *conn;
+  GCancellable *cancel;
+  OvTcpMsg *reply;
+  GError *error = NULL;
+  OvRemotePeerPrivate *priv = remote->priv;
+
+  g_mutex_lock (&priv->control_lock);
+  if (priv->control == NULL) {
+    /* Torn down before we even started */
+    g_mutex_unlock (&priv->control_lock);
+    return NULL;
+  }
+  conn = g_object_ref (priv->control);
+  cancel = g_object_ref (priv->control_cancel);
+  g_mutex_unlock (&priv->control_lock);
+
+  input = g_io_stream_get_input_stream (G_IO_STREAM (conn));
+  buffer = g_byte_array_new ();
+
+  while (ov_tcp_msg_wait_on_connection (conn, cancel, &error)) {
+    reply = ov_tcp_msg_read_from_stream (input, buffer, cancel, &error);
+    if (!reply)
+      break;
+
+    g_mutex_lock (&priv->control_lock);
+    if (g_hash_table_lookup_extended (priv->control_pending, &reply->id,
+          NULL, NULL)) {
+      key = g_new (guint64, 1);
+      *key = reply->id;
+      g_hash_table_insert (priv->control_pending, key, reply);
+      g_cond_broadcast (&priv->control_cond);
+    } else {
+      /* Replies to quick-sent messages, or to requests that timed out */
+      GST_DEBUG ("Dropping '%s' reply from %s which nobody is waiting for",
+          ov_tcp_msg_type_to_string (reply->type, reply->version),
+          remote->addr_s);
+      ov_tcp_msg_free (reply);
+    }
+    g_mutex_unlock (&priv->control_lock);
+  }
+
+  GST_DEBUG ("Control connection to %s closed: %s", remote->addr_s,
+      error ? error->message : "closed by the remote");
+  g_clear_error (&error);
+
+  g_mutex_lock (&priv->control_lock);
+  /* Only mark it closed if it hasn't been replaced in the meantime */
+  if (priv->control == conn) {
+    priv->control_closed = TRUE;
+    g_cond_broadcast (&priv->control_cond);
+  }
+  g_mutex_unlock (&priv->control_lock);
+
+  g_byte_array_unref (buffer);
+  g_object_unref (cancel);
+  g_object_unref (conn);
+  return NULL;
+}
+
+/* Called with the control lock TAKEN; it is released and re-taken while the
+ * reader thread is joined */
+static void
+ov_remote_peer_control_teardown (OvRemotePeer * remote)
+{
+  GSocketConnection *conn;
+  GCancellable *cancel;
+  GThread *thread;
+  OvRemotePeerPrivate *priv = remote->priv;
+
+  conn = priv->control;
+  cancel = priv->control_cancel;
+  thread = priv->control_thread;
+  priv->control = NULL;
+  priv->control_cancel = NULL;
+  priv->control_thread = NULL;
+  priv->control_closed = FALSE;
+  priv->control_generation++;
+  /* Requests waiting on this connection will now fail */
+  g_cond_broadcast (&priv->control_cond);
+
+  if (conn == NULL)
+    return;
+
+  g_mutex_unlock (&priv->control_lock);
+  g_cancellable_cancel (cancel);
+  g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
+  g_thread_join (thread);
+  g_object_unref (cancel);
+  g_object_unref (conn);
+  g_mutex_lock (&priv->control_lock);
+}
+
+/* Called with the control lock TAKEN */
+static gboolean
+ov_remote_peer_control_ensure (OvRemotePeer * remote,
+    GCancellable * cancellable, GError ** error)
+{
+  gchar *name;
+  GSocketConnection *conn;
+  OvRemotePeerPrivate *priv = remote->priv;
+
+  /* Tearing down drops the lock, so someone else might've reconnected */
+  while (priv->control != NULL) {
+    if (!priv->control_closed)
+      return TRUE;
+    ov_remote_peer_control_teardown (remote);
+  }
+
+  /* Connecting with the lock held means other requests to this remote wait
+   * for us instead of racing to open their own connections */
+  priv->control_connect_start = g_get_monotonic_time ();
+  conn = ov_remote_peer_tcp_connect (remote, OV_TCP_TIMEOUT, cancellable,
+      error);
+  priv->control_connect_end = g_get_monotonic_time ();
   if (!conn) {
     GST_ERROR ("Unable to connect to %s (%s): %s", remote->id, remote->addr_s,
         error ? (*error)->message : "Unknown error");
-    goto no_conn;
+    return FALSE;
   }
+  GST_DEBUG ("Opened control connection to %s", remote->addr_s);
 
-  tmp = ov_tcp_msg_print (msg);
-  GST_TRACE ("Sending to '%s' a '%s' msg of size %u: %s", remote->id,
-      ov_tcp_msg_type_to_string (msg->type, msg->version),
-      msg->size, tmp);
-  g_free (tmp);
+  priv->control = conn;
+  priv->control_cancel = g_cancellable_new ();
+  name = g_strdup_printf ("ov-control-%s", remote->addr_s);
+  priv->control_thread = g_thread_new (name,
+      (GThreadFunc) ov_remote_peer_control_thread, remote);
+  g_free (name);
 
-  output = g_io_stream_get_output_stream (G_IO_STREAM (conn));
-  ret = ov_tcp_msg_write_to_stream (output, msg, cancellable, error);
-  if (!ret)
-    goto out;
+  return TRUE;
+}
 
-  input = g_io_stream_get_input_stream (G_IO_STREAM (conn));
-  reply = ov_tcp_msg_read_from_stream (input, cancellable, error);
-  if (!reply)
+static void
+on_control_request_cancelled (GCancellable * cancellable G_GNUC_UNUSED,
+    OvRemotePeer * remote)
+{
+  g_mutex_lock (&remote->priv->control_lock);
+  g_cond_broadcast (&remote->priv->control_cond);
+  g_mutex_unlock (&remote->priv->control_lock);
+}
+
+/* Sends @msg on the control connection to @remote and waits for the reply
+ * with the same id. Several threads can have requests in flight to the same
+ * remote at once. */
+OvTcpMsg *
+ov_remote_peer_send_tcp_msg (OvRemotePeer * remote, OvTcpMsg * msg,
+    GCancellable * cancellable, GError ** error)
+{
+  gchar *tmp;
+  guint64 *key;
+  gint64 deadline;
+  gulong cancel_id = 0;
+  guint generation;
+  GOutputStream *output;
+  OvTcpMsg *reply = NULL;
+  OvRemotePeerPrivate *priv = remote->priv;
+
+  if (cancellable)
+    cancel_id = g_cancellable_connect (cancellable,
+        G_CALLBACK (on_control_request_cancelled), remote, NULL);
+
+  g_mutex_lock (&priv->control_lock);
+
+  if (!ov_remote_peer_control_ensure (remote, cancellable, error))
     goto out;
+  generation = priv->control_generation;
+
+  if (OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = ov_tcp_msg_print (msg);
+    GST_TRACE ("Sending to '%s' a '%s' msg of size %u: %s", remote->id,
+        ov_tcp_msg_type_to_string (msg->type, msg->version),
+        msg->size, tmp);
+    g_free (tmp);
+  }
+
+  key = g_new (guint64, 1);
+  *key = msg->id;
+  g_hash_table_insert (priv->control_pending, key, NULL);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (priv->control));
+  if (!ov_tcp_msg_write_to_stream (output, msg, cancellable, error)) {
+    /* The stream is in an unknown state now, reconnect next time */
+    priv->control_closed = TRUE;
+    goto done;
+  }
+
+  deadline = g_get_monotonic_time () + OV_TCP_TIMEOUT * G_TIME_SPAN_SECOND;
+  while (!(reply = g_hash_table_lookup (priv->control_pending, &msg->id))) {
+    if (priv->control_generation != generation || priv->control_closed) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+          "Connection to %s closed before it replied", remote->addr_s);
+      break;
+    }
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+      break;
+    if (!g_cond_wait_until (&priv->control_cond, &priv->control_lock,
+          deadline)) {
+      reply = g_hash_table_lookup (priv->control_pending, &msg->id);
+      if (!reply)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+            "Timed out waiting for a reply from %s", remote->addr_s);
+      break;
+    }
+  }
 
+done:
+  g_hash_table_remove (priv->control_pending, &msg->id);
 out:
-  g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
-  g_object_unref (conn);
-no_conn:
-  g_object_unref (client);
+  g_mutex_unlock (&priv->control_lock);
+  /* Must not hold the control lock here since the callback takes it */
+  if (cancel_id)
+    g_cancellable_disconnect (cancellable, cancel_id);
   return reply;
 }
 
+/* Called with the control lock NOT TAKEN */
 void
-ov_remote_peer_send_tcp_msg_quick_noreply (OvRemotePeer * remote,
-    OvTcpMsg * msg)
+ov_remote_peer_close_control_connection (OvRemotePeer * remote)
 {
-  gchar *tmp;
-  GSocketClient *client;
+  g_mutex_lock (&remote->priv->control_lock);
+  ov_remote_peer_control_teardown (remote);
+  g_mutex_unlock (&remote->priv->control_lock);
+}
+
+/* Writes @msg on the control connection to @remote if one is open. The reply
+ * is dropped by the reader thread since nobody is waiting for it.
+ * Called with the control lock NOT TAKEN */
+static gboolean
+ov_remote_peer_control_write_noreply (OvRemotePeer * remote, OvTcpMsg * msg)
+{
+  gboolean sent = FALSE;
+  GOutputStream *output;
+  OvRemotePeerPrivate *priv = remote->priv;
+
+  g_mutex_lock (&priv->control_lock);
+  if (priv->control != NULL && !priv->control_closed) {
+    output = g_io_stream_get_output_stream (G_IO_STREAM (priv->control));
+    sent = ov_tcp_msg_write_to_stream (output, msg, NULL, NULL);
+    if (!sent)
+      priv->control_closed = TRUE;
+  }
+  g_mutex_unlock (&priv->control_lock);
+
+  return sent;
+}
+
+typedef struct _OvOneWaySend OvOneWaySend;
+typedef struct _OvOneWayJob OvOneWayJob;
+
+/* A one-way message being sent to remotes that we don't have a control
+ * connection to, each over a new connection of its own. Only touched from the
+ * TCP server's main context once started; see ov_local_peer_send_noreply() */
+struct _OvOneWaySend {
+  OvLocalPeer *local;
+  /* Shared by all the jobs; nobody writes to it */
+  OvTcpMsgFrame frame;
+  GSocketAddress *local_addr;
+  /* Cancelled when OV_TCP_ONE_WAY_TIMEOUT is up for all the jobs together */
+  GCancellable *cancel;
+  GSource *timeout;
+  OvOneWayJob *jobs;
+  guint n_jobs;
+  guint pending;
+};
+
+struct _OvOneWayJob {
+  OvOneWaySend *send;
+  GInetSocketAddress *addr;
+  gchar *addr_s;
   GSocketConnection *conn;
-  GSocketAddress *addr;
+#if !GLIB_CHECK_VERSION (2, 60, 0)
+  guint vector;
+#endif
+};
+
+static void
+ov_one_way_send_free (OvOneWaySend * send)
+{
+  guint ii;
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (send->local);
+
+  priv->tcp_one_way_sends = g_list_remove (priv->tcp_one_way_sends, send);
+
+  for (ii = 0; ii < send->n_jobs; ii++) {
+    g_object_unref (send->jobs[ii].addr);
+    g_free (send->jobs[ii].addr_s);
+  }
+  g_free (send->jobs);
+  if (send->timeout != NULL) {
+    g_source_destroy (send->timeout);
+    g_source_unref (send->timeout);
+  }
+  g_object_unref (send->cancel);
+  g_object_unref (send->local_addr);
+  ov_tcp_msg_frame_clear (&send->frame);
+
+  ov_local_peer_tcp_server_quit_if_idle (send->local);
+  g_free (send);
+}
+
+static void
+ov_one_way_job_done (OvOneWayJob * job)
+{
+  if (job->conn != NULL) {
+    g_io_stream_close (G_IO_STREAM (job->conn), NULL, NULL);
+    g_clear_object (&job->conn);
+  }
+
+  if (--job->send->pending == 0)
+    ov_one_way_send_free (job->send);
+}
+
+static void
+on_one_way_msg_written (GOutputStream * output, GAsyncResult * result,
+    OvOneWayJob * job)
+{
+  gboolean ret;
+  GError *error = NULL;
+
+#if GLIB_CHECK_VERSION (2, 60, 0)
+  ret = g_output_stream_writev_all_finish (output, result, NULL, &error);
+#else
+  ret = g_output_stream_write_all_finish (output, result, NULL, &error);
+  /* Without writev, the header and the body are written one after another */
+  if (ret && ++job->vector < job->send->frame.n_vectors) {
+    GOutputVector *vector = &job->send->frame.vectors[job->vector];
+    g_output_stream_write_all_async (output, vector->buffer, vector->size,
+        G_PRIORITY_DEFAULT, job->send->cancel,
+        (GAsyncReadyCallback) on_one_way_msg_written, job);
+    return;
+  }
+#endif
+  if (!ret) {
+    GST_WARNING ("Unable to send one-way message to %s: %s", job->addr_s,
+        error->message);
+    g_error_free (error);
+  }
+
+  ov_one_way_job_done (job);
+}
+
+static void
+on_one_way_connected (GSocketClient * client, GAsyncResult * result,
+    OvOneWayJob * job)
+{
   GOutputStream *output;
+  OvOneWaySend *send = job->send;
+  GError *error = NULL;
+
+  job->conn = g_socket_client_connect_finish (client, result, &error);
+  g_object_unref (client);
+  if (job->conn == NULL) {
+    GST_WARNING ("Unable to connect to %s for a one-way message: %s",
+        job->addr_s, error->message);
+    g_error_free (error);
+    ov_one_way_job_done (job);
+    return;
+  }
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (job->conn));
+#if GLIB_CHECK_VERSION (2, 60, 0)
+  g_output_stream_writev_all_async (output, send->frame.vectors,
+      send->frame.n_vectors, G_PRIORITY_DEFAULT, send->cancel,
+      (GAsyncReadyCallback) on_one_way_msg_written, job);
+#else
+  job->vector = 0;
+  g_output_stream_write_all_async (output, send->frame.vectors[0].buffer,
+      send->frame.vectors[0].size, G_PRIORITY_DEFAULT, send->cancel,
+      (GAsyncReadyCallback) on_one_way_msg_written, job);
+#endif
+}
+
+static gboolean
+on_one_way_send_timeout (OvOneWaySend * send)
+{
+  GST_DEBUG ("Giving up on %u remotes that haven't received a one-way "
+      "message yet", send->pending);
+  g_cancellable_cancel (send->cancel);
+
+  g_clear_pointer (&send->timeout, g_source_unref);
+  return G_SOURCE_REMOVE;
+}
+
+/* Called from the TCP server's main context. Connects to all the remotes in
+ * @send at once. */
+static gboolean
+ov_one_way_send_start (OvOneWaySend * send)
+{
+  guint ii;
+  GSocketClient *client;
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (send->local);
+
+  priv->tcp_one_way_sends = g_list_prepend (priv->tcp_one_way_sends, send);
+
+  send->timeout = g_timeout_source_new_seconds (OV_TCP_ONE_WAY_TIMEOUT);
+  g_source_set_callback (send->timeout, (GSourceFunc) on_one_way_send_timeout,
+      send, NULL);
+  g_source_attach (send->timeout, priv->tcp_context);
+
+  send->pending = send->n_jobs;
+  for (ii = 0; ii < send->n_jobs; ii++) {
+    client = g_socket_client_new ();
+    /* Connect from the interface that we're listening on */
+    g_socket_client_set_local_address (client, send->local_addr);
+    g_socket_client_set_timeout (client, OV_TCP_ONE_WAY_TIMEOUT);
+    g_socket_client_connect_async (client,
+        G_SOCKET_CONNECTABLE (send->jobs[ii].addr), send->cancel,
+        (GAsyncReadyCallback) on_one_way_connected, &send->jobs[ii]);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Sends @msg to all @n_remotes @remotes without waiting for them to receive
+ * it, or for their replies. It goes on the control connection to each remote
+ * that has one open, and the rest are connected to in parallel from the TCP
+ * server's main context, giving up on all of them together after
+ * OV_TCP_ONE_WAY_TIMEOUT seconds. The remotes can be freed right away. */
+static void
+ov_local_peer_send_noreply (OvLocalPeer * local, OvRemotePeer ** remotes,
+    guint n_remotes, OvTcpMsg * msg)
+{
+  guint ii;
+  gchar *tmp;
+  OvOneWaySend *send;
   GInetSocketAddress *local_addr;
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (local);
 
-  client = g_socket_client_new ();
+  send = g_new0 (OvOneWaySend, 1);
+  send->jobs = g_new0 (OvOneWayJob, n_remotes);
 
-  /* Set local address with random port to ensure that we connect from the same
-   * interface that we're listening on */
-  g_object_get (OV_PEER (remote->local), "address", &local_addr, NULL);
-  addr = g_inet_socket_address_new (
+  for (ii = 0; ii < n_remotes; ii++) {
+    if (OV_TCP_MSG_PRINT_ENABLED) {
+      tmp = ov_tcp_msg_print (msg);
+      GST_TRACE ("Quick-sending to '%s' a '%s' msg of size %u: %s",
+          remotes[ii]->id, ov_tcp_msg_type_to_string (msg->type,
+            msg->version), msg->size, tmp);
+      g_free (tmp);
+    }
+
+    if (ov_remote_peer_control_write_noreply (remotes[ii], msg))
+      continue;
+
+    send->jobs[send->n_jobs].send = send;
+    send->jobs[send->n_jobs].addr = g_object_ref (remotes[ii]->addr);
+    send->jobs[send->n_jobs].addr_s = g_strdup (remotes[ii]->addr_s);
+    send->n_jobs++;
+  }
+
+  if (send->n_jobs == 0 || priv->tcp_context == NULL) {
+    if (send->n_jobs > 0)
+      GST_WARNING ("Not sending one-way message to %u remotes; the TCP "
+          "server isn't running", send->n_jobs);
+    for (ii = 0; ii < send->n_jobs; ii++) {
+      g_object_unref (send->jobs[ii].addr);
+      g_free (send->jobs[ii].addr_s);
+    }
+    g_free (send->jobs);
+    g_free (send);
+    return;
+  }
+
+  send->local = local;
+  /* The frame keeps the serialized variant alive, so the msg can go */
+  ov_tcp_msg_frame_init (&send->frame, msg);
+  g_object_get (OV_PEER (local), "address", &local_addr, NULL);
+  send->local_addr = g_inet_socket_address_new (
       g_inet_socket_address_get_address (local_addr), 0);
-  g_socket_client_set_local_address (client, addr);
   g_object_unref (local_addr);
-  g_object_unref (addr);
+  send->cancel = g_cancellable_new ();
 
-  /* Wait at most 1 second per client */
-  g_socket_client_set_timeout (client, 1);
-
-  conn = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (remote->addr),
-      NULL, NULL);
-  if (!conn)
-    goto no_conn;
-
-  tmp = ov_tcp_msg_print (msg);
-  GST_TRACE ("Quick-sending to '%s' a '%s' msg of size %u: %s", remote->id,
-      ov_tcp_msg_type_to_string (msg->type, msg->version),
-      msg->size, tmp);
-  g_free (tmp);
-
-  output = g_io_stream_get_output_stream (G_IO_STREAM (conn));
-  if (!ov_tcp_msg_write_to_stream (output, msg, NULL, NULL))
-    goto out;
+  g_main_context_invoke (priv->tcp_context,
+      (GSourceFunc) ov_one_way_send_start, send);
+}
 
-out:
-  g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
-  g_object_unref (conn);
-no_conn:
-  g_object_unref (client);
-  return;
+static void
+ov_remote_peer_send_tcp_msg_quick_noreply (OvRemotePeer * remote,
+    OvTcpMsg * msg)
+{
+  ov_local_peer_send_noreply (remote->local, &remote, 1, msg);
 }
 
 static gboolean
@@ -275,9 +688,11 @@ get_all_peers_list_except_this (OvRemotePeer * remote, guint64 call_id)
   peers = g_variant_new ("(xas)", call_id, builder);
   g_variant_builder_unref (builder);
 
-  tmp = g_variant_print (peers, FALSE);
-  GST_DEBUG ("Peers remote to peer %s: %s", remote->id, tmp);
-  g_free (tmp);
+  if (OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = g_variant_print (peers, FALSE);
+    GST_LOG ("Peers remote to peer %s: %s", remote->id, tmp);
+    g_free (tmp);
+  }
 
   return peers;
 }
@@ -309,22 +724,24 @@ get_all_remotes_addr_list_except_this (OvRemotePeer * remote,
   peers = g_variant_new ("(xa(ss))", call_id, builder);
   g_variant_builder_unref (builder);
 
-  tmp = g_variant_print (peers, FALSE);
-  GST_DEBUG ("Peers (other than us) remote to peer %s: %s", remote->id, tmp);
-  g_free (tmp);
+  if (OV_TCP_MSG_PRINT_ENABLED) {
+    tmp = g_variant_print (peers, FALSE);
+    GST_LOG ("Peers (other than us) remote to peer %s: %s", remote->id, tmp);
+    g_free (tmp);
+  }
 
   return peers;
 }
 
+/* @peers is from get_all_remotes_addr_list_except_this() */
 static OvTcpMsg *
 ov_remote_peer_tcp_client_query_caps (OvRemotePeer * remote,
-    guint64 call_id, GCancellable * cancellable, GError ** error)
+    GVariant * peers, GCancellable * cancellable, GError ** error)
 {
   gchar *tmp;
   OvTcpMsg *msg, *reply = NULL;
 
-  msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_QUERY_CAPS,
-      get_all_remotes_addr_list_except_this (remote, call_id));
+  msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_QUERY_CAPS, peers);
 
   reply = ov_remote_peer_send_tcp_msg (remote, msg, cancellable, error);
   if (!reply)
@@ -333,9 +750,11 @@ ov_remote_peer_tcp_client_query_caps (OvRemotePeer * remote,
   switch (reply->type) {
     case OV_TCP_MSG_TYPE_REPLY_CAPS:
       /* TODO: Check whether the call id matches */
-      tmp = ov_tcp_msg_print (reply);
-      GST_DEBUG ("Reply caps from %s: %s", remote->id, tmp);
-      g_free (tmp);
+      if (OV_TCP_MSG_PRINT_ENABLED) {
+        tmp = ov_tcp_msg_print (reply);
+        GST_LOG ("Reply caps from %s: %s", remote->id, tmp);
+        g_free (tmp);
+      }
       break;
     case OV_TCP_MSG_TYPE_ACK:
       handle_tcp_msg_ack (reply);
@@ -366,15 +785,73 @@ clear_reply:
   goto no_reply;
 }
 
+/* Media formats that can be negotiated with bits; see OvCapsBits */
+static const gchar *caps_bits_formats[] = {
+  AUDIO_FORMAT_OPUS, VIDEO_FORMAT_JPEG, VIDEO_FORMAT_H264
+};
+
+/* RTP repair fields in the caps; see ov_caps_with_rtp_repair() */
+static const struct {
+  OvRtpRepair repair;
+  const gchar *field;
+} caps_bits_repairs[] = {
+  {OV_RTP_REPAIR_RTX, "rtx"},
+  {OV_RTP_REPAIR_ULPFEC, "ulpfec"},
+};
+
+/* Number of OvVideoQuality resolutions, 240p to 1080p */
+#define OV_CAPS_BITS_N_RESOS 5
+/* Qualities that every structure without a height or framerate can have */
+#define OV_CAPS_BITS_ALL_QUALITIES \
+  ((G_GUINT64_CONSTANT (1) << (OV_CAPS_BITS_N_RESOS * 8)) - 1)
+
+typedef struct _OvCapsBits OvCapsBits;
+
+/* What a peer can send or receive, normalized from the caps in its REPLY_CAPS
+ * so that negotiating between all the peers is a bitwise AND. For each
+ * format, bit (resolution * 8 + fps) is set for each quality that it has, with
+ * the resolution and FPS as in OvVideoQuality. Audio has all the qualities. */
+struct _OvCapsBits {
+  guint64 formats[G_N_ELEMENTS (caps_bits_formats)];
+  OvRtpRepair repair;
+};
+
+typedef struct _OvNegCaps OvNegCaps;
+
+/* What each peer can send and receive, while negotiating */
+struct _OvNegCaps {
+  /* [send_acaps, send_vcaps, recv_acaps, recv_vcaps]; the send caps are then
+   * replaced by the negotiated caps */
+  GstCaps *caps[4];
+  /* The same as bits, if all of them can be */
+  OvCapsBits bits[4];
+  /* The negotiated send caps as strings, for CALL_DETAILS */
+  gchar *send_s[2];
+  /* Whether the peer offered to {send, receive} RTP on the multicast group,
+   * and the port on the group that it sends to if it was given one. The
+   * negotiated send_vcaps with the group and port go to the peer itself and
+   * to the peers that receive from the group. */
+  gboolean multicast[2];
+  guint16 multicast_port;
+  gchar *multicast_vcaps_s;
+  /* Whether the peer offered to {send, receive} Opus DTX, and whether it will
+   * send it; only if all the other peers can receive it */
+  gboolean dtx[2];
+  gboolean send_dtx;
+};
+
 static void
 _ov_free_negcaps_value (gpointer data)
 {
   guint ii;
-  GstCaps **caps = data;
+  OvNegCaps *negcaps = data;
 
   for (ii = 0; ii < 4; ii++)
-    gst_caps_unref (caps[ii]);
-  g_free (caps);
+    gst_caps_unref (negcaps->caps[ii]);
+  for (ii = 0; ii < 2; ii++)
+    g_free (negcaps->send_s[ii]);
+  g_free (negcaps->multicast_vcaps_s);
+  g_free (negcaps);
 }
 
 static GPtrArray *
@@ -430,95 +907,177 @@ _ov_strdup_print_aggports (GHashTable * table)
   return ret_s;
 }
 
-/* Format of GHashTable *in is: {OvRemotePeer*: GVariant*}
- * GVariant is of type OV_TCP_MSG_TYPE_REPLY_CAPS */
-static GHashTable *
-ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
-    guint64 call_id)
+static gboolean
+_ov_caps_has_field (const GstCaps * caps, const gchar * field)
 {
-  guint ii, jj;
-  GstCaps **caps;
-  gchar *local_id;
-  GPtrArray *peers, *remotes;
-  GHashTable *out, *negcaps, *aggports;
-  const gchar *in_vtype, *out_vtype;
-  OvLocalPeerPrivate *local_priv;
+  guint ii;
 
-  local_priv = ov_local_peer_get_private (local);
-  g_object_get (local, "id", &local_id, NULL);
-  remotes = local_priv->remote_peers;
-  peers = _ov_get_all_peers (local);
+  for (ii = 0; ii < gst_caps_get_size (caps); ii++)
+    if (gst_structure_has_field (gst_caps_get_structure (caps, ii), field))
+      return TRUE;
+  return FALSE;
+}
 
-  in_vtype = ov_tcp_msg_type_to_variant_type (
-      OV_TCP_MSG_TYPE_REPLY_CAPS, OV_TCP_MAX_VERSION);
-  out_vtype = ov_tcp_msg_type_to_variant_type (
-      OV_TCP_MSG_TYPE_CALL_DETAILS, OV_TCP_MAX_VERSION);
+/* Intersecting caps keeps fields that are only in one of them, but an RTP
+ * repair field must only survive if the sender can do it (send) and the
+ * receiver can too (recv). Older peers have no such fields. */
+static GstCaps *
+_ov_caps_intersect_rtp_repair (GstCaps * send, GstCaps * recv)
+{
+  guint ii;
+  GstCaps *ret;
+  const gchar *fields[] = {"rtx", "ulpfec"};
+
+  ret = gst_caps_intersect (send, recv);
+  for (ii = 0; ii < G_N_ELEMENTS (fields); ii++) {
+    guint jj;
+
+    if (_ov_caps_has_field (send, fields[ii]) &&
+        _ov_caps_has_field (recv, fields[ii]))
+      continue;
+    ret = gst_caps_make_writable (ret);
+    for (jj = 0; jj < gst_caps_get_size (ret); jj++)
+      gst_structure_remove_field (gst_caps_get_structure (ret, jj),
+          fields[ii]);
+  }
 
-  /* A hash table that contains negotiated send_caps information for each peer
-   * (including us; the local peer).
-   *
-   * This table is first built up from the *in hash table that contains
-   * REPLY_CAPS GVariants, and then it's edited in place to intersect send and
-   * recv caps which basically does the negotiation.
-   *
-   * Format:
-   * {gpointer peer: [GstCaps *send_acaps, GstCaps *send_vcaps,
-   *                  GstCaps *recv_acaps, GstCaps *recv_vcaps]} */
-  negcaps = g_hash_table_new_full (NULL, NULL, NULL, _ov_free_negcaps_value);
-  /* A hash table that contains aggregated destination port information for each
-   * set of from → to peer pairs.
-   *
-   * This table is built from the *in hash table that contains REPLY_CAPS
-   * GVariants.
-   *
-   * Format:
-   * {gchar *from_id: {gchar *to_id: guint16 to_recv_ports[6]}} */
-  aggports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-      (GDestroyNotify) g_hash_table_unref);
-  /* This hash table is the output of this entire function
-   *
-   * Format: {OvRemotePeer*: GVariant*}
-   * GVariant is of type OV_TCP_MSG_TYPE_CALL_DETAILS and only contains remote
-   * peers; not the local peer */
-  out = g_hash_table_new_full (NULL, NULL, NULL,
-      (GDestroyNotify) g_variant_unref);
+  return ret;
+}
 
-  /* Aggregate caps for all remotes into a separate hash table */
-  for (ii = 0; ii < remotes->len; ii++) {
-    OvRemotePeer *this;
-    GVariant *thisv;
-    gchar *caps_s[4] = {0};
+static gint
+_ov_structure_to_caps_bits_format (const GstStructure * s)
+{
+  guint ii;
 
-    this = g_ptr_array_index (remotes, ii);
-    thisv = g_hash_table_lookup (in, this);
-    g_variant_get (thisv, in_vtype, NULL, NULL, NULL,
-        /* senda_caps, sendv_caps, recva_caps, recvv_caps */
-        &caps_s[0], &caps_s[1], &caps_s[2], &caps_s[3], NULL);
+  for (ii = 0; ii < G_N_ELEMENTS (caps_bits_formats); ii++)
+    if (gst_structure_has_name (s, caps_bits_formats[ii]))
+      return ii;
+  return -1;
+}
 
-    caps = g_new0 (GstCaps*, 4);
-    for (jj = 0; jj < 4; jj++)
-      caps[jj] = gst_caps_from_string (caps_s[jj]), g_free (caps_s[jj]);
-    g_hash_table_insert (negcaps, this, caps);
+static guint64
+_ov_structure_to_quality_bits (const GstStructure * s)
+{
+  guint ii;
+  guint64 bits = 0;
+  GstCaps *normalized;
+
+  /* Expands lists of values, such as the framerates of a resolution */
+  normalized = gst_caps_normalize (gst_caps_new_full (gst_structure_copy (s),
+        NULL));
+
+  for (ii = 0; ii < gst_caps_get_size (normalized); ii++) {
+    guint reso;
+    guint64 fps;
+    OvVideoQuality quality;
+
+    quality = ov_structure_to_video_quality (
+        gst_caps_get_structure (normalized, ii));
+    fps = (quality & OV_VIDEO_QUALITY_FPS_RANGE) >> 8;
+    /* Anything that's missing could be any of them */
+    if (fps == 0)
+      fps = 0xff;
+    for (reso = 0; reso < OV_CAPS_BITS_N_RESOS; reso++)
+      if ((quality & OV_VIDEO_QUALITY_RESO_RANGE) == 0 ||
+          (quality & OV_VIDEO_QUALITY_RESO_RANGE) ==
+          OV_VIDEO_QUALITY_240P + reso)
+        bits |= fps << (reso * 8);
   }
-  /* Add ourselves because caps negotiation must include us */
-  caps = g_new0 (GstCaps*, 4);
-  caps[0] = gst_caps_ref (local_priv->supported_send_acaps);
-  caps[1] = gst_caps_ref (local_priv->supported_send_vcaps);
-  caps[2] = gst_caps_ref (local_priv->supported_recv_acaps);
-  caps[3] = gst_caps_ref (local_priv->supported_recv_vcaps);
-  g_hash_table_insert (negcaps, local, caps);
 
-  /* Decide (negotiate) the send_(a|v)caps for each peer */
+  gst_caps_unref (normalized);
+  return bits;
+}
+
+/* Returns FALSE if @caps can't be negotiated with bits, in which case they must
+ * be intersected instead. Receive caps must only have a format and the RTP
+ * repair fields, which is what all of our peers send. */
+static gboolean
+_ov_caps_to_bits (const GstCaps * caps, gboolean recv, OvCapsBits * bits)
+{
+  guint ii;
+  gint format;
+  gboolean value;
+  GstStructure *s;
+
+  memset (bits, 0, sizeof (OvCapsBits));
+
+  if (gst_caps_is_any (caps))
+    return FALSE;
+
+  for (ii = 0; ii < gst_caps_get_size (caps); ii++) {
+    guint jj, n_repair_fields = 0;
+
+    s = gst_caps_get_structure (caps, ii);
+    format = _ov_structure_to_caps_bits_format (s);
+    if (format < 0)
+      return FALSE;
+
+    for (jj = 0; jj < G_N_ELEMENTS (caps_bits_repairs); jj++) {
+      if (!gst_structure_has_field (s, caps_bits_repairs[jj].field))
+        continue;
+      n_repair_fields++;
+      if (gst_structure_get_boolean (s, caps_bits_repairs[jj].field, &value) &&
+          value)
+        bits->repair |= caps_bits_repairs[jj].repair;
+    }
+
+    if (recv) {
+      if (gst_structure_n_fields (s) > n_repair_fields)
+        return FALSE;
+      bits->formats[format] |= OV_CAPS_BITS_ALL_QUALITIES;
+    } else {
+      bits->formats[format] |= _ov_structure_to_quality_bits (s);
+    }
+  }
+
+  return TRUE;
+}
+
+/* Returns the structures of @caps that have one of the @allowed qualities, with
+ * only the @allowed kinds of RTP repair */
+static GstCaps *
+_ov_caps_filter_by_bits (const GstCaps * caps, const OvCapsBits * allowed)
+{
+  guint ii, jj;
+  GstCaps *ret;
+  GstStructure *s;
+
+  ret = gst_caps_new_empty ();
+  for (ii = 0; ii < gst_caps_get_size (caps); ii++) {
+    s = gst_caps_get_structure (caps, ii);
+    if ((_ov_structure_to_quality_bits (s) &
+          allowed->formats[_ov_structure_to_caps_bits_format (s)]) == 0)
+      continue;
+
+    s = gst_structure_copy (s);
+    for (jj = 0; jj < G_N_ELEMENTS (caps_bits_repairs); jj++)
+      if (!(allowed->repair & caps_bits_repairs[jj].repair))
+        gst_structure_remove_field (s, caps_bits_repairs[jj].field);
+    gst_caps_append_structure (ret, s);
+  }
+
+  return ret;
+}
+
+/* Intersect the send caps of each peer with the recv caps of every other peer.
+ * This is O(N²) caps intersections, so it's only done if some of the caps can't
+ * be negotiated with bits. */
+static void
+_ov_negotiate_caps_intersect (GPtrArray * peers, GHashTable * negcaps)
+{
+  guint ii, jj;
+
   for (ii = 0; ii < peers->len; ii++) {
     gpointer this;
-    GstCaps **thiscaps;
+    OvNegCaps *thiscaps;
 
     this = g_ptr_array_index (peers, ii);
     thiscaps = g_hash_table_lookup (negcaps, this);
     g_assert (thiscaps);
     for (jj = 0; jj < peers->len; jj++) {
       gpointer that;
-      GstCaps **thatcaps, *tmp;
+      OvNegCaps *thatcaps;
+      GstCaps *tmp;
 
       that = g_ptr_array_index (peers, jj);
       if (this == that)
@@ -527,11 +1086,272 @@ ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
       thatcaps = g_hash_table_lookup (negcaps, that);
       g_assert (thatcaps);
       /* this.send_acaps = this.send_acaps.intersect(that.recv_acaps) */
-      tmp = gst_caps_intersect (thiscaps[0], thatcaps[2]);
-      gst_caps_unref (thiscaps[0]), thiscaps[0] = tmp;
+      tmp = gst_caps_intersect (thiscaps->caps[0], thatcaps->caps[2]);
+      gst_caps_unref (thiscaps->caps[0]), thiscaps->caps[0] = tmp;
       /* this.send_vcaps = this.send_vcaps.intersect(that.recv_vcaps) */
-      tmp = gst_caps_intersect (thiscaps[1], thatcaps[3]);
-      gst_caps_unref (thiscaps[1]), thiscaps[1] = tmp;
+      tmp = _ov_caps_intersect_rtp_repair (thiscaps->caps[1],
+          thatcaps->caps[3]);
+      gst_caps_unref (thiscaps->caps[1]), thiscaps->caps[1] = tmp;
+    }
+  }
+}
+
+/* The same as _ov_negotiate_caps_intersect(), but the caps of each peer are
+ * ANDed as bits, and then only its send caps are filtered with the result */
+static void
+_ov_negotiate_caps_bits (GPtrArray * peers, GHashTable * negcaps)
+{
+  guint ii, jj, kk, ll;
+
+  for (ii = 0; ii < peers->len; ii++) {
+    OvNegCaps *thiscaps;
+    OvCapsBits allowed[2];
+    GstCaps *tmp;
+
+    thiscaps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, ii));
+    g_assert (thiscaps);
+    /* What this peer can send, which the others must all be able to receive;
+     * bits[kk] is send caps and bits[kk + 2] the matching recv caps */
+    memcpy (allowed, thiscaps->bits, sizeof (allowed));
+    for (jj = 0; jj < peers->len; jj++) {
+      OvNegCaps *thatcaps;
+
+      if (jj == ii)
+        continue;
+
+      thatcaps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, jj));
+      g_assert (thatcaps);
+      for (kk = 0; kk < 2; kk++) {
+        for (ll = 0; ll < G_N_ELEMENTS (caps_bits_formats); ll++)
+          allowed[kk].formats[ll] &= thatcaps->bits[kk + 2].formats[ll];
+        allowed[kk].repair &= thatcaps->bits[kk + 2].repair;
+      }
+    }
+
+    for (kk = 0; kk < 2; kk++) {
+      tmp = _ov_caps_filter_by_bits (thiscaps->caps[kk], &allowed[kk]);
+      gst_caps_unref (thiscaps->caps[kk]), thiscaps->caps[kk] = tmp;
+    }
+  }
+}
+
+/* A peer sends Opus DTX only if everyone else can receive it, since a peer
+ * that can't would try to decode the gaps */
+static void
+_ov_negotiate_dtx (GPtrArray * peers, GHashTable * negcaps)
+{
+  guint ii, jj;
+  OvNegCaps *thiscaps, *thatcaps;
+
+  for (ii = 0; ii < peers->len; ii++) {
+    thiscaps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, ii));
+    thiscaps->send_dtx = thiscaps->dtx[0];
+    for (jj = 0; jj < peers->len && thiscaps->send_dtx; jj++) {
+      thatcaps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, jj));
+      if (jj != ii && !thatcaps->dtx[1])
+        thiscaps->send_dtx = FALSE;
+    }
+  }
+}
+
+/* Give a port on the multicast group of the call to each peer that offered to
+ * send there if any other peer offered to receive from it; each of its RTP
+ * packets is then sent once for all of those. Returns the group, or NULL if
+ * nobody was given a port. */
+static gchar *
+_ov_negotiate_multicast (OvLocalPeer * local, guint64 call_id,
+    GPtrArray * peers, GHashTable * negcaps)
+{
+  guint ii, jj;
+  guint64 hash;
+  guint16 port, first_port;
+  OvNegCaps *thiscaps, *thatcaps;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (local);
+
+  /* We decide for the call. Relays forward everything themselves. */
+  if (!local_priv->multicast_media || local_priv->relay)
+    return NULL;
+
+  /* Both the group and the first port are picked from a hash of the whole
+   * call id, so two calls on the same LAN only get the same group and ports
+   * for ~1 in 2^26 pairs of calls. The id is a timestamp in microseconds, so
+   * its low 16 bits alone repeat every 65 ms. */
+  hash = call_id;
+  hash = (hash ^ (hash >> 30)) * G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+  hash = (hash ^ (hash >> 27)) * G_GUINT64_CONSTANT (0x94d049bb133111eb);
+  hash ^= hash >> 31;
+
+  first_port = OV_MULTICAST_MEDIA_PORT +
+    ((hash >> 18) % OV_MULTICAST_MEDIA_PORT_BLOCKS) * 64;
+  port = first_port;
+  for (ii = 0; ii < peers->len; ii++) {
+    thiscaps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, ii));
+    if (!thiscaps->multicast[0])
+      continue;
+
+    for (jj = 0; jj < peers->len; jj++) {
+      thatcaps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, jj));
+      if (jj != ii && thatcaps->multicast[1])
+        break;
+    }
+    if (jj == peers->len)
+      continue;
+
+    thiscaps->multicast_port = port;
+    port += 4;
+  }
+
+  if (port == first_port)
+    return NULL;
+
+  /* Organization-local scope (RFC 2365), 239.192.0.0/14 */
+  return g_strdup_printf ("239.%u.%u.%u", 192 + (guint) ((hash >> 16) & 0x3),
+      (guint) (hash >> 8) & 0xff, (guint) hash & 0xff);
+}
+
+/* Format of GHashTable *in is: {OvRemotePeer*: GVariant*}
+ * GVariant is of type OV_TCP_MSG_TYPE_REPLY_CAPS */
+static GHashTable *
+ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
+    guint64 call_id)
+{
+  guint ii, jj;
+  OvNegCaps *caps, *localcaps;
+  gchar *local_id, *group, *relay_vcaps_s = NULL;
+  gboolean has_bits;
+  GPtrArray *peers, *remotes;
+  GHashTable *out, *negcaps, *aggports;
+  const gchar *in_vtype, *out_vtype;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (local);
+  g_object_get (local, "id", &local_id, NULL);
+  remotes = local_priv->remote_peers;
+  peers = _ov_get_all_peers (local);
+
+  in_vtype = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_REPLY_CAPS, OV_TCP_MAX_VERSION);
+  out_vtype = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_CALL_DETAILS, OV_TCP_MAX_VERSION);
+
+  /* A hash table that contains negotiated send_caps information for each peer
+   * (including us; the local peer).
+   *
+   * This table is first built up from the *in hash table that contains
+   * REPLY_CAPS GVariants, and then it's edited in place to intersect send and
+   * recv caps which basically does the negotiation.
+   *
+   * Format: {gpointer peer: OvNegCaps*} */
+  negcaps = g_hash_table_new_full (NULL, NULL, NULL, _ov_free_negcaps_value);
+  /* A hash table that contains aggregated destination port information for each
+   * set of from → to peer pairs.
+   *
+   * This table is built from the *in hash table that contains REPLY_CAPS
+   * GVariants.
+   *
+   * Format:
+   * {gchar *from_id: {gchar *to_id: guint16 to_recv_ports[6]}} */
+  aggports = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) g_hash_table_unref);
+  /* This hash table is the output of this entire function
+   *
+   * Format: {OvRemotePeer*: GVariant*}
+   * GVariant is of type OV_TCP_MSG_TYPE_CALL_DETAILS and only contains remote
+   * peers; not the local peer */
+  out = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_variant_unref);
+
+  /* Aggregate caps for all remotes into a separate hash table */
+  for (ii = 0; ii < remotes->len; ii++) {
+    OvRemotePeer *this;
+    GVariant *thisv;
+    gchar *caps_s[4] = {0};
+
+    this = g_ptr_array_index (remotes, ii);
+    thisv = g_hash_table_lookup (in, this);
+    g_variant_get (thisv, in_vtype, NULL, NULL, NULL,
+        /* senda_caps, sendv_caps, recva_caps, recvv_caps */
+        &caps_s[0], &caps_s[1], &caps_s[2], &caps_s[3], NULL);
+
+    caps = g_new0 (OvNegCaps, 1);
+    for (jj = 0; jj < 4; jj++)
+      caps->caps[jj] = gst_caps_from_string (caps_s[jj]), g_free (caps_s[jj]);
+    g_hash_table_insert (negcaps, this, caps);
+  }
+  /* Add ourselves because caps negotiation must include us */
+  caps = g_new0 (OvNegCaps, 1);
+  caps->caps[0] = gst_caps_ref (local_priv->supported_send_acaps);
+  caps->caps[1] = ov_local_peer_get_offered_vcaps (local, TRUE);
+  caps->caps[2] = gst_caps_ref (local_priv->supported_recv_acaps);
+  caps->caps[3] = ov_local_peer_get_offered_vcaps (local, FALSE);
+  g_hash_table_insert (negcaps, local, caps);
+  localcaps = caps;
+
+  /* Multicast and DTX are decided per peer instead of being ANDed or
+   * intersected */
+  for (ii = 0; ii < peers->len; ii++) {
+    caps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, ii));
+    caps->multicast[0] = ov_caps_take_multicast (&caps->caps[1], NULL, NULL);
+    caps->multicast[1] = ov_caps_take_multicast (&caps->caps[3], NULL, NULL);
+    caps->dtx[0] = ov_caps_take_flag (&caps->caps[0], "dtx");
+    caps->dtx[1] = ov_caps_take_flag (&caps->caps[2], "dtx");
+  }
+
+  /* What each remote can receive is kept, to decide what a peer that joins
+   * the call later can send */
+  for (ii = 0; ii < remotes->len; ii++) {
+    OvRemotePeer *remote;
+
+    remote = g_ptr_array_index (remotes, ii);
+    caps = g_hash_table_lookup (negcaps, remote);
+    for (jj = 0; jj < 2; jj++)
+      gst_caps_replace (&remote->priv->offered_recv_caps[jj],
+          caps->caps[jj + 2]);
+    remote->priv->offered_recv_dtx = caps->dtx[1];
+  }
+
+  /* Normalize the caps of each peer to bits once, so that negotiating doesn't
+   * have to intersect the caps of every pair of peers */
+  has_bits = TRUE;
+  for (ii = 0; ii < peers->len; ii++) {
+    caps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, ii));
+    for (jj = 0; jj < 4; jj++)
+      has_bits &= _ov_caps_to_bits (caps->caps[jj], jj >= 2, &caps->bits[jj]);
+  }
+
+  /* Decide (negotiate) the send_(a|v)caps for each peer */
+  if (has_bits) {
+    _ov_negotiate_caps_bits (peers, negcaps);
+  } else {
+    GST_DEBUG ("Some peers have caps that can't be ANDed, intersecting");
+    _ov_negotiate_caps_intersect (peers, negcaps);
+  }
+
+  group = _ov_negotiate_multicast (local, call_id, peers, negcaps);
+  _ov_negotiate_dtx (peers, negcaps);
+
+  /* Every other peer is told what each peer will send */
+  for (ii = 0; ii < peers->len; ii++) {
+    caps = g_hash_table_lookup (negcaps, g_ptr_array_index (peers, ii));
+    for (jj = 0; jj < 2; jj++)
+      caps->send_s[jj] = gst_caps_to_string (caps->caps[jj]);
+    if (caps->send_dtx) {
+      GstCaps *tmp;
+
+      tmp = ov_caps_with_flag (caps->caps[0], "dtx");
+      g_free (caps->send_s[0]);
+      caps->send_s[0] = gst_caps_to_string (tmp);
+      gst_caps_unref (tmp);
+    }
+    if (caps->multicast_port != 0) {
+      GstCaps *tmp;
+
+      tmp = ov_caps_with_multicast (caps->caps[1], group,
+          caps->multicast_port);
+      caps->multicast_vcaps_s = gst_caps_to_string (tmp);
+      gst_caps_unref (tmp);
     }
   }
 
@@ -539,15 +1359,20 @@ ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
    * for all of them for our own use */
   for (ii = 0; ii < remotes->len; ii++) {
     OvRemotePeer *from;
-    GstCaps **fromcaps;
+    OvNegCaps *fromcaps;
 
     from = g_ptr_array_index (remotes, ii);
     fromcaps = g_hash_table_lookup (negcaps, from);
 
     /* The caps we will receive from 'from' are its send_caps
      * (the first two in this structure) */
-    from->priv->recv_acaps = gst_caps_ref (fromcaps[0]);
-    from->priv->recv_vcaps = gst_caps_ref (fromcaps[1]);
+    from->priv->recv_acaps = gst_caps_ref (fromcaps->caps[0]);
+    from->priv->recv_dtx = fromcaps->send_dtx;
+    from->priv->recv_vcaps = gst_caps_copy (fromcaps->caps[1]);
+    from->priv->recv_repair =
+      ov_caps_take_rtp_repair (&from->priv->recv_vcaps);
+    if (localcaps->multicast[1])
+      from->priv->recv_multicast_port = fromcaps->multicast_port;
   }
 
   /* Aggregate remote_recv_ports for each peer pair into a hash table,
@@ -648,19 +1473,30 @@ ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
     g_free (str);
   }
 
+  /* When we're the relay, the remotes must know that we won't send them any
+   * media or RTCP */
+  if (local_priv->relay) {
+    GstCaps *tmp;
+
+    tmp = ov_caps_with_flag (localcaps->caps[1], "relay");
+    relay_vcaps_s = gst_caps_to_string (tmp);
+    gst_caps_unref (tmp);
+  }
+
   /* For each remote peer, iterate over the negcaps and aggports hash tables
    * which contain information for all peers and create the *out hash table
    * containing CALL_DETAILS GVariants */
   for (ii = 0; ii < remotes->len; ii++) {
     OvRemotePeer *from;
+    OvNegCaps *fromcaps;
     GHashTable *to_ports;
     GVariantBuilder *fromb;
     GVariant *call_details;
-    gchar *from_id, *from_send_acaps, *from_send_vcaps;
-    GstCaps **caps;
+    gchar *from_id;
 
     from = g_ptr_array_index (remotes, ii);
     from_id = from->id;
+    fromcaps = g_hash_table_lookup (negcaps, from);
 
     to_ports = g_hash_table_lookup (aggports, from_id);
     g_assert (to_ports);
@@ -669,8 +1505,9 @@ ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
 
     for (jj = 0; jj < peers->len; jj++) {
       gpointer to;
-      guint16 *to_recv_ports;
-      gchar *to_id, *to_send_acaps, *to_send_vcaps;
+      guint16 *to_recv_ports, rtp_ports[2];
+      const gchar *vcaps_s;
+      gchar *to_id;
 
       to = g_ptr_array_index (peers, jj);
 
@@ -681,51 +1518,255 @@ ov_aggregate_call_details_for_remotes (OvLocalPeer * local, GHashTable * in,
 
       caps = g_hash_table_lookup (negcaps, to);
       g_assert (caps);
-      to_send_acaps = gst_caps_to_string (caps[0]);
-      to_send_vcaps = gst_caps_to_string (caps[1]);
 
       to_recv_ports = g_hash_table_lookup (to_ports, to_id);
       g_assert (to_recv_ports);
 
-      g_variant_builder_add (fromb, "(sssqqqqqq)", to_id, to_send_acaps,
-          to_send_vcaps, to_recv_ports[0], to_recv_ports[1], to_recv_ports[2],
-          to_recv_ports[3], to_recv_ports[4], to_recv_ports[5]);
-      g_free (to_send_acaps);
-      g_free (to_send_vcaps);
+      /* 'from' receives the RTP of 'to' from the multicast group if both
+       * can, and the other way around. Only the RTP moves there. */
+      vcaps_s = caps->send_s[1];
+      if (caps->multicast_vcaps_s != NULL && fromcaps->multicast[1])
+        vcaps_s = caps->multicast_vcaps_s;
+      rtp_ports[0] = to_recv_ports[0];
+      rtp_ports[1] = to_recv_ports[3];
+      if (fromcaps->multicast_port != 0 && caps->multicast[1])
+        rtp_ports[0] = rtp_ports[1] = 0;
+
+      /* When we're the relay, 'from' sends its RTP only to us and we forward
+       * it to 'to' */
+      if (relay_vcaps_s != NULL && to == local) {
+        vcaps_s = relay_vcaps_s;
+      } else if (relay_vcaps_s != NULL) {
+        ov_remote_peer_relay_add_dest (from, to, to_recv_ports[0],
+            to_recv_ports[3]);
+        rtp_ports[0] = rtp_ports[1] = 0;
+      }
+
+      g_variant_builder_add (fromb, "(sssqqqqqq)", to_id, caps->send_s[0],
+          vcaps_s, rtp_ports[0], to_recv_ports[1], to_recv_ports[2],
+          rtp_ports[1], to_recv_ports[4], to_recv_ports[5]);
     }
 
-    caps = g_hash_table_lookup (negcaps, from);
-    from_send_acaps = gst_caps_to_string (caps[0]);
-    from_send_vcaps = gst_caps_to_string (caps[1]);
     /* Create the CALL_DETAILS GVariant for this remote peer */
-    call_details = g_variant_new (out_vtype, call_id, from_send_acaps,
-        from_send_vcaps, fromb);
+    call_details = g_variant_new (out_vtype, call_id, fromcaps->send_s[0],
+        fromcaps->multicast_vcaps_s != NULL ? fromcaps->multicast_vcaps_s :
+        fromcaps->send_s[1], fromb);
     g_hash_table_insert (out, from, g_variant_ref_sink (call_details));
     g_variant_builder_unref (fromb);
-    g_free (from_send_acaps);
-    g_free (from_send_vcaps);
   }
 
   /* Set the caps we will send */
   {
-    GstCaps **caps = g_hash_table_lookup (negcaps, local);
-    gst_caps_replace (&local_priv->send_acaps, caps[0]);
-    gst_caps_replace (&local_priv->send_vcaps, caps[1]);
+    caps = localcaps;
+    gst_caps_replace (&local_priv->send_acaps, caps->caps[0]);
+    local_priv->send_dtx = caps->send_dtx;
+    gst_caps_replace (&local_priv->send_vcaps, caps->caps[1]);
+    /* The CALL_DETAILS we send have the repair fields, but they can't be
+     * in the caps that we use for the transmit pipeline */
+    local_priv->send_repair = ov_caps_take_rtp_repair (&local_priv->send_vcaps);
     local_priv->send_video_format =
       ov_caps_to_video_format (local_priv->send_vcaps);
     /* If this wasn't already set, that means we're doing passthrough of video
      * data from the video source device to the payloader */
     if (local_priv->device_video_format == OV_VIDEO_FORMAT_UNKNOWN)
       local_priv->device_video_format = local_priv->send_video_format;
+
+    /* Our RTP goes to the group instead for the remotes that receive from it */
+    g_free (local_priv->multicast_group);
+    local_priv->multicast_group = group;
+    local_priv->send_multicast_port = caps->multicast_port;
+    for (ii = 0; ii < remotes->len && caps->multicast_port != 0; ii++) {
+      OvRemotePeer *to;
+      OvNegCaps *tocaps;
+
+      to = g_ptr_array_index (remotes, ii);
+      tocaps = g_hash_table_lookup (negcaps, to);
+      if (tocaps->multicast[1])
+        to->priv->send_ports[0] = to->priv->send_ports[3] = 0;
+    }
   }
 
   g_ptr_array_free (peers, TRUE);
   g_hash_table_unref (aggports);
   g_hash_table_unref (negcaps);
+  g_free (relay_vcaps_s);
   g_free (local_id);
   return out;
 }
 
+/* @remote is joining the call that we negotiated and @in is its REPLY_CAPS.
+ * What everyone in the call sends can't change, so @remote must be able to
+ * receive all of it, and it can only send what all of them can receive.
+ * Decides that, and sets its call details for our own use like
+ * ov_aggregate_call_details_for_remotes() does. The caps that it will send, as
+ * they go in its CALL_DETAILS, are returned in @send_s, and the ADD_PEER
+ * GVariants for each of the remotes in the call in @add_peer.
+ *
+ * Called with the lock TAKEN */
+static gboolean
+_ov_negotiate_joining_remote (OvLocalPeer * local, OvRemotePeer * remote,
+    GVariant * in, guint64 call_id, gchar ** send_s, GVariant ** add_peer,
+    GError ** error)
+{
+  guint ii, jj;
+  guint16 ports[6];
+  gboolean dtx[2], local_dtx;
+  gchar *caps_s[4], *from_id, *local_id;
+  GstCaps *caps[4], *local_recv[2], *tmp;
+  OvRtpRepair repair;
+  GVariantIter *iter;
+  GPtrArray *remotes;
+  const gchar *in_vtype, *out_vtype;
+  OvLocalPeerPrivate *local_priv;
+  gboolean ret = FALSE;
+
+  local_priv = ov_local_peer_get_private (local);
+  g_object_get (local, "id", &local_id, NULL);
+  remotes = local_priv->remote_peers;
+
+  in_vtype = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_REPLY_CAPS, OV_TCP_MAX_VERSION);
+  out_vtype = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_ADD_PEER, OV_TCP_MAX_VERSION);
+
+  /* The RR ports are for everyone */
+  g_variant_get (in, in_vtype, NULL, &ports[2], &ports[5],
+      /* senda_caps, sendv_caps, recva_caps, recvv_caps */
+      &caps_s[0], &caps_s[1], &caps_s[2], &caps_s[3], &iter);
+  for (ii = 0; ii < 4; ii++)
+    caps[ii] = gst_caps_from_string (caps_s[ii]), g_free (caps_s[ii]);
+  remote->priv->send_ports[2] = ports[2];
+  remote->priv->send_ports[5] = ports[5];
+
+  /* Nobody is moved to the multicast group mid-call, so it gets everything
+   * unicast */
+  ov_caps_take_multicast (&caps[1], NULL, NULL);
+  ov_caps_take_multicast (&caps[3], NULL, NULL);
+  dtx[0] = ov_caps_take_flag (&caps[0], "dtx");
+  dtx[1] = ov_caps_take_flag (&caps[2], "dtx");
+
+  /* this.send_caps = this.send_caps.intersect(that.recv_caps) for us and all
+   * the remotes; there's only one sender, so nothing is ANDed as bits */
+  local_recv[0] = gst_caps_ref (local_priv->supported_recv_acaps);
+  local_dtx = ov_caps_take_flag (&local_recv[0], "dtx");
+  local_recv[1] = ov_local_peer_get_offered_vcaps (local, FALSE);
+  ov_caps_take_multicast (&local_recv[1], NULL, NULL);
+  for (ii = 0; ii <= remotes->len; ii++) {
+    GstCaps **recv = local_recv;
+    gboolean recv_dtx = local_dtx;
+
+    if (ii < remotes->len) {
+      OvRemotePeer *that = g_ptr_array_index (remotes, ii);
+      recv = that->priv->offered_recv_caps;
+      recv_dtx = that->priv->offered_recv_dtx;
+    }
+
+    tmp = gst_caps_intersect (caps[0], recv[0]);
+    gst_caps_unref (caps[0]), caps[0] = tmp;
+    tmp = _ov_caps_intersect_rtp_repair (caps[1], recv[1]);
+    gst_caps_unref (caps[1]), caps[1] = tmp;
+    dtx[0] &= recv_dtx;
+  }
+  gst_caps_unref (local_recv[0]);
+  gst_caps_unref (local_recv[1]);
+  if (gst_caps_is_empty (caps[0]) || gst_caps_is_empty (caps[1])) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        "Remote %s can't send anything that everyone in the call can receive",
+        remote->id);
+    goto out;
+  }
+
+  /* The others keep sending what they already are */
+  tmp = gst_caps_copy (caps[3]);
+  repair = ov_caps_take_rtp_repair (&tmp);
+  gst_caps_unref (tmp);
+  for (ii = 0; ii <= remotes->len; ii++) {
+    const gchar *that_id = local_id;
+    GstCaps *that_caps[2] = {local_priv->send_acaps, local_priv->send_vcaps};
+    OvRtpRepair that_repair = local_priv->send_repair;
+    gboolean that_dtx = local_priv->send_dtx;
+
+    if (ii < remotes->len) {
+      OvRemotePeer *that = g_ptr_array_index (remotes, ii);
+      that_id = that->id;
+      that_caps[0] = that->priv->recv_acaps;
+      that_caps[1] = that->priv->recv_vcaps;
+      that_repair = that->priv->recv_repair;
+      that_dtx = that->priv->recv_dtx;
+    }
+
+    if (!gst_caps_can_intersect (that_caps[0], caps[2]) ||
+        !gst_caps_can_intersect (that_caps[1], caps[3]) ||
+        (that_repair & ~repair) != 0 || (that_dtx && !dtx[1])) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+          "Remote %s can't receive what %s is sending", remote->id, that_id);
+      goto out;
+    }
+  }
+
+  /* The caps we will receive from it */
+  remote->priv->recv_acaps = gst_caps_ref (caps[0]);
+  remote->priv->recv_dtx = dtx[0];
+  remote->priv->recv_vcaps = gst_caps_copy (caps[1]);
+  remote->priv->recv_repair =
+    ov_caps_take_rtp_repair (&remote->priv->recv_vcaps);
+  for (ii = 0; ii < 2; ii++)
+    gst_caps_replace (&remote->priv->offered_recv_caps[ii], caps[ii + 2]);
+  remote->priv->offered_recv_dtx = dtx[1];
+
+  if (dtx[0]) {
+    tmp = ov_caps_with_flag (caps[0], "dtx");
+    send_s[0] = gst_caps_to_string (tmp);
+    gst_caps_unref (tmp);
+  } else {
+    send_s[0] = gst_caps_to_string (caps[0]);
+  }
+  send_s[1] = gst_caps_to_string (caps[1]);
+
+  /* The ports that it has allocated to receive from us and from each remote */
+  while (g_variant_iter_next (iter, "(sqqqq)", &from_id, &ports[0], &ports[1],
+        &ports[3], &ports[4])) {
+    if (g_strcmp0 (from_id, local_id) == 0) {
+      remote->priv->send_ports[0] = ports[0];
+      remote->priv->send_ports[1] = ports[1];
+      remote->priv->send_ports[3] = ports[3];
+      remote->priv->send_ports[4] = ports[4];
+    }
+
+    for (jj = 0; jj < remotes->len; jj++) {
+      OvRemotePeer *to = g_ptr_array_index (remotes, jj);
+
+      if (g_strcmp0 (from_id, to->id) != 0 || add_peer[jj] != NULL)
+        continue;
+      add_peer[jj] = g_variant_ref_sink (g_variant_new (out_vtype, call_id,
+            remote->id, remote->addr_s, send_s[0], send_s[1], ports[0],
+            ports[1], ports[2], ports[3], ports[4], ports[5]));
+    }
+    g_free (from_id);
+  }
+
+  for (jj = 0; jj < remotes->len; jj++)
+    if (add_peer[jj] == NULL) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+          "Remote %s didn't allocate ports for %s", remote->id,
+          ((OvRemotePeer *) g_ptr_array_index (remotes, jj))->id);
+      goto out;
+    }
+
+  GST_DEBUG ("Set joining remote peer call details: %s, "
+      "[%u, %u, %u, %u, %u, %u]", remote->id, remote->priv->send_ports[0],
+      remote->priv->send_ports[1], remote->priv->send_ports[2],
+      remote->priv->send_ports[3], remote->priv->send_ports[4],
+      remote->priv->send_ports[5]);
+  ret = TRUE;
+out:
+  for (ii = 0; ii < 4; ii++)
+    gst_caps_unref (caps[ii]);
+  g_variant_iter_free (iter);
+  g_free (local_id);
+  return ret;
+}
+
 static gboolean
 ov_remote_peer_tcp_client_send_call_details (OvRemotePeer * remote,
     GVariant * details, GCancellable * cancellable, GError ** error)
@@ -812,38 +1853,423 @@ no_reply:
   return ret;
 }
 
-/* Called with the lock TAKEN
- *
- * START_NEGOTIATE → ACK
- * QUERY_CAPS → REPLY_CAPS
- * CALL_DETAILS → ACK
- * START_CALL → ACK */
-void
-ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
-    gpointer task_data, GCancellable * cancellable)
+/* @details is an ADD_PEER GVariant from _ov_negotiate_joining_remote() */
+static OvTcpMsg *
+ov_remote_peer_tcp_client_add_peer (OvRemotePeer * remote,
+    GVariant * details, GCancellable * cancellable, GError ** error)
 {
-  gint ii;
-  guint64 call_id;
-  GPtrArray *remotes;
-  /* Hash table of incoming negotiation messages (REPLY_CAPS)
-   * and outgoing messages (CALL_DETAILS) for each remote peer
-   * The local peer is not included in this hash table as a key,
-   * but it is referenced in the values (obviously) */
-  GHashTable *in, *out;
-  OvLocalPeerPrivate *local_priv;
-  GError *error = NULL;
+  gchar *tmp;
+  OvTcpMsg *msg, *reply = NULL;
 
-  local_priv = ov_local_peer_get_private (local);
-  remotes = local_priv->remote_peers;
+  msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_ADD_PEER, details);
 
-  if (g_cancellable_is_cancelled (cancellable)) {
-    local_priv->negotiator_task = NULL;
-    return;
-  }
+  reply = ov_remote_peer_send_tcp_msg (remote, msg, cancellable, error);
+  if (!reply)
+    goto no_reply;
 
-  /* Format: {OvRemotePeer*: GVariant*}
-   * GVariant is of type OV_TCP_MSG_TYPE_REPLY_CAPS */
-  in = g_hash_table_new_full (NULL, NULL, NULL,
+  switch (reply->type) {
+    case OV_TCP_MSG_TYPE_REPLY_ADD_PEER:
+      if (OV_TCP_MSG_PRINT_ENABLED) {
+        tmp = ov_tcp_msg_print (reply);
+        GST_LOG ("Reply add peer from %s: %s", remote->id, tmp);
+        g_free (tmp);
+      }
+      break;
+    case OV_TCP_MSG_TYPE_ERROR:
+    case OV_TCP_MSG_TYPE_ERROR_CALL:
+      tmp = handle_tcp_msg_error (reply);
+      GST_ERROR ("Remote %s returned an error while adding a peer: %s",
+          remote->id, tmp);
+      g_free (tmp);
+      goto clear_reply;
+    default:
+      GST_ERROR ("Expected message type '%s' from %s, got '%s'",
+          ov_tcp_msg_type_to_string (
+            OV_TCP_MSG_TYPE_REPLY_ADD_PEER, OV_TCP_MAX_VERSION),
+          remote->id, ov_tcp_msg_type_to_string (reply->type,
+            reply->version));
+      goto clear_reply;
+  }
+
+no_reply:
+  ov_tcp_msg_free (msg);
+  return reply;
+
+clear_reply:
+  g_clear_pointer (&reply, (GDestroyNotify) ov_tcp_msg_free);
+  goto no_reply;
+}
+
+typedef enum _OvNegotiatePhase OvNegotiatePhase;
+
+enum _OvNegotiatePhase {
+  OV_NEGOTIATE_PHASE_START_NEGOTIATE,
+  OV_NEGOTIATE_PHASE_QUERY_CAPS,
+  OV_NEGOTIATE_PHASE_CALL_DETAILS,
+  OV_NEGOTIATE_PHASE_START_CALL,
+  /* Only when a peer joins a call; with the peers already in it */
+  OV_NEGOTIATE_PHASE_ADD_PEER,
+};
+
+/* Span names for the call trace, indexed by OvNegotiatePhase */
+static const gchar *ov_negotiate_phase_names[] = {
+  "start-negotiate",
+  "query-caps",
+  "call-details",
+  "start-call",
+  "add-peer",
+};
+
+typedef struct _OvFanout OvFanout;
+typedef struct _OvFanoutJob OvFanoutJob;
+
+/* One request/reply with one remote peer, done in its own thread */
+struct _OvFanoutJob {
+  OvFanout *fanout;
+  GThread *thread;
+  OvRemotePeer *remote;
+  /* Message-specific data (QUERY_CAPS, CALL_DETAILS, START_CALL, ADD_PEER) */
+  GVariant *data;
+  /* REPLY_CAPS reply to QUERY_CAPS, or REPLY_ADD_PEER reply to ADD_PEER */
+  OvTcpMsg *reply;
+  gboolean ret;
+  GError *error;
+  /* Protected by the fanout lock */
+  gboolean done;
+  gboolean timed_out;
+};
+
+/* A negotiation phase that is done with all remote peers at once */
+struct _OvFanout {
+  OvNegotiatePhase phase;
+  guint64 call_id;
+  /* Records how long each remote took; may be NULL */
+  OvCallTrace *trace;
+  /* Cancelled when the phase times out or negotiation is cancelled */
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint pending;
+  guint n_jobs;
+  OvFanoutJob *jobs;
+};
+
+static gpointer
+ov_fanout_job_run (OvFanoutJob * job)
+{
+  gint64 start;
+  OvFanout *fanout = job->fanout;
+
+  start = g_get_monotonic_time ();
+
+  switch (fanout->phase) {
+    case OV_NEGOTIATE_PHASE_START_NEGOTIATE:
+      /* START_NEGOTIATE → OK_NEGOTIATE */
+      job->ret = ov_remote_peer_tcp_client_start_negotiate (job->remote,
+          fanout->call_id, fanout->cancellable, &job->error);
+      break;
+    case OV_NEGOTIATE_PHASE_QUERY_CAPS:
+      /* QUERY_CAPS → REPLY_CAPS */
+      job->reply = ov_remote_peer_tcp_client_query_caps (job->remote,
+          job->data, fanout->cancellable, &job->error);
+      job->ret = job->reply != NULL;
+      break;
+    case OV_NEGOTIATE_PHASE_CALL_DETAILS:
+      /* CALL_DETAILS → ACK */
+      job->ret = ov_remote_peer_tcp_client_send_call_details (job->remote,
+          job->data, fanout->cancellable, &job->error);
+      break;
+    case OV_NEGOTIATE_PHASE_START_CALL:
+      /* START_CALL → ACK */
+      job->ret = ov_remote_peer_tcp_client_start_call (job->remote,
+          job->data, fanout->cancellable, &job->error);
+      break;
+    case OV_NEGOTIATE_PHASE_ADD_PEER:
+      /* ADD_PEER → REPLY_ADD_PEER */
+      job->reply = ov_remote_peer_tcp_client_add_peer (job->remote,
+          job->data, fanout->cancellable, &job->error);
+      job->ret = job->reply != NULL;
+      break;
+    default:
+      g_assert_not_reached ();
+  }
+
+  if (fanout->trace != NULL) {
+    /* We only know the id once START_NEGOTIATE has succeeded */
+    const gchar *peer = job->remote->id ? job->remote->id :
+      job->remote->addr_s;
+    OvRemotePeerPrivate *priv = job->remote->priv;
+
+    /* Opening the control connection is part of the first request */
+    g_mutex_lock (&priv->control_lock);
+    if (priv->control_connect_start >= start)
+      ov_call_trace_add (fanout->trace, "tcp-connect", peer,
+          priv->control_connect_start, priv->control_connect_end);
+    g_mutex_unlock (&priv->control_lock);
+
+    ov_call_trace_add (fanout->trace, ov_negotiate_phase_names[fanout->phase],
+        peer, start, g_get_monotonic_time ());
+  }
+
+  g_mutex_lock (&fanout->lock);
+  job->done = TRUE;
+  fanout->pending--;
+  g_cond_signal (&fanout->cond);
+  g_mutex_unlock (&fanout->lock);
+
+  return NULL;
+}
+
+static void
+on_negotiate_cancelled (GCancellable * cancellable, GCancellable * phase)
+{
+  g_cancellable_cancel (phase);
+}
+
+/* Does @phase with all @remotes at the same time, and waits till either all of
+ * them reply, or OV_TCP_TIMEOUT passes. Remotes that haven't replied by then
+ * are cancelled and fail with G_IO_ERROR_TIMED_OUT. @data is an array with
+ * message-specific data for each remote, or NULL. If @trace is not NULL, a
+ * span is added to it for the whole phase and for each remote.
+ *
+ * Does not take the lock, so the caller must ensure that @remotes doesn't
+ * change while this is running */
+static OvFanout *
+ov_fanout_run (OvNegotiatePhase phase, GPtrArray * remotes, guint64 call_id,
+    GVariant ** data, OvCallTrace * trace, GCancellable * cancellable)
+{
+  guint ii, span = 0;
+  gint64 deadline;
+  gulong handler_id = 0;
+  OvFanout *fanout;
+
+  fanout = g_new0 (OvFanout, 1);
+  fanout->phase = phase;
+  fanout->call_id = call_id;
+  fanout->trace = trace;
+  fanout->cancellable = g_cancellable_new ();
+  g_mutex_init (&fanout->lock);
+  g_cond_init (&fanout->cond);
+  fanout->n_jobs = remotes->len;
+  fanout->pending = remotes->len;
+  fanout->jobs = g_new0 (OvFanoutJob, remotes->len);
+
+  if (cancellable != NULL)
+    handler_id = g_cancellable_connect (cancellable,
+        G_CALLBACK (on_negotiate_cancelled), fanout->cancellable, NULL);
+
+  if (trace != NULL)
+    span = ov_call_trace_begin (trace, ov_negotiate_phase_names[phase], NULL);
+
+  /* One deadline for the whole phase, not for each remote */
+  deadline = g_get_monotonic_time () + OV_TCP_TIMEOUT * G_TIME_SPAN_SECOND;
+
+  for (ii = 0; ii < fanout->n_jobs; ii++) {
+    OvFanoutJob *job = &fanout->jobs[ii];
+
+    job->fanout = fanout;
+    job->remote = g_ptr_array_index (remotes, ii);
+    job->data = data ? data[ii] : NULL;
+    job->thread = g_thread_new ("ov-negotiate",
+        (GThreadFunc) ov_fanout_job_run, job);
+  }
+
+  g_mutex_lock (&fanout->lock);
+  while (fanout->pending > 0)
+    if (!g_cond_wait_until (&fanout->cond, &fanout->lock, deadline))
+      break;
+  if (fanout->pending > 0) {
+    for (ii = 0; ii < fanout->n_jobs; ii++)
+      if (!fanout->jobs[ii].done)
+        fanout->jobs[ii].timed_out = TRUE;
+    GST_DEBUG ("%u remotes did not reply in time", fanout->pending);
+  }
+  g_mutex_unlock (&fanout->lock);
+
+  /* Stragglers give up as soon as they notice the cancellation */
+  g_cancellable_cancel (fanout->cancellable);
+  for (ii = 0; ii < fanout->n_jobs; ii++)
+    g_thread_join (fanout->jobs[ii].thread);
+
+  if (cancellable != NULL)
+    g_cancellable_disconnect (cancellable, handler_id);
+
+  if (trace != NULL)
+    ov_call_trace_end (trace, span);
+
+  for (ii = 0; ii < fanout->n_jobs; ii++) {
+    OvFanoutJob *job = &fanout->jobs[ii];
+
+    if (job->timed_out) {
+      job->ret = FALSE;
+      g_clear_pointer (&job->reply, (GDestroyNotify) ov_tcp_msg_free);
+      g_clear_error (&job->error);
+      g_set_error (&job->error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+          "Timed out waiting for a reply from %s", job->remote->addr_s);
+    } else if (!job->ret && job->error == NULL) {
+      g_set_error (&job->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+          "Remote %s returned an error", job->remote->addr_s);
+    }
+  }
+
+  return fanout;
+}
+
+static void
+ov_fanout_free (OvFanout * fanout)
+{
+  guint ii;
+
+  for (ii = 0; ii < fanout->n_jobs; ii++) {
+    ov_tcp_msg_free (fanout->jobs[ii].reply);
+    g_clear_error (&fanout->jobs[ii].error);
+  }
+
+  g_object_unref (fanout->cancellable);
+  g_mutex_clear (&fanout->lock);
+  g_cond_clear (&fanout->cond);
+  g_free (fanout->jobs);
+  g_free (fanout);
+}
+
+/* Returns the first error in the fanout, or NULL if all remotes succeeded */
+static GError *
+ov_fanout_get_error (OvFanout * fanout)
+{
+  guint ii;
+
+  for (ii = 0; ii < fanout->n_jobs; ii++)
+    if (!fanout->jobs[ii].ret) {
+      GST_ERROR ("Negotiation failed with remote %s: %s",
+          fanout->jobs[ii].remote->addr_s, fanout->jobs[ii].error->message);
+      return g_error_copy (fanout->jobs[ii].error);
+    }
+
+  return NULL;
+}
+
+/* Removes all remotes that failed in @fanout from the call, and notifies the
+ * application about them. If @cancel is TRUE, also sends CANCEL_NEGOTIATE to
+ * them since they had already started negotiating.
+ *
+ * Called with the lock TAKEN; unlocks it while emitting signals */
+static void
+ov_local_peer_skip_failed_remotes (OvLocalPeer * local, OvFanout * fanout,
+    gboolean cancel)
+{
+  guint ii;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (local);
+
+  for (ii = 0; ii < fanout->n_jobs; ii++) {
+    OvPeer *skipped;
+    OvFanoutJob *job = &fanout->jobs[ii];
+
+    if (job->ret)
+      continue;
+
+    GST_WARNING ("Unable to negotiate with remote %s: %s. Skipped.",
+        /* We might not know remote->id yet */
+        job->remote->addr_s, job->error->message);
+
+    if (cancel)
+      ov_remote_peer_tcp_client_cancel_negotiate (job->remote,
+          fanout->call_id);
+
+    g_ptr_array_remove (local_priv->remote_peers, job->remote);
+    /* Negotiation is being cancelled; nothing to notify about */
+    if (g_error_matches (job->error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      continue;
+
+    skipped = ov_peer_new (job->remote->addr);
+
+    /* Unlock local and emit signal */
+    ov_local_peer_unlock (local);
+    g_signal_emit_by_name (local, "negotiate-skipped-remote", skipped,
+        job->error);
+    ov_local_peer_lock (local);
+
+    g_object_unref (skipped);
+  }
+}
+
+/* Removes the remotes that we can't reserve the ports to receive from on from
+ * the call, and notifies the application about them. They haven't been told
+ * anything yet, so they don't need a CANCEL_NEGOTIATE.
+ *
+ * Called with the lock TAKEN; unlocks it while emitting signals */
+static void
+ov_local_peer_skip_remotes_without_ports (OvLocalPeer * local)
+{
+  guint ii = 0;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (local);
+
+  while (ii < local_priv->remote_peers->len) {
+    OvPeer *skipped;
+    OvRemotePeer *remote;
+    GError *error = NULL;
+
+    remote = g_ptr_array_index (local_priv->remote_peers, ii);
+    if (ov_remote_peer_reserve_recv_ports (remote, &error)) {
+      ii++;
+      continue;
+    }
+
+    GST_WARNING ("Unable to negotiate with remote %s: %s. Skipped.",
+        remote->addr_s, error->message);
+    g_ptr_array_remove_index (local_priv->remote_peers, ii);
+    skipped = ov_peer_new (remote->addr);
+
+    /* Unlock local and emit signal */
+    ov_local_peer_unlock (local);
+    g_signal_emit_by_name (local, "negotiate-skipped-remote", skipped, error);
+    ov_local_peer_lock (local);
+
+    g_object_unref (skipped);
+    g_error_free (error);
+  }
+}
+
+/* Called with the lock TAKEN
+ *
+ * Each of these phases is done with all remotes in parallel:
+ *
+ * START_NEGOTIATE → ACK
+ * QUERY_CAPS → REPLY_CAPS
+ * CALL_DETAILS → ACK
+ * START_CALL → ACK */
+void
+ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
+    gpointer task_data, GCancellable * cancellable)
+{
+  gint ii;
+  guint64 call_id;
+  GPtrArray *remotes;
+  GVariant **data;
+  guint span, negotiate_span;
+  OvFanout *fanout;
+  /* Hash table of incoming negotiation messages (REPLY_CAPS)
+   * and outgoing messages (CALL_DETAILS) for each remote peer
+   * The local peer is not included in this hash table as a key,
+   * but it is referenced in the values (obviously) */
+  GHashTable *in, *out;
+  OvLocalPeerPrivate *local_priv;
+  GError *error = NULL;
+
+  local_priv = ov_local_peer_get_private (local);
+  remotes = local_priv->remote_peers;
+
+  if (g_cancellable_is_cancelled (cancellable)) {
+    local_priv->negotiator_task = NULL;
+    return;
+  }
+
+  /* Format: {OvRemotePeer*: GVariant*}
+   * GVariant is of type OV_TCP_MSG_TYPE_REPLY_CAPS */
+  in = g_hash_table_new_full (NULL, NULL, NULL,
       (GDestroyNotify) g_variant_unref);
 
   call_id = g_get_monotonic_time ();
@@ -855,46 +2281,27 @@ ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
     goto cancelled;
   ov_local_peer_set_state (local, OV_LOCAL_STATE_NEGOTIATING);
   ov_local_peer_set_state_negotiator (local);
+  /* A trace left over from an earlier aborted call setup is not reported */
+  g_clear_pointer (&local_priv->call_trace, ov_call_trace_free);
+  local_priv->call_trace = ov_call_trace_new (call_id, TRUE);
+  negotiate_span = ov_call_trace_begin (local_priv->call_trace, "negotiate",
+      NULL);
+  ov_local_peer_skip_remotes_without_ports (local);
+  if (g_cancellable_is_cancelled (cancellable))
+    goto cancelled;
   /* Begin negotiation with all peers first (which returns a peer id) */
-  /* TODO: Synchronous for now, make this async and then wait in this thread for
-   * all the replies to speed up negotiation */
-  for (ii = 0; ii < remotes->len; ii++) {
-    gboolean ret;
-    OvRemotePeer *remote;
-
-    remote = g_ptr_array_index (remotes, ii);
-
-    /* START_NEGOTIATE → ACK */
-    ret = ov_remote_peer_tcp_client_start_negotiate (remote, call_id,
-        cancellable, &error);
-    if (!ret) {
-      OvPeer *skipped;
-      GST_WARNING ("Unable to start negotiation with remote %s: %s. Skipped.",
-          /* We don't know remote->id yet */
-          remote->addr_s, error ? error->message : "Unknown error");
-
-      skipped = ov_peer_new (remote->addr);
-      g_ptr_array_remove_index (remotes, ii);
-
-      /* Unlock local and emit signal */
-      ov_local_peer_unlock (local);
-      g_signal_emit_by_name (local, "negotiate-skipped-remote", skipped, error);
-      ov_local_peer_lock (local);
-
-      g_object_unref (skipped);
-
-      if (g_cancellable_is_cancelled (cancellable)) {
-        /* We didn't START_NEGOTIATE with the rest, so don't send
-         * CANCEL_NEGOTIATE to them while cancelling */
-        g_ptr_array_remove_range (remotes, ii, remotes->len - ii);
-        goto cancelled;
-      }
-      /* This will be incremented in the next loop */
-      ii--;
-    }
-  }
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_START_NEGOTIATE, remotes,
+      call_id, NULL, local_priv->call_trace, cancellable);
+  /* Remotes that failed haven't started negotiating, so they don't need
+   * a CANCEL_NEGOTIATE */
+  ov_local_peer_skip_failed_remotes (local, fanout, FALSE);
+  ov_fanout_free (fanout);
+  if (g_cancellable_is_cancelled (cancellable))
+    goto cancelled;
   if (remotes->len == 0) {
     GST_ERROR ("No peers left to call, all failed to negotiate");
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "No peers left to call, all failed to negotiate");
     goto err;
   }
   ov_local_peer_unlock (local);
@@ -906,22 +2313,32 @@ ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
   if (g_cancellable_is_cancelled (cancellable))
     goto cancelled;
   /* Continue negotiation now that we have the peer id for all peers */
-  /* TODO: Synchronous for now, make this async and then wait in this thread for
-   * all the replies to speed up negotiation */
-  for (ii = 0; ii < remotes->len; ii++) {
-    OvTcpMsg *reply;
-    OvRemotePeer *remote;
-
-    remote = g_ptr_array_index (remotes, ii);
-
-    /* QUERY_CAPS → REPLY_CAPS */
-    reply = ov_remote_peer_tcp_client_query_caps (remote, call_id,
-        cancellable, &error);
-    if (!reply)
-      goto err;
-
-    g_hash_table_insert (in, remote, g_variant_ref (reply->variant));
-    ov_tcp_msg_free (reply);
+  data = g_new0 (GVariant*, remotes->len);
+  for (ii = 0; ii < remotes->len; ii++)
+    data[ii] = g_variant_ref_sink (get_all_remotes_addr_list_except_this (
+          g_ptr_array_index (remotes, ii), call_id));
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_QUERY_CAPS, remotes, call_id,
+      data, local_priv->call_trace, cancellable);
+  for (ii = 0; ii < fanout->n_jobs; ii++) {
+    OvFanoutJob *job = &fanout->jobs[ii];
+
+    g_variant_unref (data[ii]);
+    if (job->ret)
+      g_hash_table_insert (in, job->remote,
+          g_variant_ref (job->reply->variant));
+  }
+  g_free (data);
+  /* XXX: The remaining remotes have already been told about the skipped ones in
+   * QUERY_CAPS, but CALL_DETAILS only has the peers that are in the call */
+  ov_local_peer_skip_failed_remotes (local, fanout, TRUE);
+  ov_fanout_free (fanout);
+  if (g_cancellable_is_cancelled (cancellable))
+    goto cancelled;
+  if (remotes->len == 0) {
+    GST_ERROR ("No peers left to call, all failed to reply with caps");
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "No peers left to call, all failed to reply with caps");
+    goto err;
   }
   ov_local_peer_unlock (local);
 
@@ -930,7 +2347,13 @@ ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
     goto cancelled;
   /* Transform REPLY_CAPS to CALL_DETAILS and also set the call details for
    * each remote peer */
+  span = ov_call_trace_begin (local_priv->call_trace,
+      "aggregate-call-details", NULL);
   out = ov_aggregate_call_details_for_remotes (local, in, call_id);
+  ov_call_trace_end (local_priv->call_trace, span);
+  /* We know what we'll send now, so capture and encoding can be started while
+   * the remotes are told */
+  ov_local_peer_warm_transmit (local);
   ov_local_peer_unlock (local);
 
   /* Distribute call details to all remotes */
@@ -939,21 +2362,19 @@ ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
     g_hash_table_unref (out);
     goto cancelled;
   }
-  /* TODO: Synchronous for now, make this async to speed up negotiation */
-  for (ii = 0; ii < remotes->len; ii++) {
-    gboolean ret;
-    OvRemotePeer *remote;
-
-    remote = g_ptr_array_index (remotes, ii);
-
-    /* CALL_DETAILS → ACK */
-    ret = ov_remote_peer_tcp_client_send_call_details (remote,
-        g_hash_table_lookup (out, remote), cancellable, &error);
-
-    if (!ret) {
-      g_hash_table_unref (out);
-      goto err;
-    }
+  /* The call details of every remote refer to all the others, so we can't skip
+   * remotes from here onwards */
+  data = g_new0 (GVariant*, remotes->len);
+  for (ii = 0; ii < remotes->len; ii++)
+    data[ii] = g_hash_table_lookup (out, g_ptr_array_index (remotes, ii));
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_CALL_DETAILS, remotes, call_id,
+      data, local_priv->call_trace, cancellable);
+  g_free (data);
+  error = ov_fanout_get_error (fanout);
+  ov_fanout_free (fanout);
+  if (error != NULL) {
+    g_hash_table_unref (out);
+    goto err;
   }
   ov_local_peer_set_state (local, OV_LOCAL_STATE_NEGOTIATED);
   ov_local_peer_set_state_negotiator (local);
@@ -966,25 +2387,20 @@ ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
     g_hash_table_unref (out);
     goto cancelled;
   }
-  /* TODO: Synchronous for now, make this async and then wait in this thread for
-   * all the replies to speed up negotiation */
-  for (ii = 0; ii < remotes->len; ii++) {
-    gboolean ret;
-    GVariant *peers;
-    OvRemotePeer *remote;
-
-    remote = g_ptr_array_index (remotes, ii);
-
-    peers =
-      g_variant_ref_sink (get_all_peers_list_except_this (remote, call_id));
-    /* START_CALL → ACK */
-    ret = ov_remote_peer_tcp_client_start_call (remote,
-        peers, cancellable, &error);
-    g_variant_unref (peers);
-    if (!ret) {
-      g_hash_table_unref (out);
-      goto err;
-    }
+  data = g_new0 (GVariant*, remotes->len);
+  for (ii = 0; ii < remotes->len; ii++)
+    data[ii] = g_variant_ref_sink (get_all_peers_list_except_this (
+          g_ptr_array_index (remotes, ii), call_id));
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_START_CALL, remotes, call_id,
+      data, local_priv->call_trace, cancellable);
+  for (ii = 0; ii < remotes->len; ii++)
+    g_variant_unref (data[ii]);
+  g_free (data);
+  error = ov_fanout_get_error (fanout);
+  ov_fanout_free (fanout);
+  if (error != NULL) {
+    g_hash_table_unref (out);
+    goto err;
   }
   ov_local_peer_set_state (local, OV_LOCAL_STATE_READY);
   ov_local_peer_set_state_negotiator (local);
@@ -998,6 +2414,7 @@ ov_local_peer_negotiate_thread (GTask * task, OvLocalPeer * local,
     goto cancelled;
 
   local_priv->active_call_id = call_id;
+  ov_call_trace_end (local_priv->call_trace, negotiate_span);
   g_task_return_boolean (task, TRUE);
 
   ov_local_peer_unlock (local);
@@ -1029,83 +2446,437 @@ cancelled:
 
   /* Emit signal after unlocking. FIXME: Set the error. */
   g_signal_emit_by_name (local, "negotiate-aborted", error);
-  g_error_free (error);
+  g_clear_error (&error);
+  ov_local_peer_trace_finish (local, TRUE);
   return;
 }
 
+/* Tells each of the remotes in @added_ids that added @peer_id with ADD_PEER to
+ * remove it again, as if it had ended the call. Remotes that have left the
+ * call since are skipped, and nobody waits for the ACKs.
+ *
+ * Called with the lock TAKEN */
+static void
+ov_local_peer_remove_added_peer (OvLocalPeer * local, GPtrArray * added_ids,
+    guint64 call_id, const gchar * peer_id)
+{
+  guint ii, n_remotes = 0;
+  OvTcpMsg *msg;
+  OvRemotePeer **remotes;
+  const gchar *variant_type;
+
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_END_CALL, OV_TCP_MAX_VERSION);
+  msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_END_CALL,
+      g_variant_new (variant_type, call_id, peer_id));
+
+  remotes = g_new (OvRemotePeer *, added_ids->len);
+  for (ii = 0; ii < added_ids->len; ii++) {
+    OvRemotePeer *remote;
+
+    remote = ov_local_peer_get_remote_by_id (local,
+        g_ptr_array_index (added_ids, ii));
+    if (remote != NULL)
+      remotes[n_remotes++] = remote;
+  }
+  if (n_remotes > 0)
+    ov_local_peer_send_noreply (local, remotes, n_remotes, msg);
+
+  g_free (remotes);
+  ov_tcp_msg_free (msg);
+}
+
+/* Returns FALSE if @remote can't be added to the call @call_id anymore because
+ * the call ended, or because it's already in it.
+ *
+ * Called with the lock TAKEN */
 static gboolean
-ov_remote_peer_tcp_client_end_call (OvRemotePeer * remote, OvTcpMsg * msg,
-    GCancellable * cancellable, GError ** error)
+ov_local_peer_can_add_remote (OvLocalPeer * local, OvRemotePeer * remote,
+    guint64 call_id, GError ** error)
 {
-  gchar *error_msg;
-  OvTcpMsg *reply = NULL;
-  gboolean ret = FALSE;
+  OvLocalPeerPrivate *local_priv;
 
-  /* FIXME: This does a blocking write which is really bad especially if we're
-   * ending the call because we're exiting */
-  reply = ov_remote_peer_send_tcp_msg (remote, msg, cancellable, error);
-  if (!reply)
-    goto no_reply;
+  local_priv = ov_local_peer_get_private (local);
 
-  switch (reply->type) {
-    case OV_TCP_MSG_TYPE_ACK:
-      handle_tcp_msg_ack (reply);
-      GST_DEBUG ("Recvd from '%s' ACK", remote->id);
-      break;
-    case OV_TCP_MSG_TYPE_ERROR:
-      /* Try again? */
-      error_msg = handle_tcp_msg_error (reply);
-      GST_ERROR ("Remote %s returned an error in reply to end call: %s",
-          remote->id, error_msg);
-      g_free (error_msg);
-      goto err;
-    default:
-      GST_ERROR ("Expected message type '%s' from %s, got '%s'",
-          ov_tcp_msg_type_to_string (
-            OV_TCP_MSG_TYPE_ACK, OV_TCP_MAX_VERSION),
-          remote->id, ov_tcp_msg_type_to_string (reply->type,
-            reply->version));
-      goto err;
+  if (call_id == 0 || local_priv->active_call_id != call_id ||
+      !(ov_local_peer_get_state (local) &
+        (OV_LOCAL_STATE_PLAYING | OV_LOCAL_STATE_PAUSED))) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "The call ended before %s could be added", remote->addr_s);
+    return FALSE;
   }
 
-  ret = TRUE;
+  /* We don't know the id till it has replied to START_NEGOTIATE */
+  if (remote->id != NULL &&
+      ov_local_peer_get_remote_by_id (local, remote->id) != NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+        "Remote %s is already in the call", remote->id);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Returns TRUE if the remotes in the call are @remotes, in the same order.
+ *
+ * Called with the lock TAKEN */
+static gboolean
+ov_local_peer_remotes_are (OvLocalPeer * local, GPtrArray * remotes)
+{
+  guint ii;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (local);
+
+  if (local_priv->remote_peers->len != remotes->len)
+    return FALSE;
+
+  for (ii = 0; ii < remotes->len; ii++)
+    if (g_ptr_array_index (local_priv->remote_peers, ii) !=
+        g_ptr_array_index (remotes, ii))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Runs in its own thread, and takes the lock itself
+ *
+ * Adds @remote to the call that we negotiated and are in, by negotiating with
+ * it alone. The remotes already in the call are only told to add it, so none
+ * of their streams change or have to be renegotiated:
+ *
+ * START_NEGOTIATE → OK_NEGOTIATE
+ * QUERY_CAPS → REPLY_CAPS
+ * ADD_PEER → REPLY_ADD_PEER (with all the remotes in the call in parallel)
+ * CALL_DETAILS → ACK
+ * START_CALL → ACK
+ *
+ * Like in ov_local_peer_negotiate_thread(), the lock is released during each
+ * phase, and the call is checked again every time it's taken. The remotes that
+ * ADD_PEER and START_CALL are done with are held meanwhile, so none of them is
+ * freed under the fanout if it leaves the call. If any of them has left by the
+ * time the phase is done, @remote isn't added.
+ *
+ * @remote then starts the call like any negotiatee does. If anything fails,
+ * the remotes that added it remove it again and it's freed. */
+void
+ov_local_peer_add_remote_thread (GTask * task, OvLocalPeer * local,
+    OvRemotePeer * remote, GCancellable * cancellable)
+{
+  guint ii, n_remotes = 0;
+  guint64 call_id;
+  gchar *local_id, *send_s[2] = {0};
+  GPtrArray *joining, *remotes, *in_call, *added_ids;
+  GVariantBuilder *peers;
+  GVariant **add_peer = NULL, *details, *call_details = NULL;
+  const gchar *reply_vtype, *details_vtype;
+  OvFanout *fanout;
+  OvLocalPeerPrivate *local_priv;
+  OvPeer *peer;
+  gboolean started = FALSE, gone = FALSE;
+  GError *error = NULL;
+
+  local_priv = ov_local_peer_get_private (local);
+  remotes = local_priv->remote_peers;
+  g_object_get (local, "id", &local_id, NULL);
+  reply_vtype = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_REPLY_ADD_PEER, OV_TCP_MAX_VERSION);
+  details_vtype = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_CALL_DETAILS, OV_TCP_MAX_VERSION);
+
+  /* The fanout is done with only this remote, except for ADD_PEER */
+  joining = g_ptr_array_new ();
+  g_ptr_array_add (joining, remote);
+  /* Ids of the remotes that have added it */
+  added_ids = g_ptr_array_new_with_free_func (g_free);
+  peer = ov_peer_new (remote->addr);
+
+  ov_local_peer_lock (local);
+  call_id = local_priv->active_call_id;
+  if (!ov_local_peer_can_add_remote (local, remote, call_id, &error))
+    goto err;
+  if (!ov_remote_peer_reserve_recv_ports (remote, &error)) {
+    GST_ERROR ("Unable to add %s to the call: %s", remote->addr_s,
+        error->message);
+    goto err;
+  }
+  ov_local_peer_unlock (local);
+
+  /* Get the peer id */
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_START_NEGOTIATE, joining,
+      call_id, NULL, NULL, cancellable);
+  error = ov_fanout_get_error (fanout);
+  ov_fanout_free (fanout);
+  ov_local_peer_lock (local);
+  if (error != NULL)
+    goto err;
+  if (!ov_local_peer_can_add_remote (local, remote, call_id, &error))
+    goto cancel;
+  /* It's told about everyone that's in the call */
+  details = g_variant_ref_sink (get_all_remotes_addr_list_except_this (remote,
+        call_id));
+  ov_local_peer_unlock (local);
+
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_QUERY_CAPS, joining, call_id,
+      &details, NULL, cancellable);
+  g_variant_unref (details);
+  ov_local_peer_lock (local);
+  error = ov_fanout_get_error (fanout);
+  if (error == NULL &&
+      !ov_local_peer_can_add_remote (local, remote, call_id, &error))
+    GST_DEBUG ("Not adding %s to the call: %s", remote->id, error->message);
+  n_remotes = remotes->len;
+  add_peer = g_new0 (GVariant*, n_remotes);
+  if (error == NULL &&
+      !_ov_negotiate_joining_remote (local, remote,
+        fanout->jobs[0].reply->variant, call_id, send_s, add_peer, &error))
+    GST_ERROR ("Unable to add %s to the call: %s", remote->id, error->message);
+  ov_fanout_free (fanout);
+  if (error != NULL)
+    goto cancel;
+
+  /* Everyone in the call starts sending to it and receiving from it */
+  in_call = g_ptr_array_sized_new (n_remotes);
+  for (ii = 0; ii < n_remotes; ii++) {
+    g_ptr_array_add (in_call, g_ptr_array_index (remotes, ii));
+    ov_remote_peer_hold (g_ptr_array_index (remotes, ii));
+  }
+  ov_local_peer_unlock (local);
+
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_ADD_PEER, in_call, call_id,
+      add_peer, NULL, cancellable);
+  ov_local_peer_lock (local);
+  for (ii = 0; ii < fanout->n_jobs; ii++)
+    if (fanout->jobs[ii].ret)
+      g_ptr_array_add (added_ids, g_strdup (fanout->jobs[ii].remote->id));
+  error = ov_fanout_get_error (fanout);
+  if (error == NULL &&
+      !ov_local_peer_can_add_remote (local, remote, call_id, &error))
+    GST_DEBUG ("Not adding %s to the call: %s", remote->id, error->message);
+  /* It's told about everyone in the call, so that can't have changed */
+  if (error == NULL && !ov_local_peer_remotes_are (local, in_call))
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "The call changed while %s was being added", remote->id);
+  /* If nothing failed, they're all still in the call */
+  for (ii = 0; ii < in_call->len; ii++)
+    ov_remote_peer_release (g_ptr_array_index (in_call, ii));
+  g_ptr_array_free (in_call, TRUE);
+  if (error != NULL) {
+    ov_fanout_free (fanout);
+    goto cancel;
+  }
+
+  /* Its call details are what each of them replied with, and ours */
+  peers = g_variant_builder_new (G_VARIANT_TYPE ("a(sssqqqqqq)"));
+  {
+    gchar *caps_s[2];
+
+    caps_s[0] = ov_local_peer_get_send_caps_string (local,
+        OV_AUDIO_RTP_SESSION);
+    caps_s[1] = ov_local_peer_get_send_caps_string (local,
+        OV_VIDEO_RTP_SESSION);
+    g_variant_builder_add (peers, "(sssqqqqqq)", local_id, caps_s[0],
+        caps_s[1], remote->priv->recv_ports[0], remote->priv->recv_ports[1],
+        local_priv->recv_rtcp_ports[0], remote->priv->recv_ports[2],
+        remote->priv->recv_ports[3], local_priv->recv_rtcp_ports[1]);
+    g_free (caps_s[0]); g_free (caps_s[1]);
+  }
+  for (ii = 0; ii < fanout->n_jobs; ii++) {
+    gchar *caps_s[2];
+    guint16 ports[6];
+
+    g_variant_get (fanout->jobs[ii].reply->variant, reply_vtype, NULL,
+        &caps_s[0], &caps_s[1], &ports[0], &ports[1], &ports[2], &ports[3],
+        &ports[4], &ports[5]);
+    g_variant_builder_add (peers, "(sssqqqqqq)", fanout->jobs[ii].remote->id,
+        caps_s[0], caps_s[1], ports[0], ports[1], ports[2], ports[3],
+        ports[4], ports[5]);
+    g_free (caps_s[0]); g_free (caps_s[1]);
+  }
+  ov_fanout_free (fanout);
+  call_details = g_variant_ref_sink (g_variant_new (details_vtype, call_id,
+        send_s[0], send_s[1], peers));
+  g_variant_builder_unref (peers);
+  ov_local_peer_unlock (local);
+
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_CALL_DETAILS, joining, call_id,
+      &call_details, NULL, cancellable);
+  error = ov_fanout_get_error (fanout);
+  ov_fanout_free (fanout);
+  ov_local_peer_lock (local);
+  if (error != NULL)
+    goto cancel;
+  if (!ov_local_peer_can_add_remote (local, remote, call_id, &error))
+    goto cancel;
+
+  /* And so do we, before it starts sending */
+  started = TRUE;
+  if (!ov_local_peer_start_joined_remote (local, remote)) {
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "Unable to start receiving from %s", remote->id);
+    goto cancel;
+  }
+
+  details = g_variant_ref_sink (get_all_peers_list_except_this (remote,
+        call_id));
+  /* It's in the call now, so it can be removed from it like any other */
+  ov_remote_peer_hold (remote);
+  ov_local_peer_unlock (local);
+
+  fanout = ov_fanout_run (OV_NEGOTIATE_PHASE_START_CALL, joining, call_id,
+      &details, NULL, cancellable);
+  g_variant_unref (details);
+  error = ov_fanout_get_error (fanout);
+  ov_fanout_free (fanout);
+  ov_local_peer_lock (local);
+  if (ov_local_peer_get_remote_by_id (local, remote->id) != remote) {
+    gone = TRUE;
+    g_clear_error (&error);
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "Remote %s left the call while it was being added", remote->id);
+    goto err;
+  }
+  ov_remote_peer_release (remote);
+  if (error != NULL)
+    goto cancel;
+
+  ov_local_peer_unlock (local);
+  GST_DEBUG ("Added remote %s to the call", remote->id);
+
+  /* Emit signal after unlocking */
+  g_signal_emit_by_name (local, "call-remote-added", peer);
+  g_task_return_boolean (task, TRUE);
+  goto out;
+
+  /* Called with the lock TAKEN */
+cancel:
+  ov_remote_peer_tcp_client_cancel_negotiate (remote, call_id);
+  if (added_ids->len > 0)
+    ov_local_peer_remove_added_peer (local, added_ids, call_id, remote->id);
 err:
-  ov_tcp_msg_free (reply);
-no_reply:
-  return ret;
+  /* Frees the remote too */
+  if (gone)
+    ov_remote_peer_release (remote);
+  else if (started)
+    ov_local_peer_remove_remote (local, remote);
+  else
+    ov_remote_peer_free (remote);
+  ov_local_peer_unlock (local);
+
+  /* Emit signal after unlocking */
+  g_signal_emit_by_name (local, "negotiate-skipped-remote", peer, error);
+  g_task_return_error (task, error);
+out:
+  if (call_details != NULL)
+    g_variant_unref (call_details);
+  for (ii = 0; ii < n_remotes; ii++)
+    if (add_peer[ii] != NULL)
+      g_variant_unref (add_peer[ii]);
+  g_free (add_peer);
+  g_object_unref (peer);
+  g_ptr_array_free (added_ids, TRUE);
+  g_ptr_array_free (joining, TRUE);
+  g_free (send_s[0]); g_free (send_s[1]);
+  g_free (local_id);
 }
 
 void
 ov_local_peer_send_end_call (OvLocalPeer * local)
 {
-  guint ii;
   OvTcpMsg *msg;
   gchar *local_id;
   const gchar *variant_type;
   OvLocalPeerPrivate *local_priv;
 
   local_priv = ov_local_peer_get_private (local);
-  g_object_get (OV_PEER (local), "id", &local_id, NULL);
 
   if (!local_priv->active_call_id)
     /* No active call */
     return;
 
+  g_object_get (OV_PEER (local), "id", &local_id, NULL);
   variant_type = ov_tcp_msg_type_to_variant_type (
       OV_TCP_MSG_TYPE_END_CALL, OV_TCP_MAX_VERSION);
   msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_END_CALL,
       g_variant_new (variant_type, local_priv->active_call_id, local_id));
   g_free (local_id);
 
+  /* The remotes are freed right after this, so nothing waits for them */
   GST_DEBUG ("Sending END_CALL to remote peers");
-  for (ii = 0; ii < local_priv->remote_peers->len; ii++) {
-    OvRemotePeer *remote;
-
-    remote = g_ptr_array_index (local_priv->remote_peers, ii);
-    ov_remote_peer_tcp_client_end_call (remote, msg, NULL, NULL);
-  }
+  ov_local_peer_send_noreply (local,
+      (OvRemotePeer **) local_priv->remote_peers->pdata,
+      local_priv->remote_peers->len, msg);
 
   local_priv->active_call_id = 0;
 
   ov_tcp_msg_free (msg);
 }
+
+/* Tell @remote the best quality that we show its video at; see
+ * ov_remote_peer_update_video_view(). Nobody waits for the ACK. Called with
+ * the lock TAKEN */
+void
+ov_remote_peer_send_video_view (OvRemotePeer * remote)
+{
+  OvTcpMsg *msg;
+  gchar *local_id;
+  const gchar *variant_type;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  if (!local_priv->active_call_id)
+    /* No active call */
+    return;
+
+  if (remote->priv->is_relay)
+    /* Has no video of its own */
+    return;
+
+  g_object_get (OV_PEER (remote->local), "id", &local_id, NULL);
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_VIDEO_VIEW, OV_TCP_MAX_VERSION);
+  msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_VIDEO_VIEW,
+      g_variant_new (variant_type, local_priv->active_call_id, local_id,
+        (guint32) remote->priv->recv_view_quality));
+  g_free (local_id);
+
+  GST_DEBUG ("Sending VIDEO_VIEW %#x to %s", remote->priv->recv_view_quality,
+      remote->id);
+  ov_local_peer_send_noreply (remote->local, &remote, 1, msg);
+
+  ov_tcp_msg_free (msg);
+}
+
+/* Tell all the remotes what we've stopped sending, so they can stop expecting
+ * it. Nobody waits for the ACKs. Called with the lock TAKEN */
+void
+ov_local_peer_send_mute_media (OvLocalPeer * local)
+{
+  OvTcpMsg *msg;
+  gchar *local_id;
+  const gchar *variant_type;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (local);
+
+  if (!local_priv->active_call_id)
+    /* No active call */
+    return;
+
+  g_object_get (OV_PEER (local), "id", &local_id, NULL);
+  variant_type = ov_tcp_msg_type_to_variant_type (
+      OV_TCP_MSG_TYPE_MUTE_MEDIA, OV_TCP_MAX_VERSION);
+  msg = ov_tcp_msg_new (OV_TCP_MSG_TYPE_MUTE_MEDIA,
+      g_variant_new (variant_type, local_priv->active_call_id, local_id,
+        local_priv->send_muted[OV_AUDIO_RTP_SESSION],
+        local_priv->send_muted[OV_VIDEO_RTP_SESSION]));
+  g_free (local_id);
+
+  GST_DEBUG ("Sending MUTE_MEDIA to remote peers");
+  ov_local_peer_send_noreply (local,
+      (OvRemotePeer **) local_priv->remote_peers->pdata,
+      local_priv->remote_peers->len, msg);
+
+  ov_tcp_msg_free (msg);
+}
@@ -38,8 +38,16 @@ void	ov_local_peer_negotiate_thread    (GTask *task,
                                            OvLocalPeer *local,
                                            gpointer task_data,
                                            GCancellable *cancellable);
+void    ov_local_peer_add_remote_thread   (GTask *task,
+                                           OvLocalPeer *local,
+                                           OvRemotePeer *remote,
+                                           GCancellable *cancellable);
 
 void    ov_local_peer_send_end_call       (OvLocalPeer *local);
+void    ov_local_peer_send_mute_media     (OvLocalPeer *local);
+void    ov_remote_peer_send_video_view    (OvRemotePeer *remote);
+
+void    ov_remote_peer_close_control_connection (OvRemotePeer *remote);
 
 G_END_DECLS
 
@@ -30,6 +30,9 @@
 
 #include "lib.h"
 #include "lib-priv.h"
+#include "trace.h"
+#include "devicecaps.h"
+#include "socketpool.h"
 
 G_BEGIN_DECLS
 
@@ -44,6 +47,48 @@ struct _OvNegotiate {
   GHashTable *remotes;
   /* A GSourceFunc id that checks for timeouts */
   guint check_timeout_id;
+  /* The span in the call trace covering all of negotiation */
+  guint trace_span;
+};
+
+typedef struct _OvVideoLayer OvVideoLayer;
+
+/* A simulcast video layer. Layer 0 is the negotiated (or application-set)
+ * quality and is always present; the rest are scaled down from it. */
+struct _OvVideoLayer {
+  /* The quality this layer is being sent at */
+  OvVideoQuality quality;
+  /* SSRC set on the payloader for this layer */
+  guint ssrc;
+  /* Encoder for this layer; NULL if passing through device video */
+  GstElement *encoder;
+  /* Payloader for this layer; used for requesting keyframes */
+  GstElement *pay;
+  /* Queue linked to the rtpssrcdemux pad for this layer's SSRC */
+  GstElement *queue;
+  /* multiudpsink sending RTP for this layer to the remotes assigned to it */
+  GstElement *sink;
+};
+
+typedef struct _OvCongestion OvCongestion;
+
+/* State of the congestion controller for the video that we transmit */
+struct _OvCongestion {
+  /* Whether the application wants us to adapt the video we send */
+  gboolean enabled;
+  guint timeout_id;
+  /* Target bitrate for the encoder and its bounds at the current quality, in
+   * kbit/s. Unused if we're passing through device video. */
+  guint bitrate;
+  guint min_bitrate;
+  guint max_bitrate;
+  /* Lowest round-trip time seen during the call in milliseconds; used as the
+   * baseline for detecting queueing delay */
+  guint min_rtt;
+  /* Consecutive intervals without congestion */
+  guint clear_intervals;
+  /* Highest quality we may go back up to; set by the application */
+  OvVideoQuality max_quality;
 };
 
 struct _OvLocalPeerPrivate {
@@ -59,12 +104,89 @@ struct _OvLocalPeerPrivate {
   GstElement *vsend_rtp_sink;
   GstElement *vsend_rtcp_sink;
   GstElement *vrecv_rtcp_src;
+  /* Sources of the audio and video we capture, and the probes that drop what
+   * they capture while the application has muted it; indexed by RTP session.
+   * See ov_local_peer_set_audio_muted() */
+  GstElement *capture_srcs[2];
+  gulong capture_mute_probes[2];
+  /* What the application has muted; this outlives the transmit pipeline */
+  gboolean send_muted[2];
+  /* Number of simulcast video layers requested by the application */
+  guint n_video_layers;
+  /* Number of video layers actually being sent; 1 if simulcast is off */
+  guint n_active_video_layers;
+  /* When simulcast is active, vsend_rtp_sink is video_layers[0].sink */
+  OvVideoLayer video_layers[OV_MAX_VIDEO_LAYERS];
+  /* Frames between periodic keyframes when we encode H.264, and the monotonic
+   * time in ms, truncated to 32 bits, of when we last let a keyframe request
+   * from a remote through to the encoders. The requests come from the RTCP
+   * threads of all the remotes, so it's only accessed with g_atomic_int_*; see
+   * on_transmit_keyframe_request() */
+  guint keyframe_interval;
+  gint last_keyframe_request;
+  /* Warm standby; see ov_local_peer_set_warm_transmit(). transmit_warm is
+   * set while the transmit pipeline is running outside of a call, sending
+   * nowhere, and warm_thread is setting it to PLAYING if it isn't yet. The
+   * pipeline is only used for a call that negotiates the media it was set up
+   * for, which are saved in the warm_* fields. */
+  gboolean warm_transmit;
+  gboolean transmit_warm;
+  GThread *warm_thread;
+  GstCaps *warm_acaps;
+  GstCaps *warm_vcaps;
+  OvRtpRepair warm_repair;
+  gboolean warm_dtx;
+
+  /*~ Shared receive pipeline ~*/
+  /* Whether we receive from all remotes with one rtpbin instead of one
+   * pipeline per remote. See ov_local_peer_set_shared_receive() */
+  gboolean shared_receive;
+  /* One udpsrc per port in shared_recv_ports feeding one rtpbin session per
+   * media type. The depayloaders and decoders of each remote are in its
+   * remote->receive bin inside this pipeline. */
+  GstElement *receive;
+  GstElement *recv_rtpbin;
+  /* multiudpsinks sending our RTCP RRs to all remotes, {audio, video} */
+  GstElement *recv_rtcp_sinks[2];
+
+  /*~ Multicast media ~*/
+  /* Whether we offer to send and receive RTP on a multicast group for each
+   * call; see ov_local_peer_set_multicast_media(). During a call,
+   * multicast_group is the group if any of the peers use it, and
+   * send_multicast_port is the port that our audio RTP goes to on it, with
+   * video RTP 2 above it, or 0 if we only unicast */
+  gboolean multicast_media;
+  gchar *multicast_group;
+  guint16 send_multicast_port;
+
+  /*~ Relay ~*/
+  /* Whether we forward the RTP of the remotes between them instead of being
+   * in the calls that we negotiate; see ov_local_peer_set_relay() */
+  gboolean relay;
+  /* The ports that all remotes send to in this mode, in the same order as
+   * OvRemotePeerPrivate.recv_ports */
+  guint16 shared_recv_ports[4];
+  /* Sender SSRC -> OvRemotePeer and remote id -> OvRemotePeer for the remotes
+   * in the shared receive pipeline. These are used from streaming threads, so
+   * they're protected by recv_lock and not by the local peer lock. recv_lock
+   * also protects the jitterbuffer list of every remote. */
+  GMutex recv_lock;
+  GHashTable *recv_ssrcs;
+  GHashTable *recv_remotes;
 
   /*~ Playback pipeline ~*/
+  /* Whether we use test sources and fakesinks instead of the audio devices and
+   * video windows. See ov_local_peer_set_test_media() */
+  gboolean test_media;
   GstElement *playback;
   /* primary audio playback elements */
   GstElement *audiomixer;
   GstElement *audiosink;
+  /* glvideomixer compositing the video of all remotes into one sink, and the
+   * sink; NULL unless the application asked for it with
+   * ov_local_peer_add_compositor_gtksink() */
+  GstElement *video_compositor;
+  GstElement *video_compositor_sink;
 
   /* A unique id representing an active call (0 if no active call) */
   guint64 active_call_id;
@@ -73,15 +195,20 @@ struct _OvLocalPeerPrivate {
   OvNegotiate *negotiate;
   /* The task used for doing negotiation when we're the negotiator */
   GTask *negotiator_task;
+  /* How long each phase of negotiating and setting up the current call took;
+   * NULL unless one is being set up. See trace.c */
+  OvCallTrace *call_trace;
 
   /* The video device monitor being used */
   GstDeviceMonitor *dm;
+  /* Usable caps of the devices found by dm. See devicecaps.c */
+  OvDeviceCapsCache *device_caps;
   /* Video device being used */
   GstDevice *video_device;
   /* Video media type that we are sending */
   OvVideoFormat send_video_format;
   /* The underlying device video format (H264/JPEG/YUY2/TEST)
-   * This is set either when the video device is set (TEST/YUY2 -> JPEG),
+   * This is set either when the video device is set (TEST/YUY2 -> JPEG/H264),
    * or when the caps are negotiated (H264/JPEG passthrough) */
   OvVideoFormat device_video_format;
 
@@ -95,6 +222,30 @@ struct _OvLocalPeerPrivate {
    * requested by the application. These will be fixated before use. */
   GstCaps *send_acaps;
   GstCaps *send_vcaps;
+  /* Adapts the video we send to network conditions during a call */
+  OvCongestion cc;
+  /* Without simulcast, the highest quality that any remote shows our video
+   * at; congestion control doesn't go above it either. See
+   * ov_remote_peer_apply_video_view() */
+  OvVideoQuality view_quality;
+  /* How we help receivers repair the video we send when packets are lost;
+   * negotiated with them. fec_encoder is the rtpulpfecenc when sending FEC,
+   * and congestion control sets its overhead from the measured loss. */
+  OvRtpRepair send_repair;
+  GstElement *fec_encoder;
+  /* Whether we send Opus DTX; only if all the receivers can take it */
+  gboolean send_dtx;
+  /* How long the encoder of video layer 0 takes per frame; NULL if we're
+   * passing through device video */
+  OvFrameTimer *encode_timer;
+  /* Adapts the jitterbuffer latency of the remotes; see jitterbuffer.c */
+  guint jitterbuffer_timeout_id;
+  /* Finds the remote that is talking, and its id; see speaker.c */
+  guint speaker_timeout_id;
+  gchar *active_speaker;
+  /* Stats subscriptions and the id of the newest one; see stats.c */
+  GList *stats_subscriptions;
+  guint stats_last_id;
   
   /* User-specified interface */
   gchar *iface;
@@ -103,12 +254,36 @@ struct _OvLocalPeerPrivate {
    * we auto-detect all the network interfaces available and
    * populate this ourselves */
   GList *mc_ifaces;
-  /* TCP Server for comms (listens on all interfaces if none are specified) */
+  /* TCP Server for comms (listens on all interfaces if none are specified)
+   * It runs in its own main context and thread, and all reads and writes on
+   * its connections are asynchronous */
   GSocketService *tcp_server;
+  GMainContext *tcp_context;
+  GMainLoop *tcp_loop;
+  GThread *tcp_thread;
+  /* Open incoming connections; only touched from tcp_context */
+  GList *tcp_connections;
+  /* One-way messages still being sent; only touched from tcp_context. The
+   * loop isn't quit till they're done, so that END_CALL still goes out when
+   * we're stopping. See ov_local_peer_send_noreply() */
+  GList *tcp_one_way_sends;
   /* The incoming multicast UDP message listener for all interfaces */
   GSource *mc_socket_source;
   /* The incoming discovery unicast UDP message listener for all interfaces */
   GSource *discover_socket_source;
+  /* Whether we multicast HELLOs, and whether discovery relies on them instead
+   * of probing all the time; see ov_local_peer_set_announce_presence() */
+  gboolean announce_presence;
+  guint announce_source_id;
+  /* Seconds until the announcement after the next one */
+  guint announce_interval;
+  /* Startup probes left to send when announcing, and seconds until the next */
+  guint discover_probes_left;
+  guint discover_interval;
+  guint discover_probe_source_id;
+  /* The multicast DISCOVERs we've replied to recently, so each one is only
+   * replied to once; {gchar *"id@sender address": gint64 *time} */
+  GHashTable *replied_probes;
 
   /* The local ports we receive rtcp data on with udpsrc, in order:
    * {audio_recv_rtcp RRs, video_recv_rtcp RRs}
@@ -127,12 +302,34 @@ struct _OvLocalPeerPrivate {
    * {audio_ssrc, video_ssrc} */
   guint ssrcs[2];
 
-  /* Array of UDP ports that are either reserved or in use for receiving */
-  GArray *used_ports;
+  /* UDP ports that are either reserved or in use for receiving from remotes
+   * that have their own receive pipelines. See socketpool.c */
+  OvSocketPool *socket_pool;
   /* Array of OvRemotePeers: peers we are connecting to or are connected to */
   GPtrArray *remote_peers;
-  /* A timed source that checks if any of the remote peers have timed out */
-  GSource *remotes_timeout_source;
+  /* How long we wait to hear from a remote before removing it from the call,
+   * in ms; see ov_remote_peer_watch_liveness() */
+  guint remote_timeout;
+
+  /*~ Recording ~*/
+  /* Where calls are recorded, or NULL; see ov_local_peer_set_recording().
+   * recording is what the transmit pipeline records, if anything. */
+  gchar *record_dir;
+  OvRecording *recording;
+
+  /*~ Streaming threads ~*/
+  /* How the video of remotes is decoded; see ov_local_peer_set_thread_layout()
+   * and ov_remote_peer_wants_decode_thread() */
+  OvThreadLayout thread_layout;
+  guint max_decode_threads;
+  /* GstTask -> OvThreadInfo for every streaming thread running in one of our
+   * pipelines, and the CPUs and niceness to give them, indexed by
+   * OvThreadRole. These are used from streaming threads, so they're protected
+   * by threads_lock and not by the local peer lock. See threads.c */
+  GMutex threads_lock;
+  GHashTable *threads;
+  guint64 thread_cpus[OV_THREAD_ROLE_LAST];
+  gint thread_nice[OV_THREAD_ROLE_LAST];
 
   /* Lock to access non-thread-safe structures like GPtrArray */
   GRecMutex lock;
@@ -155,6 +352,28 @@ void                  ov_local_peer_set_state_negotiatee  (OvLocalPeer *self);
 GstCaps*              ov_local_peer_get_transmit_video_caps (OvLocalPeer *self);
 gboolean              ov_local_peer_set_transmit_video_caps (OvLocalPeer *self,
                                                              GstCaps *vcaps);
+gboolean              ov_local_peer_switch_video_quality    (OvLocalPeer *self,
+                                                             OvVideoQuality quality);
+void                  ov_local_peer_warm_transmit           (OvLocalPeer *self);
+GstCaps*              ov_local_peer_get_offered_vcaps       (OvLocalPeer *self,
+                                                             gboolean send);
+gchar*                ov_local_peer_get_send_caps_string    (OvLocalPeer *self,
+                                                             guint session);
+gboolean              ov_local_peer_start_joined_remote     (OvLocalPeer *self,
+                                                             OvRemotePeer *remote);
+gboolean              ov_remote_peer_reserve_recv_ports     (OvRemotePeer *remote,
+                                                             GError **error);
+void                  ov_remote_peer_hold                   (OvRemotePeer *remote);
+void                  ov_remote_peer_release                (OvRemotePeer *remote);
+void                  ov_remote_peer_watch_liveness         (OvRemotePeer *remote);
+void                  ov_remote_peer_liveness_event         (OvRemotePeer *remote,
+                                                             OvLivenessEvent event);
+void                  ov_remote_peer_update_video_view      (OvRemotePeer *remote);
+void                  ov_remote_peer_apply_video_view       (OvRemotePeer *remote);
+
+OvVideoQuality        ov_structure_to_video_quality (const GstStructure *s);
+gboolean              ov_video_quality_above        (OvVideoQuality quality,
+                                                     OvVideoQuality ceiling);
 
 G_END_DECLS
 
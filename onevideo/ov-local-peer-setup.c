@@ -30,17 +30,21 @@
 #include "utils.h"
 #include "incoming.h"
 #include "discovery.h"
+#include "latency.h"
+#include "jitterbuffer.h"
+#include "speaker.h"
+#include "recording.h"
+#include "threads.h"
 #include "ov-local-peer-priv.h"
 #include "ov-local-peer-setup.h"
 
+#include <stdio.h>
 #include <string.h>
 
-/* The default buffer size for kernel-side UDP send/recv buffers varies
- * between operating systems and installations. It's not unusual that
- * these are smaller than the size of a single jpeg from a HD webcam,
- * which is a problem, so try to make them larger if possible at all. */
-#define OV_VIDEO_SEND_BUFSIZE (2 * 1024 * 1024)
-#define OV_VIDEO_RECV_BUFSIZE (2 * 1024 * 1024)
+/* How much audio the proxysrc of each remote queues for playback. If the
+ * playback pipeline stalls (for instance, because the GUI main loop is busy),
+ * older audio is dropped instead of letting lag build up. */
+#define OV_AUDIO_PLAYBACK_MAX_LATENCY (200 * GST_MSECOND)
 
 void
 ov_on_gst_bus_error (GstBus * bus, GstMessage * msg, gpointer user_data)
@@ -59,6 +63,7 @@ ov_on_gst_bus_error (GstBus * bus, GstMessage * msg, gpointer user_data)
 
 #define on_local_transmit_error ov_on_gst_bus_error
 #define on_local_playback_error ov_on_gst_bus_error
+#define on_local_receive_error ov_on_gst_bus_error
 
 GSocket *
 ov_get_socket_for_addr (const gchar * addr_s, guint port)
@@ -90,6 +95,23 @@ err:
   goto out;
 }
 
+/* A udpsrc for RTP, which comes in a packet at a time. Nothing looks at who
+ * sent it (remotes are told apart by SSRC, and RTCP keeps its addresses), so
+ * don't allocate an address and a meta for every one of them. */
+GstElement *
+ov_rtp_udpsrc_new (const gchar * name)
+{
+  GstElement *src;
+
+  src = gst_element_factory_make ("udpsrc", name);
+  /* Only available with newer GStreamer */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (src),
+        "retrieve-sender-address"))
+    g_object_set (src, "retrieve-sender-address", FALSE, NULL);
+
+  return src;
+}
+
 static void
 ov_set_rtpbin_sdes_id (GstElement * rtpbin, OvLocalPeer * local)
 {
@@ -129,21 +151,27 @@ ov_local_peer_setup_playback_pipeline (OvLocalPeer * local)
   gst_pipeline_set_auto_flush_bus (GST_PIPELINE (priv->playback), FALSE);
   priv->audiomixer = gst_element_factory_make ("audiomixer", NULL);
 
+  if (priv->test_media) {
+    /* Still synced to the clock so that the pipeline runs in real time */
+    priv->audiosink = gst_element_factory_make ("fakesink", NULL);
+    g_object_set (priv->audiosink, "sync", TRUE, NULL);
+  } else {
 #ifdef __linux__
-  priv->audiosink = gst_element_factory_make ("pulsesink", NULL);
-  /* These values give the lowest audio latency with the least chance of audio
-   * artefacting with Pulseaudio on my machine. Setting buffer-time less than
-   * 50ms gives audio artefacts. */
-  g_object_set (priv->audiosink, "buffer-time", 50000, NULL);
+    priv->audiosink = gst_element_factory_make ("pulsesink", NULL);
+    /* These values give the lowest audio latency with the least chance of
+     * audio artefacting with Pulseaudio on my machine. Setting buffer-time
+     * less than 50ms gives audio artefacts. */
+    g_object_set (priv->audiosink, "buffer-time", 50000, NULL);
 #elif defined(__APPLE__) && defined(TARGET_OS_MAC)
-  priv->audiosink = gst_element_factory_make ("osxaudiosink", NULL);
-  /* These values give the lowest audio latency with the least chance of audio
-   * artefacting with Pulseaudio on my machine. Setting buffer-time less than
-   * 30ms gives audio artefacts. */
-  g_object_set (priv->audiosink, "buffer-time", 30000, NULL);
+    priv->audiosink = gst_element_factory_make ("osxaudiosink", NULL);
+    /* These values give the lowest audio latency with the least chance of
+     * audio artefacting with Pulseaudio on my machine. Setting buffer-time
+     * less than 30ms gives audio artefacts. */
+    g_object_set (priv->audiosink, "buffer-time", 30000, NULL);
 #else
 #error "Unsupported operating system"
 #endif
+  }
 
   /* FIXME: If there's no audio, this pipeline will mess up while going from
    * NULL -> PLAYING -> NULL -> PLAYING because of async state change bugs in
@@ -153,7 +181,19 @@ ov_local_peer_setup_playback_pipeline (OvLocalPeer * local)
   ret = gst_element_link_many (priv->audiomixer, priv->audiosink, NULL);
   g_assert (ret);
 
-  /* Video bits are setup by each local */
+  /* Video from all remotes is composited into one sink if the application
+   * asked for it; otherwise video bits are setup by each remote */
+  if (priv->video_compositor_sink != NULL) {
+    priv->video_compositor = gst_element_factory_make ("glvideomixer", NULL);
+    /* Shown where no remote's video is */
+    gst_util_set_object_arg (G_OBJECT (priv->video_compositor), "background",
+        "black");
+    gst_bin_add_many (GST_BIN (priv->playback), priv->video_compositor,
+        priv->video_compositor_sink, NULL);
+    ret = gst_element_link (priv->video_compositor,
+        priv->video_compositor_sink);
+    g_assert (ret);
+  }
 
   /* Use the system clock and explicitly reset the base/start times to ensure
    * that all the pipelines started by us have the same base/start times */
@@ -166,6 +206,7 @@ ov_local_peer_setup_playback_pipeline (OvLocalPeer * local)
   g_signal_connect (bus, "message::error",
       G_CALLBACK (on_local_playback_error), local);
   g_object_unref (bus);
+  ov_local_peer_watch_threads (local, priv->playback, OV_THREAD_ROLE_PLAYBACK);
 
   GST_DEBUG ("Setup pipeline to playback remote peers");
 
@@ -201,6 +242,80 @@ ov_pipeline_get_osxaudiosrcbin (const gchar * name)
 }
 #endif
 
+/* Returns a bin that encodes raw video to H.264 using the encoder selected by
+ * _ov_gst_get_h264_encoder_name(), configured for low-latency with a keyframe
+ * at least every @keyframe_interval frames. The encoder element inside the bin
+ * is returned in @encoder_out so that its bitrate can be controlled. */
+static GstElement *
+ov_pipeline_get_h264encbin (const gchar * name, guint keyframe_interval,
+    GstElement ** encoder_out)
+{
+  const gchar *encoder_name;
+  gchar *gop;
+  GstElement *conv, *encoder, *bin;
+  GstPad *ghostpad, *pad;
+
+  encoder_name = _ov_gst_get_h264_encoder_name ();
+  g_assert (encoder_name != NULL);
+
+  /* Encoders usually want I420 or NV12, but raw sources give us YUY2 */
+  conv = gst_element_factory_make ("videoconvert", NULL);
+  encoder = gst_element_factory_make (encoder_name, NULL);
+
+  /* Remotes ask for a keyframe when they join or lose packets (see
+   * on_transmit_keyframe_request()), so the periodic ones
+   * are only a fallback and can be far apart */
+  gop = g_strdup_printf ("%u", keyframe_interval);
+
+  /* Properties that don't exist on a particular version of an encoder are
+   * ignored by gst_util_set_object_arg() */
+  if (g_strcmp0 (encoder_name, "x264enc") == 0) {
+    gst_util_set_object_arg (G_OBJECT (encoder), "tune", "zerolatency");
+    gst_util_set_object_arg (G_OBJECT (encoder), "speed-preset", "ultrafast");
+    gst_util_set_object_arg (G_OBJECT (encoder), "key-int-max", gop);
+  } else if (g_strcmp0 (encoder_name, "vaapih264enc") == 0) {
+    gst_util_set_object_arg (G_OBJECT (encoder), "keyframe-period", gop);
+    gst_util_set_object_arg (G_OBJECT (encoder), "max-bframes", "0");
+    /* The default (cqp) ignores the bitrate that congestion control sets */
+    gst_util_set_object_arg (G_OBJECT (encoder), "rate-control", "cbr");
+  } else if (g_strcmp0 (encoder_name, "nvh264enc") == 0) {
+    gst_util_set_object_arg (G_OBJECT (encoder), "preset", "low-latency-hp");
+    gst_util_set_object_arg (G_OBJECT (encoder), "gop-size", gop);
+    gst_util_set_object_arg (G_OBJECT (encoder), "rc-mode", "cbr");
+  } else if (g_strcmp0 (encoder_name, "vtenc_h264") == 0) {
+    gst_util_set_object_arg (G_OBJECT (encoder), "realtime", "true");
+    gst_util_set_object_arg (G_OBJECT (encoder), "allow-frame-reordering",
+        "false");
+    gst_util_set_object_arg (G_OBJECT (encoder), "max-keyframe-interval",
+        gop);
+  }
+  /* v4l2h264enc has no low-latency knobs that we need to set */
+  g_free (gop);
+
+  bin = gst_bin_new (name);
+  gst_bin_add_many (GST_BIN (bin), conv, encoder, NULL);
+
+  gst_element_link (conv, encoder);
+
+  pad = gst_element_get_static_pad (conv, "sink");
+  ghostpad = gst_ghost_pad_new ("sink", pad);
+  g_object_unref (pad);
+  gst_pad_set_active (ghostpad, TRUE);
+  gst_element_add_pad (bin, ghostpad);
+
+  pad = gst_element_get_static_pad (encoder, "src");
+  ghostpad = gst_ghost_pad_new ("src", pad);
+  g_object_unref (pad);
+  gst_pad_set_active (ghostpad, TRUE);
+  gst_element_add_pad (bin, ghostpad);
+
+  GST_DEBUG ("Encoding raw video to H.264 with %s", encoder_name);
+
+  if (encoder_out != NULL)
+    *encoder_out = encoder;
+  return bin;
+}
+
 static guint
 ov_local_peer_get_ssrc_for_session_internal (OvLocalPeer * local,
     GstElement * rtpbin, guint session)
@@ -283,6 +398,486 @@ out:
   g_object_unref (rtpsource);
 }
 
+/* Returns the element to put between the video source and the payloader.
+ * @encoder_out is set to the element doing the encoding, or NULL if the
+ * device video is passed through. */
+static GstElement *
+ov_local_peer_get_video_encoder (OvLocalPeer * local, const gchar * name,
+    GstElement ** encoder_out)
+{
+  GstElement *encoder;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+  *encoder_out = NULL;
+
+  /* XXX: Perhaps make a new element that encodes to JPEG/H264 if necessary
+   * or does passthrough if downstream supports the negotiated caps */
+  if (priv->device_video_format == OV_VIDEO_FORMAT_JPEG ||
+      priv->device_video_format == OV_VIDEO_FORMAT_H264) {
+    /* Passthrough JPEG and H.264 */
+    encoder = gst_element_factory_make ("queue", name);
+  } else if ((priv->device_video_format == OV_VIDEO_FORMAT_YUY2 ||
+      priv->device_video_format == OV_VIDEO_FORMAT_TEST) &&
+      priv->send_video_format == OV_VIDEO_FORMAT_H264) {
+    /* We encode YUY2 to H.264 before sending if all peers can decode it */
+    encoder = ov_pipeline_get_h264encbin (NULL, priv->keyframe_interval,
+        encoder_out);
+  } else if (priv->device_video_format == OV_VIDEO_FORMAT_YUY2 ||
+      priv->device_video_format == OV_VIDEO_FORMAT_TEST) {
+    /* Otherwise we encode YUY2 to JPEG before sending */
+    encoder = gst_element_factory_make ("jpegenc", NULL);
+    g_object_set (encoder, "quality", OV_JPEG_ENCODE_QUALITY, NULL);
+    *encoder_out = encoder;
+  } else {
+    /* It is a programmer error for this to be reached */
+    g_assert_not_reached ();
+  }
+
+  return encoder;
+}
+
+static GstElement *
+ov_local_peer_get_video_payloader (OvLocalPeer * local)
+{
+  GstElement *vpay;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->send_video_format == OV_VIDEO_FORMAT_H264) {
+    vpay = gst_element_factory_make ("rtph264pay", NULL);
+    /* If the mtu is too small, the payloader splits the NAL Unit across
+     * multiple packets and that breaks depayloading for some reason. Let the
+     * network layer handle splitting up and re-joining of packets. */
+    g_object_set (vpay, "mtu", 20000, NULL);
+    /* Encoders only output SPS/PPS at the start of the stream, so resend them
+     * periodically in case the first ones are lost */
+    g_object_set (vpay, "config-interval", 1, NULL);
+  } else {
+    vpay = gst_element_factory_make ("rtpjpegpay", NULL);
+  }
+  ov_element_add_capture_time (vpay);
+
+  return vpay;
+}
+
+/* Picks the qualities of the simulcast layers below layer 0 from the
+ * negotiated send caps. Each layer has a lower resolution than the one before
+ * it. Returns the number of layers that can be sent, including layer 0. */
+static guint
+ov_local_peer_get_video_layer_caps (OvLocalPeer * local, GstCaps * layer0,
+    GstCaps ** layer_caps)
+{
+  guint ii, jj, len, n_layers;
+  gint height, prev_height;
+  const gchar *name;
+  GstCaps *normalized;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  name = gst_structure_get_name (gst_caps_get_structure (layer0, 0));
+  if (!gst_structure_get_int (gst_caps_get_structure (layer0, 0), "height",
+        &prev_height))
+    return 1;
+
+  normalized = gst_caps_normalize (gst_caps_copy (priv->send_vcaps));
+  len = gst_caps_get_size (normalized);
+
+  for (ii = 1; ii < priv->n_video_layers; ii++) {
+    gint best = -1, best_height = 0;
+
+    for (jj = 0; jj < len; jj++) {
+      GstStructure *s = gst_caps_get_structure (normalized, jj);
+
+      if (!gst_structure_has_name (s, name) ||
+          !gst_structure_get_int (s, "height", &height))
+        continue;
+
+      if (height < prev_height && height > best_height) {
+        best = jj;
+        best_height = height;
+      }
+    }
+
+    if (best < 0)
+      /* Nothing lower than the previous layer */
+      break;
+
+    layer_caps[ii] = gst_caps_new_full (gst_structure_copy (
+          gst_caps_get_structure (normalized, best)), NULL);
+    layer_caps[ii] = gst_caps_fixate (layer_caps[ii]);
+    prev_height = best_height;
+  }
+  n_layers = ii;
+
+  gst_caps_unref (normalized);
+  return n_layers;
+}
+
+/* Adds a scaled-down simulcast layer branch from the video tee to the funnel in
+ * front of the video RTP session */
+static void
+ov_local_peer_add_video_layer (OvLocalPeer * local, guint layer,
+    GstCaps * caps, GstElement * vtee, GstElement * vfunnel)
+{
+  gboolean ret;
+  gchar *name;
+  GstElement *queue, *scale, *rate, *encoder, *filter, *pay, *rtpqueue, *sink;
+  OvLocalPeerPrivate *priv;
+  OvVideoLayer *l;
+
+  priv = ov_local_peer_get_private (local);
+  l = &priv->video_layers[layer];
+
+  queue = gst_element_factory_make ("queue", NULL);
+  /* Leaky so that a slow encoder for a lower layer can't stall the others */
+  g_object_set (queue, "leaky", 2, "max-size-buffers", 2, NULL);
+  scale = gst_element_factory_make ("videoscale", NULL);
+  rate = gst_element_factory_make ("videorate", NULL);
+  g_object_set (rate, "drop-only", TRUE, NULL);
+  encoder = ov_local_peer_get_video_encoder (local, NULL, &l->encoder);
+  filter = gst_element_factory_make ("capsfilter", NULL);
+  g_object_set (filter, "caps", caps, NULL);
+  pay = ov_local_peer_get_video_payloader (local);
+  g_object_set (pay, "ssrc", l->ssrc, NULL);
+
+  rtpqueue = gst_element_factory_make ("queue", NULL);
+  name = g_strdup_printf ("vsend_rtp_sink-%u", layer);
+  sink = gst_element_factory_make ("multiudpsink", name);
+  g_free (name);
+  /* Layers with no remotes assigned to them don't get any data, so they must
+   * not hold up the pipeline state change */
+  g_object_set (sink, "buffer-size", OV_VIDEO_SEND_BUFSIZE,
+      "enable-last-sample", FALSE, "async", FALSE, NULL);
+
+  gst_bin_add_many (GST_BIN (priv->transmit), queue, scale, rate, encoder,
+      filter, pay, rtpqueue, sink, NULL);
+
+  ret = gst_element_link (vtee, queue);
+  g_assert (ret);
+  ret = gst_element_link_many (queue, scale, rate, encoder, filter, pay, NULL);
+  g_assert (ret);
+  ret = gst_element_link (pay, vfunnel);
+  g_assert (ret);
+  ret = gst_element_link (rtpqueue, sink);
+  g_assert (ret);
+
+  l->quality = ov_video_caps_to_video_quality (caps);
+  l->pay = pay;
+  l->queue = rtpqueue;
+  l->sink = sink;
+
+  GST_DEBUG ("Added simulcast video layer %u with SSRC %u: %" GST_PTR_FORMAT,
+      layer, l->ssrc, caps);
+}
+
+/* The video RTP session carries all the simulcast layers, each with its own
+ * SSRC. Route each one to the multiudpsink for that layer. */
+static void
+on_video_layer_ssrc_pad (GstElement * demux, guint ssrc, GstPad * pad,
+    OvLocalPeer * local)
+{
+  guint ii;
+  GstPad *sinkpad;
+  GstPadLinkReturn ret;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  for (ii = 0; ii < priv->n_active_video_layers; ii++)
+    if (priv->video_layers[ii].ssrc == ssrc)
+      break;
+
+  if (ii == priv->n_active_video_layers) {
+    GST_WARNING ("Got unknown video SSRC %u; not sending it", ssrc);
+    return;
+  }
+
+  sinkpad = gst_element_get_static_pad (priv->video_layers[ii].queue, "sink");
+  ret = gst_pad_link (pad, sinkpad);
+  g_assert (ret == GST_PAD_LINK_OK);
+  gst_object_unref (sinkpad);
+  GST_DEBUG ("Sending video layer %u (SSRC %u)", ii, ssrc);
+}
+
+/*-- RTP REPAIR --*/
+/* {media payload type, RTX payload type}; the RED packets carrying FEC are
+ * retransmitted too, so they get their own RTX payload type */
+static const guint rtx_pts[][2] = {
+  {26, RTP_JPEG_RTX_PT},
+  {96, RTP_H264_RTX_PT},
+  {RTP_RED_PT, RTP_RED_RTX_PT},
+};
+
+/* The payload-type-map for rtprtxsend (media -> RTX) or for rtprtxreceive
+ * (RTX -> media) */
+static GstStructure *
+ov_get_rtx_pt_map (gboolean send)
+{
+  guint ii;
+  gchar key[4];
+  GstStructure *s;
+
+  s = gst_structure_new_empty ("application/x-rtp-pt-map");
+  for (ii = 0; ii < G_N_ELEMENTS (rtx_pts); ii++) {
+    g_snprintf (key, sizeof (key), "%u", rtx_pts[ii][send ? 0 : 1]);
+    gst_structure_set (s, key, G_TYPE_UINT, rtx_pts[ii][send ? 1 : 0], NULL);
+  }
+
+  return s;
+}
+
+/* rtpbin links aux senders and receivers with sink_%u and src_%u pads named
+ * after the session they're for */
+static GstElement *
+ov_get_rtp_aux_bin (GstElement * first, GstElement * last, guint session)
+{
+  gchar *name;
+  GstPad *pad;
+  GstElement *bin;
+
+  bin = gst_bin_new (NULL);
+  gst_bin_add (GST_BIN (bin), first);
+  if (last != first) {
+    gst_bin_add (GST_BIN (bin), last);
+    gst_element_link (first, last);
+  }
+
+  pad = gst_element_get_static_pad (first, "sink");
+  name = g_strdup_printf ("sink_%u", session);
+  gst_element_add_pad (bin, gst_ghost_pad_new (name, pad));
+  gst_object_unref (pad);
+  g_free (name);
+
+  pad = gst_element_get_static_pad (last, "src");
+  name = g_strdup_printf ("src_%u", session);
+  gst_element_add_pad (bin, gst_ghost_pad_new (name, pad));
+  gst_object_unref (pad);
+  g_free (name);
+
+  return bin;
+}
+
+/* Keeps the video packets we send around for retransmission when receivers
+ * NACK them. The rtpssrcdemux used for simulcast can't route the RTX SSRC, so
+ * we only retransmit when sending a single video layer. */
+static GstElement *
+on_transmit_request_aux_sender (GstElement * rtpbin, guint session,
+    OvLocalPeer * local)
+{
+  GstElement *rtx;
+  GstStructure *pt_map;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (session != OV_VIDEO_RTP_SESSION || priv->n_active_video_layers > 1)
+    return NULL;
+
+  rtx = gst_element_factory_make ("rtprtxsend", NULL);
+  pt_map = ov_get_rtx_pt_map (TRUE);
+  g_object_set (rtx, "payload-type-map", pt_map, NULL);
+  gst_structure_free (pt_map);
+
+  GST_DEBUG ("Retransmitting lost video packets");
+  return ov_get_rtp_aux_bin (rtx, rtx, session);
+}
+
+/* Sends ULPFEC inside RED. The overhead is set by congestion control from the
+ * loss that receivers report; see congestion.c */
+static GstElement *
+on_transmit_request_fec_encoder (GstElement * rtpbin, guint session,
+    OvLocalPeer * local)
+{
+  GstElement *bin, *fecenc, *redenc;
+  GstPad *pad;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (session != OV_VIDEO_RTP_SESSION || priv->n_active_video_layers > 1)
+    return NULL;
+
+  bin = gst_bin_new (NULL);
+  fecenc = gst_element_factory_make ("rtpulpfecenc", NULL);
+  g_object_set (fecenc, "pt", RTP_ULPFEC_PT, "percentage",
+      OV_FEC_DEFAULT_PERCENTAGE, NULL);
+  redenc = gst_element_factory_make ("rtpredenc", NULL);
+  g_object_set (redenc, "pt", RTP_RED_PT, "allow-no-red-blocks", TRUE, NULL);
+  gst_bin_add_many (GST_BIN (bin), fecenc, redenc, NULL);
+  gst_element_link (fecenc, redenc);
+
+  pad = gst_element_get_static_pad (fecenc, "sink");
+  gst_element_add_pad (bin, gst_ghost_pad_new ("sink", pad));
+  gst_object_unref (pad);
+  pad = gst_element_get_static_pad (redenc, "src");
+  gst_element_add_pad (bin, gst_ghost_pad_new ("src", pad));
+  gst_object_unref (pad);
+
+  priv->fec_encoder = fecenc;
+  GST_DEBUG ("Sending FEC for video");
+  return bin;
+}
+
+/* Undoes what the sender's aux sender and FEC encoder did; see above */
+static GstElement *
+on_receive_request_aux_receiver (GstElement * rtpbin, guint session,
+    gpointer user_data)
+{
+  GstElement *rtx, *reddec;
+  GstStructure *pt_map;
+
+  if (session != OV_VIDEO_RTP_SESSION)
+    return NULL;
+
+  rtx = gst_element_factory_make ("rtprtxreceive", NULL);
+  pt_map = ov_get_rtx_pt_map (FALSE);
+  g_object_set (rtx, "payload-type-map", pt_map, NULL);
+  gst_structure_free (pt_map);
+
+  /* Passes through packets that aren't RED, so it's always there if we
+   * support ULPFEC */
+  reddec = gst_element_factory_make ("rtpreddec", NULL);
+  if (reddec == NULL)
+    return ov_get_rtp_aux_bin (rtx, rtx, session);
+  g_object_set (reddec, "pt", RTP_RED_PT, NULL);
+
+  return ov_get_rtp_aux_bin (rtx, reddec, session);
+}
+
+static GstElement *
+on_receive_request_fec_decoder (GstElement * rtpbin, guint session,
+    gpointer user_data)
+{
+  GObject *storage;
+  GstElement *fecdec;
+
+  if (session != OV_VIDEO_RTP_SESSION)
+    return NULL;
+
+  g_signal_emit_by_name (rtpbin, "get-internal-storage", session, &storage);
+  fecdec = gst_element_factory_make ("rtpulpfecdec", NULL);
+  g_object_set (fecdec, "pt", RTP_ULPFEC_PT, "storage", storage, NULL);
+  g_object_unref (storage);
+
+  return fecdec;
+}
+
+/* Caps for the payload types that we use for repair, which aren't in the caps
+ * of the udpsrc. NULL if @pt isn't one of them. */
+static GstCaps *
+ov_get_rtp_repair_pt_caps (guint session, guint pt)
+{
+  const gchar *name;
+
+  if (session != OV_VIDEO_RTP_SESSION)
+    return NULL;
+
+  if (pt == RTP_H264_RTX_PT || pt == RTP_JPEG_RTX_PT || pt == RTP_RED_RTX_PT)
+    name = "RTX";
+  else if (pt == RTP_RED_PT)
+    name = "RED";
+  else if (pt == RTP_ULPFEC_PT)
+    name = "ULPFEC";
+  else
+    return NULL;
+
+  return gst_caps_new_simple ("application/x-rtp", "payload", G_TYPE_INT, pt,
+      "media", G_TYPE_STRING, "video", "clock-rate", G_TYPE_INT, 90000,
+      "encoding-name", G_TYPE_STRING, name, NULL);
+}
+
+static GstCaps *
+on_receiver_request_pt_map (GstElement * rtpbin, guint session, guint pt,
+    gpointer user_data)
+{
+  return ov_get_rtp_repair_pt_caps (session, pt);
+}
+
+/* Called from the RTCP thread of the transmit rtpbin when a remote sends a
+ * PLI or FIR, which rtpbin turns into a GstForceKeyUnit event that goes
+ * upstream to the encoders. Every remote that joins or loses a packet asks
+ * for one, often several at once, so only let through one per
+ * OV_KEYFRAME_REQUEST_MIN_INTERVAL; the keyframe it causes goes to all of
+ * them. Keyframes we send ourselves (ov_local_peer_send_video_keyframe()) are
+ * pushed into the payloaders and aren't limited. */
+static GstPadProbeReturn
+on_transmit_keyframe_request (GstPad * pad, GstPadProbeInfo * info,
+    OvLocalPeer * local)
+{
+  gint now, last;
+  OvLocalPeerPrivate *priv;
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CUSTOM_UPSTREAM ||
+      !gst_event_has_name (event, "GstForceKeyUnit"))
+    return GST_PAD_PROBE_OK;
+
+  priv = ov_local_peer_get_private (local);
+  /* 0 means that there was none, so never use it as a time; the unsigned
+   * difference is right even when the ms wrap around */
+  now = (gint) (g_get_monotonic_time () / G_TIME_SPAN_MILLISECOND) | 1;
+  last = g_atomic_int_get (&priv->last_keyframe_request);
+
+  if (last != 0 && (guint) now - (guint) last <
+      OV_KEYFRAME_REQUEST_MIN_INTERVAL / G_TIME_SPAN_MILLISECOND) {
+    GST_LOG ("Dropping keyframe request from a remote; already sent one %u "
+        "ms ago", (guint) now - (guint) last);
+    return GST_PAD_PROBE_DROP;
+  }
+
+  /* Another remote's request got through at the same time */
+  if (!g_atomic_int_compare_and_exchange (&priv->last_keyframe_request, last,
+        now)) {
+    GST_LOG ("Dropping keyframe request from a remote; already sent one");
+    return GST_PAD_PROBE_DROP;
+  }
+
+  GST_DEBUG ("A remote asked for a keyframe");
+  return GST_PAD_PROBE_OK;
+}
+
+/* Send RTCP at least every OV_RTCP_MIN_INTERVAL in both RTP sessions of
+ * @rtpbin, since that's how the remotes know that we're still there. Must be
+ * called after the pads for both sessions have been requested. */
+static void
+ov_setup_rtpbin_rtcp_interval (GstElement * rtpbin)
+{
+  guint session;
+  GObject *rtpsession;
+
+  for (session = OV_AUDIO_RTP_SESSION; session <= OV_VIDEO_RTP_SESSION;
+      session++) {
+    g_signal_emit_by_name (rtpbin, "get-internal-session", session,
+        &rtpsession);
+    g_object_set (rtpsession, "rtcp-min-interval",
+        (guint64) OV_RTCP_MIN_INTERVAL, NULL);
+    g_object_unref (rtpsession);
+  }
+}
+
+/* Must be called before any pads are requested from the rtpbin */
+static void
+ov_setup_rtpbin_receive_repair (GstElement * rtpbin, OvRtpRepair repair)
+{
+  /* Lets us send PLIs (and NACKs) as soon as we notice loss instead of with
+   * the next regular RTCP packet */
+  gst_util_set_object_arg (G_OBJECT (rtpbin), "rtp-profile", "avpf");
+
+  if (repair == OV_RTP_REPAIR_NONE)
+    return;
+
+  g_signal_connect (rtpbin, "request-aux-receiver",
+      G_CALLBACK (on_receive_request_aux_receiver), NULL);
+  if (repair & OV_RTP_REPAIR_RTX)
+    g_object_set (rtpbin, "do-retransmission", TRUE, NULL);
+  if (repair & OV_RTP_REPAIR_ULPFEC)
+    g_signal_connect (rtpbin, "request-fec-decoder",
+        G_CALLBACK (on_receive_request_fec_decoder), NULL);
+}
+
 gboolean
 ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
 {
@@ -292,6 +887,8 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   GstElement *artpqueue, *asink, *artcpqueue, *artcpsink, *artcpsrc;
   GstElement *vsrc, *vfilter, *vqueue, *vpay;
   GstElement *vrtpqueue, *vsink, *vrtcpqueue, *vrtcpsink, *vrtcpsrc;
+  GstCaps *layer_caps[OV_MAX_VIDEO_LAYERS] = {NULL};
+  GstPad *sinkpad;
   OvLocalPeerPrivate *priv;
   OvLocalPeerState state;
   gboolean ret;
@@ -299,7 +896,9 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   priv = ov_local_peer_get_private (local);
 
   state = ov_local_peer_get_state (local);
-  if (!(state & OV_LOCAL_STATE_STARTED) && !(state & OV_LOCAL_STATE_READY))
+  /* Also while negotiating when warming up; see ov_local_peer_warm_transmit() */
+  if (!(state & (OV_LOCAL_STATE_STARTED | OV_LOCAL_STATE_NEGOTIATING |
+          OV_LOCAL_STATE_NEGOTIATED | OV_LOCAL_STATE_READY)))
     return FALSE;
 
   if (priv->transmit != NULL && GST_IS_PIPELINE (priv->transmit)) {
@@ -311,17 +910,31 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   priv->rtpbin = gst_element_factory_make ("rtpbin", "transmit-rtpbin");
   g_object_set (priv->rtpbin, "latency", RTP_DEFAULT_LATENCY_MS, NULL);
   ov_set_rtpbin_sdes_id (priv->rtpbin, local);
-
+  /* Only what all the receivers negotiated; see ov_caps_take_rtp_repair() */
+  if (priv->send_repair != OV_RTP_REPAIR_NONE)
+    gst_util_set_object_arg (G_OBJECT (priv->rtpbin), "rtp-profile", "avpf");
+  if (priv->send_repair & OV_RTP_REPAIR_RTX)
+    g_signal_connect (priv->rtpbin, "request-aux-sender",
+        G_CALLBACK (on_transmit_request_aux_sender), local);
+  if (priv->send_repair & OV_RTP_REPAIR_ULPFEC)
+    g_signal_connect (priv->rtpbin, "request-fec-encoder",
+        G_CALLBACK (on_transmit_request_fec_encoder), local);
+
+  if (priv->test_media) {
+    asrc = gst_element_factory_make ("audiotestsrc", NULL);
+    g_object_set (asrc, "is-live", TRUE, NULL);
+  } else {
 #ifdef __linux__
-  asrc = gst_element_factory_make ("pulsesrc", NULL);
-  /* latency-time to 5 ms, we use the system clock */
-  g_object_set (asrc, "latency-time", 5000, "provide-clock", FALSE, NULL);
+    asrc = gst_element_factory_make ("pulsesrc", NULL);
+    /* latency-time to 5 ms, we use the system clock */
+    g_object_set (asrc, "latency-time", 5000, "provide-clock", FALSE, NULL);
 #elif defined(__APPLE__) && defined(TARGET_OS_MAC)
-  asrc = ov_pipeline_get_osxaudiosrcbin (NULL);
-  /* same properties as above already set on the source element */
+    asrc = ov_pipeline_get_osxaudiosrcbin (NULL);
+    /* same properties as above already set on the source element */
 #else
 #error "Unsupported operating system"
 #endif
+  }
 
   afilter = gst_element_factory_make ("capsfilter", "audio-transmit-caps");
   raw_audio_caps = gst_caps_from_string ("audio/x-raw, " AUDIO_CAPS_STR);
@@ -330,6 +943,15 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   aencode = gst_element_factory_make ("opusenc", NULL);
   g_object_set (aencode, "frame-size", 10, NULL);
   apay = gst_element_factory_make ("rtpopuspay", NULL);
+  /* Send almost nothing while we're silent if all receivers can take it. The
+   * voice mode uses SILK, whose voice activity detection is what DTX needs. */
+  if (priv->send_dtx) {
+    g_object_set (aencode, "dtx", TRUE, NULL);
+    gst_util_set_object_arg (G_OBJECT (aencode), "audio-type", "voice");
+    if (g_object_class_find_property (G_OBJECT_GET_CLASS (apay), "dtx"))
+      g_object_set (apay, "dtx", TRUE, NULL);
+  }
+  ov_element_add_capture_time (apay);
   /* Send RTP audio data */
   artpqueue = gst_element_factory_make ("queue", NULL);
   asink = gst_element_factory_make ("udpsink", "asend_rtp_sink");
@@ -348,21 +970,11 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
     vsrc = gst_device_create_element (priv->video_device, NULL);
   }
 
-  /* XXX: Perhaps make a new element that encodes to JPEG/H264 if necessary
-   * or does passthrough if downstream supports the negotiated caps */
-  if (priv->device_video_format == OV_VIDEO_FORMAT_JPEG ||
-      priv->device_video_format == OV_VIDEO_FORMAT_H264) {
-    /* Passthrough JPEG and H.264 */
-    vqueue = gst_element_factory_make ("queue", "video-queue");
-  } else if (priv->device_video_format == OV_VIDEO_FORMAT_YUY2 ||
-      priv->device_video_format == OV_VIDEO_FORMAT_TEST) {
-    /* We encode YUY2 to JPEG before sending */
-    vqueue = gst_element_factory_make ("jpegenc", NULL);
-    g_object_set (vqueue, "quality", 30, NULL);
-  } else {
-    /* It is a programmer error for this to be reached */
-    g_assert_not_reached ();
-  }
+  vqueue = ov_local_peer_get_video_encoder (local, "video-queue",
+      &priv->video_layers[0].encoder);
+  if (priv->video_layers[0].encoder != NULL)
+    priv->encode_timer =
+      ov_element_add_frame_timer (priv->video_layers[0].encoder);
 
   GST_DEBUG ("Negotiated video caps that can be transmitted: %" GST_PTR_FORMAT,
       priv->send_vcaps);
@@ -379,15 +991,7 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   }
   g_clear_pointer (&vcaps, gst_caps_unref);
 
-  if (priv->send_video_format == OV_VIDEO_FORMAT_H264) {
-    vpay = gst_element_factory_make ("rtph264pay", NULL);
-    /* If the mtu is too small, the payloader splits the NAL Unit across
-     * multiple packets and that breaks depayloading for some reason. Let the
-     * network layer handle splitting up and re-joining of packets. */
-    g_object_set (vpay, "mtu", 20000, NULL);
-  } else {
-    vpay = gst_element_factory_make ("rtpjpegpay", NULL);
-  }
+  vpay = ov_local_peer_get_video_payloader (local);
   /* Send RTP video data */
   vrtpqueue = gst_element_factory_make ("queue", NULL);
   vsink = gst_element_factory_make ("udpsink", "vsend_rtp_sink");
@@ -405,8 +1009,21 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
       vsrc, vqueue, vfilter, vpay, vrtpqueue, vsink, vrtcpqueue, vrtcpsink,
       vrtcpsrc, NULL);
 
+  /* What we encode is recorded in front of the payloaders */
+  g_clear_pointer (&priv->recording, ov_recording_free);
+  if (priv->record_dir != NULL) {
+    gchar *id;
+
+    g_object_get (OV_PEER (local), "id", &id, NULL);
+    priv->recording = ov_recording_new (priv->transmit, priv->record_dir, id);
+    g_free (id);
+  }
+
   /* Link audio branch */
-  ret = gst_element_link_many (asrc, afilter, aencode, apay, NULL);
+  ret = gst_element_link_many (asrc, afilter, aencode, NULL);
+  g_assert (ret);
+  ret = ov_recording_link (priv->recording, OV_AUDIO_RTP_SESSION, aencode,
+      apay, "opusparse");
   g_assert (ret);
   ret = gst_element_link (artcpqueue, artcpsink);
   g_assert (ret);
@@ -436,8 +1053,6 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   g_assert (ret);
 
   /* Link video branch */
-  ret = gst_element_link_many (vsrc, vqueue, vfilter, vpay, NULL);
-  g_assert (ret);
   ret = gst_element_link (vrtcpqueue, vrtcpsink);
   g_assert (ret);
   priv->vsend_rtcp_sink = vrtcpsink;
@@ -446,13 +1061,90 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   priv->vsend_rtp_sink = vsink;
   priv->vrecv_rtcp_src = vrtcpsrc;
 
-  /* Send RTP data */
-  ret = gst_element_link_pads (vpay, "src", priv->rtpbin, "send_rtp_sink_"
-      OV_VIDEO_RTP_SESSION_STR);
-  g_assert (ret);
-  ret = gst_element_link_pads (priv->rtpbin, "send_rtp_src_"
-      OV_VIDEO_RTP_SESSION_STR, vrtpqueue, "sink");
-  g_assert (ret);
+  /* Layer 0 is what we send when simulcast is off */
+  priv->n_active_video_layers = 1;
+  priv->video_layers[0].quality = ov_local_peer_get_video_quality (local);
+  priv->video_layers[0].pay = vpay;
+  priv->video_layers[0].queue = vrtpqueue;
+  priv->video_layers[0].sink = vsink;
+
+  /* We can only scale down video that we encode ourselves */
+  if (priv->n_video_layers > 1 &&
+      (priv->device_video_format == OV_VIDEO_FORMAT_YUY2 ||
+       priv->device_video_format == OV_VIDEO_FORMAT_TEST)) {
+    vcaps = ov_local_peer_get_transmit_video_caps (local);
+    priv->n_active_video_layers =
+      ov_local_peer_get_video_layer_caps (local, vcaps, layer_caps);
+    gst_caps_unref (vcaps);
+  } else if (priv->n_video_layers > 1) {
+    GST_WARNING ("Can't do simulcast when passing through compressed video "
+        "from the device; sending a single video layer");
+  }
+
+  if (priv->n_active_video_layers > 1) {
+    guint ii;
+    GstElement *vtee, *vteequeue, *vfunnel, *vdemux;
+
+    /* Each layer has its own SSRC in the video RTP session, and the
+     * rtpssrcdemux after the session sends each SSRC to its own sink */
+    for (ii = 0; ii < priv->n_active_video_layers; ii++)
+      priv->video_layers[ii].ssrc = g_random_int ();
+    g_object_set (vpay, "ssrc", priv->video_layers[0].ssrc, NULL);
+    priv->ssrcs[OV_VIDEO_RTP_SESSION] = priv->video_layers[0].ssrc;
+
+    vtee = gst_element_factory_make ("tee", "video-tee");
+    vteequeue = gst_element_factory_make ("queue", NULL);
+    /* rtpfunnel is made for this, but is only available with newer GStreamer */
+    vfunnel = gst_element_factory_make ("rtpfunnel", NULL);
+    if (vfunnel == NULL)
+      vfunnel = gst_element_factory_make ("funnel", NULL);
+    vdemux = gst_element_factory_make ("rtpssrcdemux", "video-layer-demux");
+    gst_bin_add_many (GST_BIN (priv->transmit), vtee, vteequeue, vfunnel,
+        vdemux, NULL);
+
+    ret = gst_element_link_many (vsrc, vtee, vteequeue, vqueue, vfilter, NULL);
+    g_assert (ret);
+    /* Only the first layer is recorded */
+    ret = ov_recording_link (priv->recording, OV_VIDEO_RTP_SESSION, vfilter,
+        vpay, priv->send_video_format == OV_VIDEO_FORMAT_H264 ? "h264parse" :
+        NULL);
+    g_assert (ret);
+    ret = gst_element_link (vpay, vfunnel);
+    g_assert (ret);
+
+    for (ii = 1; ii < priv->n_active_video_layers; ii++) {
+      ov_local_peer_add_video_layer (local, ii, layer_caps[ii], vtee, vfunnel);
+      gst_caps_unref (layer_caps[ii]);
+    }
+
+    g_signal_connect (vdemux, "new-ssrc-pad",
+        G_CALLBACK (on_video_layer_ssrc_pad), local);
+
+    /* Send RTP data */
+    ret = gst_element_link_pads (vfunnel, "src", priv->rtpbin, "send_rtp_sink_"
+        OV_VIDEO_RTP_SESSION_STR);
+    g_assert (ret);
+    ret = gst_element_link_pads (priv->rtpbin, "send_rtp_src_"
+        OV_VIDEO_RTP_SESSION_STR, vdemux, "sink");
+    g_assert (ret);
+    GST_DEBUG ("Sending %u simulcast video layers",
+        priv->n_active_video_layers);
+  } else {
+    ret = gst_element_link_many (vsrc, vqueue, vfilter, NULL);
+    g_assert (ret);
+    ret = ov_recording_link (priv->recording, OV_VIDEO_RTP_SESSION, vfilter,
+        vpay, priv->send_video_format == OV_VIDEO_FORMAT_H264 ? "h264parse" :
+        NULL);
+    g_assert (ret);
+
+    /* Send RTP data */
+    ret = gst_element_link_pads (vpay, "src", priv->rtpbin, "send_rtp_sink_"
+        OV_VIDEO_RTP_SESSION_STR);
+    g_assert (ret);
+    ret = gst_element_link_pads (priv->rtpbin, "send_rtp_src_"
+        OV_VIDEO_RTP_SESSION_STR, vrtpqueue, "sink");
+    g_assert (ret);
+  }
 
   /* Send RTCP SR */
   ret = gst_element_link_pads (priv->rtpbin, "send_rtcp_src_"
@@ -464,6 +1156,16 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
       OV_VIDEO_RTP_SESSION_STR);
   g_assert (ret);
 
+  /* Keyframe requests from the remotes come out of here */
+  sinkpad = gst_element_get_static_pad (priv->rtpbin, "send_rtp_sink_"
+      OV_VIDEO_RTP_SESSION_STR);
+  g_atomic_int_set (&priv->last_keyframe_request, 0);
+  gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+      (GstPadProbeCallback) on_transmit_keyframe_request, local, NULL);
+  gst_object_unref (sinkpad);
+
+  ov_setup_rtpbin_rtcp_interval (priv->rtpbin);
+
   /* For outgoing data, we want RTP statistics from receivers via the RTCP RRs
    * that we receive from them on this rtpbin. We wait for the SDES so we can
    * identify which receiver each SSRC corresponds to. Then in on-ssrc-active
@@ -473,6 +1175,12 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   g_signal_connect (priv->rtpbin, "on-ssrc-sdes",
       G_CALLBACK (on_transmit_ssrc_sdes), local);
 
+  /* The application might've muted us before the call */
+  priv->capture_srcs[OV_AUDIO_RTP_SESSION] = asrc;
+  priv->capture_srcs[OV_VIDEO_RTP_SESSION] = vsrc;
+  ov_local_peer_mute_capture (local, OV_AUDIO_RTP_SESSION);
+  ov_local_peer_mute_capture (local, OV_VIDEO_RTP_SESSION);
+
   /* All done */
 
   /* Use the system clock and explicitly reset the base/start times to ensure
@@ -486,12 +1194,25 @@ ov_local_peer_setup_transmit_pipeline (OvLocalPeer * local)
   g_signal_connect (bus, "message::error",
       G_CALLBACK (on_local_transmit_error), local);
   g_object_unref (bus);
+  ov_local_peer_watch_threads (local, priv->transmit, OV_THREAD_ROLE_TRANSMIT);
 
   GST_DEBUG ("Setup pipeline to transmit to remote peers");
 
   return TRUE;
 }
 
+static gpointer
+ov_local_peer_tcp_server_thread (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv = ov_local_peer_get_private (local);
+
+  g_main_context_push_thread_default (priv->tcp_context);
+  g_main_loop_run (priv->tcp_loop);
+  g_main_context_pop_thread_default (priv->tcp_context);
+
+  return NULL;
+}
+
 gboolean
 ov_local_peer_setup_comms (OvLocalPeer * local)
 {
@@ -510,10 +1231,12 @@ ov_local_peer_setup_comms (OvLocalPeer * local)
 
   /*-- Listen for incoming TCP connections --*/
 
-  /* Threaded socket service since we use blocking TCP network reads
-   * TODO: Use threads equal to number of remote peers? To ensure that peers
-   * never wait while communicating. */
-  priv->tcp_server = g_threaded_socket_service_new (10);
+  /* The TCP server gets its own main context so that negotiation traffic is
+   * never held up by whatever the application does on the default one.
+   * GSocketService starts accepting in the thread-default context. */
+  priv->tcp_context = g_main_context_new ();
+  g_main_context_push_thread_default (priv->tcp_context);
+  priv->tcp_server = g_socket_service_new ();
 
   g_object_get (OV_PEER (local), "address", &addr, "address-string", &addr_s,
       NULL);
@@ -524,13 +1247,21 @@ ov_local_peer_setup_comms (OvLocalPeer * local)
   if (!ret) {
     GST_ERROR ("Unable to setup TCP server (%s): %s", addr_s, error->message);
     g_error_free (error);
+    g_main_context_pop_thread_default (priv->tcp_context);
+    g_clear_object (&priv->tcp_server);
+    g_clear_pointer (&priv->tcp_context, g_main_context_unref);
     goto out_early;
   }
 
-  g_signal_connect (priv->tcp_server, "run",
+  g_signal_connect (priv->tcp_server, "incoming",
       G_CALLBACK (on_incoming_peer_tcp_connection), local);
 
   g_socket_service_start (priv->tcp_server);
+  g_main_context_pop_thread_default (priv->tcp_context);
+
+  priv->tcp_loop = g_main_loop_new (priv->tcp_context, FALSE);
+  priv->tcp_thread = g_thread_new ("ov-tcp-server",
+      (GThreadFunc) ov_local_peer_tcp_server_thread, local);
   GST_DEBUG ("Listening for incoming TCP connections on %s", addr_s);
 
   /*-- Listen for incoming UDP messages (multicast and unicast) --*/
@@ -592,13 +1323,427 @@ out_early:
   return ret;
 }
 
-/*-- REMOTE PEER SETUP --*/
-static void
+/*-- SHARED RECEIVE SETUP --*/
+/* Drops RTP packets from SSRCs that we haven't mapped to a remote yet, so that
+ * rtpbin only creates jitterbuffers and pads for streams we can link */
+static GstPadProbeReturn
+on_shared_receive_rtp_buffer (GstPad * pad, GstPadProbeInfo * info,
+    OvLocalPeer * local)
+{
+  guint8 pt;
+  guint32 ssrc;
+  gboolean known;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* The payload type is in the second byte of the RTP header, but the marker
+   * bit shares it */
+  if (gst_buffer_extract (GST_PAD_PROBE_INFO_BUFFER (info), 1, &pt, 1) != 1)
+    return GST_PAD_PROBE_DROP;
+  pt &= 0x7f;
+  /* Retransmissions come with an SSRC of their own that no SDES is ever sent
+   * for; rtprtxreceive maps them to the original SSRC */
+  if (pt == RTP_H264_RTX_PT || pt == RTP_JPEG_RTX_PT || pt == RTP_RED_RTX_PT)
+    return GST_PAD_PROBE_OK;
+
+  /* The SSRC is the last field of the fixed 12-byte RTP header */
+  if (gst_buffer_extract (GST_PAD_PROBE_INFO_BUFFER (info), 8, &ssrc, 4) != 4)
+    return GST_PAD_PROBE_DROP;
+  ssrc = GUINT32_FROM_BE (ssrc);
+
+  g_mutex_lock (&priv->recv_lock);
+  known = g_hash_table_contains (priv->recv_ssrcs, GUINT_TO_POINTER (ssrc));
+  g_mutex_unlock (&priv->recv_lock);
+
+  if (!known) {
+    GST_TRACE ("Dropping RTP packet from unknown SSRC %u", ssrc);
+    return GST_PAD_PROBE_DROP;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Once a remote has been removed, the jitterbuffer for its SSRC might still
+ * push a few buffers; drop them instead of returning NOT_LINKED */
+static GstPadProbeReturn
+on_shared_receive_src_buffer (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  if (!gst_pad_is_linked (pad))
+    return GST_PAD_PROBE_DROP;
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+on_shared_receive_ssrc_sdes (GstElement * rtpbin, guint session, guint ssrc,
+    OvLocalPeer * local)
+{
+  const gchar *id;
+  GstStructure *sdes;
+  GObject *rtpsession, *rtpsource;
+  OvLocalPeerPrivate *priv;
+  OvRemotePeer *remote;
+
+  g_assert (OV_RTP_SESSION_IS_VALID (session));
+
+  priv = ov_local_peer_get_private (local);
+
+  g_signal_emit_by_name (rtpbin, "get-internal-session", session, &rtpsession);
+  g_signal_emit_by_name (rtpsession, "get-source-by-ssrc", ssrc, &rtpsource);
+  g_object_get (rtpsource, "sdes", &sdes, NULL);
+
+  /* The SDES of a remote's RTCP SRs carries its id, which is how we know which
+   * remote's decoders the media with this SSRC is for */
+  id = gst_structure_get_string (sdes, "onevideo-id");
+  if (id == NULL)
+    goto out;
+
+  g_mutex_lock (&priv->recv_lock);
+  remote = g_hash_table_lookup (priv->recv_remotes, id);
+  if (remote != NULL)
+    g_hash_table_insert (priv->recv_ssrcs, GUINT_TO_POINTER (ssrc), remote);
+  g_mutex_unlock (&priv->recv_lock);
+
+  if (remote == NULL)
+    GST_DEBUG ("Couldn't find remote peer for id %s", id);
+  else
+    GST_DEBUG ("Receiving %s from %s with SSRC %u",
+        OV_RTP_SESSION_TO_NAME (session), id, ssrc);
+
+out:
+  gst_structure_free (sdes);
+  g_object_unref (rtpsession);
+  g_object_unref (rtpsource);
+}
+
+/* Called from a streaming thread when RTCP arrives from @remote. A remote
+ * that joined the call while we were sending is only heard from once it's
+ * receiving, so that's when it gets a keyframe; see
+ * ov_local_peer_start_joined_remote() */
+static void
+ov_remote_peer_seen (OvRemotePeer * remote)
+{
+  remote->last_seen = g_get_monotonic_time ();
+  if (g_atomic_int_compare_and_exchange (&remote->priv->needs_keyframe, TRUE,
+        FALSE)) {
+    GST_DEBUG ("Sending a keyframe to %s, which joined the call",
+        remote->addr_s);
+    ov_local_peer_send_video_keyframe (remote->local);
+  }
+}
+
+/* Like the on_receiver_* handlers below, for the remote that sends @ssrc if
+ * we know which one that is */
+static void
+ov_shared_receive_liveness_event (OvLocalPeer * local, guint ssrc,
+    OvLivenessEvent event)
+{
+  OvLocalPeerPrivate *priv;
+  OvRemotePeer *remote;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_mutex_lock (&priv->recv_lock);
+  remote = g_hash_table_lookup (priv->recv_ssrcs, GUINT_TO_POINTER (ssrc));
+  if (remote != NULL) {
+    GST_DEBUG ("ssrc %u of remote %s: liveness event %u", ssrc,
+        remote->addr_s, event);
+    ov_remote_peer_liveness_event (remote, event);
+  }
+  g_mutex_unlock (&priv->recv_lock);
+}
+
+static void
+on_shared_receive_bye_ssrc (GstElement * rtpbin, guint session, guint ssrc,
+    OvLocalPeer * local)
+{
+  ov_shared_receive_liveness_event (local, ssrc, OV_LIVENESS_BYE);
+}
+
+static void
+on_shared_receive_ssrc_timeout (GstElement * rtpbin, guint session,
+    guint ssrc, OvLocalPeer * local)
+{
+  ov_shared_receive_liveness_event (local, ssrc, OV_LIVENESS_CHECK);
+}
+
+/* See on_receiver_sender_timeout() */
+static void
+on_shared_receive_sender_timeout (GstElement * rtpbin, guint session,
+    guint ssrc, OvLocalPeer * local)
+{
+  if (session == OV_VIDEO_RTP_SESSION)
+    ov_shared_receive_liveness_event (local, ssrc, OV_LIVENESS_STALLED);
+}
+
+static void
+on_shared_receive_ssrc_active (GstElement * rtpbin, guint session, guint ssrc,
+    OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+  OvRemotePeer *remote;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_mutex_lock (&priv->recv_lock);
+  remote = g_hash_table_lookup (priv->recv_ssrcs, GUINT_TO_POINTER (ssrc));
+  if (remote != NULL) {
+    GST_TRACE ("ssrc %u, session %u, remote %s active", ssrc, session,
+        remote->addr_s);
+    ov_remote_peer_seen (remote);
+  }
+  g_mutex_unlock (&priv->recv_lock);
+}
+
+/* Jitterbuffers are only created once media arrives, and the udpsrc probe
+ * drops media from SSRCs that aren't mapped to a remote yet */
+static void
+on_shared_receive_new_jitterbuffer (GstElement * rtpbin,
+    GstElement * jitterbuffer, guint session, guint ssrc, OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+  OvRemotePeer *remote;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_mutex_lock (&priv->recv_lock);
+  remote = g_hash_table_lookup (priv->recv_ssrcs, GUINT_TO_POINTER (ssrc));
+  if (remote != NULL)
+    ov_remote_peer_add_jitterbuffer (remote, jitterbuffer, session, ssrc);
+  g_mutex_unlock (&priv->recv_lock);
+}
+
+/* All remotes send to the same udpsrc, so the caps can't be set on it. Every
+ * remote negotiates its own video format, which we can tell apart by the
+ * payload type. */
+static GstCaps *
+on_shared_receive_request_pt_map (GstElement * rtpbin, guint session,
+    guint pt, OvLocalPeer * local)
+{
+  GstCaps *caps;
+
+  if (session == OV_AUDIO_RTP_SESSION && pt == 96)
+    return gst_caps_from_string (RTP_ALL_AUDIO_CAPS_STR);
+
+  if (session == OV_VIDEO_RTP_SESSION && pt == 26)
+    return gst_caps_from_string (RTP_JPEG_VIDEO_CAPS_STR);
+
+  if (session == OV_VIDEO_RTP_SESSION && pt == 96)
+    return gst_caps_from_string (RTP_H264_VIDEO_CAPS_STR);
+
+  caps = ov_get_rtp_repair_pt_caps (session, pt);
+  if (caps != NULL)
+    return caps;
+
+  GST_WARNING ("Unknown payload type %u in %s session", pt,
+      OV_RTP_SESSION_TO_NAME (session));
+  return NULL;
+}
+
+static void
+shared_rtpbin_pad_added (GstElement * rtpbin, GstPad * srcpad,
+    OvLocalPeer * local)
+{
+  gint n;
+  guint session, ssrc, pt;
+  gchar *name;
+  GstPad *ghostpad, *sinkpad;
+  GstPadLinkReturn ret;
+  OvLocalPeerPrivate *priv;
+  OvRemotePeer *remote;
+
+  priv = ov_local_peer_get_private (local);
+
+  name = gst_pad_get_name (srcpad);
+  n = sscanf (name, "recv_rtp_src_%u_%u_%u", &session, &ssrc, &pt);
+  g_free (name);
+  if (n != 3)
+    return;
+
+  gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+      on_shared_receive_src_buffer, NULL, NULL);
+
+  /* Held till we're done linking so the remote can't be removed meanwhile */
+  g_mutex_lock (&priv->recv_lock);
+  remote = g_hash_table_lookup (priv->recv_ssrcs, GUINT_TO_POINTER (ssrc));
+  if (remote == NULL) {
+    GST_DEBUG ("Not linking stream from unknown SSRC %u", ssrc);
+    goto out;
+  }
+
+  if (session == OV_AUDIO_RTP_SESSION) {
+    ghostpad = gst_element_get_static_pad (remote->receive, "audio_sink");
+  } else if (session == OV_VIDEO_RTP_SESSION) {
+    /* Every simulcast layer the remote switches us to has a new SSRC, and
+     * hence a new pad */
+    sinkpad = gst_element_get_request_pad (remote->priv->vfunnel, "sink_%u");
+    ghostpad = gst_ghost_pad_new (NULL, sinkpad);
+    gst_object_unref (sinkpad);
+    gst_pad_set_active (ghostpad, TRUE);
+    gst_element_add_pad (remote->receive, gst_object_ref (ghostpad));
+  } else {
+    /* We only have two streams with known session numbers */
+    g_assert_not_reached ();
+  }
+
+  ret = gst_pad_link (srcpad, ghostpad);
+  if (ret != GST_PAD_LINK_OK)
+    GST_WARNING ("Unable to link %s SSRC %u of %s: %i",
+        OV_RTP_SESSION_TO_NAME (session), ssrc, remote->addr_s, ret);
+  gst_object_unref (ghostpad);
+
+out:
+  g_mutex_unlock (&priv->recv_lock);
+}
+
+/* Sets up priv->receive which receives from all remotes when shared receive
+ * is enabled. Called with the lock TAKEN. */
+gboolean
+ov_local_peer_setup_receive_pipeline (OvLocalPeer * local)
+{
+  GstBus *bus;
+  GstPad *srcpad;
+  gboolean ret;
+  GSocket *socket;
+  GstElement *rtpbin;
+  GstElement *asrc, *artcpsrc, *artcpsink;
+  GstElement *vsrc, *vrtcpsrc, *vrtcpsink;
+  GInetSocketAddress *local_addr;
+  gchar *local_addr_s;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_object_get (OV_PEER (local), "address", &local_addr, NULL);
+  local_addr_s =
+    g_inet_address_to_string (g_inet_socket_address_get_address (local_addr));
+  g_object_unref (local_addr);
+
+  priv->receive = gst_object_ref_sink (gst_pipeline_new ("receive-%u"));
+
+  rtpbin = gst_element_factory_make ("rtpbin", "recv-rtpbin-%u");
+  g_object_set (rtpbin, "latency", RTP_DEFAULT_LATENCY_MS, "drop-on-latency",
+      TRUE, NULL);
+  ov_set_rtpbin_sdes_id (rtpbin, local);
+  /* Remotes negotiate repair separately, so be ready for whatever we can do */
+  ov_setup_rtpbin_receive_repair (rtpbin, _ov_gst_get_rtp_repair (FALSE));
+
+  /* Recv RTP audio data from all remotes */
+  socket = ov_get_socket_for_addr (local_addr_s, priv->shared_recv_ports[0]);
+  asrc = ov_rtp_udpsrc_new ("arecv_rtp_src-%u");
+  g_object_set (asrc, "socket", socket, NULL);
+  g_object_unref (socket);
+  /* Recv RTCP SR for audio from all remotes */
+  socket = ov_get_socket_for_addr (local_addr_s, priv->shared_recv_ports[1]);
+  artcpsrc = gst_element_factory_make ("udpsrc", "arecv_rtcp_src-%u");
+  g_object_set (artcpsrc, "socket", socket, NULL);
+  /* Send RTCP RR for audio using the same port as recv RTCP SR for audio; the
+   * remotes are added as clients as they are setup */
+  artcpsink = gst_element_factory_make ("multiudpsink", "asend_rtcp_sink-%u");
+  g_object_set (artcpsink, "socket", socket, "sync", FALSE, "async", FALSE,
+      NULL);
+  g_object_unref (socket);
+
+  /* Recv RTP video data from all remotes */
+  socket = ov_get_socket_for_addr (local_addr_s, priv->shared_recv_ports[2]);
+  vsrc = ov_rtp_udpsrc_new ("vrecv_rtp_src-%u");
+  g_object_set (vsrc, "buffer-size", OV_VIDEO_RECV_BUFSIZE, "socket", socket,
+      NULL);
+  g_object_unref (socket);
+  /* Recv RTCP SR for video from all remotes */
+  socket = ov_get_socket_for_addr (local_addr_s, priv->shared_recv_ports[3]);
+  vrtcpsrc = gst_element_factory_make ("udpsrc", "vrecv_rtcp_src-%u");
+  g_object_set (vrtcpsrc, "socket", socket, NULL);
+  /* Send RTCP RR for video using the same port as recv RTCP SR for video */
+  vrtcpsink = gst_element_factory_make ("multiudpsink", "vsend_rtcp_sink-%u");
+  g_object_set (vrtcpsink, "socket", socket, "sync", FALSE, "async", FALSE,
+      NULL);
+  g_object_unref (socket);
+
+  gst_bin_add_many (GST_BIN (priv->receive), rtpbin, asrc, artcpsrc, artcpsink,
+      vsrc, vrtcpsrc, vrtcpsink, NULL);
+
+  ret = gst_element_link_pads (asrc, "src", rtpbin, "recv_rtp_sink_"
+      OV_AUDIO_RTP_SESSION_STR);
+  g_assert (ret);
+  ret = gst_element_link_pads (artcpsrc, "src", rtpbin, "recv_rtcp_sink_"
+      OV_AUDIO_RTP_SESSION_STR);
+  g_assert (ret);
+  ret = gst_element_link_pads (rtpbin, "send_rtcp_src_"
+      OV_AUDIO_RTP_SESSION_STR, artcpsink, "sink");
+  g_assert (ret);
+
+  ret = gst_element_link_pads (vsrc, "src", rtpbin, "recv_rtp_sink_"
+      OV_VIDEO_RTP_SESSION_STR);
+  g_assert (ret);
+  ret = gst_element_link_pads (vrtcpsrc, "src", rtpbin, "recv_rtcp_sink_"
+      OV_VIDEO_RTP_SESSION_STR);
+  g_assert (ret);
+  ret = gst_element_link_pads (rtpbin, "send_rtcp_src_"
+      OV_VIDEO_RTP_SESSION_STR, vrtcpsink, "sink");
+  g_assert (ret);
+  ov_setup_rtpbin_rtcp_interval (rtpbin);
+
+  /* Media is only let through once we know which remote its SSRC belongs to,
+   * which we learn from the SDES in the remote's first RTCP SR */
+  srcpad = gst_element_get_static_pad (asrc, "src");
+  gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) on_shared_receive_rtp_buffer, local, NULL);
+  gst_object_unref (srcpad);
+  srcpad = gst_element_get_static_pad (vsrc, "src");
+  gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) on_shared_receive_rtp_buffer, local, NULL);
+  gst_object_unref (srcpad);
+
+  g_signal_connect (rtpbin, "request-pt-map",
+      G_CALLBACK (on_shared_receive_request_pt_map), local);
+  g_signal_connect (rtpbin, "on-ssrc-sdes",
+      G_CALLBACK (on_shared_receive_ssrc_sdes), local);
+  g_signal_connect (rtpbin, "on-ssrc-active",
+      G_CALLBACK (on_shared_receive_ssrc_active), local);
+  g_signal_connect (rtpbin, "on-bye-ssrc",
+      G_CALLBACK (on_shared_receive_bye_ssrc), local);
+  g_signal_connect (rtpbin, "on-timeout",
+      G_CALLBACK (on_shared_receive_ssrc_timeout), local);
+  g_signal_connect (rtpbin, "on-sender-timeout",
+      G_CALLBACK (on_shared_receive_sender_timeout), local);
+  g_signal_connect (rtpbin, "new-jitterbuffer",
+      G_CALLBACK (on_shared_receive_new_jitterbuffer), local);
+  g_signal_connect (rtpbin, "pad-added",
+      G_CALLBACK (shared_rtpbin_pad_added), local);
+
+  priv->recv_rtpbin = rtpbin;
+  priv->recv_rtcp_sinks[OV_AUDIO_RTP_SESSION] = artcpsink;
+  priv->recv_rtcp_sinks[OV_VIDEO_RTP_SESSION] = vrtcpsink;
+
+  /* Use the system clock and explicitly reset the base/start times to ensure
+   * that all the pipelines started by us have the same base/start times */
+  gst_pipeline_use_clock (GST_PIPELINE (priv->receive),
+      gst_system_clock_obtain());
+  gst_element_set_base_time (priv->receive, 0);
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (priv->receive));
+  gst_bus_add_signal_watch (bus);
+  g_signal_connect (bus, "message::error",
+      G_CALLBACK (on_local_receive_error), local);
+  g_object_unref (bus);
+  ov_local_peer_watch_threads (local, priv->receive, OV_THREAD_ROLE_RECEIVE);
+
+  GST_DEBUG ("Setup pipeline to receive from all remotes on ports %u, %u, %u, "
+      "%u", priv->shared_recv_ports[0], priv->shared_recv_ports[1],
+      priv->shared_recv_ports[2], priv->shared_recv_ports[3]);
+  g_free (local_addr_s);
+
+  return TRUE;
+}
+
+/*-- REMOTE PEER SETUP --*/
+static void
 rtpbin_pad_added (GstElement * rtpbin, GstPad * srcpad,
     OvRemotePeer * remote)
 {
   GstPad *sinkpad;
-  GstElement *queue;
   GstPadLinkReturn ret;
   gchar *name = gst_pad_get_name (srcpad);
   guint len = G_N_ELEMENTS ("recv_rtp_src_");
@@ -606,80 +1751,144 @@ rtpbin_pad_added (GstElement * rtpbin, GstPad * srcpad,
   /* Match the session number to the correct branch (audio or video)
    * The session number is the first %u in the pad name of the form
    * 'recv_rtp_src_%u_%u_%u' */
-  if (name[len-1] == '0')
-    queue = remote->priv->aqueue;
-  else if (name[len-1] == '1')
-    queue = remote->priv->vqueue;
-  else
+  if (name[len-1] == '0') {
+    sinkpad = gst_element_get_static_pad (remote->priv->aqueue, "sink");
+  } else if (name[len-1] == '1') {
+    /* Every simulcast layer the remote switches us to has a new SSRC, and
+     * hence a new pad */
+    sinkpad = gst_element_get_request_pad (remote->priv->vfunnel, "sink_%u");
+  } else {
     /* We only have two streams with known session numbers */
     g_assert_not_reached ();
+  }
   g_free (name);
 
-  sinkpad = gst_element_get_static_pad (queue, "sink");
   ret = gst_pad_link (srcpad, sinkpad);
   g_assert (ret == GST_PAD_LINK_OK);
   gst_object_unref (sinkpad);
 }
 
+static void
+on_receiver_new_jitterbuffer (GstElement * rtpbin, GstElement * jitterbuffer,
+    guint session, guint ssrc, OvRemotePeer * remote)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (remote->local);
+
+  g_mutex_lock (&priv->recv_lock);
+  ov_remote_peer_add_jitterbuffer (remote, jitterbuffer, session, ssrc);
+  g_mutex_unlock (&priv->recv_lock);
+}
+
 static void
 on_receiver_ssrc_active (GstElement * rtpbin, guint session, guint ssrc,
     OvRemotePeer * remote)
 {
   GST_TRACE ("ssrc %u, session %u, remote %s active", ssrc, session,
       remote->addr_s);
-  remote->last_seen = g_get_monotonic_time ();
+  ov_remote_peer_seen (remote);
 }
 
-void
-ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
+static void
+on_receiver_bye_ssrc (GstElement * rtpbin, guint session, guint ssrc,
+    OvRemotePeer * remote)
+{
+  GST_DEBUG ("ssrc %u, session %u, remote %s said BYE", ssrc, session,
+      remote->addr_s);
+  ov_remote_peer_liveness_event (remote, OV_LIVENESS_BYE);
+}
+
+/* rtpbin gives up on sources after a fixed number of RTCP intervals, but the
+ * application decides how long we wait for a remote */
+static void
+on_receiver_ssrc_timeout (GstElement * rtpbin, guint session, guint ssrc,
+    OvRemotePeer * remote)
+{
+  GST_DEBUG ("ssrc %u, session %u, remote %s timed out", ssrc, session,
+      remote->addr_s);
+  ov_remote_peer_liveness_event (remote, OV_LIVENESS_CHECK);
+}
+
+/* Audio stops whenever the remote mutes it or is silent with DTX, and there's
+ * nothing to suspend for it anyway */
+static void
+on_receiver_sender_timeout (GstElement * rtpbin, guint session, guint ssrc,
+    OvRemotePeer * remote)
+{
+  if (session != OV_VIDEO_RTP_SESSION)
+    return;
+
+  GST_DEBUG ("ssrc %u, session %u, remote %s stopped sending", ssrc, session,
+      remote->addr_s);
+  ov_remote_peer_liveness_event (remote, OV_LIVENESS_STALLED);
+}
+
+/* Receive the RTP of @remote with @src from the multicast group of the call if
+ * it sends there, and from our socket for recv_ports[@index] otherwise */
+static void
+ov_remote_peer_setup_rtp_src (OvRemotePeer * remote, GstElement * src,
+    guint index)
+{
+  GSocket *socket;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  if (remote->priv->recv_multicast_port != 0) {
+    /* Audio is on the port and video 2 above it, like in recv_ports */
+    g_object_set (src, "address", local_priv->multicast_group, "port",
+        remote->priv->recv_multicast_port + index, "auto-multicast", TRUE,
+        NULL);
+    GST_DEBUG ("Receiving RTP of %s from %s:%u", remote->addr_s,
+        local_priv->multicast_group, remote->priv->recv_multicast_port + index);
+    return;
+  }
+
+  socket = ov_socket_pool_get_socket (local_priv->socket_pool,
+      remote->priv->recv_ports[index]);
+  g_object_set (src, "socket", socket, NULL);
+  g_object_unref (socket);
+}
+
+/* Receive from this remote with its own rtpbin and sockets in
+ * remote->receive, which is a pipeline in this case */
+static void
+ov_local_peer_setup_remote_rtpbin (OvLocalPeer * local, OvRemotePeer * remote,
+    const gchar * remote_addr_s)
 {
   gboolean ret;
   GSocket *socket;
   GstElement *rtpbin;
-  GstElement *asrc, *artcpsrc, *adecode, *asink, *artcpsink;
-  GstElement *vsrc, *vrtcpsrc, *vdecode, *vsink, *vrtcpsink;
-  GInetSocketAddress *local_addr;
-  gchar *local_addr_s, *remote_addr_s;
+  GstElement *asrc, *artcpsrc, *artcpsink;
+  GstElement *vsrc, *vrtcpsrc, *vrtcpsink;
   OvVideoFormat video_format;
   GstCaps *rtpcaps;
+  OvLocalPeerPrivate *priv;
 
-  g_assert (remote->priv->recv_acaps != NULL &&
-      remote->priv->recv_vcaps != NULL && remote->priv->recv_ports[0] > 0 &&
-      remote->priv->recv_ports[1] > 0 && remote->priv->recv_ports[2] > 0 &&
-      remote->priv->recv_ports[3] > 0);
-
-  g_object_get (OV_PEER (local), "address", &local_addr, NULL);
-  local_addr_s =
-    g_inet_address_to_string (g_inet_socket_address_get_address (local_addr));
-  remote_addr_s =
-    g_inet_address_to_string (g_inet_socket_address_get_address (remote->addr));
-  g_object_unref (local_addr);
-
-  /* Setup pipeline (remote->receive) to recv & decode from a remote peer */
-
-  video_format = ov_caps_to_video_format (remote->priv->recv_vcaps);
+  priv = ov_local_peer_get_private (local);
 
   rtpbin = gst_element_factory_make ("rtpbin", "recv-rtpbin-%u");
   g_object_set (rtpbin, "latency", RTP_DEFAULT_LATENCY_MS, "drop-on-latency",
       TRUE, NULL);
   ov_set_rtpbin_sdes_id (rtpbin, local);
+  ov_setup_rtpbin_receive_repair (rtpbin, remote->priv->recv_repair);
+  if (remote->priv->recv_repair != OV_RTP_REPAIR_NONE)
+    g_signal_connect (rtpbin, "request-pt-map",
+        G_CALLBACK (on_receiver_request_pt_map), NULL);
 
   /* TODO: Both audio and video should be optional */
 
   /* Recv RTP audio data */
-  socket = ov_get_socket_for_addr (local_addr_s, remote->priv->recv_ports[0]);
-  asrc = gst_element_factory_make ("udpsrc", "arecv_rtp_src-%u");
+  asrc = ov_rtp_udpsrc_new ("arecv_rtp_src-%u");
+  ov_remote_peer_setup_rtp_src (remote, asrc, 0);
   /* We always use the same caps for sending audio */
   rtpcaps = gst_caps_from_string (RTP_ALL_AUDIO_CAPS_STR);
-  g_object_set (asrc, "socket", socket, "caps", rtpcaps, NULL);
+  g_object_set (asrc, "caps", rtpcaps, NULL);
   gst_caps_unref (rtpcaps);
-  g_object_unref (socket);
-  remote->priv->adepay = gst_element_factory_make ("rtpopusdepay", NULL);
-  adecode = gst_element_factory_make ("opusdec", NULL);
-  asink = gst_element_factory_make ("proxysink", "audio-proxysink-%u");
-  g_assert (asink != NULL);
   /* Recv RTCP SR for audio */
-  socket = ov_get_socket_for_addr (local_addr_s, remote->priv->recv_ports[1]);
+  socket = ov_socket_pool_get_socket (priv->socket_pool,
+      remote->priv->recv_ports[1]);
   artcpsrc = gst_element_factory_make ("udpsrc", "arecv_rtcp_src-%u");
   g_object_set (artcpsrc, "socket", socket, NULL);
   /* Send RTCP RR for audio using the same port as recv RTCP SR for audio
@@ -693,39 +1902,22 @@ ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
   g_object_unref (socket);
 
   /* Recv RTP video data */
-  vsrc = gst_element_factory_make ("udpsrc", "vrecv_rtp_src-%u");
-  /* The depayloader will detect the height/width/framerate on the fly
-   * This allows us to change that without communicating new caps
-   * TODO: Use decodebin instead of hard-coding elements */
-  if (video_format == OV_VIDEO_FORMAT_JPEG) {
+  video_format = ov_caps_to_video_format (remote->priv->recv_vcaps);
+  if (video_format == OV_VIDEO_FORMAT_JPEG)
     rtpcaps = gst_caps_from_string (RTP_JPEG_VIDEO_CAPS_STR);
-    remote->priv->vdepay = gst_element_factory_make ("rtpjpegdepay", NULL);
-    vdecode = gst_element_factory_make ("jpegdec", NULL);
-  } else if (video_format == OV_VIDEO_FORMAT_H264) {
+  else if (video_format == OV_VIDEO_FORMAT_H264)
     rtpcaps = gst_caps_from_string (RTP_H264_VIDEO_CAPS_STR);
-    remote->priv->vdepay = gst_element_factory_make ("rtph264depay", NULL);
-    vdecode = gst_element_factory_make ("avdec_h264", NULL);
-  } else {
+  else
     g_assert_not_reached ();
-  }
-  remote->priv->aqueue = gst_element_factory_make ("queue", "aqueue");
-  remote->priv->vqueue = gst_element_factory_make ("queue", "vqueue");
-  /* Pre-depayloader queues. Ensures decoupling of depayloading/decoding into
-   * threads separate from the jitterbuffer. */
-  g_object_set (remote->priv->aqueue, "max-size-buffers", 0, "max-size-bytes", 0,
-      "max-size-time", 100 * GST_MSECOND, NULL);
-  g_object_set (remote->priv->vqueue, "max-size-buffers", 0, "max-size-bytes", 0,
-      "max-size-time", 100 * GST_MSECOND, NULL);
-  socket = ov_get_socket_for_addr (local_addr_s, remote->priv->recv_ports[2]);
-  g_object_set (vsrc, "buffer-size", OV_VIDEO_RECV_BUFSIZE, "socket", socket,
-      "caps", rtpcaps, NULL);
+  vsrc = ov_rtp_udpsrc_new ("vrecv_rtp_src-%u");
+  ov_remote_peer_setup_rtp_src (remote, vsrc, 2);
+  g_object_set (vsrc, "buffer-size", OV_VIDEO_RECV_BUFSIZE, "caps", rtpcaps,
+      NULL);
   gst_caps_unref (rtpcaps);
-  g_object_unref (socket);
 
-  vsink = gst_element_factory_make ("proxysink", "video-proxysink-%u");
-  g_assert (vsink != NULL);
   /* Recv RTCP SR for video */
-  socket = ov_get_socket_for_addr (local_addr_s, remote->priv->recv_ports[3]);
+  socket = ov_socket_pool_get_socket (priv->socket_pool,
+      remote->priv->recv_ports[3]);
   vrtcpsrc = gst_element_factory_make ("udpsrc", "vrecv_rtcp_src-%u");
   g_object_set (vrtcpsrc, "socket", socket, NULL);
   /* Send RTCP RR for video using the same port as recv RTCP SR for video
@@ -738,16 +1930,9 @@ ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
       "host", remote_addr_s, "port", remote->priv->send_ports[5], NULL);
   g_object_unref (socket);
 
-  gst_bin_add_many (GST_BIN (remote->receive), rtpbin,
-      asrc, remote->priv->aqueue, remote->priv->adepay, adecode, asink,
-      vsrc, remote->priv->vqueue, remote->priv->vdepay, vdecode, vsink,
+  gst_bin_add_many (GST_BIN (remote->receive), rtpbin, asrc, vsrc,
       artcpsink, artcpsrc, vrtcpsink, vrtcpsrc, NULL);
 
-  /* Link audio branch via rtpbin */
-  ret = gst_element_link_many (remote->priv->aqueue, remote->priv->adepay,
-      adecode, asink, NULL);
-  g_assert (ret);
-
   /* Recv audio RTP and send to rtpbin */
   ret = gst_element_link_pads (asrc, "src", rtpbin, "recv_rtp_sink_"
       OV_AUDIO_RTP_SESSION_STR);
@@ -763,11 +1948,6 @@ ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
       OV_AUDIO_RTP_SESSION_STR, artcpsink, "sink");
   g_assert (ret);
 
-  /* Link video branch via rtpbin */
-  ret = gst_element_link_many (remote->priv->vqueue, remote->priv->vdepay,
-      vdecode, vsink, NULL);
-  g_assert (ret);
-
   /* Recv video RTP and send to rtpbin */
   ret = gst_element_link_pads (vsrc, "src", rtpbin, "recv_rtp_sink_"
       OV_VIDEO_RTP_SESSION_STR);
@@ -797,6 +1977,244 @@ ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
    * RTPSource statistics from here for the application. */
   g_signal_connect (rtpbin, "on-ssrc-active",
       G_CALLBACK (on_receiver_ssrc_active), remote);
+  /* Other things that tell us whether the remote is still there; see
+   * ov_remote_peer_watch_liveness() */
+  g_signal_connect (rtpbin, "on-bye-ssrc",
+      G_CALLBACK (on_receiver_bye_ssrc), remote);
+  g_signal_connect (rtpbin, "on-timeout",
+      G_CALLBACK (on_receiver_ssrc_timeout), remote);
+  g_signal_connect (rtpbin, "on-sender-timeout",
+      G_CALLBACK (on_receiver_sender_timeout), remote);
+  ov_setup_rtpbin_rtcp_interval (rtpbin);
+  /* So we can adapt the latency of each stream; see jitterbuffer.c */
+  g_signal_connect (rtpbin, "new-jitterbuffer",
+      G_CALLBACK (on_receiver_new_jitterbuffer), remote);
+}
+
+/* Receive from this remote via the shared rtpbin in priv->receive, which
+ * remote->receive (a bin in this case) is added to */
+static void
+ov_local_peer_setup_remote_shared (OvLocalPeer * local, OvRemotePeer * remote,
+    const gchar * remote_addr_s)
+{
+  gboolean res;
+  GstPad *ghostpad, *sinkpad;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_assert (remote->id != NULL);
+
+  /* The shared rtpbin links its audio pad for this remote to this; video
+   * ghostpads are added for each SSRC as they show up */
+  sinkpad = gst_element_get_static_pad (remote->priv->aqueue, "sink");
+  ghostpad = gst_ghost_pad_new ("audio_sink", sinkpad);
+  gst_object_unref (sinkpad);
+  gst_pad_set_active (ghostpad, TRUE);
+  res = gst_element_add_pad (remote->receive, ghostpad);
+  g_assert (res);
+
+  /* Our RTCP RRs go to the same ports as with a pipeline per remote */
+  g_signal_emit_by_name (priv->recv_rtcp_sinks[OV_AUDIO_RTP_SESSION], "add",
+      remote_addr_s, remote->priv->send_ports[2]);
+  g_signal_emit_by_name (priv->recv_rtcp_sinks[OV_VIDEO_RTP_SESSION], "add",
+      remote_addr_s, remote->priv->send_ports[5]);
+
+  res = gst_bin_add (GST_BIN (priv->receive), remote->receive);
+  g_assert (res);
+
+  /* Lets its SSRCs be mapped to it when its SDES arrives */
+  g_mutex_lock (&priv->recv_lock);
+  g_hash_table_insert (priv->recv_remotes, remote->id, remote);
+  g_mutex_unlock (&priv->recv_lock);
+}
+
+static gboolean
+ssrc_is_for_remote (gpointer ssrc, OvRemotePeer * value, OvRemotePeer * remote)
+{
+  return value == remote;
+}
+
+/* Undoes ov_local_peer_setup_remote_shared() */
+void
+ov_local_peer_remove_remote_shared (OvLocalPeer * local, OvRemotePeer * remote)
+{
+  gboolean res;
+  gchar *remote_addr_s;
+  GstStateChangeReturn ret;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  /* Nothing is linked to the remote after this */
+  g_mutex_lock (&priv->recv_lock);
+  g_hash_table_foreach_remove (priv->recv_ssrcs, (GHRFunc) ssrc_is_for_remote,
+      remote);
+  if (remote->id != NULL)
+    g_hash_table_remove (priv->recv_remotes, remote->id);
+  g_mutex_unlock (&priv->recv_lock);
+
+  if (priv->receive == NULL ||
+      GST_OBJECT_PARENT (remote->receive) != GST_OBJECT (priv->receive))
+    /* Never setup */
+    return;
+
+  remote_addr_s =
+    g_inet_address_to_string (g_inet_socket_address_get_address (remote->addr));
+  g_signal_emit_by_name (priv->recv_rtcp_sinks[OV_AUDIO_RTP_SESSION], "remove",
+      remote_addr_s, remote->priv->send_ports[2]);
+  g_signal_emit_by_name (priv->recv_rtcp_sinks[OV_VIDEO_RTP_SESSION], "remove",
+      remote_addr_s, remote->priv->send_ports[5]);
+  g_free (remote_addr_s);
+
+  ret = gst_element_set_state (remote->receive, GST_STATE_NULL);
+  g_assert (ret == GST_STATE_CHANGE_SUCCESS);
+  res = gst_bin_remove (GST_BIN (priv->receive), remote->receive);
+  g_assert (res);
+}
+
+void
+ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
+{
+  gboolean ret;
+  GstElement *adecode, *asink;
+  GstElement *vparse, *vdecode, *vsink;
+  const gchar *vdecoder_name;
+  gchar *remote_addr_s;
+  OvVideoFormat video_format;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_assert (remote->priv->recv_acaps != NULL &&
+      remote->priv->recv_vcaps != NULL && remote->priv->recv_ports[0] > 0 &&
+      remote->priv->recv_ports[1] > 0 && remote->priv->recv_ports[2] > 0 &&
+      remote->priv->recv_ports[3] > 0);
+
+  remote_addr_s =
+    g_inet_address_to_string (g_inet_socket_address_get_address (remote->addr));
+
+  /* Setup remote->receive to depayload & decode from a remote peer */
+
+  video_format = ov_caps_to_video_format (remote->priv->recv_vcaps);
+
+  remote->priv->adepay = gst_element_factory_make ("rtpopusdepay", NULL);
+  adecode = gst_element_factory_make ("opusdec", NULL);
+  asink = gst_element_factory_make ("proxysink", "audio-proxysink-%u");
+  g_assert (asink != NULL);
+
+  /* The depayloader will detect the height/width/framerate on the fly
+   * This allows us to change that without communicating new caps */
+  if (video_format == OV_VIDEO_FORMAT_JPEG) {
+    remote->priv->vdepay = gst_element_factory_make ("rtpjpegdepay", NULL);
+  } else if (video_format == OV_VIDEO_FORMAT_H264) {
+    remote->priv->vdepay = gst_element_factory_make ("rtph264depay", NULL);
+  } else {
+    g_assert_not_reached ();
+  }
+
+  /* Hardware decoders are picked if they work, and we don't convert what they
+   * output, so decoded frames can stay in GL/DMABuf memory all the way to a
+   * GL video sink. Software sinks just get system memory. */
+  vdecoder_name = _ov_gst_get_video_decoder_name (video_format);
+  g_assert (vdecoder_name != NULL);
+  vdecode = gst_element_factory_make (vdecoder_name, NULL);
+  /* Most decoders want a parsed stream with the format and alignment they
+   * support; jpegdec and avdec_h264 accept whatever the depayloaders output */
+  if (video_format == OV_VIDEO_FORMAT_JPEG)
+    vparse = g_strcmp0 (vdecoder_name, "jpegdec") != 0 ?
+      gst_element_factory_make ("jpegparse", NULL) : NULL;
+  else
+    vparse = g_strcmp0 (vdecoder_name, "avdec_h264") != 0 ?
+      gst_element_factory_make ("h264parse", NULL) : NULL;
+  if (vparse == NULL)
+    vparse = gst_element_factory_make ("identity", NULL);
+  remote->priv->vdecode = vdecode;
+  remote->priv->vparse = vparse;
+  remote->priv->decode_timer = ov_element_add_frame_timer (vdecode);
+  /* Don't decode its DTX frames or mix its silence; see speaker.c */
+  ov_remote_peer_add_audio_level (remote, adecode);
+  remote->priv->latency_trackers[OV_AUDIO_RTP_SESSION] =
+    ov_latency_tracker_new (remote->priv->adepay, adecode);
+  remote->priv->latency_trackers[OV_VIDEO_RTP_SESSION] =
+    ov_latency_tracker_new (remote->priv->vdepay, vdecode);
+  GST_INFO ("Decoding video from %s with %s", remote->addr_s, vdecoder_name);
+  remote->priv->aqueue = gst_element_factory_make ("queue", "aqueue");
+  remote->priv->vqueue = gst_element_factory_make ("queue", "vqueue");
+  remote->priv->vfunnel = gst_element_factory_make ("funnel", "vfunnel");
+  /* Pre-depayloader queues. Ensures decoupling of depayloading/decoding into
+   * threads separate from the jitterbuffer. */
+  g_object_set (remote->priv->aqueue, "max-size-buffers", 0, "max-size-bytes", 0,
+      "max-size-time", 100 * GST_MSECOND, NULL);
+  g_object_set (remote->priv->vqueue, "max-size-buffers", 0, "max-size-bytes", 0,
+      "max-size-time", 100 * GST_MSECOND, NULL);
+  /* Decoding is usually what costs the most, so it can get a thread of its
+   * own instead of sharing the one that depayloads */
+  if (ov_remote_peer_wants_decode_thread (remote)) {
+    remote->priv->vdecqueue = gst_element_factory_make ("queue", "vdecqueue");
+    g_object_set (remote->priv->vdecqueue, "max-size-buffers", 0,
+        "max-size-bytes", 0, "max-size-time", 100 * GST_MSECOND, NULL);
+    gst_bin_add (GST_BIN (remote->receive), remote->priv->vdecqueue);
+  }
+
+  vsink = gst_element_factory_make ("proxysink", "video-proxysink-%u");
+  g_assert (vsink != NULL);
+
+  gst_bin_add_many (GST_BIN (remote->receive),
+      remote->priv->aqueue, remote->priv->adepay, adecode, asink,
+      remote->priv->vfunnel, remote->priv->vqueue, remote->priv->vdepay, vparse,
+      vdecode, vsink, NULL);
+
+  /* What the remote sends is recorded after depayloading */
+  if (priv->record_dir != NULL)
+    remote->priv->recording = ov_recording_new (remote->receive,
+        priv->record_dir, remote->id);
+
+  /* Link audio branch */
+  ret = gst_element_link (remote->priv->aqueue, remote->priv->adepay);
+  g_assert (ret);
+  ret = ov_recording_link (remote->priv->recording, OV_AUDIO_RTP_SESSION,
+      remote->priv->adepay, adecode, "opusparse");
+  g_assert (ret);
+  ret = gst_element_link (adecode, asink);
+  g_assert (ret);
+
+  /* Link video branch */
+  ret = gst_element_link_many (remote->priv->vfunnel, remote->priv->vqueue,
+      remote->priv->vdepay, NULL);
+  g_assert (ret);
+  ret = ov_recording_link (remote->priv->recording, OV_VIDEO_RTP_SESSION,
+      remote->priv->vdepay, vparse,
+      video_format == OV_VIDEO_FORMAT_H264 ? "h264parse" : NULL);
+  g_assert (ret);
+  if (remote->priv->vdecqueue != NULL)
+    ret = gst_element_link_many (vparse, remote->priv->vdecqueue, vdecode,
+        vsink, NULL);
+  else
+    ret = gst_element_link_many (vparse, vdecode, vsink, NULL);
+  g_assert (ret);
+
+  /* H264 decoders output garbage till the next IDR if we start them in the
+   * middle of a GOP, which happens every time decoding is turned back on */
+  if (g_object_class_find_property (
+        G_OBJECT_GET_CLASS (remote->priv->vdepay), "wait-for-keyframe"))
+    g_object_set (remote->priv->vdepay, "wait-for-keyframe", TRUE, NULL);
+  /* Makes it send a PLI through the rtpbin instead of waiting for the next
+   * periodic keyframe, both when it starts in the middle of a GOP and when it
+   * notices that a packet was lost */
+  if (g_object_class_find_property (
+        G_OBJECT_GET_CLASS (remote->priv->vdepay), "request-keyframe"))
+    g_object_set (remote->priv->vdepay, "request-keyframe", TRUE, NULL);
+
+  /* The application might've hidden this remote before the call started */
+  if (remote->priv->video_hidden)
+    ov_remote_peer_drop_video (remote, TRUE);
+
+  /* Link the RTP streams from the remote to the queues */
+  if (priv->shared_receive)
+    ov_local_peer_setup_remote_shared (local, remote, remote_addr_s);
+  else
+    ov_local_peer_setup_remote_rtpbin (local, remote, remote_addr_s);
 
   /* This is what exposes video/audio data from this remote peer */
   remote->priv->audio_proxysink = asink;
@@ -804,7 +2222,6 @@ ov_local_peer_setup_remote_receive (OvLocalPeer * local, OvRemotePeer * remote)
 
   GST_DEBUG ("Setup pipeline to receive from remote");
   g_free (remote_addr_s);
-  g_free (local_addr_s);
 }
 
 void
@@ -827,7 +2244,12 @@ ov_local_peer_setup_remote_playback (OvLocalPeer * local, OvRemotePeer * remote)
 
     /* Link the two pipelines */
     g_object_set (remote->priv->audio_proxysrc, "proxysink",
-        remote->priv->audio_proxysink, NULL);
+        remote->priv->audio_proxysink, "max-latency",
+        OV_AUDIO_PLAYBACK_MAX_LATENCY, NULL);
+    if (remote->priv->latency_trackers[OV_AUDIO_RTP_SESSION] != NULL)
+      ov_latency_tracker_add_playback (
+          remote->priv->latency_trackers[OV_AUDIO_RTP_SESSION],
+          remote->priv->audio_proxysrc);
 
     sinkpad = gst_element_get_request_pad (priv->audiomixer, "sink_%u");
 
@@ -858,10 +2280,38 @@ ov_local_peer_setup_remote_playback (OvLocalPeer * local, OvRemotePeer * remote)
 
     /* Link the two pipelines */
     g_object_set (remote->priv->video_proxysrc, "proxysink",
-        remote->priv->video_proxysink, NULL);
+        remote->priv->video_proxysink, "latest-only", TRUE, NULL);
+    if (remote->priv->latency_trackers[OV_VIDEO_RTP_SESSION] != NULL)
+      ov_latency_tracker_add_playback (
+          remote->priv->latency_trackers[OV_VIDEO_RTP_SESSION],
+          remote->priv->video_proxysrc);
+
+    if (priv->video_compositor != NULL) {
+      /* glvideomixer uploads and converts the video on each sinkpad, so we
+       * only need to get it there */
+      gst_bin_add (GST_BIN (remote->priv->vplayback),
+          remote->priv->video_proxysrc);
+      res = gst_bin_add (GST_BIN (priv->playback), remote->priv->vplayback);
+      g_assert (res);
+
+      srcpad = gst_element_get_static_pad (remote->priv->video_proxysrc,
+          "src");
+      ghostpad = gst_ghost_pad_new ("videopad", srcpad);
+      res = gst_pad_set_active (ghostpad, TRUE);
+      g_assert (res);
+      res = gst_element_add_pad (remote->priv->vplayback, ghostpad);
+      g_assert (res);
+      gst_object_unref (srcpad);
+
+      ov_remote_peer_link_video_compositor (remote);
+      goto out;
+    }
 
     /* If a remote_peer_add_sink wasn't used, use a fallback (xv|gl)imagesink */
-    if (remote->priv->video_sink == NULL) {
+    if (remote->priv->video_sink == NULL && priv->test_media) {
+      remote->priv->video_sink = gst_element_factory_make ("fakesink", NULL);
+      g_object_set (remote->priv->video_sink, "sync", TRUE, NULL);
+    } else if (remote->priv->video_sink == NULL) {
       /* On Linux (Mesa), using multiple GL output windows leads to a
        * crash due to a bug in Mesa related to multiple GLX contexts */
       if (_ov_opengl_is_mesa ())
@@ -882,5 +2332,319 @@ ov_local_peer_setup_remote_playback (OvLocalPeer * local, OvRemotePeer * remote)
     g_assert (res);
   }
 
+out:
   GST_DEBUG ("Setup local pipeline to playback remote");
 }
+
+/* Links the videopad of remote->priv->vplayback to a new compositor sinkpad
+ * at the position set by the application */
+void
+ov_remote_peer_link_video_compositor (OvRemotePeer * remote)
+{
+  gint *rect;
+  GstPad *srcpad, *sinkpad;
+  GstPadLinkReturn ret;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+  rect = remote->priv->video_rect;
+
+  sinkpad = gst_element_get_request_pad (local_priv->video_compositor,
+      "sink_%u");
+  if (rect[2] > 0 && rect[3] > 0)
+    g_object_set (sinkpad, "xpos", rect[0], "ypos", rect[1], "width", rect[2],
+        "height", rect[3], NULL);
+
+  srcpad = gst_element_get_static_pad (remote->priv->vplayback, "videopad");
+  ret = gst_pad_link (srcpad, sinkpad);
+  g_assert (ret == GST_PAD_LINK_OK);
+  gst_object_unref (srcpad);
+  gst_object_unref (sinkpad);
+}
+
+static GstPadProbeReturn
+drop_buffers (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  return GST_PAD_PROBE_DROP;
+}
+
+/* Drops depayloaded video till the next keyframe, since that's where the
+ * decoder can start from. In a buffer list, only what's before the keyframe is
+ * dropped. */
+static GstPadProbeReturn
+drop_till_keyframe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  guint ii, len;
+  GstBufferList *list;
+
+  if (!(GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)) {
+    if (GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info),
+          GST_BUFFER_FLAG_DELTA_UNIT))
+      return GST_PAD_PROBE_DROP;
+    return GST_PAD_PROBE_REMOVE;
+  }
+
+  list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+  len = gst_buffer_list_length (list);
+  for (ii = 0; ii < len; ii++)
+    if (!GST_BUFFER_FLAG_IS_SET (gst_buffer_list_get (list, ii),
+          GST_BUFFER_FLAG_DELTA_UNIT))
+      break;
+  if (ii == len)
+    return GST_PAD_PROBE_DROP;
+
+  if (ii > 0) {
+    list = gst_buffer_list_make_writable (list);
+    gst_buffer_list_remove (list, 0, ii);
+    GST_PAD_PROBE_INFO_DATA (info) = list;
+  }
+  return GST_PAD_PROBE_REMOVE;
+}
+
+/* Drop (or stop dropping) the video RTP of this remote right before the
+ * depayloader so that none of it is depayloaded or decoded. The RTP session
+ * keeps seeing all packets, so RTCP and stats are unaffected. When the remote
+ * is being recorded, the video is dropped after depayloading instead, and the
+ * depayloader can't wait for a keyframe for the decoder then, so we do. */
+void
+ov_remote_peer_drop_video (OvRemotePeer * remote, gboolean drop)
+{
+  GstPad *sinkpad;
+
+  if (drop == (remote->priv->vdrop_probe != 0))
+    return;
+
+  if (remote->priv->recording != NULL)
+    sinkpad = gst_element_get_static_pad (remote->priv->vparse, "sink");
+  else
+    sinkpad = gst_element_get_static_pad (remote->priv->vdepay, "sink");
+  if (drop) {
+    remote->priv->vdrop_probe = gst_pad_add_probe (sinkpad,
+        GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+        drop_buffers, NULL, NULL);
+    GST_DEBUG ("Dropping video of %s before decoding", remote->addr_s);
+  } else {
+    gst_pad_remove_probe (sinkpad, remote->priv->vdrop_probe);
+    remote->priv->vdrop_probe = 0;
+    if (remote->priv->recording != NULL)
+      gst_pad_add_probe (sinkpad,
+          GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+          drop_till_keyframe, NULL, NULL);
+    GST_DEBUG ("Decoding video of %s again", remote->addr_s);
+  }
+  gst_object_unref (sinkpad);
+}
+
+/* Called from a streaming thread for the first video RTP that arrives from a
+ * remote whose video has stalled; it's dropped till the stall is lifted */
+static GstPadProbeReturn
+on_stalled_video_buffer (GstPad * pad, GstPadProbeInfo * info,
+    OvRemotePeer * remote)
+{
+  ov_remote_peer_liveness_event (remote, OV_LIVENESS_RESUMED);
+  return GST_PAD_PROBE_DROP;
+}
+
+/* Stop (or start) depayloading and decoding the video of @remote while it
+ * isn't sending us any, and ask for a keyframe once it's back. Called with the
+ * lock TAKEN from ov_remote_peer_check_liveness() */
+void
+ov_remote_peer_stall_video (OvRemotePeer * remote, gboolean stalled)
+{
+  GstPad *sinkpad;
+
+  remote->priv->video_stalled = stalled;
+  if (remote->priv->vdepay == NULL)
+    return;
+
+  sinkpad = gst_element_get_static_pad (remote->priv->vdepay, "sink");
+  if (stalled && remote->priv->vstall_probe == 0) {
+    remote->priv->vstall_probe = gst_pad_add_probe (sinkpad,
+        GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+        (GstPadProbeCallback) on_stalled_video_buffer, remote, NULL);
+    GST_DEBUG ("Video of %s has stalled; not decoding it", remote->addr_s);
+  } else if (!stalled && remote->priv->vstall_probe != 0) {
+    gst_pad_remove_probe (sinkpad, remote->priv->vstall_probe);
+    remote->priv->vstall_probe = 0;
+    GST_DEBUG ("Video of %s is back; decoding it again", remote->addr_s);
+    /* The decoder missed whatever was lost while it was stalled */
+    if (!remote->priv->video_hidden)
+      ov_remote_peer_request_video_keyframe (remote);
+  }
+  gst_object_unref (sinkpad);
+}
+
+/* Ask the remote for a keyframe so we can start decoding its video right
+ * away. The event goes upstream into the rtpbin, which sends a PLI/FIR. */
+void
+ov_remote_peer_request_video_keyframe (OvRemotePeer * remote)
+{
+  GstPad *sinkpad;
+  GstStructure *s;
+
+  s = gst_structure_new ("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN,
+      TRUE, NULL);
+  sinkpad = gst_element_get_static_pad (remote->priv->vdepay, "sink");
+  gst_pad_push_event (sinkpad,
+      gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM, s));
+  gst_object_unref (sinkpad);
+}
+
+/* Drop (or stop dropping) everything that the audio or video source captures
+ * if the application has muted it, so that nothing is encoded or sent. rtpbin
+ * keeps sending RTCP, so the session stays alive. Called with the lock TAKEN
+ * when @session is muted or unmuted, and once the transmit pipeline is setup */
+void
+ov_local_peer_mute_capture (OvLocalPeer * local, guint session)
+{
+  GstPad *srcpad;
+  gboolean muted;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+  muted = priv->send_muted[session];
+
+  if (priv->capture_srcs[session] == NULL ||
+      muted == (priv->capture_mute_probes[session] != 0))
+    return;
+
+  srcpad = gst_element_get_static_pad (priv->capture_srcs[session], "src");
+  if (muted) {
+    priv->capture_mute_probes[session] = gst_pad_add_probe (srcpad,
+        GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+        drop_buffers, NULL, NULL);
+    GST_DEBUG ("Not sending %s", session == OV_AUDIO_RTP_SESSION ?
+        OV_AUDIO_RTP_SESSION_NAME : OV_VIDEO_RTP_SESSION_NAME);
+  } else {
+    gst_pad_remove_probe (srcpad, priv->capture_mute_probes[session]);
+    priv->capture_mute_probes[session] = 0;
+    GST_DEBUG ("Sending %s again", session == OV_AUDIO_RTP_SESSION ?
+        OV_AUDIO_RTP_SESSION_NAME : OV_VIDEO_RTP_SESSION_NAME);
+    /* Nobody has decoded what we sent before, or they dropped it */
+    if (session == OV_VIDEO_RTP_SESSION)
+      ov_local_peer_send_video_keyframe (local);
+  }
+  gst_object_unref (srcpad);
+}
+
+/* Make the encoders of all the video layers we send start with a keyframe
+ * that has all the headers, so the remotes can start decoding right away */
+void
+ov_local_peer_send_video_keyframe (OvLocalPeer * local)
+{
+  guint ii;
+  GstPad *srcpad;
+  GstStructure *s;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  for (ii = 0; ii < priv->n_active_video_layers; ii++) {
+    s = gst_structure_new ("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN,
+        TRUE, NULL);
+    srcpad = gst_element_get_static_pad (priv->video_layers[ii].pay, "src");
+    gst_pad_send_event (srcpad,
+        gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM, s));
+    gst_object_unref (srcpad);
+  }
+}
+
+/*-- FRAME TIMING --*/
+static OvFrameTimer *
+ov_frame_timer_ref (OvFrameTimer * timer)
+{
+  g_atomic_int_inc (&timer->ref_count);
+  return timer;
+}
+
+void
+ov_frame_timer_unref (OvFrameTimer * timer)
+{
+  if (!g_atomic_int_dec_and_test (&timer->ref_count))
+    return;
+  g_mutex_clear (&timer->lock);
+  g_free (timer);
+}
+
+static GstPadProbeReturn
+on_frame_timer_in (GstPad * pad, GstPadProbeInfo * info, OvFrameTimer * timer)
+{
+  GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+
+  if (!GST_CLOCK_TIME_IS_VALID (pts))
+    return GST_PAD_PROBE_OK;
+
+  /* Frames that never come out (dropped by the element) get overwritten */
+  g_mutex_lock (&timer->lock);
+  timer->pts[timer->next] = pts;
+  timer->start[timer->next] = g_get_monotonic_time ();
+  timer->next = (timer->next + 1) % OV_FRAME_TIMER_SLOTS;
+  g_mutex_unlock (&timer->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+on_frame_timer_out (GstPad * pad, GstPadProbeInfo * info, OvFrameTimer * timer)
+{
+  guint ii;
+  GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+
+  if (!GST_CLOCK_TIME_IS_VALID (pts))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&timer->lock);
+  for (ii = 0; ii < OV_FRAME_TIMER_SLOTS; ii++) {
+    if (timer->pts[ii] != pts)
+      continue;
+    timer->frames++;
+    timer->total_us += g_get_monotonic_time () - timer->start[ii];
+    timer->pts[ii] = GST_CLOCK_TIME_NONE;
+    break;
+  }
+  g_mutex_unlock (&timer->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Times every frame that goes through @element, which must have static sink
+ * and src pads. Returns a ref to the timer, which is kept alive by the pad
+ * probes of @element for as long as that is around. */
+OvFrameTimer *
+ov_element_add_frame_timer (GstElement * element)
+{
+  guint ii;
+  GstPad *pad;
+  OvFrameTimer *timer;
+
+  timer = g_new0 (OvFrameTimer, 1);
+  timer->ref_count = 1;
+  g_mutex_init (&timer->lock);
+  for (ii = 0; ii < OV_FRAME_TIMER_SLOTS; ii++)
+    timer->pts[ii] = GST_CLOCK_TIME_NONE;
+
+  pad = gst_element_get_static_pad (element, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) on_frame_timer_in, ov_frame_timer_ref (timer),
+      (GDestroyNotify) ov_frame_timer_unref);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (element, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) on_frame_timer_out, ov_frame_timer_ref (timer),
+      (GDestroyNotify) ov_frame_timer_unref);
+  gst_object_unref (pad);
+
+  return timer;
+}
+
+/* The number of frames timed so far, and the total time they took */
+void
+ov_frame_timer_get (OvFrameTimer * timer, guint64 * frames,
+    guint64 * total_us)
+{
+  g_mutex_lock (&timer->lock);
+  *frames = timer->frames;
+  *total_us = timer->total_us;
+  g_mutex_unlock (&timer->lock);
+}
@@ -29,6 +29,7 @@
 #define __OV_LOCAL_PEER_SETUP_H__
 
 #include "lib.h"
+#include "lib-priv.h"
 #include "ov-local-peer.h"
 
 G_BEGIN_DECLS
@@ -39,15 +40,34 @@ void      ov_on_gst_bus_error                     (GstBus *bus,
 
 GSocket*  ov_get_socket_for_addr                  (const gchar *addr_s,
                                                    guint port);
+GstElement* ov_rtp_udpsrc_new                     (const gchar *name);
 
 gboolean  ov_local_peer_setup_transmit_pipeline   (OvLocalPeer *local);
 gboolean  ov_local_peer_setup_playback_pipeline   (OvLocalPeer *local);
+gboolean  ov_local_peer_setup_receive_pipeline    (OvLocalPeer *local);
 gboolean  ov_local_peer_setup_comms               (OvLocalPeer *local);
 
 void      ov_local_peer_setup_remote_receive      (OvLocalPeer *local,
                                                    OvRemotePeer *remote);
 void      ov_local_peer_setup_remote_playback     (OvLocalPeer *local,
                                                    OvRemotePeer *remote);
+void      ov_local_peer_remove_remote_shared      (OvLocalPeer *local,
+                                                   OvRemotePeer *remote);
+void      ov_remote_peer_link_video_compositor    (OvRemotePeer *remote);
+void      ov_remote_peer_drop_video               (OvRemotePeer *remote,
+                                                   gboolean drop);
+void      ov_remote_peer_request_video_keyframe   (OvRemotePeer *remote);
+void      ov_remote_peer_stall_video              (OvRemotePeer *remote,
+                                                   gboolean stalled);
+void      ov_local_peer_mute_capture              (OvLocalPeer *local,
+                                                   guint session);
+void      ov_local_peer_send_video_keyframe       (OvLocalPeer *local);
+
+OvFrameTimer* ov_element_add_frame_timer          (GstElement *element);
+void      ov_frame_timer_unref                    (OvFrameTimer *timer);
+void      ov_frame_timer_get                      (OvFrameTimer *timer,
+                                                   guint64 *frames,
+                                                   guint64 *total_us);
 
 G_END_DECLS
 
@@ -27,6 +27,12 @@
 
 #include "utils.h"
 #include "outgoing.h"
+#include "stats.h"
+#include "threads.h"
+#include "trace.h"
+#include "discovery.h"
+#include "devicecaps.h"
+#include "ov-local-peer-setup.h"
 #include "ov-local-peer.h"
 #include "ov-local-peer-priv.h"
 
@@ -53,8 +59,15 @@ enum
   NEGOTIATE_FINISHED,
   NEGOTIATE_ABORTED,
   /* Call */
+  CALL_REMOTE_ADDED,
   CALL_REMOTE_GONE,
   CALL_ALL_REMOTES_GONE,
+  CALL_REMOTE_STALLED,
+  CALL_REMOTE_MUTED,
+  ACTIVE_SPEAKER_CHANGED,
+
+  CONGESTION_CONTROL,
+  CALL_SETUP_TIMING,
   /* Network quality statistics for all remote peers */
   /* FIXME: These should be done via "video-stats" and "audio-stats"
    * props on each OvRemotePeer once that's a GObject like OvLocalPeer */
@@ -112,6 +125,8 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
 
   GST_DEBUG_CATEGORY_INIT (onevideo_debug, "onevideo", 0,
       "OneVideo VoIP library");
+  GST_DEBUG_CATEGORY_INIT (ov_trace_debug, "onevideo-trace", 0,
+      "OneVideo negotiation and call setup timing");
 
   object_class->constructed = ov_local_peer_constructed;
   object_class->dispose = ov_local_peer_dispose;
@@ -251,6 +266,28 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
         G_TYPE_NONE, 1,
         G_TYPE_ERROR);
 
+  /**
+   * OvLocalPeer::call-remote-added:
+   * @local: the local peer
+   * @remote: the #OvPeer that joined the call
+   *
+   * Emitted during a call when a remote peer has joined it. Nothing was
+   * renegotiated for the remotes already in the call, and the new one gets a
+   * keyframe from us as soon as it starts receiving.
+   *
+   * On the peer that negotiated the call, this is emitted after
+   * ov_local_peer_call_add_remote(), from the thread that adds the remote. On
+   * the others, it's emitted from the thread that handles incoming
+   * connections.
+   **/
+  signals[CALL_REMOTE_ADDED] =
+    g_signal_new ("call-remote-added", G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        G_STRUCT_OFFSET (OvLocalPeerClass, call_remote_added),
+        NULL, NULL, NULL,
+        G_TYPE_NONE, 1,
+        OV_TYPE_PEER);
+
   /**
    * OvLocalPeer::call-remote-gone:
    * @local: the local peer
@@ -258,7 +295,7 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
    * @timedout: whether the disconnection was due to a timeout
    *
    * Emitted when a remote peers leaves a call due to a timeout or because of
-   * a call hangup.
+   * a call hangup. See ov_local_peer_set_remote_timeout().
    *
    * This signal is not emitted when either ov_local_peer_call_hangup() or
    * ov_local_peer_remove_remote() is invoked.
@@ -288,6 +325,149 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
         NULL, NULL, NULL,
         G_TYPE_NONE, 0);
 
+  /**
+   * OvLocalPeer::call-remote-stalled:
+   * @local: the local peer
+   * @remote: the #OvPeer whose video stopped or started arriving again
+   * @stalled: whether its video has stopped arriving
+   *
+   * Emitted when a remote that is still in the call stops sending us video
+   * without having muted it, and again when the video comes back. Its video
+   * isn't decoded in the meantime, so the application might want to show
+   * that it's frozen.
+   **/
+  signals[CALL_REMOTE_STALLED] =
+    g_signal_new ("call-remote-stalled", G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        G_STRUCT_OFFSET (OvLocalPeerClass, call_remote_stalled),
+        NULL, NULL, NULL,
+        G_TYPE_NONE, 2,
+        OV_TYPE_PEER,
+        G_TYPE_BOOLEAN);
+
+  /**
+   * OvLocalPeer::call-remote-muted:
+   * @local: the local peer
+   * @remote: the #OvPeer that changed what it sends
+   * @audio_muted: whether it stopped sending audio
+   * @video_muted: whether it stopped sending video
+   *
+   * Emitted when a remote peer in the call tells us that it stopped or started
+   * sending its audio or video with ov_local_peer_set_audio_muted() or
+   * ov_local_peer_set_video_muted(). We stop decoding its video while it's
+   * muted, and ask for a keyframe when it isn't anymore.
+   *
+   * Emitted from the thread that handles incoming connections.
+   **/
+  signals[CALL_REMOTE_MUTED] =
+    g_signal_new ("call-remote-muted", G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        G_STRUCT_OFFSET (OvLocalPeerClass, call_remote_muted),
+        NULL, NULL, NULL,
+        G_TYPE_NONE, 3,
+        OV_TYPE_PEER,
+        G_TYPE_BOOLEAN,
+        G_TYPE_BOOLEAN);
+
+  /**
+   * OvLocalPeer::active-speaker-changed:
+   * @local: the local peer
+   * @remote: (nullable): the #OvPeer that is talking now, or %NULL if nobody
+   * is
+   *
+   * Emitted during a call when a different remote peer becomes the one that
+   * is talking, as measured from the level of the audio we decode from each
+   * of them. The active speaker only changes when it falls silent or another
+   * remote is clearly louder, so this can be used to highlight or enlarge the
+   * video of whoever is talking.
+   *
+   * Emissions of this signal are guaranteed to happen from the main thread.
+   **/
+  signals[ACTIVE_SPEAKER_CHANGED] =
+    g_signal_new ("active-speaker-changed", G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        G_STRUCT_OFFSET (OvLocalPeerClass, active_speaker_changed),
+        NULL, NULL, NULL,
+        G_TYPE_NONE, 1,
+        OV_TYPE_PEER);
+
+  /**
+   * OvLocalPeer::congestion-control:
+   * @local: the local peer
+   * @decision: a #GstStructure describing the decision
+   *
+   * Emitted when congestion control changes the video we are sending in
+   * response to the network conditions reported by remote peers via RTCP. See
+   * ov_local_peer_set_congestion_control(). @decision is named
+   * application/x-ov-congestion-control and has the following fields:
+   *
+   * "action"                 G_TYPE_STRING   one of "decrease-bitrate",
+   *                                          "decrease-framerate",
+   *                                          "decrease-resolution",
+   *                                          "increase-bitrate",
+   *                                          "increase-framerate",
+   *                                          "increase-resolution"
+   * "bitrate"                G_TYPE_UINT     target encoder bitrate in kbit/s
+   * "quality"                G_TYPE_UINT     the #OvVideoQuality now being sent
+   * "packets-fractionlost"   G_TYPE_UINT     highest loss reported by a remote
+   *                                          as an 8-bit fraction
+   * "round-trip"             G_TYPE_UINT     highest round-trip time in
+   *                                          milliseconds
+   *
+   * Emissions of this signal are guaranteed to happen from the main thread.
+   **/
+  signals[CONGESTION_CONTROL] =
+    g_signal_new ("congestion-control", G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        G_STRUCT_OFFSET (OvLocalPeerClass, congestion_control),
+        NULL, NULL, NULL,
+        G_TYPE_NONE, 1,
+        GST_TYPE_STRUCTURE | G_SIGNAL_TYPE_STATIC_SCOPE);
+
+  /**
+   * OvLocalPeer::call-setup-timing:
+   * @local: the local peer
+   * @report: a #GstStructure with the time taken by each phase
+   *
+   * Emitted once per call with how long each phase of negotiation and call
+   * setup took, when ov_local_peer_call_start() has set all pipelines to
+   * PLAYING, or after #OvLocalPeer::negotiate-aborted. Works the same way on
+   * the negotiator and on negotiatees. @report is named
+   * application/x-ov-call-setup-timing and has the following fields:
+   *
+   * "call-id"                G_TYPE_UINT64   the call that was set up
+   * "role"                   G_TYPE_STRING   "negotiator" or "negotiatee"
+   * "aborted"                G_TYPE_BOOLEAN  whether negotiation was aborted
+   * "total"                  G_TYPE_UINT64   microseconds since negotiation
+   *                                          started
+   * "spans"                  GST_TYPE_ARRAY  of #GstStructure named "span",
+   *                                          in the order they started
+   *
+   * Each span has the following fields:
+   *
+   * "phase"                  G_TYPE_STRING   such as "query-caps" or
+   *                                          "receive-setup"
+   * "peer"                   G_TYPE_STRING   id of the remote peer; only
+   *                                          present for per-remote spans
+   * "start"                  G_TYPE_UINT64   microseconds since negotiation
+   *                                          started
+   * "duration"               G_TYPE_UINT64   microseconds
+   * "finished"               G_TYPE_BOOLEAN  FALSE if the phase was still
+   *                                          running when negotiation was
+   *                                          aborted
+   *
+   * Emitted from the thread that called ov_local_peer_call_start(), or the
+   * one that emitted #OvLocalPeer::negotiate-aborted. Every span is also
+   * logged to the "onevideo-trace" debug category at the INFO level.
+   **/
+  signals[CALL_SETUP_TIMING] =
+    g_signal_new ("call-setup-timing", G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        G_STRUCT_OFFSET (OvLocalPeerClass, call_setup_timing),
+        NULL, NULL, NULL,
+        G_TYPE_NONE, 1,
+        GST_TYPE_STRUCTURE | G_SIGNAL_TYPE_STATIC_SCOPE);
+
   /**
    * OvLocalPeer::get-stats:
    * @local: the local peer
@@ -306,6 +486,14 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
    * "bitrate"                G_TYPE_UINT64   bitrate in bits per second
    * "jitter"                 G_TYPE_UINT     estimated jitter (in clock rate units)
    * "packets-fractionlost"   G_TYPE_UINT     total lost packets as an 8-bit fraction
+   * "video-encode-frames"    G_TYPE_UINT64   frames encoded so far, for "video"
+   *                                          only if we encode
+   * "video-encode-time"      G_TYPE_UINT64   total time taken to encode them,
+   *                                          in microseconds
+   * "threads"                GST_TYPE_STRUCTURE  CPU time used so far by each
+   *                                          of our streaming threads that
+   *                                          isn't one of a remote's, in ns,
+   *                                          keyed by element:pad; Linux only
    *
    * The hash table also has one entry each for statistics reported by each
    * receiver (remote peer). The key is the remote peer's id and the value is
@@ -316,6 +504,26 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
    * "packets-fractionlost"   G_TYPE_UINT     lost packets as an 8-bit fraction
    * "round-trip"             G_TYPE_UINT     the round-trip time in milliseconds
    *
+   * These also have fields about the data from that remote which is waiting to
+   * be played back by us:
+   *
+   * "playback-dropped"       G_TYPE_UINT64   buffers dropped because playback
+   *                                          couldn't keep up
+   * "playback-level"         G_TYPE_UINT64   data queued right now, in ns
+   * "playback-max-level"     G_TYPE_UINT64   most data queued during the call,
+   *                                          in ns
+   * "jitterbuffer-latency"   G_TYPE_UINT     how long we wait for late packets
+   *                                          from them, in milliseconds
+   * "video-decoder"          G_TYPE_STRING   name of the element decoding the
+   *                                          video, for "video" only
+   * "video-decode-frames"    G_TYPE_UINT64   frames decoded so far, for "video"
+   *                                          only
+   * "video-decode-time"      G_TYPE_UINT64   total time taken to decode them,
+   *                                          in microseconds
+   * "threads"                GST_TYPE_STRUCTURE  same as for "local", for the
+   *                                          threads receiving and playing
+   *                                          back what the remote sends
+   *
    * Returns: a #GHashTable
    **/
   signals[GET_STATS] =
@@ -339,23 +547,10 @@ ov_local_peer_class_init (OvLocalPeerClass * klass)
   klass->get_stats = GST_DEBUG_FUNCPTR (ov_local_peer_get_stats);
 }
 
-static gboolean
-_ov_gst_can_decode_h264 (void)
-{
-  GstElement *decoder;
-
-  decoder = gst_element_factory_make ("avdec_h264", NULL);
-  if (!decoder)
-    return FALSE;
-
-  g_object_unref (decoder);
-  return TRUE;
-}
-
 static void
 ov_local_peer_init (OvLocalPeer * self)
 {
-  GstCaps *vcaps;
+  GstCaps *acaps, *vcaps;
   OvLocalPeerPrivate *priv = ov_local_peer_get_private (self);
 
   /* Initialize the V4L2 device monitor */
@@ -367,11 +562,17 @@ ov_local_peer_init (OvLocalPeer * self)
   priv->dm = gst_device_monitor_new ();
   gst_device_monitor_add_filter (priv->dm, "Video/Source", vcaps);
   gst_caps_unref (vcaps);
+  priv->device_caps = ov_device_caps_cache_new ();
 
   /* NOTE: GArray and GPtrArray are not thread-safe; we must lock accesses */
   g_rec_mutex_init (&priv->lock);
-  priv->used_ports = g_array_sized_new (FALSE, TRUE, sizeof (guint16), 4);
   priv->remote_peers = g_ptr_array_new ();
+  priv->replied_probes = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, g_free);
+  g_mutex_init (&priv->recv_lock);
+  priv->recv_ssrcs = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->recv_remotes = g_hash_table_new (g_str_hash, g_str_equal);
+  ov_local_peer_threads_init (self);
 
   /*-- Initialize (non-RTP) caps supported by us --*/
   /* NOTE: Caps negotiated/exchanged between peers are always non-RTP caps */
@@ -382,13 +583,31 @@ ov_local_peer_init (OvLocalPeer * self)
 
   /* We will only ever use 48KHz Opus */
   priv->supported_recv_acaps = gst_caps_new_empty_simple (AUDIO_FORMAT_OPUS);
+  /* We can send Opus DTX, and skip it when receiving; only used when all the
+   * receivers of a sender can. See speaker.c */
+  acaps = ov_caps_with_flag (priv->supported_send_acaps, "dtx");
+  gst_caps_unref (priv->supported_send_acaps);
+  priv->supported_send_acaps = acaps;
+  acaps = ov_caps_with_flag (priv->supported_recv_acaps, "dtx");
+  gst_caps_unref (priv->supported_recv_acaps);
+  priv->supported_recv_acaps = acaps;
   /* We require JPEG, and conditionally enable H264 support */
   priv->supported_recv_vcaps = gst_caps_new_empty_simple (VIDEO_FORMAT_JPEG);
-  /* FIXME: All h264 code currently hard-codes avdec_h264. We should be able to
-   * choose between that and openh264 and perhaps hardware decoders. */
-  if (_ov_gst_can_decode_h264 ())
+  if (_ov_gst_get_video_decoder_name (OV_VIDEO_FORMAT_H264) != NULL)
     gst_caps_append (priv->supported_recv_vcaps,
         gst_caps_new_empty_simple (VIDEO_FORMAT_H264));
+  /* Tell senders how we can repair lost video packets */
+  vcaps = ov_caps_with_rtp_repair (priv->supported_recv_vcaps,
+      _ov_gst_get_rtp_repair (FALSE));
+  gst_caps_unref (priv->supported_recv_vcaps);
+  priv->supported_recv_vcaps = vcaps;
+
+  /* Simulcast is off by default */
+  priv->n_video_layers = 1;
+  priv->keyframe_interval = OV_DEFAULT_KEYFRAME_INTERVAL;
+  priv->remote_timeout = OV_DEFAULT_REMOTE_TIMEOUT_MS;
+  /* Congestion control is on by default */
+  priv->cc.enabled = TRUE;
 
   priv->state = OV_LOCAL_STATE_NULL;
 }
@@ -397,6 +616,7 @@ static void
 ov_local_peer_constructed (GObject * object)
 {
   guint16 tcp_port;
+  gchar *addr_s;
   GInetSocketAddress *addr;
   OvLocalPeerPrivate *priv = ov_local_peer_get_private (OV_LOCAL_PEER (object));
 
@@ -405,6 +625,17 @@ ov_local_peer_constructed (GObject * object)
   tcp_port = g_inet_socket_address_get_port (addr);
   priv->recv_rtcp_ports[0] = tcp_port + 1;
   priv->recv_rtcp_ports[1] = tcp_port + 2;
+  /* With a shared receive pipeline, all remotes send to the first set of
+   * ports that would otherwise be given to a single remote */
+  priv->shared_recv_ports[0] = tcp_port + 3;
+  priv->shared_recv_ports[1] = tcp_port + 4;
+  priv->shared_recv_ports[2] = tcp_port + 5;
+  priv->shared_recv_ports[3] = tcp_port + 6;
+  /* Otherwise, each remote gets a set of 4 ports from there onwards */
+  addr_s =
+    g_inet_address_to_string (g_inet_socket_address_get_address (addr));
+  priv->socket_pool = ov_socket_pool_new (addr_s, tcp_port + 3);
+  g_free (addr_s);
   g_object_unref (addr);
 }
 
@@ -414,6 +645,7 @@ ov_local_peer_dispose (GObject * object)
   OvLocalPeerPrivate *priv = ov_local_peer_get_private (OV_LOCAL_PEER (object));
 
   g_clear_object (&priv->dm);
+  ov_stats_unsubscribe_all (OV_LOCAL_PEER (object));
 
   g_clear_object (&priv->tcp_server);
   g_clear_pointer (&priv->mc_socket_source, g_source_destroy);
@@ -424,10 +656,17 @@ ov_local_peer_dispose (GObject * object)
   g_clear_pointer (&priv->supported_recv_vcaps, gst_caps_unref);
   g_clear_pointer (&priv->send_acaps, gst_caps_unref);
   g_clear_pointer (&priv->send_vcaps, gst_caps_unref);
+  g_clear_pointer (&priv->multicast_group, g_free);
+  g_clear_pointer (&priv->active_speaker, g_free);
+  g_clear_pointer (&priv->record_dir, g_free);
 
   g_clear_object (&priv->transmit_vcapsfilter);
   g_clear_object (&priv->transmit);
+  g_clear_pointer (&priv->warm_acaps, gst_caps_unref);
+  g_clear_pointer (&priv->warm_vcaps, gst_caps_unref);
   g_clear_object (&priv->playback);
+  g_clear_object (&priv->receive);
+  g_clear_pointer (&priv->call_trace, ov_call_trace_free);
 
   G_OBJECT_CLASS (ov_local_peer_parent_class)->dispose (object);
 }
@@ -439,10 +678,16 @@ ov_local_peer_finalize (GObject * object)
 
   GST_DEBUG ("Freeing local peer");
   g_rec_mutex_clear (&priv->lock);
+  g_mutex_clear (&priv->recv_lock);
+  g_hash_table_unref (priv->recv_ssrcs);
+  g_hash_table_unref (priv->recv_remotes);
+  ov_local_peer_threads_clear (OV_LOCAL_PEER (object));
   g_ptr_array_free (priv->remote_peers, TRUE);
   g_list_free_full (priv->mc_ifaces, g_free);
-  g_array_free (priv->used_ports, TRUE);
+  ov_socket_pool_free (priv->socket_pool);
+  g_hash_table_unref (priv->replied_probes);
   g_free (priv->iface);
+  ov_device_caps_cache_free (priv->device_caps);
 
   G_OBJECT_CLASS (ov_local_peer_parent_class)->finalize (object);
 }
@@ -513,6 +758,9 @@ void
 ov_local_peer_set_state (OvLocalPeer * self, OvLocalPeerState state)
 {
   OvLocalPeerPrivate *priv = ov_local_peer_get_private (self);
+  /* Being available for calls again is news to those looking for peers */
+  if (state == OV_LOCAL_STATE_STARTED && priv->state != state)
+    ov_local_peer_announce_presence (self);
   priv->state = state;
 }
 
@@ -678,6 +926,63 @@ out:
   return TRUE;
 }
 
+/* Negotiates with @remote alone and adds it to the call that we negotiated and
+ * are in, taking ownership of @remote. The remotes already in the call
+ * only add it to what they send to and receive from, so none of their streams
+ * change; see ov_local_peer_add_remote_thread(). Once it has been added,
+ * OvLocalPeer::call-remote-added is emitted. If it can't be, for instance
+ * because it can't decode what someone in the call is sending,
+ * OvLocalPeer::negotiate-skipped-remote is emitted and @remote is freed.
+ * If we can't add remotes to this call at all, FALSE is returned and @remote
+ * is freed right away.
+ *
+ * Remotes leave the call on their own with ov_local_peer_call_hangup(). */
+gboolean
+ov_local_peer_call_add_remote (OvLocalPeer * local, OvRemotePeer * remote)
+{
+  guint ii;
+  GTask *task;
+  OvLocalPeerState state;
+  OvLocalPeerPrivate *priv;
+  gboolean ret = FALSE;
+
+  ov_local_peer_lock (local);
+  priv = ov_local_peer_get_private (local);
+
+  state = ov_local_peer_get_state (local);
+  if (!(state & (OV_LOCAL_STATE_PLAYING | OV_LOCAL_STATE_PAUSED))) {
+    GST_ERROR ("State is %u instead of PLAYING or PAUSED", state);
+    goto out;
+  }
+
+  if (priv->relay) {
+    GST_ERROR ("Remotes can't be added to a call that we're relaying");
+    goto out;
+  }
+
+  /* Only the negotiator knows what everyone can receive */
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    OvRemotePeer *that = g_ptr_array_index (priv->remote_peers, ii);
+    if (that->priv->offered_recv_caps[0] == NULL) {
+      GST_ERROR ("Only the peer that negotiated the call can add remotes");
+      goto out;
+    }
+  }
+
+  task = g_task_new (local, NULL, NULL, NULL);
+  g_task_set_task_data (task, remote, NULL);
+  g_task_run_in_thread (task,
+      (GTaskThreadFunc) ov_local_peer_add_remote_thread);
+  g_object_unref (task);
+
+  ret = TRUE;
+out:
+  if (!ret)
+    ov_remote_peer_free (remote);
+  ov_local_peer_unlock (local);
+  return ret;
+}
+
 /*~~ Call Properties ~~*/
 
 void
@@ -766,6 +1071,45 @@ ov_gst_structure_free (GstStructure * s)
   gst_structure_free (s);
 }
 
+/* Where latency builds up between the receive and playback pipelines */
+static void
+ov_remote_peer_add_playback_stats (OvRemotePeer * remote, guint session,
+    GstStructure * stats)
+{
+  guint64 dropped, level, max_level;
+  GstElement *proxysrc;
+
+  if (session == OV_AUDIO_RTP_SESSION)
+    proxysrc = remote->priv->audio_proxysrc;
+  else
+    proxysrc = remote->priv->video_proxysrc;
+
+  if (proxysrc == NULL)
+    return;
+
+  g_object_get (proxysrc, "dropped", &dropped, "current-level-time", &level,
+      "max-level-time", &max_level, NULL);
+  gst_structure_set (stats, "playback-dropped", G_TYPE_UINT64, dropped,
+      "playback-level", G_TYPE_UINT64, level,
+      "playback-max-level", G_TYPE_UINT64, max_level, NULL);
+
+  gst_structure_set (stats, "jitterbuffer-latency", G_TYPE_UINT,
+      remote->priv->latency, NULL);
+
+  if (session == OV_VIDEO_RTP_SESSION && remote->priv->vdecode != NULL)
+    gst_structure_set (stats, "video-decoder", G_TYPE_STRING,
+        GST_OBJECT_NAME (gst_element_get_factory (remote->priv->vdecode)),
+        NULL);
+
+  if (session == OV_VIDEO_RTP_SESSION && remote->priv->decode_timer != NULL) {
+    guint64 frames, total_us;
+
+    ov_frame_timer_get (remote->priv->decode_timer, &frames, &total_us);
+    gst_structure_set (stats, "video-decode-frames", G_TYPE_UINT64, frames,
+        "video-decode-time", G_TYPE_UINT64, total_us, NULL);
+  }
+}
+
 static GHashTable *
 ov_local_peer_get_stats (OvLocalPeer * local, const gchar * media_type)
 {
@@ -800,6 +1144,17 @@ ov_local_peer_get_stats (OvLocalPeer * local, const gchar * media_type)
 
   stats = ov_local_peer_get_stats_from_ssrc (rtpsession, priv->ssrcs[session]);
 
+  if (stats != NULL && session == OV_VIDEO_RTP_SESSION &&
+      priv->encode_timer != NULL) {
+    guint64 frames, total_us;
+
+    ov_frame_timer_get (priv->encode_timer, &frames, &total_us);
+    gst_structure_set (stats, "video-encode-frames", G_TYPE_UINT64, frames,
+        "video-encode-time", G_TYPE_UINT64, total_us, NULL);
+  }
+  if (stats != NULL)
+    ov_local_peer_add_thread_stats (local, NULL, stats);
+
   statistics = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
       (GDestroyNotify) ov_gst_structure_free);
   g_hash_table_insert (statistics, g_strdup ("local"), stats);
@@ -812,6 +1167,10 @@ ov_local_peer_get_stats (OvLocalPeer * local, const gchar * media_type)
 
     stats = ov_local_peer_get_stats_from_ssrc (rtpsession,
         remote->priv->ssrcs[session]);
+    if (stats != NULL) {
+      ov_remote_peer_add_playback_stats (remote, session, stats);
+      ov_local_peer_add_thread_stats (local, remote, stats);
+    }
     g_hash_table_insert (statistics, remote_id, stats);
   }
 
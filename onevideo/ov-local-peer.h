@@ -37,6 +37,12 @@
 G_BEGIN_DECLS
 
 #define OV_DEFAULT_COMM_PORT 5000
+/* Frames between the periodic keyframes of the H.264 that we encode; see
+ * ov_local_peer_set_keyframe_interval() */
+#define OV_DEFAULT_KEYFRAME_INTERVAL 300
+/* Milliseconds without hearing from a remote after which it's removed from
+ * the call; see ov_local_peer_set_remote_timeout() */
+#define OV_DEFAULT_REMOTE_TIMEOUT_MS 3000
 
 #define OV_TYPE_LOCAL_PEER ov_local_peer_get_type ()
 G_DECLARE_DERIVABLE_TYPE (OvLocalPeer, ov_local_peer, OV, LOCAL_PEER, OvPeer)
@@ -72,8 +78,26 @@ struct _OvLocalPeerClass {
   GHashTable* (*get_stats)          (OvLocalPeer *local,
                                      const gchar *media_type);
 
-  /* Padding to allow up to 12 new virtual functions without breaking ABI */
-  gpointer padding[12];
+  /* signals added since; after the action signals so that the offsets of
+   * the members above don't change */
+  void (*congestion_control)        (OvLocalPeer *local,
+                                     GstStructure *decision);
+  void (*call_setup_timing)         (OvLocalPeer *local,
+                                     GstStructure *report);
+  void (*active_speaker_changed)    (OvLocalPeer *local,
+                                     OvPeer *remote);
+  void (*call_remote_muted)         (OvLocalPeer *local,
+                                     OvPeer *remote,
+                                     gboolean audio_muted,
+                                     gboolean video_muted);
+  void (*call_remote_added)         (OvLocalPeer *local,
+                                     OvPeer *remote);
+  void (*call_remote_stalled)       (OvLocalPeer *local,
+                                     OvPeer *remote,
+                                     gboolean stalled);
+
+  /* Padding to allow up to 6 new virtual functions without breaking ABI */
+  gpointer padding[6];
 };
 
 enum _OvLocalPeerState {
@@ -0,0 +1,246 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "recording.h"
+#include "threads.h"
+
+/* Records calls without transcoding anything. What we encode and what the
+ * remotes send us is already compressed, so a tee in front of our payloaders
+ * and behind the depayloaders of each remote sends it to a splitmuxsink that
+ * muxes it into Matroska files of about OV_RECORDING_FRAGMENT_TIME each,
+ * starting a new file at the next keyframe. All our pipelines run on the
+ * system clock with a base time of 0, and rtpbin maps the RTP timestamps of
+ * each remote to that running time with the RTCP SRs, so the timestamps in
+ * all the files of a call are on the same timeline.
+ *
+ * The branch to the muxer starts with a leaky queue, so it runs in a thread
+ * of its own with OV_THREAD_ROLE_RECORDING, and a disk that can't keep up
+ * loses recorded data instead of holding up the call. When the call ends, the
+ * branches and the muxer are kept running with their state locked while the
+ * pipeline stops, and a thread waits for the file to be finished before it
+ * stops them, so nobody waits for the disk with the lock taken. */
+
+/* Length of each file */
+#define OV_RECORDING_FRAGMENT_TIME      (60 * GST_SECOND)
+/* Data queued for the muxer before we drop the oldest */
+#define OV_RECORDING_MAX_QUEUED         (2 * GST_SECOND)
+/* How long we wait for the file being written to be finished on stopping */
+#define OV_RECORDING_STOP_TIMEOUT       (1 * G_TIME_SPAN_SECOND)
+
+/* Called from a streaming thread. splitmuxsink sends EOS to the sink at the
+ * end of every file, so this only tells us that it has finished writing the
+ * last one when we're stopping. */
+static GstPadProbeReturn
+on_recording_sink_eos (GstPad * pad, GstPadProbeInfo * info,
+    OvRecording * recording)
+{
+  if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) != GST_EVENT_EOS)
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&recording->lock);
+  if (recording->stopping) {
+    recording->finished = TRUE;
+    g_cond_signal (&recording->cond);
+  }
+  g_mutex_unlock (&recording->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Adds a muxer to @bin that writes files named after @id into @directory.
+ * Returns NULL if that isn't possible. */
+OvRecording *
+ov_recording_new (GstElement * bin, const gchar * directory, const gchar * id)
+{
+  gchar *name, *stamp, *location;
+  GDateTime *now;
+  GstElement *splitmux, *muxer, *sink;
+  GstPad *sinkpad;
+  OvRecording *recording;
+
+  splitmux = gst_element_factory_make ("splitmuxsink", NULL);
+  muxer = gst_element_factory_make ("matroskamux", NULL);
+  sink = gst_element_factory_make ("filesink", NULL);
+  if (splitmux == NULL || muxer == NULL || sink == NULL) {
+    GST_ERROR ("Unable to record: splitmuxsink, matroskamux or filesink is "
+        "missing");
+    g_clear_object (&splitmux);
+    g_clear_object (&muxer);
+    g_clear_object (&sink);
+    return NULL;
+  }
+
+  recording = g_new0 (OvRecording, 1);
+  g_mutex_init (&recording->lock);
+  g_cond_init (&recording->cond);
+  recording->bin = bin;
+  recording->splitmux = splitmux;
+  recording->elements = g_ptr_array_new_with_free_func (gst_object_unref);
+  g_ptr_array_add (recording->elements, gst_object_ref (splitmux));
+
+  /* The id goes into a pattern for g_strdup_printf() and a path */
+  name = g_strdup (id);
+  g_strdelimit (name, "%/\\", '_');
+  now = g_date_time_new_now_local ();
+  stamp = g_date_time_format (now, "%Y%m%d-%H%M%S");
+  g_date_time_unref (now);
+  location = g_strdup_printf ("%s" G_DIR_SEPARATOR_S "%s-%s-%%05d.mkv",
+      directory, stamp, name);
+  g_free (stamp);
+  g_free (name);
+
+  g_object_set (splitmux, "location", location, "max-size-time",
+      OV_RECORDING_FRAGMENT_TIME, "muxer", muxer, "sink", sink, NULL);
+  /* Whatever splitmuxsink does in threads of its own can wait too */
+  ov_element_set_thread_role (splitmux, OV_THREAD_ROLE_RECORDING);
+  gst_bin_add (GST_BIN (bin), splitmux);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      (GstPadProbeCallback) on_recording_sink_eos, recording, NULL);
+  gst_object_unref (sinkpad);
+
+  GST_INFO ("Recording %s to %s", id, location);
+  g_free (location);
+  return recording;
+}
+
+/* Links @upstream to @downstream, through a tee that also sends what passes
+ * to the muxer of @recording as the stream of @session if @recording isn't
+ * NULL. @parser_name is the parser that the muxer needs in front of it for
+ * the stream, if any. */
+gboolean
+ov_recording_link (OvRecording * recording, guint session,
+    GstElement * upstream, GstElement * downstream,
+    const gchar * parser_name)
+{
+  gboolean ret;
+  GstElement *tee, *queue, *parser;
+
+  if (recording == NULL)
+    return gst_element_link (upstream, downstream);
+
+  g_assert (OV_RTP_SESSION_IS_VALID (session));
+  g_assert (recording->sinkpads[session] == NULL);
+
+  tee = gst_element_factory_make ("tee", NULL);
+  queue = gst_element_factory_make ("queue", NULL);
+  g_object_set (queue, "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0,
+      "max-size-time", OV_RECORDING_MAX_QUEUED, NULL);
+  ov_element_set_thread_role (queue, OV_THREAD_ROLE_RECORDING);
+  parser = parser_name != NULL ?
+    gst_element_factory_make (parser_name, NULL) : NULL;
+  if (parser == NULL)
+    parser = gst_element_factory_make ("identity", NULL);
+
+  gst_bin_add_many (GST_BIN (recording->bin), tee, queue, parser, NULL);
+  g_ptr_array_add (recording->elements, gst_object_ref (queue));
+  g_ptr_array_add (recording->elements, gst_object_ref (parser));
+
+  ret = gst_element_link_many (upstream, tee, downstream, NULL) &&
+    gst_element_link_many (tee, queue, parser, NULL) &&
+    gst_element_link_pads (parser, "src", recording->splitmux,
+        session == OV_VIDEO_RTP_SESSION ? "video" : "audio_%u");
+
+  recording->sinkpads[session] = gst_element_get_static_pad (queue, "sink");
+  return ret;
+}
+
+static gpointer
+ov_recording_finish_thread (OvRecording * recording)
+{
+  guint ii;
+  gint64 end_time;
+
+  end_time = g_get_monotonic_time () + OV_RECORDING_STOP_TIMEOUT;
+  g_mutex_lock (&recording->lock);
+  while (!recording->finished)
+    if (!g_cond_wait_until (&recording->cond, &recording->lock, end_time)) {
+      GST_WARNING ("Timed out finishing the recording");
+      break;
+    }
+  g_mutex_unlock (&recording->lock);
+
+  for (ii = 0; ii < recording->elements->len; ii++)
+    gst_element_set_state (g_ptr_array_index (recording->elements, ii),
+        GST_STATE_NULL);
+  ov_recording_free (recording);
+
+  return NULL;
+}
+
+/* Finishes the file being written, and takes ownership of @recording. Must be
+ * called before the pipeline that the recording is in stops. Doesn't wait for
+ * the file to be finished; that's done in a thread of its own, which gives up
+ * after OV_RECORDING_STOP_TIMEOUT. */
+void
+ov_recording_stop (OvRecording * recording)
+{
+  guint ii;
+  gboolean sent = FALSE;
+
+  g_mutex_lock (&recording->lock);
+  recording->stopping = TRUE;
+  g_mutex_unlock (&recording->lock);
+
+  /* What's still queued is written out first. Sending a serialized event to a
+   * sink pad takes its stream lock, so this doesn't race with the buffers
+   * that the tee is pushing. */
+  for (ii = 0; ii < G_N_ELEMENTS (recording->sinkpads); ii++)
+    if (recording->sinkpads[ii] != NULL &&
+        gst_pad_send_event (recording->sinkpads[ii], gst_event_new_eos ()))
+      sent = TRUE;
+
+  /* Nothing is going to get to the muxer if the pipeline isn't running */
+  if (!sent) {
+    ov_recording_free (recording);
+    return;
+  }
+
+  /* The pipeline stopping must not stop them before the EOS gets through */
+  for (ii = 0; ii < recording->elements->len; ii++)
+    gst_element_set_locked_state (g_ptr_array_index (recording->elements, ii),
+        TRUE);
+
+  g_thread_unref (g_thread_new ("ov-recording-stop",
+        (GThreadFunc) ov_recording_finish_thread, recording));
+}
+
+void
+ov_recording_free (OvRecording * recording)
+{
+  guint ii;
+
+  for (ii = 0; ii < G_N_ELEMENTS (recording->sinkpads); ii++)
+    g_clear_object (&recording->sinkpads[ii]);
+  g_ptr_array_unref (recording->elements);
+  g_mutex_clear (&recording->lock);
+  g_cond_clear (&recording->cond);
+  g_free (recording);
+}
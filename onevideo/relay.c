@@ -0,0 +1,197 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "relay.h"
+#include "ov-local-peer-setup.h"
+#include "ov-local-peer-priv.h"
+
+/* When we're a relay, every remote sends its RTP only to us and we forward
+ * each packet as-is to the other remotes, on the ports that they allocated
+ * to receive from it. Nothing is depayloaded or decoded, so each remote only
+ * needs a udpsrc and a multiudpsink per media type in its receive pipeline.
+ *
+ * The RTCP isn't relayed: it's small, and the remotes still send it to each
+ * other directly, so the SRs that lip-sync and statistics rely on and the
+ * RRs and NACKs that congestion control and retransmission rely on all
+ * reach the peer they're about. */
+
+/* Called from the streaming thread of the udpsrc */
+static GstPadProbeReturn
+on_relay_rtp_buffer (GstPad * pad, GstPadProbeInfo * info,
+    OvRemotePeer * remote)
+{
+  /* We don't have an rtpbin to tell us that the remote is active, so it's
+   * only timed out; see ov_remote_peer_watch_liveness() */
+  remote->last_seen = g_get_monotonic_time ();
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+ov_remote_peer_setup_relay (OvRemotePeer * remote)
+{
+  guint ii;
+  gpointer key, value;
+  GHashTableIter iter;
+  GString *clients;
+  GSocket *socket;
+  GstPad *srcpad;
+  GstElement *src, *sink;
+  GstStateChangeReturn ret;
+  OvLocalPeerPrivate *local_priv;
+
+  local_priv = ov_local_peer_get_private (remote->local);
+
+  /* {audio, video}; their RTP ports are 0 and 2 in recv_ports */
+  for (ii = 0; ii < 2; ii++) {
+    clients = g_string_new ("");
+    if (remote->priv->relay_dests != NULL) {
+      g_hash_table_iter_init (&iter, remote->priv->relay_dests);
+      while (g_hash_table_iter_next (&iter, &key, &value)) {
+        OvRemotePeer *to = key;
+        guint16 *ports = value;
+        gchar *addr_s;
+
+        addr_s = g_inet_address_to_string (
+            g_inet_socket_address_get_address (to->addr));
+        g_string_append_printf (clients, "%s:%u,", addr_s, ports[ii]);
+        g_free (addr_s);
+      }
+    }
+
+    socket = ov_socket_pool_get_socket (local_priv->socket_pool,
+        remote->priv->recv_ports[ii * 2]);
+    src = ov_rtp_udpsrc_new (NULL);
+    g_object_set (src, "socket", socket, NULL);
+    g_object_unref (socket);
+    sink = gst_element_factory_make ("multiudpsink", NULL);
+    g_object_set (sink, "clients", clients->str, "sync", FALSE, "async", FALSE,
+        "enable-last-sample", FALSE, NULL);
+    if (ii == 1) {
+      g_object_set (src, "buffer-size", OV_VIDEO_RECV_BUFSIZE, NULL);
+      g_object_set (sink, "buffer-size", OV_VIDEO_SEND_BUFSIZE, NULL);
+    }
+
+    gst_bin_add_many (GST_BIN (remote->receive), src, sink, NULL);
+    if (!gst_element_link (src, sink))
+      g_assert_not_reached ();
+
+    srcpad = gst_element_get_static_pad (src, "src");
+    gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+        (GstPadProbeCallback) on_relay_rtp_buffer, remote, NULL);
+    gst_object_unref (srcpad);
+
+    remote->priv->relay_sinks[ii] = sink;
+    GST_DEBUG ("Relaying %s of %s to %s",
+        ii == 0 ? OV_AUDIO_RTP_SESSION_NAME : OV_VIDEO_RTP_SESSION_NAME,
+        remote->addr_s, clients->str);
+    g_string_free (clients, TRUE);
+  }
+
+  ret = gst_element_set_state (remote->receive, GST_STATE_PLAYING);
+  if (ret == GST_STATE_CHANGE_FAILURE) {
+    GST_ERROR ("Unable to relay from %s; state change failed",
+        remote->addr_s);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Start forwarding instead of transmitting, receiving and playing back
+ * anything ourselves */
+gboolean
+ov_local_peer_relay_start (OvLocalPeer * local)
+{
+  guint ii;
+  OvRemotePeer *remote;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    remote = g_ptr_array_index (priv->remote_peers, ii);
+    ov_remote_peer_watch_liveness (remote);
+    if (!ov_remote_peer_setup_relay (remote))
+      return FALSE;
+    remote->state = OV_REMOTE_STATE_PLAYING;
+  }
+
+  GST_DEBUG ("Relaying between %u remotes", priv->remote_peers->len);
+  return TRUE;
+}
+
+/* Stop forwarding to @remote, which has just been removed from the call */
+void
+ov_local_peer_relay_remove_remote (OvLocalPeer * local, OvRemotePeer * remote)
+{
+  guint ii, jj;
+  guint16 *ports;
+  gchar *addr_only;
+  OvRemotePeer *from;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  addr_only = g_inet_address_to_string (
+      g_inet_socket_address_get_address (remote->addr));
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    from = g_ptr_array_index (priv->remote_peers, ii);
+    if (from->priv->relay_dests == NULL)
+      continue;
+
+    ports = g_hash_table_lookup (from->priv->relay_dests, remote);
+    if (ports == NULL)
+      continue;
+
+    /* Not set if we haven't started relaying yet */
+    for (jj = 0; jj < 2; jj++)
+      if (from->priv->relay_sinks[jj] != NULL)
+        g_signal_emit_by_name (from->priv->relay_sinks[jj], "remove",
+            addr_only, ports[jj]);
+    g_hash_table_remove (from->priv->relay_dests, remote);
+  }
+  g_free (addr_only);
+}
+
+/* While negotiating, remember that we forward the RTP of @from to @to on
+ * these ports */
+void
+ov_remote_peer_relay_add_dest (OvRemotePeer * from, OvRemotePeer * to,
+    guint16 aport, guint16 vport)
+{
+  guint16 *ports;
+
+  if (from->priv->relay_dests == NULL)
+    from->priv->relay_dests = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  ports = g_new (guint16, 2);
+  ports[0] = aport;
+  ports[1] = vport;
+  g_hash_table_insert (from->priv->relay_dests, to, ports);
+}
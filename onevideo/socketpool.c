@@ -0,0 +1,350 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "socketpool.h"
+#include "ov-local-peer-setup.h"
+
+#include <gio/gnetworking.h>
+
+/* Every remote that we receive from with its own pipeline gets a slot of 4
+ * contiguous ports after the RTCP recv ports: audio RTP, audio RTCP, video RTP
+ * and video RTCP. The sockets of a few slots are bound in the background ahead
+ * of time, so a new remote gets ports that are known to be free, and whose
+ * sockets are ready to be used when its receive pipeline is set up. */
+
+#define OV_SOCKET_POOL_MAX_SLOTS 256
+/* How many slots are kept bound ahead of being needed */
+#define OV_SOCKET_POOL_N_SPARE 2
+
+typedef struct _OvSocketSlot OvSocketSlot;
+
+struct _OvSocketSlot {
+  guint index;
+  /* NULL once it's been taken by ov_socket_pool_get_socket() */
+  GSocket *sockets[4];
+};
+
+struct _OvSocketPool {
+  /* Protects everything below, since slots are bound from the refill thread */
+  GMutex lock;
+  gchar *addr_s;
+  guint16 base_port;
+  /* A set bit means that the slot has been reserved, has been bound as
+   * a spare, or that something else on the system is using its ports */
+  guint32 used[OV_SOCKET_POOL_MAX_SLOTS / 32];
+  /* Slots that have been bound, but not reserved yet */
+  GQueue spares;
+  /* Reserved slots; index -> OvSocketSlot* */
+  GHashTable *reserved;
+  /* Binds spares in the background; NULL while stopped */
+  GThreadPool *refill;
+  gboolean refill_queued;
+};
+
+static void
+ov_socket_slot_free (OvSocketSlot * slot)
+{
+  guint ii;
+
+  for (ii = 0; ii < 4; ii++)
+    g_clear_object (&slot->sockets[ii]);
+  g_free (slot);
+}
+
+/* Called with the lock TAKEN. Returns -1 if all the slots are used. */
+static gint
+ov_socket_pool_take_free_index (OvSocketPool * pool)
+{
+  guint ii;
+  gint bit;
+
+  for (ii = 0; ii < G_N_ELEMENTS (pool->used); ii++) {
+    if (pool->used[ii] == G_MAXUINT32)
+      continue;
+    bit = g_bit_nth_lsf (~pool->used[ii], -1);
+    pool->used[ii] |= 1u << bit;
+    return ii * 32 + bit;
+  }
+
+  return -1;
+}
+
+/* Called with the lock TAKEN */
+static void
+ov_socket_pool_clear_index (OvSocketPool * pool, guint index)
+{
+  pool->used[index / 32] &= ~(1u << (index % 32));
+}
+
+static GSocket *
+ov_socket_pool_bind (OvSocketPool * pool, guint16 port, gboolean video_rtp)
+{
+  GSocket *socket;
+  GError *error = NULL;
+  GSocketAddress *sock_addr;
+
+  sock_addr = g_inet_socket_address_new_from_string (pool->addr_s, port);
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+      G_SOCKET_PROTOCOL_UDP, &error);
+  if (socket == NULL)
+    goto err;
+
+  /* Not allowing reuse is what tells us if something else has the port */
+  if (!g_socket_bind (socket, sock_addr, FALSE, &error))
+    goto err;
+  /* ...but later binds of the same port by ov_get_socket_for_addr() when the
+   * pipeline is set up again must still work */
+  g_socket_set_option (socket, SOL_SOCKET, SO_REUSEADDR, 1, NULL);
+
+  /* udpsrc sets this too, but only once the pipeline is starting */
+  if (video_rtp && !g_socket_set_option (socket, SOL_SOCKET, SO_RCVBUF,
+        OV_VIDEO_RECV_BUFSIZE, &error)) {
+    GST_WARNING ("Unable to set the receive buffer size of port %u: %s", port,
+        error->message);
+    g_clear_error (&error);
+  }
+
+out:
+  g_object_unref (sock_addr);
+  return socket;
+err:
+  GST_DEBUG ("Unable to bind port %u: %s", port, error->message);
+  g_clear_object (&socket);
+  g_error_free (error);
+  goto out;
+}
+
+/* Returns a slot with all its sockets bound, or NULL if none is free */
+static OvSocketSlot *
+ov_socket_pool_bind_slot (OvSocketPool * pool)
+{
+  gint index;
+  guint ii, port;
+  OvSocketSlot *slot;
+
+  while (TRUE) {
+    g_mutex_lock (&pool->lock);
+    index = ov_socket_pool_take_free_index (pool);
+    g_mutex_unlock (&pool->lock);
+    if (index < 0)
+      return NULL;
+
+    port = pool->base_port + index * 4;
+    if (port + 3 > G_MAXUINT16) {
+      g_mutex_lock (&pool->lock);
+      ov_socket_pool_clear_index (pool, index);
+      g_mutex_unlock (&pool->lock);
+      return NULL;
+    }
+
+    slot = g_new0 (OvSocketSlot, 1);
+    slot->index = index;
+    for (ii = 0; ii < 4; ii++) {
+      slot->sockets[ii] = ov_socket_pool_bind (pool, port + ii, ii == 2);
+      if (slot->sockets[ii] == NULL)
+        break;
+    }
+    if (ii == 4)
+      return slot;
+
+    /* The slot stays used, so we don't try its ports again */
+    GST_WARNING ("Ports %u to %u are in use, skipping them", port, port + 3);
+    ov_socket_slot_free (slot);
+  }
+}
+
+static void
+ov_socket_pool_refill_func (gpointer data G_GNUC_UNUSED, OvSocketPool * pool)
+{
+  OvSocketSlot *slot;
+
+  g_mutex_lock (&pool->lock);
+  pool->refill_queued = FALSE;
+  while (pool->spares.length < OV_SOCKET_POOL_N_SPARE) {
+    g_mutex_unlock (&pool->lock);
+    slot = ov_socket_pool_bind_slot (pool);
+    g_mutex_lock (&pool->lock);
+    if (slot == NULL)
+      break;
+    g_queue_push_tail (&pool->spares, slot);
+    GST_DEBUG ("Bound spare ports %u to %u", pool->base_port + slot->index * 4,
+        pool->base_port + slot->index * 4 + 3);
+  }
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Called with the lock TAKEN */
+static void
+ov_socket_pool_queue_refill (OvSocketPool * pool)
+{
+  if (pool->refill == NULL || pool->refill_queued)
+    return;
+  pool->refill_queued = TRUE;
+  /* The data is unused, but it can't be NULL */
+  g_thread_pool_push (pool->refill, pool, NULL);
+}
+
+/* @base_port is the first port of the first slot */
+OvSocketPool *
+ov_socket_pool_new (const gchar * addr_s, guint16 base_port)
+{
+  OvSocketPool *pool;
+
+  pool = g_new0 (OvSocketPool, 1);
+  g_mutex_init (&pool->lock);
+  pool->addr_s = g_strdup (addr_s);
+  pool->base_port = base_port;
+  g_queue_init (&pool->spares);
+  pool->reserved = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) ov_socket_slot_free);
+
+  return pool;
+}
+
+void
+ov_socket_pool_free (OvSocketPool * pool)
+{
+  ov_socket_pool_stop (pool);
+  g_hash_table_unref (pool->reserved);
+  g_free (pool->addr_s);
+  g_mutex_clear (&pool->lock);
+  g_free (pool);
+}
+
+/* Start keeping spare slots bound */
+void
+ov_socket_pool_start (OvSocketPool * pool)
+{
+  g_mutex_lock (&pool->lock);
+  if (pool->refill == NULL)
+    pool->refill = g_thread_pool_new (
+        (GFunc) ov_socket_pool_refill_func, pool, 1, FALSE, NULL);
+  ov_socket_pool_queue_refill (pool);
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Stop keeping spare slots bound, and free the ones that are. Reserved slots
+ * are kept until they are released. */
+void
+ov_socket_pool_stop (OvSocketPool * pool)
+{
+  GThreadPool *refill;
+  OvSocketSlot *slot;
+
+  g_mutex_lock (&pool->lock);
+  refill = pool->refill;
+  pool->refill = NULL;
+  pool->refill_queued = FALSE;
+  g_mutex_unlock (&pool->lock);
+
+  /* Wait for the refill thread, which takes the lock */
+  if (refill != NULL)
+    g_thread_pool_free (refill, TRUE, TRUE);
+
+  g_mutex_lock (&pool->lock);
+  while ((slot = g_queue_pop_head (&pool->spares))) {
+    ov_socket_pool_clear_index (pool, slot->index);
+    ov_socket_slot_free (slot);
+  }
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Reserve 4 contiguous free ports and set them in @ports. Uses a spare slot if
+ * there is one, and binds a new one otherwise. If all of them are in use,
+ * @ports isn't touched and @error is set. */
+gboolean
+ov_socket_pool_reserve (OvSocketPool * pool, guint16 (*ports)[4],
+    GError ** error)
+{
+  guint ii;
+  OvSocketSlot *slot;
+
+  g_mutex_lock (&pool->lock);
+  slot = g_queue_pop_head (&pool->spares);
+  g_mutex_unlock (&pool->lock);
+
+  if (slot == NULL) {
+    GST_DEBUG ("No spare ports, binding new ones");
+    slot = ov_socket_pool_bind_slot (pool);
+    if (slot == NULL) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+          "All %u sets of receive ports are in use", OV_SOCKET_POOL_MAX_SLOTS);
+      return FALSE;
+    }
+  }
+
+  for (ii = 0; ii < 4; ii++)
+    (*ports)[ii] = pool->base_port + slot->index * 4 + ii;
+
+  g_mutex_lock (&pool->lock);
+  g_hash_table_insert (pool->reserved, GUINT_TO_POINTER (slot->index), slot);
+  ov_socket_pool_queue_refill (pool);
+  g_mutex_unlock (&pool->lock);
+
+  return TRUE;
+}
+
+/* Release the ports that were reserved along with @port */
+void
+ov_socket_pool_release (OvSocketPool * pool, guint16 port)
+{
+  guint index;
+
+  if (port < pool->base_port)
+    return;
+  index = (port - pool->base_port) / 4;
+
+  g_mutex_lock (&pool->lock);
+  if (g_hash_table_remove (pool->reserved, GUINT_TO_POINTER (index)))
+    ov_socket_pool_clear_index (pool, index);
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Returns the socket that was bound for @port when it was reserved, or a newly
+ * bound one if that has already been taken or the port isn't from the pool */
+GSocket *
+ov_socket_pool_get_socket (OvSocketPool * pool, guint16 port)
+{
+  OvSocketSlot *slot;
+  GSocket *socket = NULL;
+
+  g_mutex_lock (&pool->lock);
+  if (port >= pool->base_port) {
+    slot = g_hash_table_lookup (pool->reserved,
+        GUINT_TO_POINTER ((port - pool->base_port) / 4));
+    if (slot != NULL) {
+      socket = slot->sockets[(port - pool->base_port) % 4];
+      slot->sockets[(port - pool->base_port) % 4] = NULL;
+    }
+  }
+  g_mutex_unlock (&pool->lock);
+
+  if (socket == NULL)
+    socket = ov_get_socket_for_addr (pool->addr_s, port);
+
+  return socket;
+}
@@ -0,0 +1,54 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __OV_SOCKET_POOL_H__
+#define __OV_SOCKET_POOL_H__
+
+#include <gio/gio.h>
+
+#include "lib-priv.h"
+
+G_BEGIN_DECLS
+
+typedef struct _OvSocketPool OvSocketPool;
+
+OvSocketPool*   ov_socket_pool_new          (const gchar *addr_s,
+                                             guint16 base_port);
+void            ov_socket_pool_free         (OvSocketPool *pool);
+void            ov_socket_pool_start        (OvSocketPool *pool);
+void            ov_socket_pool_stop         (OvSocketPool *pool);
+gboolean        ov_socket_pool_reserve      (OvSocketPool *pool,
+                                             guint16 (*ports)[4],
+                                             GError **error);
+void            ov_socket_pool_release      (OvSocketPool *pool,
+                                             guint16 port);
+GSocket*        ov_socket_pool_get_socket   (OvSocketPool *pool,
+                                             guint16 port);
+
+G_END_DECLS
+
+#endif /* __OV_SOCKET_POOL_H__ */
@@ -0,0 +1,252 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "speaker.h"
+#include "ov-local-peer-priv.h"
+
+/* Keeps remotes that aren't talking from costing us anything in playback, and
+ * finds the remote that is talking:
+ *
+ * - Remotes that send Opus DTX send a tiny frame now and then while they're
+ *   silent; we drop those in front of the decoder so nothing is decoded
+ * - We measure the level of everything that is decoded, and flag buffers as
+ *   GAP once a remote has been below the silence threshold for a while, so
+ *   the audiomixer skips them instead of mixing in silence
+ * - Every interval the loudest remote above the threshold is the active
+ *   speaker, and it stays that until it falls silent or someone else is
+ *   clearly louder. See OvLocalPeer::active-speaker-changed.
+ *
+ * Levels are the RMS of the decoded samples in dBov, in steps of 3dB, which
+ * is plenty for telling speech from silence. */
+
+/* Opus frames of this size or less are DTX frames (RFC 6716, 2.1.9) */
+#define OV_SPEAKER_DTX_MAX_BYTES        2
+/* Below any level we can measure */
+#define OV_SPEAKER_SILENT_DB            -127
+/* Audio below this level is silence */
+#define OV_SPEAKER_SILENCE_DB           -45
+/* How long we keep mixing a remote after it falls silent, so that we don't
+ * cut off the quiet ends of words */
+#define OV_SPEAKER_HANGOVER             (300 * GST_MSECOND)
+/* How much the level of a remote falls per interval when it's quieter than it
+ * was before */
+#define OV_SPEAKER_DECAY_DB             3
+/* How much louder than the active speaker another remote has to be to take
+ * over */
+#define OV_SPEAKER_SWITCH_DB            6
+
+static GstPadProbeReturn
+ov_speaker_drop_dtx (GstPad * pad, GstPadProbeInfo * info,
+    OvRemotePeer * remote)
+{
+  if (gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info)) >
+      OV_SPEAKER_DTX_MAX_BYTES)
+    return GST_PAD_PROBE_OK;
+
+  /* The remote is silent, and the audiomixer times out its pad for as long as
+   * nothing arrives, which is the same as mixing in silence */
+  GST_LOG ("Dropping DTX frame from %s", remote->addr_s);
+  return GST_PAD_PROBE_DROP;
+}
+
+static gint
+ov_speaker_measure_level (GstBuffer * buffer)
+{
+  gsize ii, n_samples;
+  guint64 sum = 0;
+  GstMapInfo map;
+  const gint16 *samples;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+    return OV_SPEAKER_SILENT_DB;
+
+  /* Decoded as AUDIO_CAPS_STR, so S16LE */
+  samples = (const gint16 *) map.data;
+  n_samples = map.size / sizeof (gint16);
+  for (ii = 0; ii < n_samples; ii++)
+    sum += samples[ii] * samples[ii];
+  gst_buffer_unmap (buffer, &map);
+
+  if (n_samples == 0)
+    return OV_SPEAKER_SILENT_DB;
+
+  /* A full-scale square wave has a mean square of 2^30 */
+  return ((gint) g_bit_storage (sum / n_samples) - 30) * 3;
+}
+
+static GstPadProbeReturn
+ov_speaker_skip_silence (GstPad * pad, GstPadProbeInfo * info,
+    OvRemotePeer * remote)
+{
+  gint level, peak;
+  GstBuffer *buffer;
+
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  level = ov_speaker_measure_level (buffer);
+
+  /* Keep the loudest level till the next active speaker check */
+  do {
+    peak = g_atomic_int_get (&remote->priv->audio_peak);
+  } while (level > peak && !g_atomic_int_compare_and_exchange (
+        &remote->priv->audio_peak, peak, level));
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  if (level >= OV_SPEAKER_SILENCE_DB) {
+    remote->priv->audio_hangover_end = GST_BUFFER_PTS (buffer) +
+      OV_SPEAKER_HANGOVER;
+    return GST_PAD_PROBE_OK;
+  }
+
+  if (GST_BUFFER_PTS (buffer) < remote->priv->audio_hangover_end)
+    return GST_PAD_PROBE_OK;
+
+  buffer = gst_buffer_make_writable (buffer);
+  GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_GAP);
+  GST_PAD_PROBE_INFO_DATA (info) = buffer;
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Called with the lock TAKEN, while setting up the receive pipeline */
+void
+ov_remote_peer_add_audio_level (OvRemotePeer * remote, GstElement * decoder)
+{
+  GstPad *pad;
+
+  remote->priv->audio_peak = OV_SPEAKER_SILENT_DB;
+  remote->priv->audio_level = OV_SPEAKER_SILENT_DB;
+  remote->priv->audio_hangover_end = 0;
+
+  if (remote->priv->recv_dtx) {
+    pad = gst_element_get_static_pad (decoder, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+        (GstPadProbeCallback) ov_speaker_drop_dtx, remote, NULL);
+    gst_object_unref (pad);
+  }
+
+  pad = gst_element_get_static_pad (decoder, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) ov_speaker_skip_silence, remote, NULL);
+  gst_object_unref (pad);
+}
+
+static gboolean
+ov_speaker_tick (OvLocalPeer * local)
+{
+  guint ii;
+  gint peak;
+  gboolean changed;
+  OvPeer *peer = NULL;
+  OvRemotePeer *remote, *active = NULL, *loudest = NULL;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    remote = g_ptr_array_index (priv->remote_peers, ii);
+    if (remote->state != OV_REMOTE_STATE_PLAYING)
+      continue;
+
+    do {
+      peak = g_atomic_int_get (&remote->priv->audio_peak);
+    } while (!g_atomic_int_compare_and_exchange (&remote->priv->audio_peak,
+          peak, OV_SPEAKER_SILENT_DB));
+    remote->priv->audio_level = MAX (peak,
+        MAX (remote->priv->audio_level - OV_SPEAKER_DECAY_DB,
+          OV_SPEAKER_SILENT_DB));
+
+    if (g_strcmp0 (remote->id, priv->active_speaker) == 0)
+      active = remote;
+    if (remote->priv->audio_level >= OV_SPEAKER_SILENCE_DB &&
+        (loudest == NULL ||
+         remote->priv->audio_level > loudest->priv->audio_level))
+      loudest = remote;
+  }
+
+  /* Don't flip between remotes that are talking over each other */
+  if (active != NULL && loudest != NULL &&
+      active->priv->audio_level >= OV_SPEAKER_SILENCE_DB &&
+      loudest->priv->audio_level <
+      active->priv->audio_level + OV_SPEAKER_SWITCH_DB)
+    loudest = active;
+
+  changed = g_strcmp0 (loudest ? loudest->id : NULL, priv->active_speaker) != 0;
+  if (changed) {
+    g_free (priv->active_speaker);
+    priv->active_speaker = loudest ? g_strdup (loudest->id) : NULL;
+    if (loudest != NULL)
+      peer = ov_peer_new (loudest->addr);
+    GST_DEBUG ("Active speaker is now %s", loudest ? loudest->addr_s :
+        "nobody");
+  }
+  ov_local_peer_unlock (local);
+
+  /* Emit signal after unlocking */
+  if (changed)
+    g_signal_emit_by_name (local, "active-speaker-changed", peer);
+  g_clear_object (&peer);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called with the lock TAKEN */
+void
+ov_speaker_start (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  if (priv->speaker_timeout_id > 0)
+    return;
+
+  priv->speaker_timeout_id = g_timeout_add (OV_SPEAKER_INTERVAL_MS,
+      (GSourceFunc) ov_speaker_tick, local);
+}
+
+/* Called with the lock TAKEN */
+void
+ov_speaker_stop (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_clear_pointer (&priv->active_speaker, g_free);
+
+  if (priv->speaker_timeout_id == 0)
+    return;
+
+  g_source_remove (priv->speaker_timeout_id);
+  priv->speaker_timeout_id = 0;
+}
@@ -0,0 +1,454 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "stats.h"
+#include "jitterbuffer.h"
+#include "latency.h"
+#include "ov-local-peer-priv.h"
+
+#include <string.h>
+
+/* Subscriptions to the RTP statistics of the call. Consumers used to poll
+ * OvLocalPeer::get-stats, which copies everything into a new hash table every
+ * time, and then work out the rates themselves from the counters. Instead,
+ * every interval we read the RTPSources once, work out the rates since the
+ * previous interval, and hand them out in an OvStats that is allocated once
+ * and only grows when remotes are added. */
+
+typedef struct _OvStatsCounters OvStatsCounters;
+
+/* The RTPSource counters at the previous interval for one stream */
+struct _OvStatsCounters {
+  /* SSRC of the RR source of the remote in our transmit session; used to
+   * tell when the remote at this index has changed */
+  guint rr_ssrc;
+  /* SSRC of the stream we receive from the remote, which changes when it
+   * switches us to another simulcast layer */
+  guint recv_ssrc;
+  guint64 octets;
+  guint64 packets;
+  /* From the RRs; only for remotes */
+  guint extseq;
+  gint lost;
+  /* Of the latency tracker; only for remotes */
+  OvLatencyTotals latency;
+};
+
+typedef struct _OvStatsSubscription OvStatsSubscription;
+
+struct _OvStatsSubscription {
+  OvLocalPeer *local;
+  guint id;
+  guint session;
+  guint timeout_id;
+  /* One for the list of subscriptions and one for the timeout source, which
+   * only drops it once a running ov_stats_tick has returned */
+  gint refcount;
+  /* Set with the lock taken once unsubscribed */
+  gboolean removed;
+  OvStatsFunc func;
+  gpointer user_data;
+  GDestroyNotify notify;
+
+  /* Monotonic time of the previous interval; 0 if there was none */
+  gint64 last_time;
+  OvStats stats;
+  OvStatsCounters local_counters;
+  /* Same length as stats.remotes */
+  OvStatsCounters *counters;
+  guint n_allocated;
+};
+
+static void
+ov_stats_subscription_unref (OvStatsSubscription * sub)
+{
+  guint ii;
+
+  if (!g_atomic_int_dec_and_test (&sub->refcount))
+    return;
+
+  if (sub->notify != NULL)
+    sub->notify (sub->user_data);
+
+  for (ii = 0; ii < sub->n_allocated; ii++)
+    g_free ((gchar *) sub->stats.remotes[ii].id);
+  g_free (sub->stats.remotes);
+  g_free (sub->counters);
+  g_free (sub);
+}
+
+/* Called with the lock TAKEN */
+static void
+ov_stats_subscription_remove (OvStatsSubscription * sub)
+{
+  sub->removed = TRUE;
+  g_source_remove (sub->timeout_id);
+  ov_stats_subscription_unref (sub);
+}
+
+/* Per-second rate of the growth of a counter over @elapsed microseconds */
+static guint64
+ov_stats_rate (guint64 now, guint64 before, gint64 elapsed)
+{
+  if (elapsed <= 0 || now < before)
+    return 0;
+  return ((now - before) * G_USEC_PER_SEC) / elapsed;
+}
+
+static GstStructure *
+ov_stats_get_source_stats (GObject * rtpsession, guint ssrc)
+{
+  GObject *rtpsource;
+  GstStructure *stats;
+
+  g_signal_emit_by_name (rtpsession, "get-source-by-ssrc", ssrc, &rtpsource);
+  if (rtpsource == NULL)
+    return NULL;
+
+  g_object_get (rtpsource, "stats", &stats, NULL);
+  g_object_unref (rtpsource);
+  return stats;
+}
+
+/* What we send, from our internal source */
+static void
+ov_stats_sample_local (OvStatsSubscription * sub, GObject * rtpsession,
+    guint ssrc, gint64 elapsed, gint * clock_rate)
+{
+  guint64 octets = 0, packets = 0;
+  GstStructure *stats;
+  OvStatsCounters *c = &sub->local_counters;
+
+  sub->stats.local.bitrate = 0;
+  sub->stats.local.packet_rate = 0;
+  sub->stats.local.bytes = 0;
+  sub->stats.local.packets = 0;
+
+  stats = ov_stats_get_source_stats (rtpsession, ssrc);
+  if (stats == NULL)
+    return;
+
+  gst_structure_get_uint64 (stats, "octets-sent", &octets);
+  gst_structure_get_uint64 (stats, "packets-sent", &packets);
+  gst_structure_get_int (stats, "clock-rate", clock_rate);
+  gst_structure_free (stats);
+
+  /* A new transmit pipeline starts counting from zero again */
+  if (c->rr_ssrc == ssrc) {
+    sub->stats.local.bitrate = ov_stats_rate (octets, c->octets, elapsed) * 8;
+    sub->stats.local.packet_rate = ov_stats_rate (packets, c->packets, elapsed);
+  }
+  c->rr_ssrc = ssrc;
+  c->octets = octets;
+  c->packets = packets;
+  sub->stats.local.bytes = octets;
+  sub->stats.local.packets = packets;
+}
+
+/* How @remote receives what we send, from its RRs */
+static void
+ov_stats_sample_rr (OvStreamStats * s, OvStatsCounters * c,
+    GObject * rtpsession, guint ssrc, gboolean reset, gint clock_rate)
+{
+  gint lost = 0;
+  guint extseq = 0, fraction = 0, jitter = 0, round_trip = 0;
+  gboolean have_rb = FALSE;
+  GstStructure *stats;
+
+  s->loss = 0;
+  s->jitter = 0;
+  s->round_trip = 0;
+
+  stats = ov_stats_get_source_stats (rtpsession, ssrc);
+  if (stats == NULL)
+    return;
+
+  gst_structure_get_boolean (stats, "have-rb", &have_rb);
+  gst_structure_get_uint (stats, "rb-fractionlost", &fraction);
+  gst_structure_get_int (stats, "rb-packetslost", &lost);
+  gst_structure_get_uint (stats, "rb-exthighestseq", &extseq);
+  gst_structure_get_uint (stats, "rb-jitter", &jitter);
+  gst_structure_get_uint (stats, "rb-round-trip", &round_trip);
+  gst_structure_free (stats);
+
+  if (!have_rb)
+    return;
+
+  /* Over the interval if we have one and they got new packets since; the
+   * fraction in the RR is only over the interval between two RRs */
+  if (!reset && extseq > c->extseq)
+    s->loss = (MAX (lost - c->lost, 0) * 100.0) / (extseq - c->extseq);
+  else
+    s->loss = (fraction * 100.0) / 256;
+  s->loss = MIN (s->loss, 100.0);
+  if (clock_rate > 0)
+    s->jitter = (guint) (((guint64) jitter * 1000) / clock_rate);
+  /* The round-trip time is in 1/65536ths of a second */
+  s->round_trip = (guint) (((guint64) round_trip * 1000) / 65536);
+
+  c->extseq = extseq;
+  c->lost = lost;
+}
+
+/* What we receive from @remote */
+static void
+ov_stats_sample_receive (OvStreamStats * s, OvStatsCounters * c,
+    OvRemotePeer * remote, guint session, gboolean reset, gint64 elapsed)
+{
+  guint ssrc = 0;
+  guint64 octets = 0, packets = 0;
+  GstStructure *stats;
+
+  s->bitrate = 0;
+  s->packet_rate = 0;
+  s->bytes = 0;
+  s->packets = 0;
+
+  stats = ov_remote_peer_get_receive_stats (remote, session, &ssrc);
+  if (stats == NULL)
+    return;
+
+  gst_structure_get_uint64 (stats, "octets-received", &octets);
+  gst_structure_get_uint64 (stats, "packets-received", &packets);
+  gst_structure_free (stats);
+
+  if (!reset && c->recv_ssrc == ssrc) {
+    s->bitrate = ov_stats_rate (octets, c->octets, elapsed) * 8;
+    s->packet_rate = ov_stats_rate (packets, c->packets, elapsed);
+  }
+  c->recv_ssrc = ssrc;
+  c->octets = octets;
+  c->packets = packets;
+  s->bytes = octets;
+  s->packets = packets;
+}
+
+/* Average glass-to-glass latency of the frames from @remote that were played
+ * back since the previous interval */
+static void
+ov_stats_sample_latency (OvStreamStats * s, OvStatsCounters * c,
+    OvRemotePeer * remote, guint session, gboolean reset)
+{
+  guint64 frames;
+  OvLatencyTotals t;
+  OvLatencyTracker *tracker = remote->priv->latency_trackers[session];
+
+  s->latency = 0;
+  s->capture_latency = 0;
+  s->network_latency = 0;
+  s->decode_latency = 0;
+  s->render_latency = 0;
+
+  if (tracker == NULL)
+    return;
+
+  ov_latency_tracker_get (tracker, &t);
+  frames = t.frames - c->latency.frames;
+  /* A new tracker starts counting from zero again */
+  if (!reset && t.frames > c->latency.frames) {
+    s->capture_latency = (t.capture_us - c->latency.capture_us) /
+      frames / 1000;
+    s->network_latency = (t.network_us - c->latency.network_us) /
+      frames / 1000;
+    s->decode_latency = (t.decode_us - c->latency.decode_us) / frames / 1000;
+    s->render_latency = (t.render_us - c->latency.render_us) / frames / 1000;
+    s->latency = s->capture_latency + s->network_latency +
+      s->decode_latency + s->render_latency;
+  }
+  c->latency = t;
+}
+
+/* Called with the lock TAKEN. Returns FALSE if there's no call. */
+static gboolean
+ov_stats_sample (OvStatsSubscription * sub)
+{
+  guint ii;
+  gint clock_rate = 0;
+  gint64 now, elapsed;
+  GObject *rtpsession;
+  OvStreamStats *s;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (sub->local);
+
+  if (priv->rtpbin == NULL)
+    return FALSE;
+
+  g_signal_emit_by_name (priv->rtpbin, "get-internal-session", sub->session,
+      &rtpsession);
+  if (rtpsession == NULL)
+    return FALSE;
+
+  now = g_get_monotonic_time ();
+  elapsed = sub->last_time > 0 ? now - sub->last_time : 0;
+  sub->last_time = now;
+  sub->stats.interval = elapsed / 1000;
+
+  /* Only grows, so the remotes array handed out is reused across intervals */
+  if (priv->remote_peers->len > sub->n_allocated) {
+    guint n = priv->remote_peers->len;
+
+    sub->stats.remotes = g_renew (OvStreamStats, sub->stats.remotes, n);
+    sub->counters = g_renew (OvStatsCounters, sub->counters, n);
+    memset (sub->stats.remotes + sub->n_allocated, 0,
+        (n - sub->n_allocated) * sizeof (OvStreamStats));
+    memset (sub->counters + sub->n_allocated, 0,
+        (n - sub->n_allocated) * sizeof (OvStatsCounters));
+    sub->n_allocated = n;
+  }
+  sub->stats.n_remotes = priv->remote_peers->len;
+
+  ov_stats_sample_local (sub, rtpsession, priv->ssrcs[sub->session], elapsed,
+      &clock_rate);
+  sub->stats.local.loss = 0;
+  sub->stats.local.jitter = 0;
+  sub->stats.local.round_trip = 0;
+
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    OvRemotePeer *remote = g_ptr_array_index (priv->remote_peers, ii);
+    OvStatsCounters *c = &sub->counters[ii];
+    guint ssrc = remote->priv->ssrcs[sub->session];
+    gboolean reset = elapsed == 0;
+
+    s = &sub->stats.remotes[ii];
+    /* Remotes come and go, so this might be a different one than last time */
+    if (c->rr_ssrc != ssrc || g_strcmp0 (s->id, remote->id) != 0) {
+      g_free ((gchar *) s->id);
+      s->id = g_strdup (remote->id);
+      memset (c, 0, sizeof (OvStatsCounters));
+      c->rr_ssrc = ssrc;
+      reset = TRUE;
+    }
+
+    ov_stats_sample_rr (s, c, rtpsession, ssrc, reset, clock_rate);
+    ov_stats_sample_receive (s, c, remote, sub->session, reset, elapsed);
+    ov_stats_sample_latency (s, c, remote, sub->session, reset);
+
+    sub->stats.local.loss = MAX (sub->stats.local.loss, s->loss);
+    sub->stats.local.jitter = MAX (sub->stats.local.jitter, s->jitter);
+    sub->stats.local.round_trip = MAX (sub->stats.local.round_trip,
+        s->round_trip);
+  }
+
+  g_object_unref (rtpsession);
+  return TRUE;
+}
+
+static gboolean
+ov_stats_tick (OvStatsSubscription * sub)
+{
+  gboolean have_call;
+
+  ov_local_peer_lock (sub->local);
+  if (sub->removed) {
+    /* Unsubscribed from another thread while this was being dispatched */
+    ov_local_peer_unlock (sub->local);
+    return G_SOURCE_REMOVE;
+  }
+  have_call = ov_stats_sample (sub);
+  if (!have_call)
+    /* Don't compute rates across calls */
+    sub->last_time = 0;
+  ov_local_peer_unlock (sub->local);
+
+  /* The callback isn't called with the lock taken, and it can unsubscribe.
+   * The timeout source keeps sub alive till we've returned, though. */
+  if (have_call)
+    sub->func (sub->local, &sub->stats, sub->user_data);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called with the lock TAKEN */
+guint
+ov_stats_subscribe (OvLocalPeer * local, guint session, guint interval_ms,
+    OvStatsFunc func, gpointer user_data, GDestroyNotify notify)
+{
+  OvStatsSubscription *sub;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  sub = g_new0 (OvStatsSubscription, 1);
+  sub->local = local;
+  sub->id = ++priv->stats_last_id;
+  sub->session = session;
+  sub->func = func;
+  sub->user_data = user_data;
+  sub->notify = notify;
+  sub->stats.media_type = OV_RTP_SESSION_TO_NAME (session);
+  sub->stats.local.id = "local";
+  sub->refcount = 2;
+  sub->timeout_id = g_timeout_add_full (G_PRIORITY_DEFAULT, interval_ms,
+      (GSourceFunc) ov_stats_tick, sub,
+      (GDestroyNotify) ov_stats_subscription_unref);
+
+  priv->stats_subscriptions = g_list_prepend (priv->stats_subscriptions, sub);
+  GST_DEBUG ("Added %s stats subscription %u every %ums",
+      sub->stats.media_type, sub->id, interval_ms);
+  return sub->id;
+}
+
+/* Called with the lock TAKEN */
+gboolean
+ov_stats_unsubscribe (OvLocalPeer * local, guint id)
+{
+  GList *l;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  for (l = priv->stats_subscriptions; l != NULL; l = l->next) {
+    OvStatsSubscription *sub = l->data;
+
+    if (sub->id != id)
+      continue;
+
+    priv->stats_subscriptions = g_list_delete_link (priv->stats_subscriptions,
+        l);
+    ov_stats_subscription_remove (sub);
+    GST_DEBUG ("Removed stats subscription %u", id);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+void
+ov_stats_unsubscribe_all (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_list_free_full (priv->stats_subscriptions,
+      (GDestroyNotify) ov_stats_subscription_remove);
+  priv->stats_subscriptions = NULL;
+}
@@ -0,0 +1,359 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+/* For pthread_setaffinity_np() and the CPU_* macros */
+#define _GNU_SOURCE
+#endif
+
+#include "lib.h"
+#include "lib-priv.h"
+#include "threads.h"
+#include "ov-local-peer-priv.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+/* Recording can always wait for the call */
+#define OV_THREAD_RECORDING_NICE 10
+
+/* Keeps track of the streaming threads in our pipelines. Every GstTask posts
+ * a stream-status message from its own thread when it starts and stops
+ * running, which we handle synchronously on the bus of each pipeline to:
+ *
+ * - Pin the thread to the CPUs and give it the niceness that the application
+ *   asked for its role; see ov_local_peer_set_thread_affinity()
+ * - Remember its CPU clock, so that the CPU time it has used can be reported
+ *   in OvLocalPeer::get-stats without knowing anything else about it
+ *
+ * Threads have the role of the pipeline they're in unless the element they
+ * stream for or one of its parents was given another one with
+ * ov_element_set_thread_role(). They're attributed to a remote if they're in
+ * its receive pipeline or bin or in one of its playback bins, and to "local"
+ * otherwise. Only implemented on Linux; elsewhere threads aren't tracked. */
+
+static GQuark
+ov_thread_role_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (quark == 0)
+    quark = g_quark_from_static_string ("ov-thread-role");
+  return quark;
+}
+
+typedef struct _OvThreadWatch OvThreadWatch;
+
+struct _OvThreadWatch {
+  OvLocalPeer *local;
+  OvThreadRole role;
+};
+
+typedef struct _OvThreadInfo OvThreadInfo;
+
+struct _OvThreadInfo {
+  /* element:pad that the thread pushes from */
+  gchar *name;
+  OvThreadRole role;
+  /* The pipeline it's in and the child of that pipeline that it's in; only
+   * compared with, never dereferenced */
+  gconstpointer pipeline;
+  gconstpointer bin;
+#ifdef __linux__
+  clockid_t clock;
+#endif
+};
+
+static void
+ov_thread_info_free (OvThreadInfo * info)
+{
+  g_free (info->name);
+  g_free (info);
+}
+
+#ifdef __linux__
+/* Called from the thread itself */
+static void
+ov_thread_apply_affinity (const gchar * name, guint64 cpus, gint nice)
+{
+  guint ii;
+  cpu_set_t set;
+
+  if (cpus != 0) {
+    CPU_ZERO (&set);
+    for (ii = 0; ii < 64; ii++)
+      if (cpus & (G_GUINT64_CONSTANT (1) << ii))
+        CPU_SET (ii, &set);
+    if (pthread_setaffinity_np (pthread_self (), sizeof (set), &set) != 0)
+      GST_WARNING ("Unable to set the CPU affinity of %s", name);
+  }
+
+  /* On Linux, this only changes the priority of the calling thread */
+  if (nice != 0 &&
+      setpriority (PRIO_PROCESS, syscall (SYS_gettid), nice) != 0)
+    GST_WARNING ("Unable to set the niceness of %s to %i", name, nice);
+}
+#endif
+
+/* Finds where @owner is, and its role if it or one of its parents has one */
+static void
+ov_thread_find_owner (GstObject * owner, gconstpointer * pipeline,
+    gconstpointer * bin, OvThreadRole * role)
+{
+  gpointer data;
+  gboolean have_role = FALSE;
+  GstObject *object, *parent;
+
+  *bin = NULL;
+  object = gst_object_ref (owner);
+  while (TRUE) {
+    data = g_object_get_qdata (G_OBJECT (object), ov_thread_role_quark ());
+    if (!have_role && data != NULL) {
+      *role = GPOINTER_TO_UINT (data) - 1;
+      have_role = TRUE;
+    }
+
+    parent = gst_object_get_parent (object);
+    if (parent == NULL)
+      break;
+    *bin = object;
+    gst_object_unref (object);
+    object = parent;
+  }
+  *pipeline = object;
+  gst_object_unref (object);
+}
+
+static GstBusSyncReply
+ov_thread_on_stream_status (GstBus * bus G_GNUC_UNUSED, GstMessage * msg,
+    OvThreadWatch * watch)
+{
+  GstStreamStatusType type;
+  GstElement *owner;
+  const GValue *value;
+  GstObject *task;
+  OvThreadInfo *info;
+  OvLocalPeerPrivate *priv;
+
+  if (GST_MESSAGE_TYPE (msg) != GST_MESSAGE_STREAM_STATUS)
+    return GST_BUS_PASS;
+
+  gst_message_parse_stream_status (msg, &type, &owner);
+  if (type != GST_STREAM_STATUS_TYPE_ENTER &&
+      type != GST_STREAM_STATUS_TYPE_LEAVE)
+    return GST_BUS_PASS;
+
+  value = gst_message_get_stream_status_object (msg);
+  if (value == NULL || !G_VALUE_HOLDS (value, GST_TYPE_TASK))
+    return GST_BUS_PASS;
+  task = g_value_get_object (value);
+
+  priv = ov_local_peer_get_private (watch->local);
+
+  if (type == GST_STREAM_STATUS_TYPE_LEAVE) {
+    g_mutex_lock (&priv->threads_lock);
+    g_hash_table_remove (priv->threads, task);
+    g_mutex_unlock (&priv->threads_lock);
+    return GST_BUS_PASS;
+  }
+
+  info = g_new0 (OvThreadInfo, 1);
+  info->name = g_strdup_printf ("%s:%s", GST_OBJECT_NAME (owner),
+      GST_MESSAGE_SRC_NAME (msg));
+  info->role = watch->role;
+  ov_thread_find_owner (GST_OBJECT (owner), &info->pipeline, &info->bin,
+      &info->role);
+
+  g_mutex_lock (&priv->threads_lock);
+#ifdef __linux__
+  ov_thread_apply_affinity (info->name, priv->thread_cpus[info->role],
+      priv->thread_nice[info->role]);
+  if (pthread_getcpuclockid (pthread_self (), &info->clock) == 0)
+    g_hash_table_replace (priv->threads, task, info);
+  else
+    ov_thread_info_free (info);
+#else
+  ov_thread_info_free (info);
+#endif
+  g_mutex_unlock (&priv->threads_lock);
+
+  return GST_BUS_PASS;
+}
+
+void
+ov_local_peer_threads_init (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_mutex_init (&priv->threads_lock);
+  priv->threads = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+      (GDestroyNotify) ov_thread_info_free);
+  priv->thread_nice[OV_THREAD_ROLE_RECORDING] = OV_THREAD_RECORDING_NICE;
+}
+
+void
+ov_local_peer_threads_clear (OvLocalPeer * local)
+{
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+
+  g_mutex_clear (&priv->threads_lock);
+  g_hash_table_unref (priv->threads);
+}
+
+/* Must be called before @pipeline starts, and every thread in it has @role */
+void
+ov_local_peer_watch_threads (OvLocalPeer * local, GstElement * pipeline,
+    OvThreadRole role)
+{
+  GstBus *bus;
+  OvThreadWatch *watch;
+
+  watch = g_new0 (OvThreadWatch, 1);
+  watch->local = local;
+  watch->role = role;
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+  gst_bus_set_sync_handler (bus,
+      (GstBusSyncHandler) ov_thread_on_stream_status, watch, g_free);
+  gst_object_unref (bus);
+}
+
+/* The threads that stream for @element and everything in it get @role
+ * instead of the role of their pipeline. Must be called before @element
+ * starts. */
+void
+ov_element_set_thread_role (GstElement * element, OvThreadRole role)
+{
+  /* Offset by one, since 0 would be OV_THREAD_ROLE_TRANSMIT */
+  g_object_set_qdata (G_OBJECT (element), ov_thread_role_quark (),
+      GUINT_TO_POINTER (role + 1));
+}
+
+static gboolean
+ov_thread_is_in_remote (OvThreadInfo * info, OvRemotePeer * remote)
+{
+  gconstpointer bins[] = {remote->receive, remote->priv->aplayback,
+    remote->priv->vplayback};
+  guint ii;
+
+  for (ii = 0; ii < G_N_ELEMENTS (bins); ii++)
+    if (bins[ii] != NULL &&
+        (info->pipeline == bins[ii] || info->bin == bins[ii]))
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Adds a "threads" field to @stats with the CPU time used so far by each
+ * thread of @remote, or of the local peer if @remote is NULL, in ns. See
+ * OvLocalPeer::get-stats */
+void
+ov_local_peer_add_thread_stats (OvLocalPeer * local, OvRemotePeer * remote,
+    GstStructure * stats)
+{
+#ifdef __linux__
+  guint ii;
+  guint64 cpu_time;
+  struct timespec ts;
+  GHashTableIter iter;
+  OvThreadInfo *info;
+  GstStructure *threads;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (local);
+  threads = gst_structure_new_empty ("application/x-ov-thread-stats");
+
+  g_mutex_lock (&priv->threads_lock);
+  g_hash_table_iter_init (&iter, priv->threads);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &info)) {
+    if (remote != NULL) {
+      if (!ov_thread_is_in_remote (info, remote))
+        continue;
+    } else {
+      for (ii = 0; ii < priv->remote_peers->len; ii++)
+        if (ov_thread_is_in_remote (info,
+              g_ptr_array_index (priv->remote_peers, ii)))
+          break;
+      if (ii < priv->remote_peers->len)
+        continue;
+    }
+
+    if (clock_gettime (info->clock, &ts) != 0)
+      continue;
+    cpu_time = (guint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+
+    /* Elements in different bins can have the same name */
+    if (gst_structure_has_field (threads, info->name)) {
+      guint64 other;
+
+      gst_structure_get_uint64 (threads, info->name, &other);
+      cpu_time += other;
+    }
+    gst_structure_set (threads, info->name, G_TYPE_UINT64, cpu_time, NULL);
+  }
+  g_mutex_unlock (&priv->threads_lock);
+
+  gst_structure_set (stats, "threads", GST_TYPE_STRUCTURE, threads, NULL);
+  gst_structure_free (threads);
+#endif
+}
+
+/* Whether the video of @remote should be decoded in a thread of its own; see
+ * ov_local_peer_set_thread_layout(). Called with the lock TAKEN while
+ * setting up its receive pipeline */
+gboolean
+ov_remote_peer_wants_decode_thread (OvRemotePeer * remote)
+{
+  guint ii, n_threads = 0;
+  OvLocalPeerPrivate *priv;
+
+  priv = ov_local_peer_get_private (remote->local);
+
+  if (priv->thread_layout != OV_THREAD_LAYOUT_DECODE_THREADS)
+    return FALSE;
+
+  if (priv->max_decode_threads == 0)
+    return TRUE;
+
+  for (ii = 0; ii < priv->remote_peers->len; ii++) {
+    OvRemotePeer *other = g_ptr_array_index (priv->remote_peers, ii);
+    if (other != remote && other->priv->vdecqueue != NULL)
+      n_threads++;
+  }
+
+  return n_threads < priv->max_decode_threads;
+}
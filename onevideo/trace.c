@@ -0,0 +1,266 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "trace.h"
+#include "ov-local-peer-priv.h"
+
+/* A trace records how long each phase of negotiation and call setup takes.
+ * One is started when a negotiation starts (on either end), spans are added to
+ * it as phases begin and end, and it's delivered to the application as the
+ * OvLocalPeer::call-setup-timing report once the call is playing or the
+ * negotiation is aborted. Every span is also logged to the "onevideo-trace"
+ * debug category as it ends. */
+
+GST_DEBUG_CATEGORY (ov_trace_debug);
+#define GST_CAT_DEFAULT ov_trace_debug
+
+typedef struct _OvCallTraceSpan OvCallTraceSpan;
+
+struct _OvCallTraceSpan {
+  /* Static string */
+  const gchar *phase;
+  /* The id of the remote this span is for, or NULL if it's for all of them */
+  gchar *peer;
+  /* Monotonic time in microseconds; end is 0 till the span ends */
+  gint64 start;
+  gint64 end;
+};
+
+struct _OvCallTrace {
+  /* Spans are added from the negotiator's fanout threads too, so this has its
+   * own lock instead of relying on the local peer lock */
+  GMutex lock;
+  guint64 call_id;
+  gboolean negotiator;
+  gint64 start;
+  GArray *spans;
+};
+
+static void
+ov_call_trace_span_clear (OvCallTraceSpan * span)
+{
+  g_free (span->peer);
+}
+
+static void
+ov_call_trace_log_span (OvCallTrace * trace, OvCallTraceSpan * span)
+{
+  GST_INFO ("call %" G_GUINT64_FORMAT " (%s): %s%s%s took %.3f ms, %.3f ms "
+      "after the start", trace->call_id,
+      trace->negotiator ? "negotiator" : "negotiatee", span->phase,
+      span->peer ? " with " : "", span->peer ? span->peer : "",
+      (span->end - span->start) / 1000.0,
+      (span->start - trace->start) / 1000.0);
+}
+
+OvCallTrace *
+ov_call_trace_new (guint64 call_id, gboolean negotiator)
+{
+  OvCallTrace *trace;
+
+  trace = g_new0 (OvCallTrace, 1);
+  g_mutex_init (&trace->lock);
+  trace->call_id = call_id;
+  trace->negotiator = negotiator;
+  trace->start = g_get_monotonic_time ();
+  trace->spans = g_array_new (FALSE, TRUE, sizeof (OvCallTraceSpan));
+  g_array_set_clear_func (trace->spans,
+      (GDestroyNotify) ov_call_trace_span_clear);
+
+  return trace;
+}
+
+void
+ov_call_trace_free (OvCallTrace * trace)
+{
+  g_array_free (trace->spans, TRUE);
+  g_mutex_clear (&trace->lock);
+  g_free (trace);
+}
+
+/* Returns the index of the span for ov_call_trace_end() */
+guint
+ov_call_trace_begin (OvCallTrace * trace, const gchar * phase,
+    const gchar * peer)
+{
+  OvCallTraceSpan span = {0};
+  guint index;
+
+  span.phase = phase;
+  span.peer = g_strdup (peer);
+  span.start = g_get_monotonic_time ();
+
+  g_mutex_lock (&trace->lock);
+  g_array_append_val (trace->spans, span);
+  index = trace->spans->len - 1;
+  g_mutex_unlock (&trace->lock);
+
+  return index;
+}
+
+void
+ov_call_trace_end (OvCallTrace * trace, guint index)
+{
+  OvCallTraceSpan *span;
+
+  g_mutex_lock (&trace->lock);
+  g_assert (index < trace->spans->len);
+  span = &g_array_index (trace->spans, OvCallTraceSpan, index);
+  span->end = g_get_monotonic_time ();
+  ov_call_trace_log_span (trace, span);
+  g_mutex_unlock (&trace->lock);
+}
+
+/* Add a span that has already ended; @start and @end are monotonic times */
+void
+ov_call_trace_add (OvCallTrace * trace, const gchar * phase,
+    const gchar * peer, gint64 start, gint64 end)
+{
+  OvCallTraceSpan span = {0};
+
+  g_return_if_fail (end >= start);
+
+  span.phase = phase;
+  span.peer = g_strdup (peer);
+  span.start = start;
+  span.end = end;
+
+  g_mutex_lock (&trace->lock);
+  g_array_append_val (trace->spans, span);
+  ov_call_trace_log_span (trace, &span);
+  g_mutex_unlock (&trace->lock);
+}
+
+static GstStructure *
+ov_call_trace_to_structure (OvCallTrace * trace, gboolean aborted)
+{
+  GstStructure *s;
+  GValue spans = G_VALUE_INIT;
+  gint64 now;
+  guint ii;
+
+  now = g_get_monotonic_time ();
+  g_value_init (&spans, GST_TYPE_ARRAY);
+
+  g_mutex_lock (&trace->lock);
+  for (ii = 0; ii < trace->spans->len; ii++) {
+    OvCallTraceSpan *span;
+    GValue v = G_VALUE_INIT;
+    GstStructure *span_s;
+    gint64 end;
+
+    span = &g_array_index (trace->spans, OvCallTraceSpan, ii);
+    /* Spans that didn't end are where an aborted negotiation was stuck; they
+     * last till now */
+    end = span->end ? span->end : now;
+    span_s = gst_structure_new ("span",
+        "phase", G_TYPE_STRING, span->phase,
+        "start", G_TYPE_UINT64, (guint64) (span->start - trace->start),
+        "duration", G_TYPE_UINT64, (guint64) (end - span->start),
+        "finished", G_TYPE_BOOLEAN, span->end != 0,
+        NULL);
+    if (span->peer)
+      gst_structure_set (span_s, "peer", G_TYPE_STRING, span->peer, NULL);
+
+    g_value_init (&v, GST_TYPE_STRUCTURE);
+    g_value_take_boxed (&v, span_s);
+    gst_value_array_append_and_take_value (&spans, &v);
+  }
+  g_mutex_unlock (&trace->lock);
+
+  s = gst_structure_new ("application/x-ov-call-setup-timing",
+      "call-id", G_TYPE_UINT64, trace->call_id,
+      "role", G_TYPE_STRING, trace->negotiator ? "negotiator" : "negotiatee",
+      "aborted", G_TYPE_BOOLEAN, aborted,
+      "total", G_TYPE_UINT64, (guint64) (now - trace->start),
+      NULL);
+  gst_structure_take_value (s, "spans", &spans);
+
+  return s;
+}
+
+/* Returns a span index, or G_MAXUINT if no call is being traced. Takes the
+ * lock, so it may be called with or without it held. */
+guint
+ov_local_peer_trace_begin (OvLocalPeer * local, const gchar * phase,
+    const gchar * peer)
+{
+  OvLocalPeerPrivate *priv;
+  guint index = G_MAXUINT;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+  if (priv->call_trace)
+    index = ov_call_trace_begin (priv->call_trace, phase, peer);
+  ov_local_peer_unlock (local);
+
+  return index;
+}
+
+void
+ov_local_peer_trace_end (OvLocalPeer * local, guint index)
+{
+  OvLocalPeerPrivate *priv;
+
+  if (index == G_MAXUINT)
+    return;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+  if (priv->call_trace)
+    ov_call_trace_end (priv->call_trace, index);
+  ov_local_peer_unlock (local);
+}
+
+/* Emit the report for the call being traced, if any, and stop tracing.
+ * Call with the lock RELEASED since this emits a signal. */
+void
+ov_local_peer_trace_finish (OvLocalPeer * local, gboolean aborted)
+{
+  OvLocalPeerPrivate *priv;
+  OvCallTrace *trace;
+  GstStructure *report;
+
+  priv = ov_local_peer_get_private (local);
+
+  ov_local_peer_lock (local);
+  trace = priv->call_trace;
+  priv->call_trace = NULL;
+  ov_local_peer_unlock (local);
+
+  if (trace == NULL)
+    return;
+
+  report = ov_call_trace_to_structure (trace, aborted);
+  ov_call_trace_free (trace);
+
+  GST_DEBUG ("Call setup timing: %" GST_PTR_FORMAT, report);
+  g_signal_emit_by_name (local, "call-setup-timing", report);
+  gst_structure_free (report);
+}
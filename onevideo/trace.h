@@ -0,0 +1,65 @@
+/*  vim: set sts=2 sw=2 et :
+ *
+ *  Copyright (C) 2015 Centricular Ltd
+ *  Author(s): Nirbheek Chauhan <nirbheek@centricular.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __OV_TRACE_H__
+#define __OV_TRACE_H__
+
+#include <gst/gst.h>
+
+#include "ov-local-peer.h"
+
+G_BEGIN_DECLS
+
+GST_DEBUG_CATEGORY_EXTERN (ov_trace_debug);
+
+typedef struct _OvCallTrace OvCallTrace;
+
+OvCallTrace*  ov_call_trace_new             (guint64 call_id,
+                                             gboolean negotiator);
+void          ov_call_trace_free            (OvCallTrace *trace);
+guint         ov_call_trace_begin           (OvCallTrace *trace,
+                                             const gchar *phase,
+                                             const gchar *peer);
+void          ov_call_trace_end             (OvCallTrace *trace,
+                                             guint span);
+void          ov_call_trace_add             (OvCallTrace *trace,
+                                             const gchar *phase,
+                                             const gchar *peer,
+                                             gint64 start,
+                                             gint64 end);
+
+guint         ov_local_peer_trace_begin     (OvLocalPeer *local,
+                                             const gchar *phase,
+                                             const gchar *peer);
+void          ov_local_peer_trace_end       (OvLocalPeer *local,
+                                             guint span);
+void          ov_local_peer_trace_finish    (OvLocalPeer *local,
+                                             gboolean aborted);
+
+G_END_DECLS
+
+#endif /* __OV_TRACE_H__ */